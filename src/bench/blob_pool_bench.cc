@@ -0,0 +1,38 @@
+#include <benchmark/benchmark.h>
+#include <utils/blob_pool.h>
+
+namespace {
+constexpr size_t kBlobCap = 1 << 20;
+} // namespace
+
+// blob_cap 0 disables the pool, every acquire allocates and touches a new
+// blob, which is the baseline the pool is meant to avoid
+static void BM_BlobAcquireRelease(benchmark::State &state) {
+  const bool use_pool = state.range(0);
+  BlobPool pool(use_pool ? kBlobCap : 0, 16);
+  for (auto _ : state) {
+    auto blob = pool.acquireBlob(kBlobCap);
+    benchmark::DoNotOptimize(blob.get_addr());
+    pool.releaseBlob(std::move(blob));
+  }
+}
+BENCHMARK(BM_BlobAcquireRelease)->ArgName("pool")->Arg(0)->Arg(1);
+
+// the DPU acquires blobs in the content client thread and releases them in
+// the decompress thread, so the pool mutex is contended
+static void BM_BlobPoolContended(benchmark::State &state) {
+  static BlobPool *pool = nullptr;
+  if (state.thread_index() == 0) {
+    pool = new BlobPool(kBlobCap, 4 * state.threads());
+  }
+  for (auto _ : state) {
+    auto blob = pool->acquireBlob(kBlobCap);
+    benchmark::DoNotOptimize(blob.get_addr());
+    pool->releaseBlob(std::move(blob));
+  }
+  if (state.thread_index() == 0) {
+    delete pool;
+    pool = nullptr;
+  }
+}
+BENCHMARK(BM_BlobPoolContended)->ThreadRange(1, 8)->UseRealTime();
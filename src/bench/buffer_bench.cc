@@ -0,0 +1,52 @@
+#include <benchmark/benchmark.h>
+#include <network/tcp/Buffer.h>
+#include <string>
+
+using hdc::network::tcp::Buffer;
+
+// append a payload and consume it again, the pattern of TcpConnection
+static void BM_BufferAppendRetrieve(benchmark::State &state) {
+  Buffer buffer;
+  std::string payload(state.range(0), 'x');
+  for (auto _ : state) {
+    buffer.append(payload);
+    benchmark::DoNotOptimize(buffer.peek());
+    buffer.retrieve(payload.size());
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_BufferAppendRetrieve)->RangeMultiplier(8)->Range(64, 1 << 20);
+
+// accumulate several frames before reading them, which makes the buffer
+// grow and move the readable bytes to the front
+static void BM_BufferFramedBatch(benchmark::State &state) {
+  const auto frames = state.range(0);
+  std::string payload(256, 'x');
+  for (auto _ : state) {
+    Buffer buffer;
+    for (int i = 0; i < frames; ++i) {
+      buffer.appendInt32(static_cast<int32_t>(payload.size()));
+      buffer.append(payload);
+    }
+    while (buffer.readableBytes() >= sizeof(int32_t)) {
+      auto len = buffer.readInt32();
+      benchmark::DoNotOptimize(buffer.peek());
+      buffer.retrieve(len);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * frames);
+}
+BENCHMARK(BM_BufferFramedBatch)->Arg(1)->Arg(16)->Arg(256);
+
+static void BM_BufferPrepend(benchmark::State &state) {
+  Buffer buffer;
+  std::string payload(state.range(0), 'x');
+  for (auto _ : state) {
+    buffer.append(payload);
+    buffer.prependInt32(static_cast<int32_t>(payload.size()));
+    benchmark::DoNotOptimize(buffer.peek());
+    buffer.retrieveAll();
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_BufferPrepend)->Arg(64)->Arg(4096);
@@ -0,0 +1,55 @@
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <network/EventLoop.h>
+#include <network/EventLoopThread.h>
+
+using hdc::network::EventLoop;
+using hdc::network::EventLoopThread;
+
+// one functor at a time posted from another thread, the caller spins until it
+// has run. It measures the eventfd wakeup + pending functor latency that every
+// cross-thread handoff in the pipeline pays.
+static void BM_RunInLoopCrossThreadLatency(benchmark::State &state) {
+  EventLoopThread loop_thread;
+  EventLoop *loop = loop_thread.startLoop();
+  std::atomic<int64_t> done{0};
+  int64_t posted = 0;
+  for (auto _ : state) {
+    ++posted;
+    loop->runInLoop([&done]() { done.fetch_add(1, std::memory_order_release); });
+    while (done.load(std::memory_order_acquire) != posted) {
+    }
+  }
+}
+BENCHMARK(BM_RunInLoopCrossThreadLatency)->UseRealTime();
+
+// a burst of functors posted at once, drained by a single wakeup
+static void BM_QueueInLoopBurst(benchmark::State &state) {
+  EventLoopThread loop_thread;
+  EventLoop *loop = loop_thread.startLoop();
+  const auto burst = state.range(0);
+  std::atomic<int64_t> done{0};
+  int64_t posted = 0;
+  for (auto _ : state) {
+    for (int64_t i = 0; i < burst; ++i) {
+      loop->queueInLoop(
+          [&done]() { done.fetch_add(1, std::memory_order_release); });
+    }
+    posted += burst;
+    while (done.load(std::memory_order_acquire) != posted) {
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * burst);
+}
+BENCHMARK(BM_QueueInLoopBurst)->Arg(16)->Arg(256)->UseRealTime();
+
+// runInLoop from the loop thread itself runs the functor inline
+static void BM_RunInLoopSameThread(benchmark::State &state) {
+  EventLoop loop;
+  int64_t counter = 0;
+  for (auto _ : state) {
+    loop.runInLoop([&counter]() { ++counter; });
+  }
+  benchmark::DoNotOptimize(counter);
+}
+BENCHMARK(BM_RunInLoopSameThread);
@@ -0,0 +1,449 @@
+/// End-to-end pull benchmark on a single host. The registry (ContentServer),
+/// the DPU daemon (OffloadServerEpoll, ContentFetcher, DecompressClientEpoll)
+/// and the host daemon (OffloadClientEpoll, DecompressServerEpoll,
+/// CommandServer) run in this process on their own EventLoop threads and talk
+/// to each other over the loopback address, by TCP by default, or by shared
+/// memory or RDMA with --loopback_transport. The compress engines are the zlib
+/// engine of doca/soft_compress.h and the registry is a synthetic one written
+/// into --loopback_work_dir.
+///
+/// For each image size and concurrency level, --loopback_images_per_run
+/// distinct images are pulled through CreateContainerRequest with at most
+/// `concurrency` pulls in flight, and the throughput and the p50/p99 pull
+/// latency are reported.
+#include "bench/synthetic_registry.h"
+#include "container.pb.h"
+#include "doca/engine.h"
+#include "dpu/content_fetcher.h"
+#include "dpu/decompress_client_epoll.h"
+#include "dpu/offload_server_epoll.h"
+#include "host/client/command_server.h"
+#include "host/client/decompress_server_epoll.h"
+#include "host/client/offload_client_epoll.h"
+#include "host/server/content_server.h"
+#include "network/CountDownLatch.h"
+#include "network/EventLoop.h"
+#include "network/EventLoopThread.h"
+#include "network/InetAddress.h"
+#include "network/tcp/TcpClient.h"
+#include "network/transport/TransportConfig.h"
+#include "utils/blob_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <gflags/gflags.h>
+#include <memory>
+#include <spdlog/spdlog.h>
+#include <sstream>
+#include <string>
+#include <utils/MsgFrame.h>
+#include <utils/logging.h>
+#include <utils/transport_flags.h>
+#include <vector>
+
+using hdc::CountDownLatch;
+using hdc::dpu::ContentFetcher;
+using hdc::dpu::DecompressClientEpoll;
+using hdc::dpu::OffloadServerEpoll;
+using hdc::host::client::CommandServer;
+using hdc::host::client::DecompressServerEpoll;
+using hdc::host::client::DpuPeer;
+using hdc::host::client::LayerStore;
+using hdc::host::client::MetadataService;
+using hdc::host::client::OffloadClientEpoll;
+using hdc::host::client::UntarEngine;
+using hdc::host::client::UntarResult;
+using hdc::host::server::ContentServer;
+using hdc::network::EventLoop;
+using hdc::network::EventLoopThread;
+using hdc::network::InetAddress;
+using hdc::network::Timestamp;
+using hdc::network::tcp::Buffer;
+using hdc::network::tcp::TcpClient;
+using hdc::network::tcp::TcpConnectionPtr;
+using hdc::network::transport::TransportConfig;
+
+// defined in dpu/offload_server_epoll.cc
+DECLARE_string(content_client_transport);
+DECLARE_string(content_client_ib_dev_name);
+DECLARE_int32(content_client_ib_dev_port);
+DECLARE_string(content_client_peer_ip);
+DECLARE_uint32(content_client_peer_port);
+DECLARE_uint64(content_client_rdma_mem);
+DECLARE_uint64(content_client_rdma_mem_num);
+
+DEFINE_string(loopback_transport, "tcp",
+              "The transport of all connections: tcp, shm or rdma");
+DEFINE_validator(loopback_transport, &hdc::utils::validateTransportFlag);
+DEFINE_string(loopback_ib_dev_name, "rxe0",
+              "The IB device used by RDMA connections, e.g. a soft-RoCE "
+              "device bound to the loopback interface");
+DEFINE_int32(loopback_ib_dev_port, 1, "The IB device port");
+DEFINE_string(loopback_ip, "127.0.0.1", "The IP address of all servers");
+DEFINE_uint32(loopback_base_port, 19000,
+              "The first of the 4 consecutive ports used by the servers");
+DEFINE_string(loopback_work_dir, "/tmp/poby_loopback",
+              "The dir of the synthetic registry, metadata and untar output");
+DEFINE_string(loopback_image_sizes, "4,16,64",
+              "Comma separated uncompressed image sizes in MB");
+DEFINE_string(loopback_concurrency, "1,4",
+              "Comma separated numbers of concurrent pulls");
+DEFINE_int32(loopback_images_per_run, 8,
+             "The number of distinct images pulled per size and concurrency");
+DEFINE_int32(loopback_layers_per_image, 2, "The number of layers per image");
+DEFINE_uint64(loopback_segment_size, 4 * 1024 * 1024,
+              "The uncompressed size of a layer segment in bytes");
+DEFINE_int32(loopback_engine_mem_num, 2,
+             "The number of bufpairs of each compress engine");
+DEFINE_int32(loopback_dpu_engines, 1,
+             "The number of decompress engines of the DPU, each in its own "
+             "thread");
+DEFINE_uint64(loopback_untar_num_threads, 3, "The number of untar threads");
+DEFINE_bool(loopback_keep_work_dir, false,
+            "Keep the registry and untar output after the benchmark");
+
+namespace {
+
+std::vector<size_t> parseList(const std::string &str) {
+  std::vector<size_t> res;
+  std::stringstream ss(str);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) {
+      res.emplace_back(std::stoul(item));
+    }
+  }
+  return res;
+}
+
+/// @brief: Run `make` in the loop thread and wait for its result. The
+/// components must be created in the thread of their EventLoop.
+template <typename F> auto runInLoopAndWait(EventLoop *loop, F make) {
+  std::promise<decltype(make())> p;
+  auto f = p.get_future();
+  loop->runInLoop([&p, &make]() { p.set_value(make()); });
+  return f.get();
+}
+
+InetAddress loopbackAddr(int offset) {
+  return InetAddress{FLAGS_loopback_ip,
+                     static_cast<uint16_t>(FLAGS_loopback_base_port + offset)};
+}
+
+/// @brief: Send one CreateContainerRequest and report the pull latency.
+class PullClient {
+public:
+  using DoneCallback = std::function<void(bool success, double latency_ms)>;
+
+  PullClient(EventLoop *loop, const InetAddress &addr, std::string image,
+             DoneCallback done_cb)
+      : client_(loop, addr, "PullClient"), image_(std::move(image)),
+        done_cb_(std::move(done_cb)) {
+    client_.setConnectionCallback(
+        [this](const TcpConnectionPtr &conn) { this->onConnection(conn); });
+    client_.setMessageCallback([this](const TcpConnectionPtr &conn,
+                                      Buffer *buffer, Timestamp timestamp) {
+      this->onMessage(conn, buffer, timestamp);
+    });
+  }
+
+  void start() {
+    start_time_ = std::chrono::steady_clock::now();
+    client_.connect();
+  }
+
+private:
+  TcpClient client_;
+  std::string image_;
+  DoneCallback done_cb_;
+  std::chrono::steady_clock::time_point start_time_;
+
+  void onConnection(const TcpConnectionPtr &conn) {
+    if (!conn->connected()) {
+      return;
+    }
+    container::CreateContainerRequest req;
+    req.set_image_name_tag(image_);
+    sendTcpPbMsg(conn, req);
+  }
+
+  void onMessage(const TcpConnectionPtr &conn, Buffer *buffer,
+                 Timestamp timestamp) {
+    container::CreateContainerResponse resp;
+    if (!receiveTcpPbMsg(buffer, resp)) {
+      return;
+    }
+    auto latency = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start_time_)
+                       .count();
+    conn->shutdown();
+    done_cb_(resp.success(), latency);
+  }
+};
+
+/// @brief: Pull `images` with at most `concurrency` pulls in flight. All
+/// methods run in the driver loop.
+class PullDriver {
+public:
+  PullDriver(EventLoop *loop, std::deque<std::string> images,
+             size_t concurrency, CountDownLatch *done)
+      : loop_(loop), images_(std::move(images)), concurrency_(concurrency),
+        done_(done) {}
+
+  void start() {
+    for (size_t i = 0; i < concurrency_; ++i) {
+      startNext();
+    }
+  }
+
+  const std::vector<double> &latencies() const { return latencies_; }
+
+  int failed() const { return failed_; }
+
+private:
+  EventLoop *loop_;
+  std::deque<std::string> images_;
+  size_t concurrency_;
+  CountDownLatch *done_;
+  // the clients are kept until the driver is destroyed, a TcpClient can not
+  // be destroyed in its own callback.
+  std::vector<std::unique_ptr<PullClient>> clients_;
+  std::vector<double> latencies_;
+  int failed_{0};
+
+  void startNext() {
+    if (images_.empty()) {
+      return;
+    }
+    auto image = std::move(images_.front());
+    images_.pop_front();
+    SPDLOG_DEBUG("start pulling {}", image);
+    clients_.emplace_back(std::make_unique<PullClient>(
+        loop_, loopbackAddr(3), std::move(image),
+        [this](bool success, double latency_ms) {
+          if (success) {
+            latencies_.emplace_back(latency_ms);
+          } else {
+            failed_++;
+          }
+          done_->countDown();
+          // the next pull is started outside the callback of the finished one
+          loop_->queueInLoop([this]() { startNext(); });
+        }));
+    clients_.back()->start();
+  }
+};
+
+double percentile(std::vector<double> sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  std::sort(sorted.begin(), sorted.end());
+  auto idx = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+  hdc::utils::initLogger("loopback_pull");
+  namespace fs = std::filesystem;
+
+  auto image_sizes = parseList(FLAGS_loopback_image_sizes);
+  auto concurrencies = parseList(FLAGS_loopback_concurrency);
+  auto work_dir = fs::path(FLAGS_loopback_work_dir);
+  auto registry_path = (work_dir / "registry").string();
+  auto metadata_path = (work_dir / "metadata").string();
+  auto untar_path = (work_dir / "untar").string();
+  fs::remove_all(work_dir);
+
+  // synthetic registry, one set of distinct images per run
+  struct Run {
+    size_t image_size;
+    size_t concurrency;
+    std::deque<std::string> images;
+    size_t tar_bytes{0};
+    size_t compressed_bytes{0};
+  };
+  std::vector<Run> runs;
+  uint32_t seed = 0;
+  for (auto size_mb : image_sizes) {
+    for (auto concurrency : concurrencies) {
+      Run run{size_mb, concurrency, {}};
+      for (int i = 0; i < FLAGS_loopback_images_per_run; ++i) {
+        auto name = fmt::format("loopback_{}m_c{}_{}", size_mb, concurrency, i);
+        auto image = hdc::bench::writeSyntheticImage(
+            registry_path, metadata_path, name, size_mb * 1024 * 1024,
+            FLAGS_loopback_layers_per_image, FLAGS_loopback_segment_size,
+            seed++);
+        if (!image.has_value()) {
+          SPDLOG_ERROR("write synthetic image {} error", name);
+          spdlog::shutdown();
+          return 1;
+        }
+        run.images.emplace_back(image->image_name_tag);
+        run.tar_bytes += image->tar_bytes;
+        run.compressed_bytes += image->compressed_bytes;
+      }
+      runs.emplace_back(std::move(run));
+    }
+  }
+
+  // a compressed segment may be a little larger than the tar piece
+  auto segment_cap = FLAGS_loopback_segment_size +
+                     FLAGS_loopback_segment_size / 8 + 64 * 1024;
+  FLAGS_content_client_transport = FLAGS_loopback_transport;
+  FLAGS_content_client_ib_dev_name = FLAGS_loopback_ib_dev_name;
+  FLAGS_content_client_ib_dev_port = FLAGS_loopback_ib_dev_port;
+  FLAGS_content_client_peer_ip = FLAGS_loopback_ip;
+  FLAGS_content_client_peer_port = FLAGS_loopback_base_port;
+  FLAGS_content_client_rdma_mem = segment_cap;
+  FLAGS_content_client_rdma_mem_num = 4;
+  auto transportConfig = [](size_t mem, size_t mem_num) {
+    return TransportConfig{
+        hdc::utils::transportTypeFlag(FLAGS_loopback_transport),
+        FLAGS_loopback_ib_dev_name, FLAGS_loopback_ib_dev_port, mem, mem_num};
+  };
+
+  // registry
+  EventLoopThread content_thread;
+  auto content_loop = content_thread.startLoop();
+  auto content_server = runInLoopAndWait(content_loop, [&]() {
+    auto server = std::make_unique<ContentServer>(
+        content_loop, loopbackAddr(0), "ContentServer",
+        transportConfig(segment_cap, 4), registry_path, true);
+    server->start();
+    return server;
+  });
+
+  // host
+  auto layer_store = LayerStore::open(untar_path, 0);
+  if (!layer_store.has_value()) {
+    SPDLOG_ERROR("open layer store {} error", untar_path);
+    spdlog::shutdown();
+    return 1;
+  }
+  MetadataService metadata_service{metadata_path};
+  metadata_service.start();
+  EventLoopThread host_thread;
+  auto host_loop = host_thread.startLoop();
+  auto offload_client = runInLoopAndWait(host_loop, [&]() {
+    return std::make_unique<OffloadClientEpoll>(
+        host_loop,
+        std::vector<DpuPeer>{{loopbackAddr(2), transportConfig(4096, 4)}},
+        &metadata_service, &*layer_store);
+  });
+  UntarEngine untar_engine{
+      FLAGS_loopback_untar_num_threads,
+      [&offload_client](UntarResult untar_res) {
+        offload_client->completeTask(std::move(untar_res));
+      },
+      untar_path};
+  auto decompress_server = runInLoopAndWait(host_loop, [&]() {
+    // the bufpairs of all the engines of the DPU
+    auto engine = CompressEngine::create(
+        "", DOCA_BUF_EXTENSION_NONE, 16, host_loop, 8, MAX_FILE_SIZE,
+        FLAGS_loopback_engine_mem_num * FLAGS_loopback_dpu_engines);
+    auto server = std::make_unique<DecompressServerEpoll>(
+        std::move(*engine), host_loop, loopbackAddr(1),
+        transportConfig(4096, 4), &untar_engine);
+    server->start();
+    return server;
+  });
+  auto command_server = runInLoopAndWait(host_loop, [&]() {
+    auto server = std::make_unique<CommandServer>(host_loop, loopbackAddr(3),
+                                                  0, offload_client.get());
+    server->start();
+    return server;
+  });
+
+  // DPU
+  EventLoopThread decompress_thread;
+  auto decompress_loop = decompress_thread.startLoop();
+  std::vector<std::unique_ptr<EventLoopThread>> engine_threads;
+  for (int i = 1; i < FLAGS_loopback_dpu_engines; ++i) {
+    engine_threads.push_back(std::make_unique<EventLoopThread>());
+  }
+  auto decompress_client = runInLoopAndWait(decompress_loop, [&]() {
+    // the first engine runs in the loop of the client
+    std::vector<CompressEngine> engines;
+    for (int i = 0; i < FLAGS_loopback_dpu_engines; ++i) {
+      auto engine_loop =
+          i == 0 ? decompress_loop : engine_threads[i - 1]->startLoop();
+      engines.push_back(std::move(*CompressEngine::create(
+          "", DOCA_BUF_EXTENSION_NONE, 16, engine_loop, segment_cap, 8,
+          FLAGS_loopback_engine_mem_num)));
+    }
+    auto client = std::make_unique<DecompressClientEpoll>(
+        std::move(engines), decompress_loop, loopbackAddr(1),
+        transportConfig(4096, 4),
+        std::make_shared<BlobPool>(segment_cap, 16));
+    client->decompressStart();
+    return client;
+  });
+  EventLoopThread fetcher_thread;
+  auto fetcher_loop = fetcher_thread.startLoop();
+  auto fetcher = runInLoopAndWait(fetcher_loop, [&]() {
+    return std::make_shared<ContentFetcher>(fetcher_loop,
+                                            decompress_client.get());
+  });
+  EventLoopThread offload_thread;
+  auto offload_loop = offload_thread.startLoop();
+  auto offload_server = runInLoopAndWait(offload_loop, [&]() {
+    auto server = std::make_unique<OffloadServerEpoll>(
+        offload_loop, loopbackAddr(2), transportConfig(4096, 4), fetcher,
+        decompress_client.get());
+    server->start();
+    return server;
+  });
+  host_loop->runInLoop([&]() { offload_client->connect(); });
+
+  // pulls
+  EventLoopThread driver_thread;
+  auto driver_loop = driver_thread.startLoop();
+  std::printf("%10s %6s %8s %10s %10s %10s %10s\n", "size(MB)", "conc",
+              "images", "MB/s", "images/s", "p50(ms)", "p99(ms)");
+  int failed = 0;
+  for (auto &run : runs) {
+    auto image_num = run.images.size();
+    CountDownLatch done(image_num);
+    auto driver = runInLoopAndWait(driver_loop, [&]() {
+      auto driver = std::make_unique<PullDriver>(
+          driver_loop, std::move(run.images), run.concurrency, &done);
+      driver->start();
+      return driver;
+    });
+    auto start = std::chrono::steady_clock::now();
+    done.wait();
+    auto seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    auto &latencies = driver->latencies();
+    std::printf("%10zu %6zu %8zu %10.1f %10.2f %10.1f %10.1f\n",
+                run.image_size, run.concurrency, image_num,
+                run.tar_bytes / 1024.0 / 1024.0 / seconds,
+                image_num / seconds, percentile(latencies, 0.5),
+                percentile(latencies, 0.99));
+    std::fflush(stdout);
+    failed += driver->failed();
+    runInLoopAndWait(driver_loop, [&]() {
+      driver.reset();
+      return true;
+    });
+  }
+  if (failed != 0) {
+    SPDLOG_ERROR("{} pulls failed", failed);
+  }
+  if (!FLAGS_loopback_keep_work_dir) {
+    fs::remove_all(work_dir);
+  }
+  spdlog::shutdown();
+  // like dpu_main and client_main, the daemons have no shutdown path. Leave
+  // them to the process exit instead of destroying them under their loops.
+  std::quick_exit(failed == 0 ? 0 : 1);
+}
@@ -0,0 +1,80 @@
+#include "compress.pb.h"
+#include "content.pb.h"
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <utils/MsgFrame.h>
+#include <vector>
+
+namespace {
+content::GetLayerResponse makeGetLayerResponse() {
+  content::GetLayerResponse resp;
+  resp.set_layer(
+      "sha256:5f70bf18a086007016e948b04aed3b82103a36bea41755b6cddfaf10ace3c6ef");
+  resp.set_index(3);
+  resp.set_iscompressed(true);
+  resp.set_segment_size(64 << 20);
+  resp.set_image_name_tag("library/nginx:latest");
+  resp.set_total_segments(8);
+  return resp;
+}
+
+compress::DecompressFinishRequest makeDecompressFinishRequest() {
+  compress::DecompressFinishRequest req;
+  req.set_layer_name(
+      "sha256:5f70bf18a086007016e948b04aed3b82103a36bea41755b6cddfaf10ace3c6ef");
+  req.set_image_name_tag("library/nginx:latest");
+  req.set_segment_size(64 << 20);
+  req.set_segment_idx(3);
+  req.set_total_segments(8);
+  req.set_bufpair_id(1);
+  req.set_data_inline(false);
+  return req;
+}
+} // namespace
+
+static void BM_SerializeRdmaPbMsg(benchmark::State &state) {
+  auto resp = makeGetLayerResponse();
+  std::vector<uint8_t> send_buf(4096);
+  for (auto _ : state) {
+    auto len = serializeRdmaPbMsg(send_buf.data(), send_buf.size(), resp);
+    benchmark::DoNotOptimize(len);
+  }
+}
+BENCHMARK(BM_SerializeRdmaPbMsg);
+
+static void BM_ParseRdmaPbMsg(benchmark::State &state) {
+  auto resp = makeGetLayerResponse();
+  std::vector<uint8_t> recv_buf(4096);
+  auto len = serializeRdmaPbMsg(recv_buf.data(), recv_buf.size(), resp);
+  for (auto _ : state) {
+    content::GetLayerResponse parsed;
+    auto n = parseRdmaPbMsg(recv_buf.data(), len, parsed);
+    benchmark::DoNotOptimize(n);
+  }
+}
+BENCHMARK(BM_ParseRdmaPbMsg);
+
+// a full DPU -> host round trip of the per-segment control message
+static void BM_DecompressFinishRoundTrip(benchmark::State &state) {
+  auto req = makeDecompressFinishRequest();
+  std::vector<uint8_t> buf(4096);
+  for (auto _ : state) {
+    auto len = serializeRdmaPbMsg(buf.data(), buf.size(), req);
+    compress::DecompressFinishRequest parsed;
+    benchmark::DoNotOptimize(parseRdmaPbMsg(buf.data(), len, parsed));
+  }
+}
+BENCHMARK(BM_DecompressFinishRoundTrip);
+
+static void BM_ReceiveTcpPbMsg(benchmark::State &state) {
+  auto resp = makeGetLayerResponse();
+  auto payload = resp.SerializeAsString();
+  Buffer buffer;
+  for (auto _ : state) {
+    buffer.appendInt32(static_cast<int32_t>(payload.size()));
+    buffer.append(payload);
+    content::GetLayerResponse parsed;
+    benchmark::DoNotOptimize(receiveTcpPbMsg(&buffer, parsed));
+  }
+}
+BENCHMARK(BM_ReceiveTcpPbMsg);
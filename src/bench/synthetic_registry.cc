@@ -0,0 +1,187 @@
+#include "bench/synthetic_registry.h"
+#include "bench/synthetic_tar.h"
+#include <algorithm>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <openssl/evp.h>
+#include <spdlog/spdlog.h>
+#include <zlib.h>
+
+namespace hdc {
+namespace bench {
+
+namespace {
+constexpr size_t kFileSize = 256 * 1024;
+
+class Sha256 {
+public:
+  Sha256() : ctx_(EVP_MD_CTX_new()) {
+    EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr);
+  }
+
+  ~Sha256() { EVP_MD_CTX_free(ctx_); }
+
+  Sha256(const Sha256 &) = delete;
+
+  Sha256 &operator=(const Sha256 &) = delete;
+
+  void update(const uint8_t *data, size_t len) {
+    EVP_DigestUpdate(ctx_, data, len);
+  }
+
+  /// @return: `sha256:<64 hex>`
+  std::string digest() {
+    uint8_t md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    EVP_DigestFinal_ex(ctx_, md, &md_len);
+    std::string res = "sha256:";
+    for (unsigned int i = 0; i < md_len; ++i) {
+      res += fmt::format("{:02x}", md[i]);
+    }
+    return res;
+  }
+
+private:
+  EVP_MD_CTX *ctx_;
+};
+
+std::optional<std::vector<uint8_t>> rawDeflate(const uint8_t *src,
+                                               size_t len) {
+  z_stream stream{};
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return std::nullopt;
+  }
+  std::vector<uint8_t> out(deflateBound(&stream, len));
+  stream.next_in = const_cast<Bytef *>(src);
+  stream.avail_in = len;
+  stream.next_out = out.data();
+  stream.avail_out = out.size();
+  auto ret = deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  if (ret != Z_STREAM_END) {
+    return std::nullopt;
+  }
+  return out;
+}
+
+bool writeFile(const std::filesystem::path &path, const void *data,
+               size_t len) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    SPDLOG_ERROR("Fail to open file {}", path.string());
+    return false;
+  }
+  out.write(reinterpret_cast<const char *>(data), len);
+  return out.good();
+}
+
+bool writeFile(const std::filesystem::path &path, const std::string &data) {
+  return writeFile(path, data.data(), data.size());
+}
+} // namespace
+
+std::optional<SyntheticImage>
+writeSyntheticImage(const std::string &registry_path,
+                    const std::string &metadata_path, const std::string &name,
+                    size_t image_size, int layer_num, size_t segment_size,
+                    uint32_t seed) {
+  namespace fs = std::filesystem;
+  SyntheticImage image;
+  image.image_name_tag = name + ":latest";
+  std::vector<std::pair<std::string, size_t>> manifest_layers;
+  std::vector<std::string> diff_ids;
+
+  auto layer_size = image_size / layer_num;
+  auto file_num = std::max<size_t>(1, layer_size / kFileSize);
+  for (int l = 0; l < layer_num; ++l) {
+    auto tar = makeSyntheticTar(file_num, kFileSize, seed * 1024 + l);
+    Sha256 diff_id;
+    diff_id.update(tar.data(), tar.size());
+    diff_ids.emplace_back(diff_id.digest());
+
+    std::vector<std::vector<uint8_t>> segments;
+    Sha256 layer_digest;
+    size_t layer_compressed = 0;
+    for (size_t off = 0; off < tar.size(); off += segment_size) {
+      auto len = std::min(segment_size, tar.size() - off);
+      auto segment = rawDeflate(tar.data() + off, len);
+      if (!segment.has_value()) {
+        SPDLOG_ERROR("deflate layer {} of {} error", l, name);
+        return std::nullopt;
+      }
+      layer_digest.update(segment->data(), segment->size());
+      layer_compressed += segment->size();
+      segments.emplace_back(std::move(*segment));
+    }
+    auto digest = layer_digest.digest();
+
+    auto layer_dir = fs::path(registry_path) / digest;
+    std::error_code ec;
+    fs::create_directories(layer_dir, ec);
+    if (ec) {
+      SPDLOG_ERROR("create dir {} error: {}", layer_dir.string(), ec.message());
+      return std::nullopt;
+    }
+    for (size_t i = 0; i < segments.size(); ++i) {
+      if (!writeFile(layer_dir / (std::to_string(i) + ".tar.gz"),
+                     segments[i].data(), segments[i].size())) {
+        return std::nullopt;
+      }
+    }
+    if (!writeFile(layer_dir / "total_segment.txt",
+                   std::to_string(segments.size()))) {
+      return std::nullopt;
+    }
+    manifest_layers.emplace_back(digest, layer_compressed);
+    image.layers.emplace_back(std::move(digest));
+    image.tar_bytes += tar.size();
+    image.compressed_bytes += layer_compressed;
+  }
+
+  std::string diff_ids_json;
+  for (auto &diff_id : diff_ids) {
+    diff_ids_json += fmt::format("{}\"{}\"", diff_ids_json.empty() ? "" : ",",
+                                 diff_id);
+  }
+  auto config = fmt::format(
+      R"({{"architecture":"amd64","os":"linux","config":{{}},)"
+      R"("rootfs":{{"type":"layers","diff_ids":[{}]}}}})",
+      diff_ids_json);
+  Sha256 config_digest;
+  config_digest.update(reinterpret_cast<const uint8_t *>(config.data()),
+                       config.size());
+
+  std::string layers_json;
+  for (auto &[digest, size] : manifest_layers) {
+    layers_json += fmt::format(
+        R"({}{{"mediaType":"application/vnd.docker.image.rootfs.diff.tar.gzip",)"
+        R"("size":{},"digest":"{}"}})",
+        layers_json.empty() ? "" : ",", size, digest);
+  }
+  auto manifest = fmt::format(
+      R"({{"schemaVersion":2,)"
+      R"("mediaType":"application/vnd.docker.distribution.manifest.v2+json",)"
+      R"("config":{{"mediaType":"application/vnd.docker.container.image.v1+json",)"
+      R"("size":{},"digest":"{}"}},"layers":[{}]}})",
+      config.size(), config_digest.digest(), layers_json);
+
+  auto metadata_dir = fs::path(metadata_path) / image.image_name_tag;
+  std::error_code ec;
+  fs::create_directories(metadata_dir, ec);
+  if (ec) {
+    SPDLOG_ERROR("create dir {} error: {}", metadata_dir.string(),
+                 ec.message());
+    return std::nullopt;
+  }
+  if (!writeFile(metadata_dir / "manifest.json", manifest) ||
+      !writeFile(metadata_dir / "config", config)) {
+    return std::nullopt;
+  }
+  return image;
+}
+
+} // namespace bench
+} // namespace hdc
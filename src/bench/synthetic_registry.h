@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace hdc {
+namespace bench {
+
+struct SyntheticImage {
+  // the image id passed to CreateContainerRequest, `<name>:latest`
+  std::string image_name_tag;
+  // the digests of the layers
+  std::vector<std::string> layers;
+  // the uncompressed size of all layers
+  size_t tar_bytes{0};
+  // the size of all segments in the registry
+  size_t compressed_bytes{0};
+};
+
+/// @brief: Write an image made of synthetic tar layers in the layout read by
+/// ContentServer and OffloadClientEpoll:
+///   `<registry_path>/<digest>/<i>.tar.gz` and `total_segment.txt`,
+///   `<metadata_path>/<name>:latest/manifest.json` and `config`.
+/// Each layer is cut into `segment_size` pieces of tar and every piece is
+/// compressed independently with raw deflate, the format of the DOCA engine.
+/// `seed` must be different for every image, the pipeline keys its state by
+/// layer digest and pulls a layer shared by several images only once.
+std::optional<SyntheticImage>
+writeSyntheticImage(const std::string &registry_path,
+                    const std::string &metadata_path, const std::string &name,
+                    size_t image_size, int layer_num, size_t segment_size,
+                    uint32_t seed);
+
+} // namespace bench
+} // namespace hdc
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace hdc {
+namespace bench {
+
+/// @brief: Build an in-memory ustar archive with `file_num` regular files of
+/// `file_size` bytes each. The content is pseudo random but half of every
+/// file is a repeated pattern, so it compresses roughly like a real layer.
+inline std::vector<uint8_t> makeSyntheticTar(size_t file_num, size_t file_size,
+                                             uint32_t seed = 0) {
+  constexpr size_t kBlock = 512;
+  std::vector<uint8_t> tar;
+  tar.reserve(file_num * (kBlock + file_size + kBlock) + 2 * kBlock);
+  std::mt19937 rng(seed);
+
+  for (size_t i = 0; i < file_num; ++i) {
+    uint8_t header[kBlock] = {0};
+    auto name = "file_" + std::to_string(i);
+    std::memcpy(header, name.data(), name.size());
+    std::snprintf(reinterpret_cast<char *>(header + 100), 8, "%07o", 0644);
+    std::snprintf(reinterpret_cast<char *>(header + 108), 8, "%07o", 0);
+    std::snprintf(reinterpret_cast<char *>(header + 116), 8, "%07o", 0);
+    std::snprintf(reinterpret_cast<char *>(header + 124), 12, "%011zo",
+                  file_size);
+    std::snprintf(reinterpret_cast<char *>(header + 136), 12, "%011o", 0);
+    header[156] = '0';
+    std::memcpy(header + 257, "ustar", 6);
+    std::memcpy(header + 263, "00", 2);
+    // the checksum is computed with the checksum field filled by spaces
+    std::memset(header + 148, ' ', 8);
+    unsigned int checksum = 0;
+    for (auto c : header) {
+      checksum += c;
+    }
+    std::snprintf(reinterpret_cast<char *>(header + 148), 8, "%06o", checksum);
+    header[155] = ' ';
+    tar.insert(tar.end(), header, header + kBlock);
+
+    auto begin = tar.size();
+    tar.resize(begin + (file_size + kBlock - 1) / kBlock * kBlock, 0);
+    for (size_t j = 0; j < file_size; ++j) {
+      tar[begin + j] = j < file_size / 2 ? static_cast<uint8_t>(rng())
+                                         : static_cast<uint8_t>(j % 64);
+    }
+  }
+  tar.resize(tar.size() + 2 * kBlock, 0);
+  return tar;
+}
+
+} // namespace bench
+} // namespace hdc
@@ -0,0 +1,52 @@
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <network/EventLoop.h>
+#include <network/EventLoopThread.h>
+#include <network/TimerId.h>
+#include <vector>
+
+using hdc::network::EventLoop;
+using hdc::network::EventLoopThread;
+using hdc::network::TimerId;
+
+// schedule and cancel timers far in the future, which only exercises the
+// timer set bookkeeping
+static void BM_TimerAddCancel(benchmark::State &state) {
+  EventLoop loop;
+  const auto timers = state.range(0);
+  std::vector<TimerId> ids;
+  ids.reserve(timers);
+  for (auto _ : state) {
+    for (int64_t i = 0; i < timers; ++i) {
+      ids.push_back(loop.runAfter(3600.0 + i, []() {}));
+    }
+    for (auto &id : ids) {
+      loop.cancel(id);
+    }
+    ids.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * timers);
+}
+BENCHMARK(BM_TimerAddCancel)->Arg(1)->Arg(64)->Arg(1024);
+
+// schedule timers that expire immediately from another thread and wait until
+// all of them fired
+static void BM_TimerExpire(benchmark::State &state) {
+  EventLoopThread loop_thread;
+  EventLoop *loop = loop_thread.startLoop();
+  const auto timers = state.range(0);
+  std::atomic<int64_t> fired{0};
+  int64_t scheduled = 0;
+  for (auto _ : state) {
+    for (int64_t i = 0; i < timers; ++i) {
+      loop->runAfter(0.0, [&fired]() {
+        fired.fetch_add(1, std::memory_order_release);
+      });
+    }
+    scheduled += timers;
+    while (fired.load(std::memory_order_acquire) != scheduled) {
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * timers);
+}
+BENCHMARK(BM_TimerExpire)->Arg(1)->Arg(64)->UseRealTime();
@@ -0,0 +1,80 @@
+#include "bench/synthetic_tar.h"
+#include <algorithm>
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <filesystem>
+#include <host/client/untar_engine.h>
+#include <network/CountDownLatch.h>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <unistd.h>
+
+using hdc::CountDownLatch;
+using hdc::host::client::UntarData;
+using hdc::host::client::UntarEngine;
+using hdc::host::client::UntarResult;
+
+namespace {
+constexpr size_t kSegmentSize = 4 << 20;
+}
+
+// Extract `layers` synthetic layers of 64 files each through UntarEngine, fed
+// in kSegmentSize segments like DecompressServerEpoll does. The time covers
+// the popen'ed tar processes and the per-layer queues.
+static void BM_UntarEngineExtract(benchmark::State &state) {
+  // the engine logs every layer at info level
+  spdlog::set_level(spdlog::level::warn);
+  const auto layers = state.range(0);
+  const auto file_size = static_cast<size_t>(state.range(1));
+  const auto threads = static_cast<size_t>(state.range(2));
+  const auto tar = hdc::bench::makeSyntheticTar(64, file_size);
+  const int total_segments = (tar.size() + kSegmentSize - 1) / kSegmentSize;
+
+  auto root = std::filesystem::temp_directory_path() /
+              ("poby_untar_bench_" + std::to_string(getpid()));
+  std::atomic<int> failed{0};
+  CountDownLatch *latch = nullptr;
+  UntarEngine engine(
+      threads,
+      [&latch, &failed](UntarResult res) {
+        if (!res.success) {
+          failed++;
+        }
+        latch->countDown();
+      },
+      root.string());
+
+  int64_t round = 0;
+  for (auto _ : state) {
+    CountDownLatch done(layers);
+    latch = &done;
+    for (int64_t l = 0; l < layers; ++l) {
+      // layer names must be unique, the engine keys its queues by layer
+      auto layer = "layer_" + std::to_string(round) + "_" + std::to_string(l);
+      for (int i = 0; i < total_segments; ++i) {
+        auto begin = tar.begin() + i * kSegmentSize;
+        auto end = tar.begin() +
+                   std::min(tar.size(), (i + 1) * kSegmentSize);
+        engine.untar(UntarData{layer, "bench", std::vector<uint8_t>(begin, end),
+                               i, total_segments});
+      }
+    }
+    done.wait();
+    state.PauseTiming();
+    std::filesystem::remove_all(root);
+    ++round;
+    state.ResumeTiming();
+  }
+  if (failed != 0) {
+    state.SkipWithError("untar failed");
+  }
+  state.SetBytesProcessed(state.iterations() * layers * tar.size());
+}
+BENCHMARK(BM_UntarEngineExtract)
+    ->ArgNames({"layers", "file_size", "threads"})
+    ->Args({1, 64 << 10, 1})
+    ->Args({1, 1 << 20, 1})
+    ->Args({4, 1 << 20, 1})
+    ->Args({4, 1 << 20, 4})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
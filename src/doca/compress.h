@@ -288,6 +288,10 @@ public:
 
   bool engine_busy() { return engine_busy_; }
 
+  /// @brief: The EventLoop the engine is polled in, where start_job() is
+  /// called and the callbacks run.
+  EventLoop *get_loop() { return loop_; }
+
   size_t bufpair_num() { return bufpairs_.size(); }
 
   void releaseFreeBufpair(size_t id) {
@@ -0,0 +1,11 @@
+#pragma once
+/// The compress engine used by the DPU and host daemons. POBY_SOFT_COMPRESS
+/// selects the zlib engine in doca/soft_compress.h instead of the DOCA one.
+#ifdef POBY_SOFT_COMPRESS
+#include "doca/soft_compress.h"
+#else
+#include "doca/common.h"
+#include "doca/compress.h"
+#include "doca/doca_buf.h"
+#include "doca_error.h"
+#endif
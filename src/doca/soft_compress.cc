@@ -0,0 +1,403 @@
+#include "doca/soft_compress.h"
+#include <cerrno>
+#include <cstring>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace {
+constexpr int kRawDeflateWindowBits = -15;
+constexpr int kGzipWindowBits = 15 + 16;
+constexpr int kZlibWindowBits = 15;
+
+/// DOCA deflate produces raw deflate streams. Segments produced by other
+/// tools may carry a gzip or zlib header, accept them as well.
+int detectWindowBits(const uint8_t *src, size_t len) {
+  if (len >= 2 && src[0] == 0x1f && src[1] == 0x8b) {
+    return kGzipWindowBits;
+  }
+  if (len >= 2 && (src[0] & 0x0f) == Z_DEFLATED &&
+      ((src[0] << 8) | src[1]) % 31 == 0) {
+    return kZlibWindowBits;
+  }
+  return kRawDeflateWindowBits;
+}
+
+tl::expected<size_t, doca_error_t> inflateSegment(const uint8_t *src,
+                                                  size_t src_len, uint8_t *dst,
+                                                  size_t dst_cap) {
+  z_stream stream{};
+  if (inflateInit2(&stream, detectWindowBits(src, src_len)) != Z_OK) {
+    return tl::unexpected(DOCA_ERROR_NO_MEMORY);
+  }
+  stream.next_in = const_cast<Bytef *>(src);
+  stream.avail_in = src_len;
+  stream.next_out = dst;
+  stream.avail_out = dst_cap;
+  auto ret = inflate(&stream, Z_FINISH);
+  size_t dst_len = stream.total_out;
+  inflateEnd(&stream);
+  if (ret == Z_BUF_ERROR && stream.avail_out == 0) {
+    SPDLOG_ERROR("inflate: dst buffer {} is too small", dst_cap);
+    return tl::unexpected(DOCA_ERROR_NO_MEMORY);
+  }
+  if (ret != Z_STREAM_END) {
+    SPDLOG_ERROR("inflate error: {}", ret);
+    return tl::unexpected(DOCA_ERROR_INVALID_VALUE);
+  }
+  return dst_len;
+}
+
+tl::expected<size_t, doca_error_t> deflateSegment(const uint8_t *src,
+                                                  size_t src_len, uint8_t *dst,
+                                                  size_t dst_cap, int level) {
+  z_stream stream{};
+  if (deflateInit2(&stream, level, Z_DEFLATED, kRawDeflateWindowBits, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return tl::unexpected(DOCA_ERROR_NO_MEMORY);
+  }
+  stream.next_in = const_cast<Bytef *>(src);
+  stream.avail_in = src_len;
+  stream.next_out = dst;
+  stream.avail_out = dst_cap;
+  auto ret = deflate(&stream, Z_FINISH);
+  size_t dst_len = stream.total_out;
+  deflateEnd(&stream);
+  if (ret != Z_STREAM_END) {
+    SPDLOG_ERROR("deflate error: {}, dst buffer {}", ret, dst_cap);
+    return tl::unexpected(DOCA_ERROR_NO_MEMORY);
+  }
+  return dst_len;
+}
+} // namespace
+
+const char *doca_get_error_string(doca_error_t err) {
+  switch (err) {
+  case DOCA_SUCCESS:
+    return "Success";
+  case DOCA_ERROR_INVALID_VALUE:
+    return "Invalid input";
+  case DOCA_ERROR_NO_MEMORY:
+    return "Not enough memory";
+  case DOCA_ERROR_NOT_FOUND:
+    return "Not found";
+  case DOCA_ERROR_IO_FAILED:
+    return "Input/Output operation failed";
+  case DOCA_ERROR_NOT_SUPPORTED:
+    return "Operation not supported";
+  case DOCA_ERROR_OPERATING_SYSTEM:
+    return "Operating system call failure";
+  default:
+    return "Unexpected error";
+  }
+}
+
+doca_error_t DocaBuf::set_data_by_offset(size_t offset, size_t len) {
+  if (offset + len > capacity_) {
+    SPDLOG_ERROR("overflow in DocaBuf set_data_by_offset");
+    return DOCA_ERROR_INVALID_VALUE;
+  }
+  data_offset_ = offset;
+  data_len_ = len;
+  return DOCA_SUCCESS;
+}
+
+doca_error_t DocaBuf::flush_remote(size_t len) {
+  data_len_ = len;
+  if (!is_remote() || len == 0) {
+    return DOCA_SUCCESS;
+  }
+  iovec local{ptr_, len};
+  iovec remote{remote_addr_, len};
+  auto n = process_vm_writev(remote_pid_, &local, 1, &remote, 1, 0);
+  if (n != static_cast<ssize_t>(len)) {
+    SPDLOG_ERROR("process_vm_writev to pid {} error: {}. The soft engine "
+                 "needs ptrace permission on the peer process",
+                 remote_pid_, strerror(errno));
+    return DOCA_ERROR_OPERATING_SYSTEM;
+  }
+  return DOCA_SUCCESS;
+}
+
+CompressEngine::Worker::Worker(int level)
+    : event_fd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), level(level) {
+  if (event_fd < 0) {
+    SPDLOG_ERROR("Fail to create an eventfd");
+    abort();
+  }
+  thread = std::thread([this]() { run(); });
+}
+
+CompressEngine::Worker::~Worker() {
+  {
+    std::lock_guard<std::mutex> guard(mtx);
+    quit = true;
+  }
+  cond.notify_one();
+  thread.join();
+  ::close(event_fd);
+}
+
+void CompressEngine::Worker::run() {
+  while (true) {
+    Job curr;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cond.wait(lock, [this]() { return quit || job.has_value(); });
+      if (quit) {
+        return;
+      }
+      curr = *job;
+      job.reset();
+    }
+    auto res =
+        curr.job_type == DOCA_DECOMPRESS_DEFLATE_JOB
+            ? inflateSegment(curr.src, curr.src_len, curr.dst, curr.dst_cap)
+            : deflateSegment(curr.src, curr.src_len, curr.dst, curr.dst_cap,
+                             level);
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      result = JobResult{curr.job_id,
+                         res.has_value() ? DOCA_SUCCESS : res.error(),
+                         res.has_value() ? *res : 0};
+    }
+    uint64_t one = 1;
+    if (::write(event_fd, &one, sizeof one) != sizeof one) {
+      SPDLOG_ERROR("write eventfd error: {}", strerror(errno));
+    }
+  }
+}
+
+CompressEngine::CompressEngine(EventLoop *loop, size_t src_mem_size,
+                               size_t dst_mem_size, int mem_num,
+                               int level) noexcept
+    : loop_(loop), worker_(new Worker(level)),
+      channel_(new Channel(loop, worker_->event_fd, "SoftCompress")) {
+  bufpairs_.reserve(mem_num);
+  for (int i = 0; i < mem_num; ++i) {
+    bufpairs_.emplace_back(src_mem_size, dst_mem_size, i);
+    free_bufpairs_.emplace_back(i);
+  }
+  bindChannel();
+}
+
+CompressEngine::CompressEngine() noexcept {}
+
+CompressEngine::CompressEngine(CompressEngine &&engine) noexcept
+    : bufpairs_(std::move(engine.bufpairs_)),
+      free_bufpairs_(std::move(engine.free_bufpairs_)), loop_(engine.loop_),
+      worker_(std::move(engine.worker_)), channel_(std::move(engine.channel_)),
+      compress_success_cb_(std::move(engine.compress_success_cb_)),
+      compress_error_cb_(std::move(engine.compress_error_cb_)),
+      engine_busy_(engine.engine_busy_),
+      ongoing_bufpair_id_(engine.ongoing_bufpair_id_) {
+  if (channel_) {
+    bindChannel();
+  }
+  engine.loop_ = nullptr;
+}
+
+CompressEngine::~CompressEngine() {
+  if (!channel_) {
+    return;
+  }
+  if (!channel_->isNoneEvent()) {
+    channel_->disableAll();
+    channel_->remove();
+  }
+}
+
+void CompressEngine::bindChannel() {
+  channel_->setReadCallback(
+      [this](Timestamp recv_time) { handleRead(recv_time); });
+  channel_->setErrorCallback([this]() { handleError(); });
+}
+
+void CompressEngine::swap(CompressEngine &rhs) noexcept {
+  using std::swap;
+  swap(bufpairs_, rhs.bufpairs_);
+  swap(free_bufpairs_, rhs.free_bufpairs_);
+  swap(loop_, rhs.loop_);
+  swap(worker_, rhs.worker_);
+  swap(channel_, rhs.channel_);
+  swap(compress_success_cb_, rhs.compress_success_cb_);
+  swap(compress_error_cb_, rhs.compress_error_cb_);
+  swap(engine_busy_, rhs.engine_busy_);
+  swap(ongoing_bufpair_id_, rhs.ongoing_bufpair_id_);
+  if (channel_) {
+    bindChannel();
+  }
+  if (rhs.channel_) {
+    rhs.bindChannel();
+  }
+}
+
+CompressEngine &CompressEngine::operator=(CompressEngine rhs) noexcept {
+  rhs.swap(*this);
+  return *this;
+}
+
+void swap(CompressEngine &lhs, CompressEngine &rhs) noexcept { lhs.swap(rhs); }
+
+tl::expected<CompressEngine, doca_error_t>
+CompressEngine::create(const char *pci_addr, uint32_t extensions,
+                       uint32_t workq_depth, EventLoop *loop,
+                       size_t src_mem_size, size_t dst_mem_size, int mem_num) {
+  SPDLOG_INFO("Use the software compress engine, {} bufpairs", mem_num);
+  return CompressEngine(loop, src_mem_size, dst_mem_size, mem_num,
+                        Z_DEFAULT_COMPRESSION);
+}
+
+doca_error_t
+CompressEngine::src_mmaps_start(std::optional<uint32_t> access_mask) {
+  for (auto &buf : bufpairs_) {
+    buf.src_doca_buf = DocaBuf{buf.src_mem.data(), buf.src_mem.size()};
+  }
+  return DOCA_SUCCESS;
+}
+
+doca_error_t
+CompressEngine::dst_mmaps_start(std::optional<uint32_t> access_mask) {
+  for (auto &buf : bufpairs_) {
+    buf.dst_doca_buf = DocaBuf{buf.dst_mem.data(), buf.dst_mem.size()};
+  }
+  return DOCA_SUCCESS;
+}
+
+namespace {
+/// @brief: Build the DocaBuf of an exported range. The memory of the same
+/// process is used in place, the memory of another process goes through
+/// `staging`.
+tl::expected<DocaBuf, doca_error_t>
+docaBufFromExport(const ExportDescRemote &desc,
+                  std::vector<uint8_t> &staging) {
+  uint64_t exported[3];
+  if (desc.export_desc_len != sizeof exported) {
+    SPDLOG_ERROR("export desc len {} error", desc.export_desc_len);
+    return tl::unexpected(DOCA_ERROR_INVALID_VALUE);
+  }
+  memcpy(exported, desc.export_desc, sizeof exported);
+  auto pid = static_cast<pid_t>(exported[0]);
+  if (pid == getpid()) {
+    return DocaBuf{desc.remote_addr, desc.remote_len};
+  }
+  staging.resize(desc.remote_len);
+  return DocaBuf{staging.data(), staging.size(), pid, desc.remote_addr};
+}
+} // namespace
+
+doca_error_t CompressEngine::src_mmaps_create_from_export(
+    const std::vector<ExportDescRemote> &export_descs) {
+  assert(bufpairs_.size() == export_descs.size());
+  for (int i = 0, n = bufpairs_.size(); i < n; ++i) {
+    auto &buf = bufpairs_[i];
+    // src memory is only read by the engine, copy it from the remote process
+    // is not supported.
+    auto doca_buf = docaBufFromExport(export_descs[i], buf.dst_staging);
+    if (!doca_buf.has_value()) {
+      return doca_buf.error();
+    }
+    if (doca_buf->is_remote()) {
+      SPDLOG_ERROR("src_mmap from another process is not supported");
+      return DOCA_ERROR_NOT_SUPPORTED;
+    }
+    buf.src_doca_buf = std::move(*doca_buf);
+  }
+  return DOCA_SUCCESS;
+}
+
+doca_error_t CompressEngine::dst_mmaps_create_from_export(
+    const std::vector<ExportDescRemote> &export_descs) {
+  assert(bufpairs_.size() == export_descs.size());
+  for (int i = 0, n = bufpairs_.size(); i < n; ++i) {
+    auto &buf = bufpairs_[i];
+    auto doca_buf = docaBufFromExport(export_descs[i], buf.dst_staging);
+    if (!doca_buf.has_value()) {
+      SPDLOG_ERROR("dst_mmap create from export error: {}",
+                   doca_get_error_string(doca_buf.error()));
+      return doca_buf.error();
+    }
+    buf.dst_doca_buf = std::move(*doca_buf);
+  }
+  return DOCA_SUCCESS;
+}
+
+tl::expected<std::vector<ExportDesc>, doca_error_t>
+CompressEngine::src_mmaps_export_dpu() {
+  std::vector<ExportDesc> res;
+  res.reserve(bufpairs_.size());
+  for (auto &buf : bufpairs_) {
+    buf.export_desc = {static_cast<uint64_t>(getpid()),
+                       reinterpret_cast<uint64_t>(buf.src_mem.data()),
+                       buf.src_mem.size()};
+    res.emplace_back(buf.export_desc.data(), sizeof(buf.export_desc));
+  }
+  return res;
+}
+
+tl::expected<std::vector<ExportDesc>, doca_error_t>
+CompressEngine::dst_mmaps_export_dpu() {
+  std::vector<ExportDesc> res;
+  res.reserve(bufpairs_.size());
+  for (auto &buf : bufpairs_) {
+    buf.export_desc = {static_cast<uint64_t>(getpid()),
+                       reinterpret_cast<uint64_t>(buf.dst_mem.data()),
+                       buf.dst_mem.size()};
+    res.emplace_back(buf.export_desc.data(), sizeof(buf.export_desc));
+  }
+  return res;
+}
+
+void CompressEngine::start_job(uint64_t job_id,
+                               doca_compress_job_types job_type,
+                               size_t bufpair_id) {
+  assert(engine_busy_ == false);
+  ongoing_bufpair_id_ = bufpair_id;
+  auto &buf = bufpairs_[bufpair_id];
+  {
+    std::lock_guard<std::mutex> guard(worker_->mtx);
+    worker_->job = Job{job_id,
+                       job_type,
+                       buf.src_doca_buf.get_data(),
+                       *buf.src_doca_buf.get_doca_buf_data_len(),
+                       buf.dst_doca_buf.get_ptr(),
+                       buf.dst_doca_buf.get_capacity()};
+  }
+  worker_->cond.notify_one();
+  engine_busy_ = true;
+}
+
+void CompressEngine::handleRead(Timestamp recvTime) {
+  uint64_t one = 0;
+  if (::read(worker_->event_fd, &one, sizeof one) != sizeof one) {
+    SPDLOG_ERROR("read eventfd error: {}", strerror(errno));
+    return;
+  }
+  JobResult res;
+  {
+    std::lock_guard<std::mutex> guard(worker_->mtx);
+    assert(worker_->result.has_value());
+    res = *worker_->result;
+    worker_->result.reset();
+  }
+  engine_busy_ = false;
+  auto &buf = bufpairs_[ongoing_bufpair_id_];
+  auto err = res.err;
+  if (err == DOCA_SUCCESS) {
+    err = buf.dst_doca_buf.flush_remote(res.dst_len);
+  }
+  if (err != DOCA_SUCCESS) {
+    SPDLOG_ERROR("soft compress job {} error: {}", res.job_id,
+                 doca_get_error_string(err));
+    compress_error_cb_(*this, err);
+    return;
+  }
+  compress_success_cb_(*this, res.job_id, buf.src_mem.data(),
+                       *buf.src_doca_buf.get_doca_buf_data_len(),
+                       buf.dst_mem.data(), res.dst_len);
+}
+
+void CompressEngine::handleError() {
+  SPDLOG_ERROR("CompressEngine handle soft engine event: error");
+}
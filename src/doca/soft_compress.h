@@ -0,0 +1,278 @@
+#pragma once
+/// A zlib based CompressEngine with the same interface as the DOCA engine in
+/// doca/compress.h. It is selected by POBY_SOFT_COMPRESS (see doca/engine.h)
+/// so that the DPU and host daemons can be built and run on machines without
+/// DOCA or a BlueField. Jobs run one at a time in a worker thread and their
+/// completion is reported to the EventLoop through an eventfd, like the DOCA
+/// workq event handle.
+#include "network/Channel.h"
+#include "network/EventLoop.h"
+#include "network/Timestamp.h"
+#include <array>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <sys/types.h>
+#include <thread>
+#include <tl/expected.hpp>
+#include <vector>
+using hdc::network::Channel;
+using hdc::network::EventLoop;
+using hdc::network::Timestamp;
+using std::uint8_t;
+using std::vector;
+
+// The subset of DOCA definitions used by the pipeline.
+enum doca_error_t {
+  DOCA_SUCCESS = 0,
+  DOCA_ERROR_INVALID_VALUE,
+  DOCA_ERROR_NO_MEMORY,
+  DOCA_ERROR_NOT_FOUND,
+  DOCA_ERROR_IO_FAILED,
+  DOCA_ERROR_NOT_SUPPORTED,
+  DOCA_ERROR_OPERATING_SYSTEM,
+  DOCA_ERROR_UNEXPECTED,
+};
+
+enum doca_compress_job_types {
+  DOCA_COMPRESS_DEFLATE_JOB = 1,
+  DOCA_DECOMPRESS_DEFLATE_JOB,
+};
+
+enum doca_access_flags {
+  DOCA_ACCESS_LOCAL_READ_WRITE = 0,
+  DOCA_ACCESS_DPU_READ_ONLY = 1 << 1,
+  DOCA_ACCESS_DPU_READ_WRITE = 1 << 2,
+};
+
+constexpr uint32_t DOCA_BUF_EXTENSION_NONE = 0;
+
+// same as doca/common.h
+constexpr size_t MAX_FILE_SIZE = (128 * 1024 * 1024);
+
+const char *doca_get_error_string(doca_error_t err);
+
+/// @brief: A view of a memory range with a data length, like a doca_buf. When
+/// the range belongs to another process, `ptr` is a local staging buffer and
+/// the data is copied to `remote_pid` with process_vm_writev after each job.
+class DocaBuf {
+  uint8_t *ptr_{nullptr};
+  size_t capacity_{0};
+  size_t data_offset_{0};
+  size_t data_len_{0};
+  pid_t remote_pid_{0};
+  uint8_t *remote_addr_{nullptr};
+
+public:
+  DocaBuf() noexcept = default;
+
+  DocaBuf(uint8_t *ptr, size_t capacity, pid_t remote_pid = 0,
+          uint8_t *remote_addr = nullptr) noexcept
+      : ptr_(ptr), capacity_(capacity), remote_pid_(remote_pid),
+        remote_addr_(remote_addr) {}
+
+  DocaBuf(const DocaBuf &) = delete;
+
+  DocaBuf &operator=(const DocaBuf &) = delete;
+
+  DocaBuf(DocaBuf &&) noexcept = default;
+
+  DocaBuf &operator=(DocaBuf &&) noexcept = default;
+
+  inline uint8_t *get_ptr() { return ptr_; }
+
+  inline size_t get_capacity() { return capacity_; }
+
+  inline uint8_t *get_data() { return ptr_ + data_offset_; }
+
+  inline bool is_remote() const { return remote_pid_ != 0; }
+
+  doca_error_t set_data_by_offset(size_t offset, size_t len);
+
+  tl::expected<size_t, doca_error_t> get_doca_buf_data_len() {
+    return data_len_;
+  }
+
+  /// @brief: Copy the first `len` bytes to the remote process.
+  doca_error_t flush_remote(size_t len);
+};
+
+struct ExportDesc {
+  const void *export_desc;
+  size_t export_desc_len;
+
+  ExportDesc(const void *export_desc, size_t export_desc_len) noexcept
+      : export_desc(export_desc), export_desc_len(export_desc_len) {}
+};
+
+struct ExportDescRemote {
+  const void *export_desc;
+  size_t export_desc_len;
+  uint8_t *remote_addr;
+  size_t remote_len;
+
+  ExportDescRemote(const void *export_desc, size_t export_desc_len,
+                   uint8_t *remote_addr, size_t remote_len)
+      : export_desc(export_desc), export_desc_len(export_desc_len),
+        remote_addr(remote_addr), remote_len(remote_len) {}
+};
+
+class CompressEngine;
+using CompressSuccessCallback = std::function<void(
+    CompressEngine &engine, uint64_t job_id, uint8_t *src_addr, size_t src_len,
+    uint8_t *dst_addr, size_t dst_len)>;
+using CompressErrorCallback =
+    std::function<void(CompressEngine &engine, doca_error_t err)>;
+
+class CompressEngine {
+private:
+  struct DocaBufPair {
+    std::vector<uint8_t> src_mem;
+    std::vector<uint8_t> dst_mem;
+    DocaBuf src_doca_buf;
+    DocaBuf dst_doca_buf;
+    // staging memory when the dst memory belongs to another process
+    std::vector<uint8_t> dst_staging;
+    // the exported descriptor: {pid, addr, len}
+    std::array<uint64_t, 3> export_desc{};
+    int id;
+    DocaBufPair(size_t src_mem_size, size_t dst_mem_size, int id) noexcept
+        : src_mem(src_mem_size, 0), dst_mem(dst_mem_size, 0), id(id) {}
+  };
+
+  struct Job {
+    uint64_t job_id;
+    doca_compress_job_types job_type;
+    uint8_t *src;
+    size_t src_len;
+    uint8_t *dst;
+    size_t dst_cap;
+  };
+
+  struct JobResult {
+    uint64_t job_id;
+    doca_error_t err;
+    size_t dst_len;
+  };
+
+  /// the worker thread and its eventfd. It is owned through a unique_ptr so
+  /// that it keeps its address when the engine is moved.
+  struct Worker {
+    int event_fd{-1};
+    int level{0};
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::optional<Job> job;
+    std::optional<JobResult> result;
+    bool quit{false};
+    std::thread thread;
+
+    Worker(int level);
+    ~Worker();
+    void run();
+  };
+
+  std::vector<DocaBufPair> bufpairs_;
+  // store the id of bufpairs_
+  std::vector<int> free_bufpairs_;
+  EventLoop *loop_{nullptr};
+  std::unique_ptr<Worker> worker_;
+  std::unique_ptr<Channel> channel_;
+  CompressSuccessCallback compress_success_cb_;
+  CompressErrorCallback compress_error_cb_;
+  bool engine_busy_{false};
+  size_t ongoing_bufpair_id_{0};
+
+  CompressEngine(EventLoop *loop, size_t src_mem_size, size_t dst_mem_size,
+                 int mem_num, int level) noexcept;
+
+  void bindChannel();
+
+public:
+  /// @brief: `pci_addr`, `extensions` and `workq_depth` are accepted for
+  /// compatibility with the DOCA engine and ignored.
+  static tl::expected<CompressEngine, doca_error_t>
+  create(const char *pci_addr, uint32_t extensions, uint32_t workq_depth,
+         EventLoop *loop, size_t src_mem_size, size_t dst_mem_size,
+         int mem_num = 1);
+
+  CompressEngine() noexcept;
+
+  CompressEngine(CompressEngine &&engine) noexcept;
+
+  ~CompressEngine();
+
+  void swap(CompressEngine &rhs) noexcept;
+
+  CompressEngine &operator=(CompressEngine rhs) noexcept;
+
+  CompressEngine(const CompressEngine &) = delete;
+
+  void start() { channel_->enableReading(); }
+
+  void setCompressSuccessCallback(CompressSuccessCallback cb) {
+    compress_success_cb_ = std::move(cb);
+  }
+
+  void setCompressErrorCallback(CompressErrorCallback cb) {
+    compress_error_cb_ = std::move(cb);
+  }
+
+  doca_error_t src_mmaps_start(std::optional<uint32_t> access_mask);
+
+  doca_error_t dst_mmaps_start(std::optional<uint32_t> access_mask);
+
+  doca_error_t src_mmaps_create_from_export(
+      const std::vector<ExportDescRemote> &export_descs);
+
+  doca_error_t dst_mmaps_create_from_export(
+      const std::vector<ExportDescRemote> &export_descs);
+
+  tl::expected<std::vector<ExportDesc>, doca_error_t> src_mmaps_export_dpu();
+
+  tl::expected<std::vector<ExportDesc>, doca_error_t> dst_mmaps_export_dpu();
+
+  /// @brief: Start a compresss job.
+  /// @detail: Not thread safe. Must be called in the EventLoop thread of
+  /// CompressEngine. Before call this function. You must make sure there are no
+  /// ongoing compress tasks.
+  void start_job(uint64_t job_id, doca_compress_job_types job_type,
+                 size_t bufpair_id);
+
+  void handleRead(Timestamp recvTime);
+
+  void handleError();
+
+  DocaBufPair &get_bufpair(size_t idx) { return bufpairs_[idx]; }
+
+  bool engine_busy() { return engine_busy_; }
+
+  /// @brief: The EventLoop the engine is polled in, where start_job() is
+  /// called and the callbacks run.
+  EventLoop *get_loop() { return loop_; }
+
+  size_t bufpair_num() { return bufpairs_.size(); }
+
+  void releaseFreeBufpair(size_t id) {
+    assert(id < bufpairs_.size());
+    free_bufpairs_.emplace_back(id);
+  }
+
+  std::optional<size_t> acquireFreeBufpair() {
+    if (!free_bufpairs_.empty()) {
+      auto id = free_bufpairs_.back();
+      free_bufpairs_.pop_back();
+      return id;
+    } else {
+      return std::nullopt;
+    }
+  }
+};
+
+void swap(CompressEngine &lhs, CompressEngine &rhs) noexcept;
@@ -2,13 +2,17 @@
 #include "network/EventLoop.h"
 #include "network/EventLoopThread.h"
 #include "network/InetAddress.h"
-#include "network/rdma/RdmaConfig.h"
+#include "network/transport/TransportConfig.h"
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <dpu/content_fetcher.h>
+#include <functional>
 #include <future>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <optional>
 #include <spdlog/spdlog.h>
@@ -19,69 +23,205 @@ using hdc::dpu::ContentTaskQueue;
 using hdc::dpu::ContentTaskQueuePtr;
 using hdc::network::EventLoop;
 using hdc::network::InetAddress;
-using hdc::network::rdma::RdmaConfig;
+using hdc::network::transport::TransportConfig;
 
 namespace hdc {
 namespace dpu {
 
+namespace {
+// the weight of a new sample in the measured latency and throughput
+constexpr double kStatWeight = 0.2;
+// the latency, throughput and segment size of a registry before it answers,
+// the same for all, so that the first layers go where the least is queued
+constexpr double kInitLatencyMs = 1;
+constexpr double kInitThroughput = 1024.0 * 1024;
+constexpr double kInitSegmentBytes = 4.0 * 1024 * 1024;
+
+/// @brief: The codec of a response, of a server before the codecs too.
+content::Codec responseCodec(const content::GetLayerResponse &resp) {
+  if (resp.has_codec()) {
+    return resp.codec();
+  }
+  return resp.iscompressed() ? content::DEFLATE : content::UNCOMPRESSED;
+}
+
+void updateStat(double &stat, double sample) {
+  stat = (1 - kStatWeight) * stat + kStatWeight * sample;
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point from,
+                 std::chrono::steady_clock::time_point to) {
+  return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+bool sameAddress(const InetAddress &lhs, const InetAddress &rhs) {
+  return !(lhs < rhs) && !(rhs < lhs);
+}
+} // namespace
+
 ContentClient::ContentClient(EventLoop *loop, const InetAddress &listenAddr,
-                             const std::string &name, RdmaConfig rdmaConfig,
-                             DecompressClientEpoll *decompress_client,
-                             std::shared_ptr<BlobPool> blob_pool)
-    : client_(loop, listenAddr, name, std::move(rdmaConfig)), loop_(loop),
-      decompress_client_(decompress_client), blob_pool_(std::move(blob_pool)) {
-  client_.setConnectedCallback(
-      [this](const RdmaConnectionPtr &conn) { this->onConnected(conn); });
-  client_.setRecvSuccessCallback([this](const RdmaConnectionPtr &conn,
-                                        uint8_t *recv_buf, uint32_t recv_len,
-                                        const ibv_wc &wc) {
+                             const std::string &name,
+                             TransportConfig transportConfig,
+                             std::vector<content::Codec> codecs,
+                             std::shared_ptr<BlobPool> blob_pool,
+                             std::shared_ptr<SegmentCache> segment_cache,
+                             std::shared_ptr<FetchBudget> fetch_budget,
+                             SchedPolicy sched_policy,
+                             SegmentFetchedCallback segment_fetched_cb,
+                             std::function<void()> failed_cb)
+    : listen_addr_(listenAddr), name_(name),
+      transport_config_(std::move(transportConfig)), loop_(loop),
+      codecs_(std::move(codecs)), blob_pool_(std::move(blob_pool)),
+      segment_cache_(std::move(segment_cache)),
+      fetch_budget_(std::move(fetch_budget)),
+      segment_fetched_cb_(std::move(segment_fetched_cb)),
+      failed_cb_(std::move(failed_cb)), latency_ms_(kInitLatencyMs),
+      throughput_(kInitThroughput), segment_bytes_(kInitSegmentBytes),
+      unsend_reqs_(sched_policy) {
+  createClient();
+}
+
+void ContentClient::createClient() {
+  client_ = createMsgClient(loop_, listen_addr_, name_, transport_config_);
+  client_->setConnectedCallback(
+      [this](const MsgConnectionPtr &conn) { this->onConnected(conn); });
+  client_->setDisconnectedCallback(
+      [this](const MsgConnectionPtr &conn) { this->onDisconnected(conn); });
+  client_->setRecvSuccessCallback([this](const MsgConnectionPtr &conn,
+                                         uint8_t *recv_buf, uint32_t recv_len,
+                                         const Completion &wc) {
     this->onRecvSuccess(conn, recv_buf, recv_len, wc);
   });
-  client_.setRecvFailCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  client_->setRecvFailCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onRecvFail(conn, wc);
       });
-  client_.setSendCompleteSuccessCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  client_->setSendCompleteSuccessCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onSendCompleteSuccess(conn, wc);
       });
-  client_.setSendCompleteFailCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  client_->setSendCompleteFailCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onSendCompleteFail(conn, wc);
       });
 }
 
 void ContentClient::connect() {
   loop_->assertInLoopThread();
-  client_.connect();
+  connecting_since_ = std::chrono::steady_clock::now();
+  client_->connect();
 }
 
-void ContentClient::onConnected(const RdmaConnectionPtr &conn) {
+void ContentClient::reconnect() {
+  loop_->assertInLoopThread();
+  SPDLOG_INFO("ContentClient reconnects to {}", listen_addr_.toIpPort());
+  createClient();
+  connect();
+}
+
+void ContentClient::onConnected(const MsgConnectionPtr &conn) {
   SPDLOG_DEBUG("ContentClient RDMA connection success");
   conn_ = conn;
-  assert(!unsend_reqs_.empty() && !conn_->isFreeSendBufEmpty());
+  lost_ = false;
+  connecting_since_.reset();
+  last_response_ = std::chrono::steady_clock::now();
   // Send request
   trySendRequests();
 }
 
-void ContentClient::onRecvSuccess(const RdmaConnectionPtr &conn,
+void ContentClient::onDisconnected(const MsgConnectionPtr &conn) {
+  if (conn != conn_) {
+    return;
+  }
+  SPDLOG_ERROR("ContentClient connection {} lost", conn->name());
+  conn_ = nullptr;
+  lost_ = true;
+  // the requests queued from now on count as waiting for a connection
+  connecting_since_ = std::chrono::steady_clock::now();
+  // no response comes on the lost connection, the requests not taken and
+  // the cached segments behind them are requested again, in their order
+  for (auto it = inflight_sends_.rbegin(); it != inflight_sends_.rend();
+       ++it) {
+    if (it->cached.has_value()) {
+      dropCached(*it->cached);
+      enqueueRequest(std::move(it->request), true);
+    } else if (!it->taken) {
+      enqueueRequest(std::move(it->request), true);
+    }
+  }
+  inflight_sends_.clear();
+  inflight_requests_ = 0;
+  failed_cb_();
+}
+
+void ContentClient::onRecvSuccess(const MsgConnectionPtr &conn,
                                   uint8_t *recv_buf, uint32_t recv_len,
-                                  const ibv_wc &wc) {
+                                  const Completion &wc) {
   // Get response and send segment to Decompress Client
+  if (conn != conn_) {
+    SPDLOG_WARN("Drop a GetLayerResponse of the lost connection {}",
+                conn->name());
+    return;
+  }
   content::GetLayerResponse resp{};
   auto frame_len = parseRdmaPbMsg(recv_buf, recv_len, resp);
 
-  conn->releaseSendBuf(inflight_sends_.front());
+  if (inflight_sends_.empty()) {
+    SPDLOG_ERROR("GetLayerResponse without a request in flight");
+    return;
+  }
+  // the cached segments at the front are delivered at once
+  assert(!inflight_sends_.front().cached.has_value());
+  auto inflight = std::move(inflight_sends_.front());
   inflight_sends_.pop_front();
+  conn->releaseSendBuf(inflight.bufpair_id);
   if (frame_len == -1) {
-    SPDLOG_ERROR("parseRdmaPbMsg error");
+    SPDLOG_ERROR("parseRdmaPbMsg error, segment {} of layer {}",
+                 inflight.request.req.index(), inflight.request.req.layer());
+    failRequest(std::move(inflight));
+    return;
+  }
+  if (resp.has_error()) {
+    SPDLOG_ERROR("Registry failed segment {} of layer {}: {}",
+                 inflight.request.req.index(), inflight.request.req.layer(),
+                 resp.error());
+    failRequest(std::move(inflight));
+    return;
   }
   assert(resp.segment_size() == recv_len - frame_len);
 
   size_t segment_size = recv_len - frame_len;
+  // the registry works on the response since it finished the one before, or
+  // since the request if it was idle
+  auto now_steady = std::chrono::steady_clock::now();
+  updateStat(latency_ms_, elapsedMs(inflight.sent, now_steady));
+  if (double busy_ms = elapsedMs(std::max(inflight.sent, last_response_),
+                                 now_steady);
+      busy_ms > 0) {
+    updateStat(throughput_, segment_size / busy_ms);
+  }
+  updateStat(segment_bytes_, static_cast<double>(segment_size));
+  last_response_ = now_steady;
+  if (!inflight.taken) {
+    inflight_requests_--;
+  }
   Blob segment = blob_pool_->acquireBlob(segment_size);
   memcpy(segment.get_addr(), recv_buf + frame_len, segment_size);
   segment.set_size(segment_size);
+  if (fetch_budget_) {
+    fetch_budget_->acquire(segment_size);
+  }
+  auto codec = responseCodec(resp);
+  if (segment_cache_) {
+    segment_cache_->insert(resp.layer(), resp.index(), resp.total_segments(),
+                           codec, recv_buf + frame_len,
+                           segment_size, resp.chunk());
+    if (resp.chunks_size() > 0) {
+      segment_cache_->insertRecipe(
+          resp.layer(),
+          std::vector<std::string>(resp.chunks().begin(), resp.chunks().end()));
+    }
+  }
 
   // record transfer time
   auto now = std::chrono::high_resolution_clock::now();
@@ -92,44 +232,113 @@ void ContentClient::onRecvSuccess(const RdmaConnectionPtr &conn,
     curr_image_tag_ = resp.image_name_tag();
   }
   rdma_duration_ += duration;
-  decompress_client_->submitDecompressTask(
-      ContentElement{std::move(segment), resp.index(), resp.total_segments(),
-                     resp.layer(), resp.image_name_tag(), resp.iscompressed()});
+  int priority = inflight.request.priority;
+  SPDLOG_DEBUG("Recv GetLayerResponse: image: {}, layer: {}, index: {}, size: "
+               "{}, rdma_rtt {}us, rdma_duration {}us",
+               resp.image_name_tag(), resp.layer(), resp.index(),
+               resp.segment_size(), duration, rdma_duration_);
+  segment_fetched_cb_(ContentElement{std::move(segment), resp.index(),
+                                     resp.total_segments(), resp.layer(),
+                                     resp.image_name_tag(), codec, priority},
+                      inflight.request.partial,
+                      std::vector<std::string>(resp.chunks().begin(),
+                                               resp.chunks().end()));
 
-  SPDLOG_INFO("Recv GetLayerResponse: image: {}, layer: {}, index: {}, size: "
-              "{}, rdma_rtt {}us, rdma_duration {}us",
-              resp.image_name_tag(), resp.layer(), resp.index(),
-              resp.segment_size(), duration, rdma_duration_);
+  deliverCached();
+  trySendRequests();
+}
 
-  // Send new request if needed.
-  if (int n = resp.total_segments(); resp.index() == 0 && n > 1) {
-    for (int i = n - 1; i > 0; --i) {
-      content::GetLayerRequest req{};
-      req.set_layer(resp.layer());
-      req.set_image_name_tag(resp.image_name_tag());
-      req.set_index(i);
-      req.set_total_segments(n);
-      unsend_reqs_.push_front(std::move(req));
-    }
+void ContentClient::deliverCached() {
+  while (!inflight_sends_.empty() &&
+         inflight_sends_.front().cached.has_value()) {
+    auto inflight = std::move(inflight_sends_.front());
+    inflight_sends_.pop_front();
+    segment_fetched_cb_(std::move(*inflight.cached), inflight.request.partial,
+                        {});
   }
+}
 
+void ContentClient::dropCached(ContentElement &cached) {
+  size_t size = cached.segment.get_size();
+  blob_pool_->releaseBlob(std::move(cached.segment));
+  if (fetch_budget_) {
+    fetch_budget_->release(size);
+  }
+}
+
+void ContentClient::failRequest(InflightRequest inflight) {
+  if (!inflight.taken) {
+    inflight_requests_--;
+    enqueueRequest(std::move(inflight.request), true);
+  }
+  failed_cb_();
+  deliverCached();
   trySendRequests();
 }
 
-void ContentClient::onRecvFail(const RdmaConnectionPtr &conn,
-                               const ibv_wc &wc) {
+bool ContentClient::serveFromCache(const LayerRequest &request) {
+  if (!segment_cache_) {
+    return false;
+  }
+  auto &req = request.req;
+  auto chunk = request.chunk;
+  int total_segments = req.total_segments();
+  if (chunk.empty()) {
+    // the recipe is kept while a segment of the layer is cached
+    auto *recipe = segment_cache_->lookupRecipe(req.layer());
+    if (recipe == nullptr || req.index() >= static_cast<int>(recipe->size())) {
+      return false;
+    }
+    chunk = (*recipe)[req.index()];
+    total_segments = static_cast<int>(recipe->size());
+  }
+  auto cached = segment_cache_->lookupChunk(chunk);
+  if (!cached.has_value()) {
+    return false;
+  }
+  SPDLOG_DEBUG("Segment cache hit by chunk {}: layer {}, index {}", chunk,
+               req.layer(), req.index());
+  Blob segment = blob_pool_->acquireBlob(cached->size);
+  memcpy(segment.get_addr(), cached->data, cached->size);
+  segment.set_size(cached->size);
+  if (fetch_budget_) {
+    fetch_budget_->acquire(cached->size);
+  }
+  auto codec = cached->codec;
+  // it extends the cached prefix of this layer as well
+  segment_cache_->insert(req.layer(), req.index(), total_segments, codec,
+                         segment.get_addr(), segment.get_size(), chunk);
+  auto priority = request.priority;
+  inflight_sends_.push_back(InflightRequest{
+      0, request, std::chrono::steady_clock::now(), true,
+      ContentElement{std::move(segment), req.index(), total_segments,
+                     req.layer(), req.image_name_tag(), codec, priority}});
+  deliverCached();
+  return true;
+}
+
+void ContentClient::onRecvFail(const MsgConnectionPtr &conn,
+                               const Completion &wc) {
+  if (conn != conn_) {
+    return;
+  }
   SPDLOG_ERROR("RDMA recv fail");
+  failed_cb_();
 }
 
-void ContentClient::onSendCompleteSuccess(const RdmaConnectionPtr &conn,
-                                          const ibv_wc &wc) {
+void ContentClient::onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                                          const Completion &wc) {
   // SPDLOG_INFO("RDMA send complete success, wc_id {}, size {}", wc.wr_id,
   //             wc.byte_len);
 }
 
-void ContentClient::onSendCompleteFail(const RdmaConnectionPtr &conn,
-                                       const ibv_wc &wc) {
+void ContentClient::onSendCompleteFail(const MsgConnectionPtr &conn,
+                                       const Completion &wc) {
+  if (conn != conn_) {
+    return;
+  }
   SPDLOG_ERROR("RDMA send complete fail");
+  failed_cb_();
 }
 
 void ContentClient::trySendRequests() {
@@ -137,12 +346,86 @@ void ContentClient::trySendRequests() {
     return;
   }
   while (!unsend_reqs_.empty() && !conn_->isFreeSendBufEmpty()) {
+    // the decompress client calls back once it has drained the budget
+    if (fetch_budget_ && fetch_budget_->exhausted()) {
+      SPDLOG_DEBUG("Fetch budget exhausted, {} bytes not yet decompressed",
+                   fetch_budget_->used());
+      return;
+    }
     sendRequest();
   }
 }
 
-void ContentClient::enqueueRequest(content::GetLayerRequest req) {
-  unsend_reqs_.emplace_back(std::move(req));
+void ContentClient::enqueueRequest(LayerRequest request, bool front) {
+  auto image_name_tag = request.req.image_name_tag();
+  auto priority = request.priority;
+  if (front) {
+    unsend_reqs_.pushFront(image_name_tag, std::move(request), 1, priority);
+  } else {
+    unsend_reqs_.push(image_name_tag, std::move(request), 1, priority);
+  }
+}
+
+std::vector<ContentClient::LayerRequest> ContentClient::takeRequests() {
+  std::vector<LayerRequest> requests;
+  for (auto it = inflight_sends_.begin(); it != inflight_sends_.end();) {
+    if (it->cached.has_value()) {
+      // it waits for the responses before it
+      dropCached(*it->cached);
+      requests.push_back(std::move(it->request));
+      it = inflight_sends_.erase(it);
+      continue;
+    }
+    if (!it->taken) {
+      it->taken = true;
+      requests.push_back(it->request);
+    }
+    ++it;
+  }
+  inflight_requests_ = 0;
+  while (!unsend_reqs_.empty()) {
+    requests.push_back(std::move(unsend_reqs_.front()));
+    unsend_reqs_.pop();
+  }
+  return requests;
+}
+
+size_t ContentClient::outstanding() const {
+  return unsend_reqs_.size() + inflight_requests_;
+}
+
+double ContentClient::expectedWaitMs() const {
+  return latency_ms_ + outstanding() * segment_bytes_ / throughput_;
+}
+
+bool ContentClient::stalled(std::chrono::steady_clock::time_point now,
+                            double timeout_ms) const {
+  if (connecting_since_.has_value()) {
+    return !unsend_reqs_.empty() &&
+           elapsedMs(*connecting_since_, now) > timeout_ms;
+  }
+  for (auto &inflight : inflight_sends_) {
+    if (!inflight.taken) {
+      return elapsedMs(inflight.sent, now) > timeout_ms;
+    }
+  }
+  // the requests taken by a failover still hold the send bufs, those queued
+  // since and the cached segments behind them wait for their responses
+  bool blocked = !unsend_reqs_.empty() && conn_ != nullptr &&
+                 conn_->isFreeSendBufEmpty();
+  bool cached_waiting =
+      std::any_of(inflight_sends_.begin(), inflight_sends_.end(),
+                  [](const InflightRequest &inflight) {
+                    return inflight.cached.has_value();
+                  });
+  if (blocked || cached_waiting) {
+    for (auto &inflight : inflight_sends_) {
+      if (!inflight.cached.has_value()) {
+        return elapsedMs(inflight.sent, now) > timeout_ms;
+      }
+    }
+  }
+  return false;
 }
 
 /// Before call this function, must assert both the unsend request queue and
@@ -151,56 +434,392 @@ void ContentClient::sendRequest() {
   if (conn_ == nullptr) {
     return;
   }
+  auto request = std::move(unsend_reqs_.front());
+  unsend_reqs_.pop();
+  if (serveFromCache(request)) {
+    return;
+  }
   start_time_ = std::chrono::high_resolution_clock::now();
+  // the request is kept as queued, to be sent again to another registry
+  auto req = request.req;
+  for (auto codec : codecs_) {
+    req.add_accept_codecs(codec);
+  }
 
   auto free_buf = conn_->acquireFreeSendBuf();
   auto send_buf = free_buf->addr;
   auto send_cap = free_buf->cap;
-  auto req = std::move(unsend_reqs_.front());
-  unsend_reqs_.pop_front();
   auto frame_len = serializeRdmaPbMsg(send_buf, send_cap, req);
   if (frame_len == -1) {
     SPDLOG_ERROR("serializeRdmaPbMsg error");
     return;
   }
   start_time_ = std::chrono::high_resolution_clock::now();
-  SPDLOG_INFO("Send GetLayerRequest. image_name_tag: {}, layer: {}, index: {}. "
-              "wr_id: {}. free_bufpair {}",
-              req.image_name_tag(), req.layer(), req.index(), wr_id_,
-              free_buf->id);
+  SPDLOG_DEBUG("Send GetLayerRequest. image_name_tag: {}, layer: {}, index: {}. "
+               "wr_id: {}. free_bufpair {}",
+               req.image_name_tag(), req.layer(), req.index(), wr_id_,
+               free_buf->id);
   conn_->send(send_buf, frame_len, wr_id_++);
-  inflight_sends_.emplace_back(free_buf->id);
+  inflight_sends_.push_back(InflightRequest{free_buf->id, std::move(request),
+                                            std::chrono::steady_clock::now(),
+                                            false, std::nullopt});
+  inflight_requests_++;
 }
 
 ContentFetcher::ContentFetcher(EventLoop *loop,
-                               DecompressClientEpoll *decompress_client)
-    : loop_(loop), decompress_client_(decompress_client) {
+                               DecompressClientEpoll *decompress_client,
+                               std::shared_ptr<SegmentCache> segment_cache,
+                               SchedPolicy sched_policy,
+                               RegistryPolicy registry_policy)
+    : loop_(loop), decompress_client_(decompress_client),
+      segment_cache_(std::move(segment_cache)), sched_policy_(sched_policy),
+      registry_policy_(registry_policy) {
   blob_pool_ = decompress_client_->get_blob_pool();
+  fetch_budget_ = decompress_client_->get_fetch_budget();
+  if (fetch_budget_) {
+    // called in the loop of the decompress client
+    fetch_budget_->setAvailableCallback([this]() {
+      loop_->queueInLoop([this]() {
+        for (auto &[addr, registry] : clients_) {
+          registry.client->trySendRequests();
+        }
+      });
+    });
+  }
+  loop_->runEvery(registry_policy_.timeout_ms / 2 / 1000,
+                  [this]() { checkStalled(); });
+}
+
+void ContentFetcher::onSegmentFetched(ContentElement element, bool partial,
+                                      std::vector<std::string> chunks) {
+  auto drop = [this](ContentElement &dropped) {
+    size_t size = dropped.segment.get_size();
+    blob_pool_->releaseBlob(std::move(dropped.segment));
+    if (fetch_budget_) {
+      fetch_budget_->release(size);
+    }
+  };
+  auto layer = element.layer;
+  if (partial) {
+    auto it = partials_.find({layer, element.segment_idx});
+    if (it == partials_.end()) {
+      drop(element);
+      return;
+    }
+    if (--it->second == 0) {
+      partials_.erase(it);
+    }
+    decompress_client_->submitDecompressTask(std::move(element));
+    return;
+  }
+  auto it = layers_.find(layer);
+  if (it == layers_.end() || element.segment_idx != it->second.next) {
+    SPDLOG_DEBUG("Drop duplicate segment {} of layer {}", element.segment_idx,
+                 layer);
+    drop(element);
+    return;
+  }
+  auto &fetch = it->second;
+  auto image_name_tag = element.image_name_tag;
+  int index = element.segment_idx;
+  int total_segments = element.total_segments;
+  fetch.next++;
+  decompress_client_->submitDecompressTask(std::move(element));
+  // without segment 0, the total was unknown: request the others now, before
+  // the other layers of the image
+  if (index == 0 && total_segments > 1) {
+    std::vector<ContentClient::LayerRequest> requests;
+    for (int i = total_segments - 1; i > 0; --i) {
+      content::GetLayerRequest req{};
+      req.set_layer(layer);
+      req.set_image_name_tag(image_name_tag);
+      req.set_index(i);
+      req.set_total_segments(total_segments);
+      auto chunk = i < static_cast<int>(chunks.size()) ? chunks[i]
+                                                       : std::string();
+      requests.push_back(ContentClient::LayerRequest{
+          std::move(req), fetch.priority, false, std::move(chunk)});
+    }
+    enqueueRequests(fetch.registry, fetch.transport_config,
+                    std::move(requests), true);
+  }
+  if (fetch.next >= total_segments) {
+    int cached = fetch.cached;
+    layers_.erase(it);
+    if (layer_fetched_cb_) {
+      layer_fetched_cb_(layer, image_name_tag, total_segments, cached);
+    }
+  }
+}
+
+void ContentFetcher::failover(const InetAddress &addr) {
+  loop_->assertInLoopThread();
+  auto it = clients_.find(addr);
+  if (it == clients_.end()) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (it->second.down_until > now) {
+    // the requests have been taken already
+    return;
+  }
+  it->second.down_until =
+      now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double, std::milli>(
+                    registry_policy_.timeout_ms));
+  auto requests = it->second.client->takeRequests();
+  SPDLOG_WARN("Registry {} failed, {} requests go to the other registries",
+              addr.toIpPort(), requests.size());
+  // the layers on the registry move to another one as a whole, from the
+  // first segment not submitted, since its responses come in order
+  std::map<std::string, std::vector<ContentClient::LayerRequest>> moved;
+  for (auto &request : requests) {
+    auto &layer = request.req.layer();
+    if (request.partial) {
+      auto reg_it = partial_registries_.find(layer);
+      if (reg_it == partial_registries_.end()) {
+        continue;
+      }
+      auto &[registries, transport_config] = reg_it->second;
+      auto to = pickRegistry(layer, registries, addr);
+      std::vector<ContentClient::LayerRequest> one;
+      one.push_back(std::move(request));
+      enqueueRequests(to, transport_config, std::move(one));
+      continue;
+    }
+    auto layer_it = layers_.find(layer);
+    if (layer_it == layers_.end() ||
+        request.req.index() < layer_it->second.next) {
+      continue;
+    }
+    moved[layer].push_back(std::move(request));
+  }
+  for (auto &[layer, layer_requests] : moved) {
+    auto &fetch = layers_.at(layer);
+    fetch.registry = pickRegistry(layer, fetch.registries, addr);
+    std::sort(layer_requests.begin(), layer_requests.end(),
+              [](const ContentClient::LayerRequest &lhs,
+                 const ContentClient::LayerRequest &rhs) {
+                return lhs.req.index() < rhs.req.index();
+              });
+    enqueueRequests(fetch.registry, fetch.transport_config,
+                    std::move(layer_requests), true);
+  }
+}
+
+void ContentFetcher::checkStalled() {
+  auto now = std::chrono::steady_clock::now();
+  std::vector<InetAddress> stalled;
+  std::vector<InetAddress> lost;
+  for (auto &[addr, registry] : clients_) {
+    if (registry.down_until > now) {
+      continue;
+    }
+    if (registry.client->lost()) {
+      lost.push_back(addr);
+    } else if (registry.client->stalled(now, registry_policy_.timeout_ms)) {
+      stalled.push_back(addr);
+    }
+  }
+  for (auto &addr : stalled) {
+    failover(addr);
+  }
+  for (auto &addr : lost) {
+    // what was queued on it since goes to the others, and it is passed over
+    // again until it connects
+    failover(addr);
+    clients_.at(addr).client->reconnect();
+  }
+}
+
+InetAddress
+ContentFetcher::pickRegistry(const std::string &layer,
+                             const std::vector<InetAddress> &registries,
+                             const std::optional<InetAddress> &exclude) {
+  assert(!registries.empty());
+  auto now = std::chrono::steady_clock::now();
+  auto usable = [&](const InetAddress &addr) {
+    if (exclude.has_value() && sameAddress(addr, *exclude)) {
+      return false;
+    }
+    auto it = clients_.find(addr);
+    return it == clients_.end() || (it->second.down_until <= now &&
+                                    !it->second.client->lost());
+  };
+  std::vector<InetAddress> candidates;
+  std::copy_if(registries.begin(), registries.end(),
+               std::back_inserter(candidates), usable);
+  if (candidates.empty()) {
+    // all are down, the one failed last may be back first
+    candidates = registries;
+  }
+  if (registry_policy_.sharded) {
+    // rendezvous hashing: a layer keeps its registry when others are added,
+    // and moves to the next in its order when its registry is down
+    auto weight = [&layer](const InetAddress &addr) {
+      return std::hash<std::string>{}(layer + "@" + addr.toIpPort());
+    };
+    return *std::max_element(candidates.begin(), candidates.end(),
+                             [&](const InetAddress &lhs,
+                                 const InetAddress &rhs) {
+                               return weight(lhs) < weight(rhs);
+                             });
+  }
+  auto wait = [this](const InetAddress &addr) {
+    auto it = clients_.find(addr);
+    return it == clients_.end() ? kInitLatencyMs
+                                : it->second.client->expectedWaitMs();
+  };
+  return *std::min_element(candidates.begin(), candidates.end(),
+                           [&](const InetAddress &lhs, const InetAddress &rhs) {
+                             return wait(lhs) < wait(rhs);
+                           });
+}
+
+void ContentFetcher::submitCachedSegment(const std::string &layer,
+                                         const std::string &image_name_tag,
+                                         int index,
+                                         const SegmentCache::Segment &cached,
+                                         int priority) {
+  Blob segment = blob_pool_->acquireBlob(cached.size);
+  memcpy(segment.get_addr(), cached.data, cached.size);
+  segment.set_size(cached.size);
+  if (fetch_budget_) {
+    fetch_budget_->acquire(cached.size);
+  }
+  decompress_client_->submitDecompressTask(
+      ContentElement{std::move(segment), index, cached.total_segments, layer,
+                     image_name_tag, cached.codec, priority});
+}
+
+std::pair<int, int>
+ContentFetcher::submitCachedSegments(const std::string &layer,
+                                     const std::string &image_name_tag,
+                                     int priority) {
+  int index = 0;
+  int total_segments = 0;
+  if (!segment_cache_) {
+    return {index, total_segments};
+  }
+  while (index == 0 || index < total_segments) {
+    auto cached = segment_cache_->lookup(layer, index);
+    if (!cached.has_value()) {
+      break;
+    }
+    total_segments = cached->total_segments;
+    submitCachedSegment(layer, image_name_tag, index, *cached, priority);
+    ++index;
+  }
+  return {index, total_segments};
+}
+
+ContentClient &ContentFetcher::client(const InetAddress &addr,
+                                      const TransportConfig &transport_config) {
+  auto it = clients_.find(addr);
+  if (it != clients_.end()) {
+    return *it->second.client;
+  }
+  auto client = std::make_unique<ContentClient>(
+      loop_, addr, "ContentClient", transport_config,
+      decompress_client_->codecs(),
+      this->blob_pool_, segment_cache_, fetch_budget_, sched_policy_,
+      [this](ContentElement element, bool partial,
+             std::vector<std::string> chunks) {
+        onSegmentFetched(std::move(element), partial, std::move(chunks));
+      },
+      [this, addr]() { failover(addr); });
+  client->connect();
+  return *clients_.emplace(addr, Registry{std::move(client), {}})
+              .first->second.client;
+}
+
+void ContentFetcher::enqueueRequests(
+    const InetAddress &addr, const TransportConfig &transport_config,
+    std::vector<ContentClient::LayerRequest> requests, bool front) {
+  auto &content_client = client(addr, transport_config);
+  if (front) {
+    // pushed to the front one by one, the first goes last
+    for (auto it = requests.rbegin(); it != requests.rend(); ++it) {
+      content_client.enqueueRequest(std::move(*it), true);
+    }
+  } else {
+    for (auto &request : requests) {
+      content_client.enqueueRequest(std::move(request));
+    }
+  }
+  content_client.trySendRequests();
 }
 
 void ContentFetcher::fetch(const std::string &layer,
                            const std::string &image_name_tag,
-                           const InetAddress &addr,
-                           const RdmaConfig &rdma_config) {
-  loop_->runInLoop([this, layer, image_name_tag, addr, rdma_config]() {
+                           const std::vector<InetAddress> &registries,
+                           const TransportConfig &transport_config,
+                           int priority, std::vector<int> segments) {
+  loop_->runInLoop([this, layer, image_name_tag, registries, transport_config,
+                    priority, segments = std::move(segments)]() {
     loop_->assertInLoopThread();
-    content::GetLayerRequest req{};
-    req.set_layer(layer);
-    req.set_image_name_tag(image_name_tag);
-    req.set_index(0);
-    req.set_total_segments(0);
-    auto it = clients_.find(addr);
-    if (it == clients_.end()) {
-      auto client = std::make_unique<ContentClient>(
-          loop_, addr, "ContentClient", std::move(rdma_config),
-          decompress_client_, this->blob_pool_);
-      client->enqueueRequest(std::move(req));
-      client->connect();
-      clients_.emplace(addr, std::move(client));
-    } else {
-      it->second->enqueueRequest(std::move(req));
-      it->second->trySendRequests();
+    if (!segments.empty()) {
+      // the segments a lazy pull reads, the host takes them in any order, so
+      // each goes to the registry expected to answer it first
+      partial_registries_.insert_or_assign(
+          layer, std::make_pair(registries, transport_config));
+      size_t requested = 0;
+      for (int i : segments) {
+        auto cached = segment_cache_ ? segment_cache_->lookup(layer, i)
+                                     : std::nullopt;
+        if (cached.has_value()) {
+          submitCachedSegment(layer, image_name_tag, i, *cached, priority);
+          continue;
+        }
+        content::GetLayerRequest req{};
+        req.set_layer(layer);
+        req.set_image_name_tag(image_name_tag);
+        req.set_index(i);
+        req.set_total_segments(0);
+        partials_[{layer, i}]++;
+        std::vector<ContentClient::LayerRequest> requests;
+        requests.push_back(
+            ContentClient::LayerRequest{std::move(req), priority, true, ""});
+        enqueueRequests(pickRegistry(layer, registries), transport_config,
+                        std::move(requests));
+        requested++;
+      }
+      SPDLOG_DEBUG("Fetch {} segments of layer {}, {} from the segment cache",
+                   segments.size(), layer, segments.size() - requested);
+      return;
+    }
+    // the cached segments are submitted before the others are requested, so
+    // the decompress client still gets the segments of the layer in order
+    auto [cached, total_segments] =
+        submitCachedSegments(layer, image_name_tag, priority);
+    if (cached != 0) {
+      SPDLOG_DEBUG("Segment cache hit: image {}, layer {}, {} of {} segments",
+                   image_name_tag, layer, cached, total_segments);
+    }
+    if (cached != 0 && cached == total_segments) {
+      if (layer_fetched_cb_) {
+        layer_fetched_cb_(layer, image_name_tag, total_segments, cached);
+      }
+      return;
+    }
+    // the segments of the layer come from one registry, in order
+    auto registry = pickRegistry(layer, registries);
+    layers_.insert_or_assign(layer,
+                             LayerFetch{registries, transport_config, registry,
+                                        priority, cached, cached});
+    // without segment 0, the total is unknown: request segment 0 and the
+    // others once it has the response
+    std::vector<ContentClient::LayerRequest> requests;
+    for (int i = cached; i == cached || i < total_segments; ++i) {
+      content::GetLayerRequest req{};
+      req.set_layer(layer);
+      req.set_image_name_tag(image_name_tag);
+      req.set_index(i);
+      req.set_total_segments(total_segments);
+      requests.push_back(
+          ContentClient::LayerRequest{std::move(req), priority, false, ""});
     }
+    enqueueRequests(registry, transport_config, std::move(requests));
   });
 }
 void ContentFetcher::loop() { loop_->loop(); }
@@ -1,78 +1,229 @@
 #pragma once
 #include "content.pb.h"
 #include "dpu/decompress_client_epoll.h"
+#include "dpu/fetch_budget.h"
+#include "dpu/segment_cache.h"
 #include "network/EventLoop.h"
 #include "network/InetAddress.h"
-#include "network/rdma/Callbacks.h"
-#include "network/rdma/RdmaClient.h"
-#include "network/rdma/RdmaConfig.h"
+#include "network/transport/Callbacks.h"
+#include "network/transport/Transport.h"
+#include "network/transport/TransportConfig.h"
 #include "utils/blob_pool.h"
+#include "utils/sched_queue.h"
 #include <chrono>
 #include <deque>
 #include <folly/concurrency/UnboundedQueue.h>
+#include <functional>
 #include <future>
 #include <map>
 #include <memory>
 #include <optional>
+#include <utility>
+#include <vector>
 
 namespace hdc {
 namespace dpu {
 using hdc::network::EventLoop;
 using hdc::network::InetAddress;
-using hdc::network::rdma::RdmaClient;
-using hdc::network::rdma::RdmaConfig;
-using hdc::network::rdma::RdmaConnectionPtr;
+using hdc::network::transport::createMsgClient;
+using hdc::network::transport::MsgClient;
+using hdc::network::transport::TransportConfig;
+using hdc::network::transport::Completion;
+using hdc::network::transport::MsgConnectionPtr;
+using hdc::utils::SchedPolicy;
+using hdc::utils::SchedQueue;
 
 using ContentTaskQueue = folly::USPSCQueue<ContentElement, false>;
 using ContentTaskQueuePtr = std::shared_ptr<ContentTaskQueue>;
 
+/// @brief: Called with a segment fetched or found in the segment cache,
+/// whether its request is partial, and the chunks of the segments of its
+/// layer if the registry sent them with segment 0.
+using SegmentFetchedCallback =
+    std::function<void(ContentElement, bool, std::vector<std::string>)>;
+
+/// @brief: Called with (layer, image_name_tag, total_segments,
+/// cached_segments) once all segments of a layer are fetched or found in the
+/// segment cache.
+using LayerProgressCallback =
+    std::function<void(const std::string &, const std::string &, int, int)>;
+
+/// @brief: How the segments of a fetch are spread over its registries.
+struct RegistryPolicy {
+  // the registries hold disjoint shards of the layers, each layer is fetched
+  // from the registry its digest hashes to, rather than replicas of all the
+  // layers, each layer fetched from the one expected to answer first
+  bool sharded{false};
+  // a registry is passed over for this long once a request to it fails or
+  // gets no response in this time, its requests go to the next registry
+  double timeout_ms{5000};
+};
+
+/// @brief: The requests to one registry. The responses come in the order of
+/// the requests, and the client measures how long the registry takes.
 class ContentClient {
 public:
+  struct LayerRequest {
+    content::GetLayerRequest req;
+    int priority;
+    // the segment only, of a lazy pull, the host takes it in any order
+    bool partial;
+    // the content address of the segment, empty if unknown
+    std::string chunk;
+  };
+
+  /// @brief: The requests accept `codecs`, the preferred first.
   ContentClient(EventLoop *loop, const InetAddress &listenAddr,
-                const std::string &name, RdmaConfig rdmaConfig,
-                DecompressClientEpoll *decompress_client,
-                std::shared_ptr<BlobPool> blob_pool);
+                const std::string &name,
+                TransportConfig transportConfig,
+                std::vector<content::Codec> codecs,
+                std::shared_ptr<BlobPool> blob_pool,
+                std::shared_ptr<SegmentCache> segment_cache,
+                std::shared_ptr<FetchBudget> fetch_budget,
+                SchedPolicy sched_policy,
+                SegmentFetchedCallback segment_fetched_cb,
+                std::function<void()> failed_cb);
 
   void connect();
 
+  /// @brief: Connect again through a new transport client, once the
+  /// connection is lost. The old client and its connection are dropped.
+  void reconnect();
+
+  /// @brief: The connection is lost and not made again yet.
+  bool lost() const { return lost_; }
+
+  /// @brief: Send the queued requests while there are free send buffers and
+  /// the fetch budget is not exhausted.
   void trySendRequests();
 
-  void enqueueRequest(content::GetLayerRequest req);
+  /// @brief: Queue a request, before the others of its image with `front`.
+  /// A request of a chunk in the segment cache, cached for any layer, is
+  /// served from the cache in its turn.
+  void enqueueRequest(LayerRequest request, bool front = false);
+
+  /// @brief: Take the queued requests and those waiting for a response, to
+  /// send them to another registry. A response that comes later is still
+  /// delivered, the fetcher drops it if it is a duplicate. The segments
+  /// served from the segment cache behind a request waiting for a response
+  /// are dropped and taken as requests too, since that response may never
+  /// come.
+  std::vector<LayerRequest> takeRequests();
+
+  /// @brief: The time in ms the registry is expected to take to answer one
+  /// more request: its latency plus the bytes of the requests before it at
+  /// its measured throughput.
+  double expectedWaitMs() const;
+
+  /// @brief: Whether the oldest request not taken has had no response for
+  /// `timeout_ms`, or, when requests are queued and all send bufs are in
+  /// flight or a cached segment waits, the oldest request in flight.
+  bool stalled(std::chrono::steady_clock::time_point now,
+               double timeout_ms) const;
+
+  /// @brief: The requests queued or waiting for a response, not taken.
+  size_t outstanding() const;
 
 private:
-  RdmaClient client_;
+  std::unique_ptr<MsgClient> client_;
+  InetAddress listen_addr_;
+  std::string name_;
+  TransportConfig transport_config_;
   EventLoop *loop_;
-  DecompressClientEpoll *decompress_client_;
+  const std::vector<content::Codec> codecs_;
   std::shared_ptr<BlobPool> blob_pool_;
+  std::shared_ptr<SegmentCache> segment_cache_;
+  std::shared_ptr<FetchBudget> fetch_budget_;
+  SegmentFetchedCallback segment_fetched_cb_;
+  std::function<void()> failed_cb_;
+
+  struct InflightRequest {
+    size_t bufpair_id;
+    LayerRequest request;
+    std::chrono::steady_clock::time_point sent;
+    // sent to another registry by takeRequests()
+    bool taken{false};
+    // a segment served from the segment cache, it is delivered once the
+    // responses before it are
+    std::optional<ContentElement> cached;
+  };
+
+  // the measured latency in ms, throughput in bytes/ms and segment size, to
+  // estimate the bytes of the outstanding requests
+  double latency_ms_;
+  double throughput_;
+  double segment_bytes_;
+  // the time the registry finished the last response
+  std::chrono::steady_clock::time_point last_response_;
+  // the requests in inflight_sends_ not taken nor cached
+  size_t inflight_requests_{0};
+  // since the first request was queued before the connection
+  std::optional<std::chrono::steady_clock::time_point> connecting_since_;
+  // the connection is lost, until a new one is made
+  bool lost_{false};
 
   uint64_t wr_id_{0};
-  std::deque<content::GetLayerRequest> unsend_reqs_;
-  RdmaConnectionPtr conn_{nullptr};
-  // record the bufpair_id of inflight_sends_;
-  std::deque<size_t> inflight_sends_;
+  // the requests of all images wait here, the sched policy picks the image
+  SchedQueue<LayerRequest> unsend_reqs_;
+  MsgConnectionPtr conn_{nullptr};
+  // the responses come in the order of the requests
+  std::deque<InflightRequest> inflight_sends_;
 
   // record the image translate time without pipeline.
   std::chrono::high_resolution_clock::time_point start_time_;
   double rdma_duration_{0};
   std::string curr_image_tag_{""};
 
-  void onConnected(const RdmaConnectionPtr &conn);
+  /// @brief: Create client_ and register the callbacks on it.
+  void createClient();
+
+  void onConnected(const MsgConnectionPtr &conn);
 
-  void onRecvSuccess(const RdmaConnectionPtr &conn, uint8_t *recv_buf,
-                     uint32_t recv_len, const ibv_wc &wc);
+  /// @brief: Drop the lost connection, queue the requests that wait for a
+  /// response on it again and hand them to the other registries.
+  void onDisconnected(const MsgConnectionPtr &conn);
 
-  void onRecvFail(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onRecvSuccess(const MsgConnectionPtr &conn, uint8_t *recv_buf,
+                     uint32_t recv_len, const Completion &wc);
 
-  void onSendCompleteSuccess(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onRecvFail(const MsgConnectionPtr &conn, const Completion &wc);
 
-  void onSendCompleteFail(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                             const Completion &wc);
+
+  void onSendCompleteFail(const MsgConnectionPtr &conn, const Completion &wc);
 
   void sendRequest();
+
+  /// @brief: Serve a request from the segment cache if it has its chunk.
+  bool serveFromCache(const LayerRequest &request);
+
+  /// @brief: Deliver the cached segments at the front of the inflight queue.
+  void deliverCached();
+
+  /// @brief: Give the blob and the fetch budget of a cached segment back.
+  void dropCached(ContentElement &cached);
+
+  /// @brief: The registry failed the request of `inflight`: queue it again,
+  /// unless it is taken, and fail the registry over, which moves it to the
+  /// next registry.
+  void failRequest(InflightRequest inflight);
 };
 
+/// @brief: Fetches the segments of the layers from a set of registries as
+/// `registry_policy` says, and submits them to the decompress client in the
+/// order of each layer. The segments of a layer are fetched from one
+/// registry, as its responses come in order, and from the next one from the
+/// first segment not submitted once it fails. The segments of a lazy pull
+/// are spread one by one.
 class ContentFetcher {
 public:
-  ContentFetcher(EventLoop *loop, DecompressClientEpoll *decompress_client);
+  /// @brief: `segment_cache` may be null, then every segment is fetched from
+  /// the registry.
+  ContentFetcher(EventLoop *loop, DecompressClientEpoll *decompress_client,
+                 std::shared_ptr<SegmentCache> segment_cache = nullptr,
+                 SchedPolicy sched_policy = SchedPolicy::kFifo,
+                 RegistryPolicy registry_policy = {});
 
   ContentFetcher(const ContentFetcher &) = delete;
 
@@ -82,18 +233,104 @@ public:
 
   ContentFetcher &operator=(ContentFetcher &&) = delete;
 
-  /// @brief: Fetch segments from remote. Thread Safe.
+  /// @brief: Fetch segments from `registries`. The cached prefix of the
+  /// layer is submitted to the decompress client without fetching it. With
+  /// `segments`, only those segments are fetched, for a lazy pull. Thread
+  /// Safe.
   void fetch(const std::string &layer, const std::string &image_name_tag,
-             const InetAddress &addr, const RdmaConfig &rdma_config);
+             const std::vector<InetAddress> &registries,
+             const TransportConfig &transport_config, int priority = 0,
+             std::vector<int> segments = {});
+
+  /// @brief: `cb` is called in the loop of the fetcher with the number of
+  /// segments served from the segment cache. Not thread safe, set it before
+  /// the first fetch.
+  void setLayerFetchedCallback(LayerProgressCallback cb) {
+    layer_fetched_cb_ = std::move(cb);
+  }
 
   void loop();
 
 private:
-  using ClientMap = std::map<InetAddress, std::unique_ptr<ContentClient>>;
+  struct Registry {
+    std::unique_ptr<ContentClient> client;
+    // passed over until then, after a failure
+    std::chrono::steady_clock::time_point down_until;
+  };
+  using RegistryMap = std::map<InetAddress, Registry>;
+  // a layer being fetched, but for a lazy pull
+  struct LayerFetch {
+    std::vector<InetAddress> registries;
+    TransportConfig transport_config;
+    // the registry its segments are requested from
+    InetAddress registry;
+    int priority;
+    // the next segment to submit, the earlier ones are duplicates
+    int next{0};
+    // the segments served from the segment cache
+    int cached{0};
+  };
+  // the segments of a lazy pull requested, (layer, index) -> requests
+  using PartialMap = std::map<std::pair<std::string, int>, int>;
   EventLoop *loop_;
-  ClientMap clients_;
+  RegistryMap clients_;
   DecompressClientEpoll *decompress_client_;
   std::shared_ptr<BlobPool> blob_pool_;
+  std::shared_ptr<SegmentCache> segment_cache_;
+  // shared with the decompress client, may be null
+  std::shared_ptr<FetchBudget> fetch_budget_;
+  SchedPolicy sched_policy_;
+  const RegistryPolicy registry_policy_;
+  LayerProgressCallback layer_fetched_cb_;
+  std::map<std::string, LayerFetch> layers_;
+  PartialMap partials_;
+  // the registries of the lazy pulls, which have no LayerFetch
+  std::map<std::string, std::pair<std::vector<InetAddress>, TransportConfig>>
+      partial_registries_;
+
+  /// @brief: Submit a segment of a layer in order, or of a lazy pull,
+  /// request the rest of the layer with segment 0 and report the layer once
+  /// its last segment is submitted. A duplicate of a segment requested again
+  /// from another registry is dropped.
+  void onSegmentFetched(ContentElement element, bool partial,
+                        std::vector<std::string> chunks);
+
+  /// @brief: Pass over the registry and send its requests to the others.
+  void failover(const InetAddress &addr);
+
+  /// @brief: Fail over the registries which have not answered in time, and
+  /// connect again to those whose connection is lost once they are no longer
+  /// passed over.
+  void checkStalled();
+
+  /// @brief: The registry to request a segment of `layer` from: the shard
+  /// of the layer, or the replica expected to answer first, of those neither
+  /// down nor disconnected, but for `exclude`.
+  InetAddress pickRegistry(const std::string &layer,
+                           const std::vector<InetAddress> &registries,
+                           const std::optional<InetAddress> &exclude = {});
+
+  void submitCachedSegment(const std::string &layer,
+                           const std::string &image_name_tag, int index,
+                           const SegmentCache::Segment &cached, int priority);
+
+  /// @brief: Submit the cached segments of the layer from index 0 on. Return
+  /// the number of segments submitted and the total number of segments, 0 if
+  /// unknown.
+  std::pair<int, int> submitCachedSegments(const std::string &layer,
+                                           const std::string &image_name_tag,
+                                           int priority);
+
+  /// @brief: The client of `addr`, which is created and connected with the
+  /// first request queued on it.
+  ContentClient &client(const InetAddress &addr,
+                        const TransportConfig &transport_config);
+
+  /// @brief: Queue the requests on the client of `addr`.
+  void enqueueRequests(const InetAddress &addr,
+                       const TransportConfig &transport_config,
+                       std::vector<ContentClient::LayerRequest> requests,
+                       bool front = false);
 };
 using ContentFetcherPtr = std::shared_ptr<ContentFetcher>;
 
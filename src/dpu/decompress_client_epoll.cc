@@ -1,87 +1,143 @@
 #include "dpu/decompress_client_epoll.h"
 #include "compress.pb.h"
-#include "doca/common.h"
-#include "doca/doca_buf.h"
-#include "doca_error.h"
+#include "doca/engine.h"
 #include "dpu/metadata.h"
+#include "utils/affinity.h"
 #include "utils/blob_pool.h"
+#include "utils/codec.h"
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cstring>
+#include <exception>
+#include <folly/executors/thread_factory/InitThreadFactory.h>
+#include <folly/executors/thread_factory/NamedThreadFactory.h>
+#include <iterator>
 #include <ratio>
 #include <spdlog/spdlog.h>
 #include <utils/MsgFrame.h>
 namespace hdc {
 namespace dpu {
+namespace {
+// the weight of a new sample in the measured throughput
+constexpr double kRateWeight = 0.2;
+// the room for the DecompressFinishRequest before an inline segment
+constexpr size_t kInlineFrameReserve = 256;
+
+void updateRate(double &rate, size_t bytes, double ms) {
+  if (ms > 0) {
+    rate = (1 - kRateWeight) * rate + kRateWeight * (bytes / ms);
+  }
+}
+} // namespace
+
 DecompressClientEpoll::DecompressClientEpoll(
-    CompressEngine compress_engine,
+    std::vector<CompressEngine> compress_engines,
     // DmaEngine dma_engine,
-    EventLoop *loop, const InetAddress &listen_addr, RdmaConfig rdma_config,
-    std::shared_ptr<BlobPool> blob_pool)
-    : compress_engine_(std::move(compress_engine)),
-      // dma_engine_(std::move(dma_engine)),
-      client_(loop, listen_addr, "DecompressClientEpoll",
-              std::move(rdma_config)),
-      loop_(loop), blob_pool_(std::move(blob_pool)) {
-  client_.setConnectedCallback(
-      [this](const RdmaConnectionPtr &conn) { this->onConnected(conn); });
-  client_.setRecvSuccessCallback([this](const RdmaConnectionPtr &conn,
-                                        uint8_t *recv_buf, uint32_t recv_len,
-                                        const ibv_wc &wc) {
+    EventLoop *loop, const InetAddress &listen_addr,
+    TransportConfig transport_config, std::shared_ptr<BlobPool> blob_pool,
+    SchedPolicy sched_policy, std::shared_ptr<FetchBudget> fetch_budget,
+    std::vector<content::Codec> codecs, SoftDecompressSite soft_site,
+    size_t soft_threads, AdaptiveSplit adaptive_split,
+    std::vector<int> soft_cpus)
+    : // dma_engine_(std::move(dma_engine)),
+      client_(createMsgClient(loop, listen_addr, "DecompressClientEpoll",
+                              transport_config)),
+      loop_(loop), blob_pool_(std::move(blob_pool)),
+      fetch_budget_(std::move(fetch_budget)), codecs_(std::move(codecs)),
+      soft_site_(soft_site), adaptive_split_(adaptive_split),
+      inline_cap_(transport_config.memSize_ > kInlineFrameReserve
+                      ? transport_config.memSize_ - kInlineFrameReserve
+                      : 0),
+      pending_compress_jobs_(sched_policy), pending_rdma_jobs_(sched_policy),
+      hw_rate_(adaptive_split.engine_mbps * 1000),
+      soft_rate_(adaptive_split.soft_mbps * 1000),
+      soft_workers_(soft_site == SoftDecompressSite::kDpu ? soft_threads : 1) {
+  if (soft_site_ == SoftDecompressSite::kDpu) {
+    soft_executor_ = std::make_unique<folly::CPUThreadPoolExecutor>(
+        soft_threads,
+        std::make_shared<folly::InitThreadFactory>(
+            std::make_shared<folly::NamedThreadFactory>("SoftDecompress"),
+            [cpus = soft_cpus.empty() ? utils::threadCpus()
+                                      : std::move(soft_cpus)] {
+              utils::pinThread(cpus);
+            }));
+  }
+  client_->setConnectedCallback(
+      [this](const MsgConnectionPtr &conn) { this->onConnected(conn); });
+  client_->setRecvSuccessCallback([this](const MsgConnectionPtr &conn,
+                                         uint8_t *recv_buf, uint32_t recv_len,
+                                         const Completion &wc) {
     this->onRecvSuccess(conn, recv_buf, recv_len, wc);
   });
-  client_.setRecvFailCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  client_->setRecvFailCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onRecvFail(conn, wc);
       });
-  client_.setSendCompleteSuccessCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  client_->setSendCompleteSuccessCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onSendCompleteSuccess(conn, wc);
       });
-  client_.setSendCompleteFailCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  client_->setSendCompleteFailCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onSendCompleteFail(conn, wc);
       });
 
-  compress_engine_.setCompressSuccessCallback(
-      [this](CompressEngine &engine, uint64_t job_id, uint8_t *src_addr,
-             size_t src_len, uint8_t *dst_addr, size_t dst_len) {
-        this->onDecompressTaskSuccess(engine, job_id, src_addr, src_len,
-                                      dst_addr, dst_len);
-      });
-  compress_engine_.setCompressErrorCallback(
-      [this](CompressEngine &engine, doca_error_t err) {
-        this->onDecompressTaskError(engine, err);
-      });
+  int bufpair_base = 0;
+  engines_.reserve(compress_engines.size());
+  for (auto &engine : compress_engines) {
+    auto bufpair_num = engine.bufpair_num();
+    engines_.push_back(EngineSlot{std::move(engine), bufpair_base});
+    bufpair_base += bufpair_num;
+  }
+  for (size_t i = 0; i < engines_.size(); ++i) {
+    // called in the EventLoop of the engine
+    engines_[i].engine.setCompressSuccessCallback(
+        [this, i](CompressEngine &engine, uint64_t job_id, uint8_t *src_addr,
+                  size_t src_len, uint8_t *dst_addr, size_t dst_len) {
+          loop_->runInLoop([this, i, job_id, dst_len]() {
+            this->onDecompressTaskSuccess(i, job_id, dst_len);
+          });
+        });
+    engines_[i].engine.setCompressErrorCallback(
+        [this, i](CompressEngine &engine, doca_error_t err) {
+          loop_->runInLoop(
+              [this, i, err]() { this->onDecompressTaskError(i, err); });
+        });
+  }
 }
 
 void DecompressClientEpoll::connect() {
-  loop_->runInLoop([this]() { client_.connect(); });
+  loop_->runInLoop([this]() { client_->connect(); });
 }
 
 void DecompressClientEpoll::decompressStart() {
-  compress_engine_.start();
+  for (auto &slot : engines_) {
+    auto &engine = slot.engine;
+    engine.get_loop()->runInLoop([&engine]() { engine.start(); });
+  }
 }
 
 bool DecompressClientEpoll::handleDecompressFinishResponse(
     const compress::DecompressFinishResponse &resp) {
-  SPDLOG_INFO("Recv DecompressFinishResponse: layer {}, idx {}, success {}, "
-              "data_inline {}, bufpair_id {}",
-              resp.layer_name(), resp.segment_idx(), resp.success(),
-              resp.data_inline(), resp.bufpair_id());
+  SPDLOG_DEBUG("Recv DecompressFinishResponse: layer {}, idx {}, success {}, "
+               "data_inline {}, bufpair_id {}",
+               resp.layer_name(), resp.segment_idx(), resp.success(),
+               resp.data_inline(), resp.bufpair_id());
   if (!pending_rdma_jobs_.empty()) {
+    // the job stays queued for the next response if no buffer is free
     auto free_buf = conn_->acquireFreeSendBuf();
-    auto info = std::move(pending_rdma_jobs_.front());
-    pending_rdma_jobs_.pop_front();
-    sendDecompressFinishRequest(std::move(info), *free_buf);
+    if (free_buf.has_value()) {
+      auto info = std::move(pending_rdma_jobs_.front());
+      pending_rdma_jobs_.pop();
+      sendDecompressFinishRequest(std::move(info), *free_buf);
+    }
   }
   if (!resp.data_inline()) {
-    compress_engine_.releaseFreeBufpair(resp.bufpair_id());
-    if (!decompress_busy_) {
-      if (!tryStartDecompressJob()) {
-        SPDLOG_ERROR("tryStartDecompressJob error");
-        return false;
-      }
+    releaseBufpair(resp.bufpair_id());
+    if (!tryStartDecompressJob()) {
+      SPDLOG_ERROR("tryStartDecompressJob error");
+      return false;
     }
   } else {
     dma_busy_ = false;
@@ -90,58 +146,74 @@ bool DecompressClientEpoll::handleDecompressFinishResponse(
 }
 
 bool DecompressClientEpoll::startDecompressJob(ContentElement &task,
+                                               size_t engine_idx,
                                                size_t bufpair_id) {
+  auto &slot = engines_[engine_idx];
   // record decompress time
-  start_time_ = std::chrono::high_resolution_clock::now();
-
-  compress_job_.image_name_tag = std::move(task.image_name_tag);
-  compress_job_.layer = std::move(task.layer);
-  compress_job_.segment_idx = task.segment_idx;
-  compress_job_.total_segments = task.total_segments;
-  compress_job_.bufpair_id = bufpair_id;
-
-  auto &segment = task.segment;
-  auto &bufpair = compress_engine_.get_bufpair(bufpair_id);
-  assert(bufpair.src_mem.size() >= segment.get_size());
-  memcpy(bufpair.src_mem.data(), segment.get_addr(), segment.get_size());
-  if (bufpair.src_doca_buf.set_data_by_offset(0, segment.get_size()) !=
-      DOCA_SUCCESS) {
-    SPDLOG_ERROR("set doca buf error");
-    return false;
-  }
-  blob_pool_->releaseBlob(std::move(segment));
-
-  compress_engine_.start_job(job_id_++, DOCA_DECOMPRESS_DEFLATE_JOB,
-                             bufpair_id);
-  decompress_busy_ = true;
-  SPDLOG_INFO("enqueue DOCA Decompress job {}. image {}, layer {}, idx {}-{}, "
-              "bufpair_id {}",
-              job_id_ - 1, compress_job_.image_name_tag, compress_job_.layer,
-              compress_job_.segment_idx, compress_job_.total_segments,
-              bufpair_id);
+  slot.start_time = std::chrono::high_resolution_clock::now();
+
+  auto &job = slot.job;
+  job.image_name_tag = std::move(task.image_name_tag);
+  job.layer = std::move(task.layer);
+  job.segment_idx = task.segment_idx;
+  job.total_segments = task.total_segments;
+  job.bufpair_id = bufpair_id;
+  job.priority = task.priority;
+  job.ticket = task.ticket;
+  job.src_len = task.segment.get_size();
+  slot.busy = true;
+
+  // the copy to the bufpair runs in the thread of the engine too
+  auto job_id = job_id_++;
+  auto &engine = slot.engine;
+  engine.get_loop()->runInLoop([this, &engine, engine_idx, job_id, bufpair_id,
+                                segment = std::move(task.segment)]() mutable {
+    auto &bufpair = engine.get_bufpair(bufpair_id);
+    assert(bufpair.src_mem.size() >= segment.get_size());
+    memcpy(bufpair.src_mem.data(), segment.get_addr(), segment.get_size());
+    auto res = bufpair.src_doca_buf.set_data_by_offset(0, segment.get_size());
+    releaseSegment(std::move(segment));
+    if (res != DOCA_SUCCESS) {
+      SPDLOG_ERROR("set doca buf error");
+      loop_->runInLoop([this, engine_idx, res]() {
+        onDecompressTaskError(engine_idx, res);
+      });
+      return;
+    }
+    engine.start_job(job_id, DOCA_DECOMPRESS_DEFLATE_JOB, bufpair_id);
+  });
+  SPDLOG_DEBUG("enqueue DOCA Decompress job {} on engine {}. image {}, layer "
+               "{}, idx {}-{}, bufpair_id {}",
+               job_id, engine_idx, job.image_name_tag, job.layer,
+               job.segment_idx, job.total_segments, bufpair_id);
   return true;
 }
 
 bool DecompressClientEpoll::tryStartDecompressJob() {
-  assert(connected_ && !decompress_busy_);
-  if (pending_compress_jobs_.empty()) {
-    return true;
-  }
-  auto bufpair_id = compress_engine_.acquireFreeBufpair();
-  if (!bufpair_id.has_value()) {
-    return true;
-  }
-  auto &task = pending_compress_jobs_.front();
-  if (!startDecompressJob(task, *bufpair_id)) {
-    SPDLOG_ERROR("startDecompressJob error");
-    return false;
+  assert(connected_);
+  for (size_t i = 0; i < engines_.size(); ++i) {
+    if (pending_compress_jobs_.empty()) {
+      return true;
+    }
+    if (engines_[i].busy) {
+      continue;
+    }
+    auto bufpair_id = engines_[i].engine.acquireFreeBufpair();
+    if (!bufpair_id.has_value()) {
+      continue;
+    }
+    // popped first, a job that fails to start is handled right away
+    auto task = std::move(pending_compress_jobs_.front());
+    pending_compress_jobs_.pop();
+    if (!startDecompressJob(task, i, *bufpair_id)) {
+      SPDLOG_ERROR("startDecompressJob error");
+      return false;
+    }
   }
-  pending_compress_jobs_.pop_front();
   return true;
 }
 
-
-void DecompressClientEpoll::onConnected(const RdmaConnectionPtr &conn) {
+void DecompressClientEpoll::onConnected(const MsgConnectionPtr &conn) {
 
   conn_ = conn;
   SPDLOG_INFO("DecompressClientEpoll connected");
@@ -151,7 +223,8 @@ void DecompressClientEpoll::onConnected(const RdmaConnectionPtr &conn) {
   auto send_buf = free_buf->addr;
   auto send_cap = free_buf->cap;
   auto mmap_info_req = compress::MmapInfoRequest{};
-  mmap_info_req.set_mmap_num(compress_engine_.bufpair_num());
+  auto &last = engines_.back();
+  mmap_info_req.set_mmap_num(last.bufpair_base + last.engine.bufpair_num());
   *reinterpret_cast<int *>(send_buf) = static_cast<int>(MsgType::kMmapInfo);
   auto frame_len = serializeRdmaPbMsg(
       send_buf + sizeof(MsgType), send_cap - sizeof(MsgType), mmap_info_req);
@@ -164,9 +237,9 @@ void DecompressClientEpoll::onConnected(const RdmaConnectionPtr &conn) {
   return;
 }
 
-void DecompressClientEpoll::onRecvSuccess(const RdmaConnectionPtr &conn,
+void DecompressClientEpoll::onRecvSuccess(const MsgConnectionPtr &conn,
                                           uint8_t *recv_buf, uint32_t recv_len,
-                                          const ibv_wc &wc) {
+                                          const Completion &wc) {
   if (recv_len < sizeof(int)) {
     SPDLOG_ERROR("recv_len < 4");
     return;
@@ -202,69 +275,88 @@ void DecompressClientEpoll::onRecvSuccess(const RdmaConnectionPtr &conn,
   }
 }
 
-void DecompressClientEpoll::onRecvFail(const RdmaConnectionPtr &conn,
-                                       const ibv_wc &wc) {
+void DecompressClientEpoll::onRecvFail(const MsgConnectionPtr &conn,
+                                       const Completion &wc) {
   SPDLOG_ERROR("RDMA recv complete fail. wr_id: {}", wc.wr_id);
 }
 
-void DecompressClientEpoll::onSendCompleteSuccess(const RdmaConnectionPtr &conn,
-                                                  const ibv_wc &wc) {}
+void DecompressClientEpoll::onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                                                  const Completion &wc) {}
 
-void DecompressClientEpoll::onSendCompleteFail(const RdmaConnectionPtr &conn,
-                                               const ibv_wc &wc) {
+void DecompressClientEpoll::onSendCompleteFail(const MsgConnectionPtr &conn,
+                                               const Completion &wc) {
   SPDLOG_ERROR("RDMA send complete fail. wr_id: {}", wc.wr_id);
 }
 
-void DecompressClientEpoll::onDecompressTaskSuccess(
-    CompressEngine &engine, uint64_t job_id, uint8_t *src_addr, size_t src_len,
-    uint8_t *dst_addr, size_t dst_len) {
-
-  RdmaInfo info{compress_job_.image_name_tag,
-                compress_job_.layer,
-                compress_job_.total_segments,
-                compress_job_.segment_idx,
+void DecompressClientEpoll::onDecompressTaskSuccess(size_t engine_idx,
+                                                    uint64_t job_id,
+                                                    size_t dst_len) {
+  auto &slot = engines_[engine_idx];
+  auto &job = slot.job;
+  RdmaInfo info{job.image_name_tag,
+                job.layer,
+                job.total_segments,
+                job.segment_idx,
                 dst_len,
-                compress_job_.bufpair_id,
-                false};
-
-  auto free_buf = conn_->acquireFreeSendBuf();
-
-  if (free_buf.has_value()) {
-    sendDecompressFinishRequest(std::move(info), *free_buf);
-  } else {
-    pending_rdma_jobs_.push_back(std::move(info));
-  }
-  decompress_busy_ = false;
+                slot.bufpair_base + job.bufpair_id,
+                false,
+                Blob{},
+                job.priority};
+  finishSegment(job.layer, job.ticket, std::move(info));
+  slot.busy = false;
 
   // decompress time
   auto now = std::chrono::high_resolution_clock::now();
   auto duration =
-      std::chrono::duration<double, std::milli>(now - start_time_).count();
-  if (compress_job_.image_name_tag != curr_image_tag_) {
+      std::chrono::duration<double, std::milli>(now - slot.start_time).count();
+  hw_backlog_ -= job.src_len;
+  updateRate(hw_rate_, job.src_len, duration);
+  if (job.image_name_tag != curr_image_tag_) {
     decompress_duration_ = 0;
-    curr_image_tag_ = compress_job_.image_name_tag;
+    curr_image_tag_ = job.image_name_tag;
   }
   decompress_duration_ += duration;
 
-  SPDLOG_INFO("Decompress job {} success, image {}, decompress_rtt {}ms, "
-              "decompress_duration {}ms",
-              job_id, compress_job_.image_name_tag, duration,
-              decompress_duration_);
+  SPDLOG_DEBUG("Decompress job {} success on engine {}, image {}, "
+               "decompress_rtt {}ms, decompress_duration {}ms",
+               job_id, engine_idx, job.image_name_tag, duration,
+               decompress_duration_);
 
   if (!tryStartDecompressJob()) {
     SPDLOG_ERROR("tryStartDecompressJob error");
   }
 }
 
-void DecompressClientEpoll::onDecompressTaskError(CompressEngine &engine,
+void DecompressClientEpoll::onDecompressTaskError(size_t engine_idx,
                                                   doca_error_t err) {
-  SPDLOG_ERROR("Decompress Task error: {}", doca_get_error_string(err));
+  auto &slot = engines_[engine_idx];
+  auto &job = slot.job;
+  SPDLOG_ERROR("Decompress Task error on engine {}: {}. layer {}, idx {}",
+               engine_idx, doca_get_error_string(err), job.layer,
+               job.segment_idx);
+  // the host fails the layer, the segments after it are still sent and
+  // dropped there
+  slot.engine.releaseFreeBufpair(job.bufpair_id);
+  hw_backlog_ -= job.src_len;
+  finishSegment(job.layer, job.ticket,
+                failedInfo(job.image_name_tag, job.layer, job.total_segments,
+                           job.segment_idx, job.priority));
+  slot.busy = false;
+  if (!tryStartDecompressJob()) {
+    SPDLOG_ERROR("tryStartDecompressJob error");
+  }
 }
 
-
 bool DecompressClientEpoll::handleMmapInfoResponse(
     const compress::MmapInfoResponse &resp) {
   SPDLOG_INFO("recv MmapInfoResponse");
+  auto &last = engines_.back();
+  auto mmap_num = last.bufpair_base + last.engine.bufpair_num();
+  if (resp.has_error() || resp.mmaps_size() != mmap_num) {
+    SPDLOG_ERROR("The host exports {} of {} mmaps: {}", resp.mmaps_size(),
+                 mmap_num, resp.error());
+    return false;
+  }
   std::vector<ExportDescRemote> export_descs;
   export_descs.reserve(resp.mmaps_size());
   for (int i = 0, n = resp.mmaps_size(); i < n; ++i) {
@@ -274,96 +366,332 @@ bool DecompressClientEpoll::handleMmapInfoResponse(
         reinterpret_cast<uint8_t *>(export_mmap.addr()), export_mmap.len());
   }
 
-  auto res = compress_engine_.src_mmaps_start(std::nullopt);
-  if (res != DOCA_SUCCESS) {
-    SPDLOG_ERROR("src buf mmap error: {}", doca_get_error_string(res));
-    return false;
+  // the mmaps of an engine are created in its EventLoop, which runs its jobs
+  mmaps_pending_ = engines_.size();
+  mmaps_failed_ = false;
+  for (size_t i = 0; i < engines_.size(); ++i) {
+    auto &slot = engines_[i];
+    auto begin = export_descs.begin() + slot.bufpair_base;
+    std::vector<ExportDescRemote> descs(begin,
+                                        begin + slot.engine.bufpair_num());
+    auto &engine = slot.engine;
+    engine.get_loop()->runInLoop(
+        [this, &engine, i, descs = std::move(descs)]() {
+          auto res = engine.src_mmaps_start(std::nullopt);
+          if (res != DOCA_SUCCESS) {
+            SPDLOG_ERROR("src buf mmap of engine {} error: {}", i,
+                         doca_get_error_string(res));
+          } else if (res = engine.dst_mmaps_create_from_export(descs);
+                     res != DOCA_SUCCESS) {
+            SPDLOG_ERROR("dst buf mmap of engine {} error: {}", i,
+                         doca_get_error_string(res));
+          }
+          loop_->runInLoop([this, ok = res == DOCA_SUCCESS]() {
+            onEngineMmapsCreated(ok);
+          });
+        });
   }
+  return true;
+}
 
-  res = compress_engine_.dst_mmaps_create_from_export(export_descs);
-
-  if (res != DOCA_SUCCESS) {
-    SPDLOG_ERROR("dst buf mmap error: {}", doca_get_error_string(res));
-    return false;
+void DecompressClientEpoll::onEngineMmapsCreated(bool ok) {
+  mmaps_failed_ = mmaps_failed_ || !ok;
+  if (--mmaps_pending_ > 0) {
+    return;
+  }
+  if (mmaps_failed_) {
+    SPDLOG_ERROR("Create the mmaps of the engines error");
+    return;
   }
-
   connected_ = true;
   if (!tryStartDecompressJob()) {
     SPDLOG_ERROR("tryStartDecompressJob error");
+  }
+}
+
+void DecompressClientEpoll::submitDecompressTask(ContentElement element) {
+  submitted_.enqueue(std::move(element));
+  // one wakeup of the loop for the segments submitted until it drains
+  if (!drain_queued_.exchange(true)) {
+    loop_->queueInLoop([this]() { drainSubmitted(); });
+  }
+}
+
+void DecompressClientEpoll::drainSubmitted() {
+  // an exchange, so that the segments enqueued before the flag was set are
+  // seen below
+  drain_queued_.exchange(false);
+  ContentElement cont;
+  while (submitted_.try_dequeue(cont)) {
+    dispatchSegment(std::move(cont));
+  }
+}
+
+void DecompressClientEpoll::dispatchSegment(ContentElement cont) {
+  if (cont.codec == content::DEFLATE) {
+    admitSegment(cont);
+    if (!preferSoft(cont.segment.get_size())) {
+      pushDecompressJob(std::move(cont));
+    } else if (soft_site_ == SoftDecompressSite::kDpu) {
+      soft_backlog_ += cont.segment.get_size();
+      startSoftJob(std::move(cont));
+    } else {
+      // the host inflates it, counted until it is sent
+      soft_backlog_ += cont.segment.get_size();
+      auto layer = cont.layer;
+      auto ticket = cont.ticket;
+      finishSegment(layer, ticket,
+                    inlineInfo(std::move(cont), content::DEFLATE));
+    }
+  } else if (cont.codec == content::UNCOMPRESSED ||
+             soft_site_ == SoftDecompressSite::kHost) {
+    // pending_dma_jobs_.emplace_back(std::move(cont));
+    // if (connected_ && !dma_busy_) {
+    //   tryStartDmaJob();
+    // }
+    // after the segments of its layer still on the engines
+    admitSegment(cont);
+    auto codec = cont.codec;
+    auto layer = cont.layer;
+    auto ticket = cont.ticket;
+    finishSegment(layer, ticket, inlineInfo(std::move(cont), codec));
+  } else {
+    admitSegment(cont);
+    startSoftJob(std::move(cont));
+  }
+}
+
+void DecompressClientEpoll::pushDecompressJob(ContentElement cont) {
+  auto image_name_tag = cont.image_name_tag;
+  auto cost = cont.segment.get_size();
+  auto priority = cont.priority;
+  hw_backlog_ += cost;
+  pending_compress_jobs_.push(image_name_tag, std::move(cont), cost, priority);
+  if (connected_) {
+    tryStartDecompressJob();
+  }
+}
+
+bool DecompressClientEpoll::preferSoft(size_t size) const {
+  if (!adaptive_split_.enabled || size > inline_cap_) {
     return false;
   }
+  double hw_eta = (hw_backlog_ + size) / (hw_rate_ * engines_.size());
+  double soft_eta = (soft_backlog_ + size) / (soft_rate_ * soft_workers_);
+  return soft_eta < hw_eta;
+}
 
-  return true;
+DecompressClientEpoll::RdmaInfo
+DecompressClientEpoll::inlineInfo(ContentElement cont, content::Codec codec) {
+  size_t segment_size = cont.segment.get_size();
+  return RdmaInfo{std::move(cont.image_name_tag),
+                  std::move(cont.layer),
+                  cont.total_segments,
+                  cont.segment_idx,
+                  segment_size,
+                  0,
+                  true,
+                  std::move(cont.segment),
+                  cont.priority,
+                  codec};
+}
+
+DecompressClientEpoll::RdmaInfo DecompressClientEpoll::failedInfo(
+    std::string image_name_tag, std::string layer, int total_segments,
+    int segment_idx, int priority) {
+  RdmaInfo info{std::move(image_name_tag),
+                std::move(layer),
+                total_segments,
+                segment_idx,
+                0,
+                0,
+                true,
+                Blob{},
+                priority};
+  info.failed = true;
+  return info;
+}
+
+void DecompressClientEpoll::releaseBufpair(int bufpair_id) {
+  // the engine of the bufpair, the last one whose first bufpair is not after
+  auto slot = std::prev(std::upper_bound(
+      engines_.begin(), engines_.end(), bufpair_id,
+      [](int id, const EngineSlot &slot) { return id < slot.bufpair_base; }));
+  slot->engine.releaseFreeBufpair(bufpair_id - slot->bufpair_base);
+}
+
+void DecompressClientEpoll::sendRdmaInfo(RdmaInfo info) {
+  auto free_buf = conn_->acquireFreeSendBuf();
+  if (!free_buf.has_value()) {
+    enqueueRdmaJob(std::move(info));
+  } else {
+    sendDecompressFinishRequest(std::move(info), *free_buf);
+  }
 }
 
-void DecompressClientEpoll::submitDecompressTask(ContentElement content) {
-  loop_->runInLoop([this, cont = std::move(content)]() {
-    if (cont.is_compressed) {
-      pending_compress_jobs_.emplace_back(std::move(cont));
-      if (connected_ && !decompress_busy_) {
-        tryStartDecompressJob();
+void DecompressClientEpoll::admitSegment(ContentElement &cont) {
+  cont.ticket = segment_order_.admit(cont.layer);
+}
+
+void DecompressClientEpoll::finishSegment(const std::string &layer,
+                                          uint64_t ticket, RdmaInfo info) {
+  segment_order_.finish(layer, ticket, std::move(info),
+                        [this](RdmaInfo ready) {
+                          sendRdmaInfo(std::move(ready));
+                        });
+}
+
+void DecompressClientEpoll::startSoftJob(ContentElement cont) {
+  // the blobs share their memory with the ones in the job
+  Blob src = cont.segment;
+  auto codec = cont.codec;
+  auto size =
+      utils::softDecompressedSize(codec, src.get_addr(), src.get_size());
+  // a DEFLATE segment is at most what the engine decompresses it into
+  Blob dst = blob_pool_->acquireBlob(
+      size.value_or(engines_[0].engine.get_bufpair(0).dst_mem.size()));
+  soft_executor_->add([this, cont = std::move(cont), src, dst]() mutable {
+    auto start = std::chrono::high_resolution_clock::now();
+    auto size = utils::softDecompress(cont.codec, src.get_addr(),
+                                      src.get_size(), dst.get_addr(),
+                                      dst.get_cap());
+    auto duration = std::chrono::duration<double, std::milli>(
+                        std::chrono::high_resolution_clock::now() - start)
+                        .count();
+    loop_->runInLoop([this, cont = std::move(cont), dst, size,
+                      duration]() mutable {
+      auto layer = cont.layer;
+      auto ticket = cont.ticket;
+      if (cont.codec == content::DEFLATE) {
+        soft_backlog_ -= cont.segment.get_size();
+        updateRate(soft_rate_, cont.segment.get_size(), duration);
+        if (!size.has_value() || *size > inline_cap_) {
+          SPDLOG_WARN("Inflate segment {} of layer {} on the DPU error, "
+                      "decompress it on the engine",
+                      cont.segment_idx, layer);
+          blob_pool_->releaseBlob(std::move(dst));
+          pushDecompressJob(std::move(cont));
+          return;
+        }
       }
-    } else {
-      // pending_dma_jobs_.emplace_back(std::move(cont));
-      // if (connected_ && !dma_busy_) {
-      //   tryStartDmaJob();
-      // }
-
-      size_t segment_size = cont.segment.get_size();
-      RdmaInfo info{std::move(cont.image_name_tag),
-                    std::move(cont.layer),
-                    cont.total_segments,
-                    cont.segment_idx,
-                    segment_size,
-                    0,
-                    true,
-                    std::move(cont.segment)};
-      auto free_buf = conn_->acquireFreeSendBuf();
-      if (!free_buf.has_value()) {
-        pending_rdma_jobs_.push_back(std::move(info));
-      } else {
-        sendDecompressFinishRequest(std::move(info), *free_buf);
+      releaseSegment(std::move(cont.segment));
+      if (!size.has_value()) {
+        SPDLOG_ERROR("Decompress {} segment {} of layer {} error",
+                     utils::codecName(cont.codec), cont.segment_idx, layer);
+        blob_pool_->releaseBlob(std::move(dst));
+        finishSegment(layer, ticket,
+                      failedInfo(std::move(cont.image_name_tag), layer,
+                                 cont.total_segments, cont.segment_idx,
+                                 cont.priority));
+        return;
       }
-    }
+      dst.set_size(*size);
+      if (fetch_budget_) {
+        // released once it is sent
+        fetch_budget_->acquire(*size);
+      }
+      cont.segment = std::move(dst);
+      finishSegment(layer, ticket,
+                    inlineInfo(std::move(cont), content::UNCOMPRESSED));
+    });
   });
 }
 
+void DecompressClientEpoll::releaseSegment(Blob segment) {
+  if (fetch_budget_) {
+    fetch_budget_->release(segment.get_size());
+  }
+  blob_pool_->releaseBlob(std::move(segment));
+}
+
+void DecompressClientEpoll::enqueueRdmaJob(RdmaInfo info) {
+  auto image_name_tag = info.image_name_tag;
+  auto cost = info.dst_len;
+  auto priority = info.priority;
+  pending_rdma_jobs_.push(image_name_tag, std::move(info), cost, priority);
+}
+
 void DecompressClientEpoll::sendDecompressFinishRequest(
-    RdmaInfo info, const RdmaConnection::SendBuf &free_buf) {
+    RdmaInfo info, const MsgConnection::SendBuf &free_buf) {
   compress::DecompressFinishRequest req{};
-  req.set_image_name_tag(std::move(info.image_name_tag));
-  req.set_layer_name(std::move(info.layer));
+  req.set_image_name_tag(info.image_name_tag);
+  req.set_layer_name(info.layer);
   req.set_segment_idx(info.segment_idx);
   req.set_segment_size(info.dst_len);
   req.set_bufpair_id(info.mmap_id);
   req.set_total_segments(info.total_segments);
   req.set_data_inline(info.data_inline);
+  if (info.data_inline) {
+    req.set_codec(info.codec);
+  }
+  if (info.failed) {
+    req.set_failed(true);
+  }
+  if (info.data_inline && info.codec == content::DEFLATE) {
+    // inflated on the host
+    soft_backlog_ -= info.dst_len;
+  }
 
-  inflight_sends_.emplace_back(free_buf.id);
   auto send_buf = free_buf.addr;
   auto send_cap = free_buf.cap;
   *reinterpret_cast<int *>(send_buf) =
       static_cast<int>(MsgType::kDecompressFinish);
   auto frame_len = serializeRdmaPbMsg(send_buf + sizeof(MsgType),
                                       send_cap - sizeof(MsgType), req);
-  if (frame_len == -1) {
-    SPDLOG_ERROR("serialize DecompressFinishRequest error");
+  bool fits = frame_len != -1 &&
+              (!req.data_inline() ||
+               frame_len + sizeof(MsgType) + req.segment_size() <= send_cap);
+  if (!fits) {
+    if (frame_len == -1) {
+      SPDLOG_ERROR("serialize DecompressFinishRequest of segment {} of layer "
+                   "{} error",
+                   req.segment_idx(), req.layer_name());
+    } else {
+      SPDLOG_ERROR("Inline segment {} of layer {} of {} bytes exceeds the "
+                   "send buffer",
+                   req.segment_idx(), req.layer_name(), req.segment_size());
+    }
+    if (info.failed && !info.image_name_tag.empty()) {
+      // the host fails the layer by its name alone
+      info.image_name_tag.clear();
+      sendDecompressFinishRequest(std::move(info), free_buf);
+      return;
+    }
+    if (info.failed) {
+      // the host would wait for the layer forever
+      SPDLOG_CRITICAL("The send buffer of {} bytes cannot hold the failure of "
+                      "layer {}",
+                      send_cap, req.layer_name());
+      std::terminate();
+    }
+    if (!info.data_inline) {
+      releaseBufpair(info.mmap_id);
+      tryStartDecompressJob();
+    } else {
+      releaseSegment(std::move(info.segment));
+    }
+    sendDecompressFinishRequest(
+        failedInfo(std::move(info.image_name_tag), std::move(info.layer),
+                   info.total_segments, info.segment_idx, info.priority),
+        free_buf);
     return;
   }
-  if (req.data_inline()) { 
+  inflight_sends_.emplace_back(free_buf.id);
+  if (req.data_inline() && !info.failed) {
     memcpy(send_buf + frame_len + sizeof(MsgType), info.segment.get_addr(),
            req.segment_size());
     conn_->send(send_buf, frame_len + sizeof(MsgType) + req.segment_size(),
                 wr_id_++);
-    blob_pool_->releaseBlob(std::move(info.segment));
+    releaseSegment(std::move(info.segment));
 
   } else {
     conn_->send(send_buf, frame_len + sizeof(MsgType), wr_id_++);
   }
-  SPDLOG_INFO("Send DecompressFinishRequest. image: {}, layer: {}, idx: {}, "
-              "total_segments: {}, size: {}, bufpair_id: {}",
-              req.image_name_tag(), req.layer_name(), req.segment_idx(),
-              req.total_segments(), req.segment_size(), req.bufpair_id());
+  SPDLOG_DEBUG("Send DecompressFinishRequest. image: {}, layer: {}, idx: {}, "
+               "total_segments: {}, size: {}, bufpair_id: {}, failed: {}",
+               req.image_name_tag(), req.layer_name(), req.segment_idx(),
+               req.total_segments(), req.segment_size(), req.bufpair_id(),
+               req.failed());
 }
 } // namespace dpu
 } // namespace hdc
\ No newline at end of file
@@ -1,35 +1,90 @@
 #pragma once
-#include "doca/compress.h"
-#include "doca_error.h"
+#include "content.pb.h"
+#include "doca/engine.h"
+#include "dpu/fetch_budget.h"
 #include "dpu/metadata.h"
-#include "network/rdma/RdmaClient.h"
-#include "network/rdma/RdmaConfig.h"
-#include "network/rdma/RdmaConnection.h"
+#include "dpu/segment_order.h"
+#include "network/transport/Transport.h"
+#include "network/transport/TransportConfig.h"
+#include "network/transport/MsgConnection.h"
 #include "utils/blob_pool.h"
+#include "utils/sched_queue.h"
+#include <atomic>
 #include <chrono>
 #include <compress.pb.h>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <folly/concurrency/UnboundedQueue.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace hdc {
 namespace dpu {
 using hdc::network::EventLoop;
 using hdc::network::InetAddress;
-using hdc::network::rdma::RdmaClient;
-using hdc::network::rdma::RdmaConfig;
-using hdc::network::rdma::RdmaConnection;
-using hdc::network::rdma::RdmaConnectionPtr;
+using hdc::network::transport::createMsgClient;
+using hdc::network::transport::MsgClient;
+using hdc::network::transport::TransportConfig;
+using hdc::network::transport::MsgConnection;
+using hdc::network::transport::Completion;
+using hdc::network::transport::MsgConnectionPtr;
+using hdc::utils::SchedPolicy;
+using hdc::utils::SchedQueue;
 
+/// @brief: Where the segments of a software codec, zstd or LZ4, and the
+/// DEFLATE segments split off the engine are decompressed. Either way they
+/// are sent to the host inline, so the RDMA buffers of both sides must hold
+/// a segment, a decompressed one for kDpu.
+enum class SoftDecompressSite {
+  // the host decompresses them before they are extracted
+  kHost,
+  // the ARM cores of the DPU
+  kDpu,
+};
+
+/// @brief: The split of the DEFLATE segments between the DOCA engine and
+/// software inflate where `soft_site` says. A segment goes to the side that
+/// is expected to finish it first, from the bytes queued on each side and
+/// their throughput, so the ARM cores or the host cores take the excess of
+/// a busy engine.
+struct AdaptiveSplit {
+  bool enabled{false};
+  // the throughput of an engine and of a software inflate thread to start
+  // with in MB/s of compressed bytes, then measured
+  double engine_mbps{4000};
+  double soft_mbps{200};
+};
+
+/// @brief: Sends the segments to the host. A DEFLATE segment is
+/// decompressed by the DOCA engine into the host memory, or in software as
+/// `adaptive_split` says, the others are sent inline and decompressed in
+/// software where `soft_site` says. The segments of a layer reach the host
+/// in the order they are submitted.
+///
+/// The DEFLATE segments are spread over `compress_engines`, on one device or
+/// several. Each one runs its jobs in the EventLoop it is created with, and
+/// owns the next bufpair_num() bufpairs of the host in turn, so the host
+/// exports as many bufpairs as all of them together. The `soft_threads` of
+/// the DPU run on `soft_cpus`, on those of the constructing thread if it is
+/// empty.
 class DecompressClientEpoll {
 
 public:
-  DecompressClientEpoll(CompressEngine compress_engine,
+  DecompressClientEpoll(std::vector<CompressEngine> compress_engines,
                         //  DmaEngine dma_engine,
                         EventLoop *loop, const InetAddress &listen_addr,
-                        RdmaConfig rdma_config,
-                        std::shared_ptr<BlobPool> blob_pool);
+                        TransportConfig transport_config,
+                        std::shared_ptr<BlobPool> blob_pool,
+                        SchedPolicy sched_policy = SchedPolicy::kFifo,
+                        std::shared_ptr<FetchBudget> fetch_budget = nullptr,
+                        std::vector<content::Codec> codecs = {content::DEFLATE},
+                        SoftDecompressSite soft_site = SoftDecompressSite::kHost,
+                        size_t soft_threads = 1,
+                        AdaptiveSplit adaptive_split = {},
+                        std::vector<int> soft_cpus = {});
 
   /// @brief: RDMA connect. Thread safe.
   void connect();
@@ -37,11 +92,19 @@ public:
   /// @brief: enable epoll for DOCA. Not thread safe.
   void decompressStart();
 
-  /// @brief: submit a decompress task to client. Thread safe.
+  /// @brief: submit a decompress task to client. Thread safe, the segments
+  /// of the fetchers are handed over without a lock and taken in batches.
   void submitDecompressTask(ContentElement content);
 
   std::shared_ptr<BlobPool> get_blob_pool() { return blob_pool_; }
 
+  /// @brief: The budget of the segments submitted but not yet decompressed or
+  /// sent, may be null.
+  std::shared_ptr<FetchBudget> get_fetch_budget() { return fetch_budget_; }
+
+  /// @brief: The codecs the segments are fetched in, the preferred first.
+  const std::vector<content::Codec> &codecs() const { return codecs_; }
+
 private:
   enum class MsgType : int {
     kMmapInfo,
@@ -50,9 +113,13 @@ private:
   struct JobInfo {
     std::string image_name_tag;
     std::string layer;
+    // the id in its engine
     int bufpair_id;
     int total_segments;
     int segment_idx;
+    int priority;
+    uint64_t ticket;
+    size_t src_len;
   };
 
   struct RdmaInfo {
@@ -65,64 +132,157 @@ private:
     bool data_inline;
     // std::vector<uint8_t> segment{vector<uint8_t>(0)};
     Blob segment;
+    int priority{0};
+    // the codec of the inline segment
+    content::Codec codec{content::UNCOMPRESSED};
+    // the segment failed, the host fails its layer
+    bool failed{false};
   };
 
-  CompressEngine compress_engine_;
+  struct EngineSlot {
+    CompressEngine engine;
+    // the id on the host of its first bufpair
+    int bufpair_base;
+    bool busy{false};
+    // the on-going job
+    JobInfo job{};
+    std::chrono::high_resolution_clock::time_point start_time{};
+  };
+
+  std::vector<EngineSlot> engines_;
   // DmaEngine dma_engine_;
-  RdmaClient client_;
+  std::unique_ptr<MsgClient> client_;
   EventLoop *loop_;
   std::shared_ptr<BlobPool> blob_pool_;
+  std::shared_ptr<FetchBudget> fetch_budget_;
+  const std::vector<content::Codec> codecs_;
+  const SoftDecompressSite soft_site_;
+  const AdaptiveSplit adaptive_split_;
+  // the max bytes of an inline segment
+  const size_t inline_cap_;
 
-  std::deque<ContentElement> pending_compress_jobs_;
+  // the segments submitted from the other threads, drained in the loop
+  folly::UMPSCQueue<ContentElement, false> submitted_;
+  // a drain of submitted_ is queued in the loop
+  std::atomic<bool> drain_queued_{false};
+  // the segments of all images wait here, the sched policy picks the image
+  SchedQueue<ContentElement> pending_compress_jobs_;
   std::deque<ContentElement> pending_dma_jobs_;
-  std::deque<RdmaInfo> pending_rdma_jobs_;
+  SchedQueue<RdmaInfo> pending_rdma_jobs_;
   // record the bufpair_id of inflight_sends_;
   std::deque<size_t> inflight_sends_;
-  bool decompress_busy_{false};
   bool dma_busy_{false};
+  // the mmaps of all engines are created
   bool connected_{false};
-  RdmaConnectionPtr conn_{nullptr};
+  // the engines creating their mmaps, and whether one failed
+  size_t mmaps_pending_{0};
+  bool mmaps_failed_{false};
+  MsgConnectionPtr conn_{nullptr};
   uint64_t wr_id_{0};
   uint64_t job_id_{0};
-  // record on-going job
-  JobInfo compress_job_;
   JobInfo dma_job_;
-  
+
   // record the image translate time without pipeline.
-  std::chrono::high_resolution_clock::time_point start_time_;
   double decompress_duration_{0};
   std::string curr_image_tag_{""};
 
+  // the segments of each layer not sent yet, sent in the order they came
+  SegmentOrder<RdmaInfo> segment_order_;
+  // the compressed bytes queued on the engines and on software inflate, and
+  // the measured throughput of an engine and of a thread in bytes per ms
+  size_t hw_backlog_{0};
+  size_t soft_backlog_{0};
+  double hw_rate_;
+  double soft_rate_;
+  // the threads of software inflate, 1 for the host
+  const size_t soft_workers_;
+  // decompresses the segments on the DPU, it is joined first
+  std::unique_ptr<folly::CPUThreadPoolExecutor> soft_executor_;
+
+  /// @brief: Create the mmaps of the exported host memory in the EventLoop
+  /// of each engine.
   bool handleMmapInfoResponse(const compress::MmapInfoResponse &resp);
 
+  /// @brief: An engine created its mmaps. The jobs start once all have.
+  void onEngineMmapsCreated(bool ok);
+
   bool handleDecompressFinishResponse(
       const compress::DecompressFinishResponse &resp);
 
+  /// @brief: Start the pending jobs on the idle engines with a free bufpair.
   bool tryStartDecompressJob();
 
-  bool startDecompressJob(ContentElement &task, size_t bufpair_id);
+  bool startDecompressJob(ContentElement &task, size_t engine_idx,
+                          size_t bufpair_id);
 
   // bool tryStartDmaJob();
 
-  void onConnected(const RdmaConnectionPtr &conn);
+  void onConnected(const MsgConnectionPtr &conn);
+
+  void onRecvSuccess(const MsgConnectionPtr &conn, uint8_t *recv_buf,
+                     uint32_t recv_len, const Completion &wc);
+
+  void onRecvFail(const MsgConnectionPtr &conn, const Completion &wc);
+
+  void onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                             const Completion &wc);
+
+  void onSendCompleteFail(const MsgConnectionPtr &conn, const Completion &wc);
+
+  void onDecompressTaskSuccess(size_t engine_idx, uint64_t job_id,
+                               size_t dst_len);
+
+  void onDecompressTaskError(size_t engine_idx, doca_error_t err);
+
+  /// @brief: Release the blob of a segment and its bytes of the fetch budget.
+  void releaseSegment(Blob segment);
+
+  void enqueueRdmaJob(RdmaInfo info);
+
+  /// @brief: Take the segments of submitted_ in the order they came.
+  void drainSubmitted();
+
+  /// @brief: Send a segment to the engines, to software inflate or inline.
+  void dispatchSegment(ContentElement cont);
+
+  /// @brief: Send `info` now if a send buffer is free, or later.
+  void sendRdmaInfo(RdmaInfo info);
+
+  /// @brief: The info of a segment sent to the host inline, in `codec`.
+  static RdmaInfo inlineInfo(ContentElement cont, content::Codec codec);
+
+  /// @brief: The info that tells the host a segment failed.
+  static RdmaInfo failedInfo(std::string image_name_tag, std::string layer,
+                             int total_segments, int segment_idx,
+                             int priority);
 
-  void onRecvSuccess(const RdmaConnectionPtr &conn, uint8_t *recv_buf,
-                     uint32_t recv_len, const ibv_wc &wc);
+  /// @brief: Free a bufpair of the host, `bufpair_id` of all engines.
+  void releaseBufpair(int bufpair_id);
 
-  void onRecvFail(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  /// @brief: Give the segment its place in its layer, it is sent once the
+  /// segments before it are.
+  void admitSegment(ContentElement &cont);
 
-  void onSendCompleteSuccess(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  /// @brief: Send the segment of `ticket` of `layer` in its order, or that
+  /// it failed. Then send the segments after it that are done.
+  void finishSegment(const std::string &layer, uint64_t ticket,
+                     RdmaInfo info);
 
-  void onSendCompleteFail(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  /// @brief: Queue a DEFLATE segment on the DOCA engine.
+  void pushDecompressJob(ContentElement cont);
 
-  void onDecompressTaskSuccess(CompressEngine &engine, uint64_t job_id,
-                               uint8_t *src_addr, size_t src_len,
-                               uint8_t *dst_addr, size_t dst_len);
+  /// @brief: Whether a DEFLATE segment of `size` bytes is expected to finish
+  /// sooner in software than on the engine.
+  bool preferSoft(size_t size) const;
 
-  void onDecompressTaskError(CompressEngine &engine, doca_error_t err);
+  /// @brief: Decompress a segment in the soft executor. A DEFLATE one goes
+  /// back to the engine if it fails or does not fit inline.
+  void startSoftJob(ContentElement cont);
 
+  /// @brief: Send `info` in `free_buf`. A segment that cannot be sent frees
+  /// its bufpair or blob and is sent as failed instead.
   void sendDecompressFinishRequest(RdmaInfo info,
-                                   const RdmaConnection::SendBuf &free_buf);
+                                   const MsgConnection::SendBuf &free_buf);
 };
 } // namespace dpu
 } // namespace hdc
\ No newline at end of file
@@ -1,11 +1,19 @@
-#include "doca/common.h"
-#include "doca_buf.h"
+#include "doca/engine.h"
 #include "dpu/decompress_client_epoll.h"
+#include "dpu/fetch_budget.h"
 #include "dpu/offload_server_epoll.h"
+#include "dpu/segment_cache.h"
 #include "network/EventLoop.h"
+#include "network/EventLoopThread.h"
 #include "network/InetAddress.h"
-#include "network/rdma/RdmaConfig.h"
+#include "network/transport/TransportConfig.h"
+#include "utils/affinity.h"
 #include "utils/blob_pool.h"
+#include "utils/codec.h"
+#include "utils/logging.h"
+#include "utils/sched_queue.h"
+#include "utils/transport_flags.h"
+#include <cstdio>
 #include <dpu/content_fetcher.h>
 #include <future>
 #include <gflags/gflags.h>
@@ -13,15 +21,24 @@
 #include <spdlog/spdlog.h>
 #include <thread>
 
+using hdc::dpu::AdaptiveSplit;
 using hdc::dpu::ContentFetcher;
 using hdc::dpu::ContentFetcherPtr;
 using hdc::dpu::ContentTaskQueue;
 using hdc::dpu::ContentTaskQueuePtr;
 using hdc::dpu::DecompressClientEpoll;
+using hdc::dpu::FetchBudget;
 using hdc::dpu::OffloadServerEpoll;
+using hdc::dpu::RegistryPolicy;
+using hdc::dpu::SoftDecompressSite;
+using hdc::dpu::SegmentCache;
+using hdc::network::EventLoopThread;
 using hdc::network::InetAddress;
 
-using hdc::network::rdma::RdmaConfig;
+using hdc::network::transport::TransportConfig;
+DEFINE_string(offload_server_transport, "rdma",
+              "The transport of offload server: rdma, tcp or shm");
+DEFINE_validator(offload_server_transport, &hdc::utils::validateTransportFlag);
 DEFINE_string(offload_server_ib_dev_name, "mlx5_2",
               "The IB device name of offload server");
 DEFINE_int32(offload_server_ib_dev_port, 1,
@@ -34,6 +51,10 @@ DEFINE_uint32(offload_server_rdma_mem, 4096,
               "The memory of RDMA sendbuf/recvbuf for offload server in bytes");
 DEFINE_uint64(offload_server_rdma_mem_num, 4,
               "The number of RDMA buf for offload server");
+DEFINE_string(decompress_client_transport, "rdma",
+              "The transport of decompress engine in DPU: rdma, tcp or shm");
+DEFINE_validator(decompress_client_transport,
+                 &hdc::utils::validateTransportFlag);
 DEFINE_string(decompress_client_ib_dev_name, "mlx5_2",
               "The IB device name of decompress engine in DPU");
 DEFINE_int32(decompress_client_ib_dev_port, 1,
@@ -48,56 +69,227 @@ DEFINE_uint32(
 DEFINE_uint64(decompress_client_rdma_mem_num, 4,
               "The number of RDMA buf for decompress engine");
 DEFINE_string(decompress_client_pci_address, "03:00.0",
-              "The PCI address of DPU decompress engine");
+              "The PCI addresses of the DPU decompress engines, separated by "
+              "commas");
+DEFINE_uint32(decompress_client_engines_per_device, 1,
+              "The decompress engines, each a context with its own workq, "
+              "bufpairs and thread, on each device. The host must export "
+              "--decompress_client_doca_mem_num bufpairs for each engine "
+              "with --decompress_server_doca_mem_num");
+static bool ValidatePositive(const char *flagname, uint32_t value) {
+  if (value > 0) {
+    return true;
+  }
+  SPDLOG_ERROR("Invalid value for --{}: {}, expect > 0", flagname, value);
+  return false;
+}
+DEFINE_validator(decompress_client_engines_per_device, &ValidatePositive);
 DEFINE_int32(decompress_client_doca_workq_depth, 16,
              "DOCA workq depth of decompress engine");
 DEFINE_int32(decompress_client_doca_mem_num, 4,
              "DOCA memory num of decompress engine");
 DEFINE_uint64(decompress_client_doca_mem, 128 * 1024 * 1024,
               "DOCA memory in bytes");
+DEFINE_string(decompress_client_codecs, "deflate",
+              "The codecs the segments are fetched in, the preferred first, "
+              "of deflate, zstd, lz4 and none. A segment not stored in any of "
+              "them is fetched in deflate");
+DEFINE_validator(decompress_client_codecs, &hdc::utils::validateCodecsFlag);
+DEFINE_string(decompress_client_soft_decompress, "host",
+              "Where the zstd and LZ4 segments, and the split deflate ones, "
+              "are decompressed: host, or dpu on the ARM cores. They are sent "
+              "inline, so the RDMA buffers must hold a segment, a "
+              "decompressed one for dpu");
+static bool ValidateSoftDecompress(const char *flagname,
+                                   const std::string &value) {
+  if (value == "host" || value == "dpu") {
+    return true;
+  }
+  SPDLOG_ERROR("Invalid value for --{}: {}, expect host or dpu", flagname,
+               value);
+  return false;
+}
+DEFINE_validator(decompress_client_soft_decompress, &ValidateSoftDecompress);
+DEFINE_uint64(decompress_client_soft_threads, 4,
+              "The ARM cores that decompress the zstd and LZ4 segments, and "
+              "the split deflate ones, with "
+              "--decompress_client_soft_decompress=dpu");
+DEFINE_bool(decompress_client_adaptive_split, false,
+            "Inflate the deflate segments in software too, where "
+            "--decompress_client_soft_decompress says, when the DOCA engine "
+            "is expected to finish them later. Only the segments that fit "
+            "in the RDMA buffers are split");
+DEFINE_double(decompress_client_engine_mbps, 4000,
+              "The throughput of a DOCA engine in MB/s of compressed bytes "
+              "to start the adaptive split with, then measured");
+DEFINE_double(decompress_client_soft_inflate_mbps, 200,
+              "The throughput of a software inflate thread in MB/s of "
+              "compressed bytes to start the adaptive split with, then "
+              "measured on the DPU");
 DEFINE_int32(blob_num, 16, "the number of 128MB blob");
 DEFINE_uint64(blob_size, 128 * 1024 * 1024, "the size of each blob");
+DEFINE_uint64(segment_cache_capacity, 1024 * 1024 * 1024,
+              "The bytes of compressed segments cached in DPU memory, 0 "
+              "disables the segment cache. The memory is allocated as "
+              "segments are cached");
+DEFINE_string(sched_policy, "fifo",
+              "The order in which the segments of concurrent pulls are "
+              "fetched, decompressed and sent to the host: fifo, srpt "
+              "(the image with the least queued work first), fair (fair "
+              "share per image, weighted by priority) or priority");
+DEFINE_validator(sched_policy, &hdc::utils::validateSchedPolicyFlag);
+DEFINE_uint64(fetch_budget_bytes, 1024 * 1024 * 1024,
+              "The max bytes of compressed segments fetched from the registry "
+              "but not yet decompressed or sent to the host, 0 means no "
+              "limit");
+// the thread of each stage, e.g. 0-1 or 2,3, empty for any CPU
+DEFINE_string(offload_server_cpus, "",
+              "The CPUs of the offload server thread");
+DEFINE_validator(offload_server_cpus, &hdc::utils::validateCpuListFlag);
+DEFINE_string(content_fetcher_cpus, "",
+              "The CPUs of the content fetcher thread");
+DEFINE_validator(content_fetcher_cpus, &hdc::utils::validateCpuListFlag);
+DEFINE_bool(content_fetcher_sharded_registries, false,
+            "Whether the registries of --content_client_peer_ip hold disjoint "
+            "shards of the layers, each layer fetched from the one its digest "
+            "hashes to, rather than replicas, each layer fetched from the one "
+            "expected to answer first");
+DEFINE_double(content_fetcher_registry_timeout_ms, 5000,
+              "The time in ms a registry may take to answer before its "
+              "requests go to the other registries, and it is passed over");
+static bool ValidateTimeout(const char *flagname, double value) {
+  if (value > 0) {
+    return true;
+  }
+  SPDLOG_ERROR("Invalid value for --{}: {}, expect > 0", flagname, value);
+  return false;
+}
+DEFINE_validator(content_fetcher_registry_timeout_ms, &ValidateTimeout);
+DEFINE_string(decompress_client_cpus, "",
+              "The CPUs of the decompress client thread, with the first "
+              "decompress engine");
+DEFINE_validator(decompress_client_cpus, &hdc::utils::validateCpuListFlag);
+DEFINE_string(decompress_client_engine_cpus, "",
+              "The CPUs of the threads of the other decompress engines");
+DEFINE_validator(decompress_client_engine_cpus,
+                 &hdc::utils::validateCpuListFlag);
+DEFINE_string(decompress_client_soft_cpus, "",
+              "The CPUs of the threads of --decompress_client_soft_threads");
+DEFINE_validator(decompress_client_soft_cpus,
+                 &hdc::utils::validateCpuListFlag);
+DEFINE_bool(numa_local, false,
+            "Create the DOCA buffers of each decompress engine on the NUMA "
+            "node of its device, and run the stages without CPUs on the node "
+            "of --decompress_client_ib_dev_name, where the RDMA buffers are "
+            "then created");
+
+/// @brief: The CPUs of a stage from its `*_cpus` flag, or with --numa_local
+/// those of the node of the decompress client device if it is empty.
+std::vector<int> stageCpus(const std::string &cpus_flag) {
+  auto cpus = hdc::utils::cpuListFlag(cpus_flag);
+  if (cpus.empty() && FLAGS_numa_local) {
+    auto node =
+        hdc::utils::ibDeviceNumaNode(FLAGS_decompress_client_ib_dev_name);
+    if (node.has_value()) {
+      cpus = hdc::utils::numaNodeCpus(*node);
+    }
+  }
+  return cpus;
+}
+
 void runDecompressClient(std::promise<DecompressClientEpoll *> p) {
   EventLoop loop;
   // decompress client
-  RdmaConfig decompress_client_config{
+  TransportConfig decompress_client_config{
+      hdc::utils::transportTypeFlag(FLAGS_decompress_client_transport),
       FLAGS_decompress_client_ib_dev_name, FLAGS_decompress_client_ib_dev_port,
       FLAGS_decompress_client_rdma_mem, FLAGS_decompress_client_rdma_mem_num};
 
-  auto compress_engine = CompressEngine::create(
-      FLAGS_decompress_client_pci_address.data(), DOCA_BUF_EXTENSION_NONE,
-      FLAGS_decompress_client_doca_workq_depth, &loop,
-      FLAGS_decompress_client_doca_mem, 8,
-      FLAGS_decompress_client_doca_mem_num);
-  if (!compress_engine.has_value()) {
-    SPDLOG_ERROR("create compress_engine error");
-    return;
+  auto pci_addresses =
+      hdc::utils::listFlag(FLAGS_decompress_client_pci_address);
+  auto engine_num =
+      pci_addresses.size() * FLAGS_decompress_client_engines_per_device;
+  // the first engine runs in the loop of the client, the others in their own
+  std::vector<std::unique_ptr<EventLoopThread>> engine_threads;
+  std::vector<CompressEngine> compress_engines;
+  for (size_t i = 0; i < engine_num; ++i) {
+    auto engine_loop = &loop;
+    if (i > 0) {
+      engine_threads.push_back(std::make_unique<EventLoopThread>(
+          [](EventLoop *) {
+            hdc::utils::pinThread(
+                stageCpus(FLAGS_decompress_client_engine_cpus));
+          },
+          "DecompressEngine" + std::to_string(i)));
+      engine_loop = engine_threads.back()->startLoop();
+    }
+    auto &pci_address =
+        pci_addresses[i / FLAGS_decompress_client_engines_per_device];
+    // the engine fills its buffers as it is created
+    std::vector<int> node_cpus;
+    if (auto node = hdc::utils::pciDeviceNumaNode(pci_address);
+        FLAGS_numa_local && node.has_value()) {
+      node_cpus = hdc::utils::numaNodeCpus(*node);
+    }
+    hdc::utils::ScopedPin pin{node_cpus};
+    auto compress_engine = CompressEngine::create(
+        pci_address.data(), DOCA_BUF_EXTENSION_NONE,
+        FLAGS_decompress_client_doca_workq_depth, engine_loop,
+        FLAGS_decompress_client_doca_mem, 8,
+        FLAGS_decompress_client_doca_mem_num);
+    if (!compress_engine.has_value()) {
+      SPDLOG_ERROR("create compress_engine {} on {} error", i, pci_address);
+      return;
+    }
+    compress_engines.push_back(std::move(*compress_engine));
   }
 
   auto blob_pool = std::make_shared<BlobPool>(FLAGS_blob_size, FLAGS_blob_num);
   DecompressClientEpoll decompress_client{
-      std::move(*compress_engine),
+      std::move(compress_engines),
       &loop,
       InetAddress{FLAGS_decompress_client_peer_ip,
                   static_cast<uint16_t>(FLAGS_decompress_client_peer_port)},
-      std::move(decompress_client_config), blob_pool};
+      std::move(decompress_client_config), blob_pool,
+      hdc::utils::schedPolicyFlag(FLAGS_sched_policy),
+      std::make_shared<FetchBudget>(FLAGS_fetch_budget_bytes),
+      hdc::utils::codecsFlag(FLAGS_decompress_client_codecs),
+      FLAGS_decompress_client_soft_decompress == "dpu"
+          ? SoftDecompressSite::kDpu
+          : SoftDecompressSite::kHost,
+      FLAGS_decompress_client_soft_threads,
+      AdaptiveSplit{FLAGS_decompress_client_adaptive_split,
+                    FLAGS_decompress_client_engine_mbps,
+                    FLAGS_decompress_client_soft_inflate_mbps},
+      stageCpus(FLAGS_decompress_client_soft_cpus)};
   p.set_value(&decompress_client);
   decompress_client.decompressStart();
+  // after the engine threads are started, so that they do not inherit it
+  hdc::utils::pinThread(stageCpus(FLAGS_decompress_client_cpus));
   loop.loop();
 }
 
 void runContentFetcher(DecompressClientEpoll *decompress_client,
                        std::promise<std::shared_ptr<ContentFetcher>> p) {
+  hdc::utils::pinThread(stageCpus(FLAGS_content_fetcher_cpus));
   EventLoop loop;
-  auto fetcher = std::make_shared<ContentFetcher>(&loop, decompress_client);
+  std::shared_ptr<SegmentCache> segment_cache;
+  if (FLAGS_segment_cache_capacity != 0) {
+    segment_cache =
+        std::make_shared<SegmentCache>(FLAGS_segment_cache_capacity);
+  }
+  auto fetcher = std::make_shared<ContentFetcher>(
+      &loop, decompress_client, std::move(segment_cache),
+      hdc::utils::schedPolicyFlag(FLAGS_sched_policy),
+      RegistryPolicy{FLAGS_content_fetcher_sharded_registries,
+                     FLAGS_content_fetcher_registry_timeout_ms});
   p.set_value(fetcher);
   loop.loop();
 }
 
 int main(int argc, char **argv) {
-  spdlog::set_level(spdlog::level::debug);
-  spdlog::set_pattern("%^[%L][%T.%e]%$[%s:%#] %v");
   GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+  hdc::utils::initLogger("dpu_main");
   // decompress client
   std::promise<DecompressClientEpoll *> p;
   auto f = p.get_future();
@@ -111,9 +303,11 @@ int main(int argc, char **argv) {
   auto fetcher = f1.get();
 
   // offload server
+  hdc::utils::pinThread(stageCpus(FLAGS_offload_server_cpus));
   EventLoop loop;
 
-  RdmaConfig offload_server_config{
+  TransportConfig offload_server_config{
+      hdc::utils::transportTypeFlag(FLAGS_offload_server_transport),
       FLAGS_offload_server_ib_dev_name, FLAGS_offload_server_ib_dev_port,
       FLAGS_offload_server_rdma_mem, FLAGS_offload_server_rdma_mem_num};
 
@@ -125,4 +319,5 @@ int main(int argc, char **argv) {
 
   offload_server.start();
   loop.loop();
+  spdlog::shutdown();
 }
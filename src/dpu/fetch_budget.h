@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+namespace hdc {
+namespace dpu {
+
+/// @brief: The bytes of the compressed segments that are fetched but not yet
+/// handed to the decompress engine or sent to the host. ContentFetcher
+/// acquires the bytes of a segment when it arrives, DecompressClientEpoll
+/// releases them when the segment leaves its blob, and the fetcher sends no
+/// new request while the budget is exhausted, so a fast registry cannot fill
+/// the DPU memory with segments the decompress engine cannot keep up with.
+/// The requests in flight are not counted, the budget may be exceeded by
+/// their responses. A capacity of 0 means no limit. Thread safe.
+class FetchBudget {
+public:
+  explicit FetchBudget(uint64_t capacity) : capacity_(capacity) {}
+
+  FetchBudget(const FetchBudget &) = delete;
+
+  FetchBudget &operator=(const FetchBudget &) = delete;
+
+  /// @brief: `cb` is called, in the thread that releases, when the budget is
+  /// no longer exhausted. Not thread safe, set it before the first acquire.
+  void setAvailableCallback(std::function<void()> cb) {
+    available_cb_ = std::move(cb);
+  }
+
+  bool exhausted() const {
+    return capacity_ != 0 && used_.load(std::memory_order_acquire) >= capacity_;
+  }
+
+  void acquire(uint64_t bytes) {
+    used_.fetch_add(bytes, std::memory_order_acq_rel);
+  }
+
+  void release(uint64_t bytes) {
+    auto prev = used_.fetch_sub(bytes, std::memory_order_acq_rel);
+    if (capacity_ != 0 && prev >= capacity_ && prev - bytes < capacity_ &&
+        available_cb_) {
+      available_cb_();
+    }
+  }
+
+  uint64_t used() const { return used_.load(std::memory_order_acquire); }
+
+private:
+  const uint64_t capacity_;
+  std::atomic<uint64_t> used_{0};
+  std::function<void()> available_cb_;
+};
+
+} // namespace dpu
+} // namespace hdc
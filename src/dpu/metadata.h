@@ -1,4 +1,6 @@
 #pragma once
+#include "content.pb.h"
+#include <cstdint>
 #include <string>
 #include <utils/blob_pool.h>
 #include <vector>
@@ -10,7 +12,12 @@ struct ContentElement {
   int total_segments;
   std::string layer;
   std::string image_name_tag;
-  bool is_compressed{true};
+  // the format of the segment as fetched from the registry
+  content::Codec codec{content::DEFLATE};
+  // the priority of the pull of the image
+  int priority{0};
+  // the place of the segment in its layer, set by DecompressClientEpoll
+  uint64_t ticket{0};
 };
 } // namespace dpu
 } // namespace hdc
\ No newline at end of file
@@ -2,15 +2,20 @@
 #include <fmt/format.h>
 #include <gflags/gflags.h>
 #include <spdlog/spdlog.h>
+#include <utils/transport_flags.h>
 
+DEFINE_string(content_client_transport, "rdma",
+              "The transport of host ContentClient: rdma, tcp or shm");
+DEFINE_validator(content_client_transport, &hdc::utils::validateTransportFlag);
 DEFINE_string(content_client_ib_dev_name, "mlx5_2",
               "The IB device name of host ContentClient");
 DEFINE_int32(content_client_ib_dev_port, 1,
              "The IB device port of host ContentClient");
 DEFINE_string(content_client_peer_ip, "172.24.46.186",
-              "The IP address of host ContentClient to connect");
+              "The IP addresses of the registries ContentClient connects to, "
+              "separated by commas");
 DEFINE_uint32(content_client_peer_port, 9002,
-              "The IP port of host ContentClient to connect");
+              "The IP port of the registries ContentClient connects to");
 DEFINE_uint64(
     content_client_rdma_mem, 129 * 1024 * 1024,
     "The memory of RDMA sendbuf/recvbuf for host ContentClient in bytes");
@@ -21,40 +26,95 @@ namespace hdc {
 namespace dpu {
 
 OffloadServerEpoll::OffloadServerEpoll(
-    EventLoop *loop, const InetAddress &listen_addr, RdmaConfig rdma_config,
-    ContentFetcherPtr fetcher,
+    EventLoop *loop, const InetAddress &listen_addr,
+    TransportConfig transport_config, ContentFetcherPtr fetcher,
     DecompressClientEpoll *decompress_client) noexcept
-    : server_(loop, listen_addr, "OffloadServerEpoll", std::move(rdma_config)),
+    : loop_(loop),
+      server_(createMsgServer(loop, listen_addr, "OffloadServerEpoll",
+                              transport_config)),
       fetcher_(std::move(fetcher)), decompress_client_(decompress_client) {
-  server_.setConnectedCallback(
-      [this](const RdmaConnectionPtr &conn) { this->onConnected(conn); });
-  server_.setRecvSuccessCallback([this](const RdmaConnectionPtr &conn,
-                                        uint8_t *recv_buf, uint32_t recv_len,
-                                        const ibv_wc &wc) {
+  fetcher_->setLayerFetchedCallback(
+      [this](const std::string &layer, const std::string &image_name_tag,
+             int total_segments, int cached_segments) {
+        offload::LayerProgress progress{};
+        progress.set_layer(layer);
+        progress.set_image_name_tag(image_name_tag);
+        progress.set_total_segments(total_segments);
+        progress.set_cached_segments(cached_segments);
+        loop_->runInLoop([this, progress = std::move(progress)]() {
+          pending_progress_.push_back(std::move(progress));
+          sendLayerProgress();
+        });
+      });
+  server_->setConnectedCallback(
+      [this](const MsgConnectionPtr &conn) { this->onConnected(conn); });
+  server_->setRecvSuccessCallback([this](const MsgConnectionPtr &conn,
+                                         uint8_t *recv_buf, uint32_t recv_len,
+                                         const Completion &wc) {
     this->onRecvSuccess(conn, recv_buf, recv_len, wc);
   });
-  server_.setRecvFailCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  server_->setRecvFailCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onRecvFail(conn, wc);
       });
-  server_.setSendCompleteSuccessCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  server_->setSendCompleteSuccessCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onSendCompleteSuccess(conn, wc);
       });
-  server_.setSendCompleteFailCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  server_->setSendCompleteFailCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onSendCompleteFail(conn, wc);
       });
 }
 
-void OffloadServerEpoll::start() { server_.start(); }
-void OffloadServerEpoll::onConnected(const RdmaConnectionPtr &conn) {
+void OffloadServerEpoll::start() { server_->start(); }
+void OffloadServerEpoll::onConnected(const MsgConnectionPtr &conn) {
   SPDLOG_INFO("OffloadServerEpoll connected");
+  conn_ = conn;
+  // the batch in flight on the previous connection never completes
+  progress_wr_id_.reset();
+  sendLayerProgress();
+}
+
+void OffloadServerEpoll::sendLayerProgress() {
+  if (conn_ == nullptr || progress_wr_id_.has_value() ||
+      pending_progress_.empty()) {
+    return;
+  }
+  auto free_buf = conn_->acquireFreeSendBuf();
+  if (!free_buf.has_value()) {
+    // sent with the next progress or once a batch is complete
+    SPDLOG_DEBUG("No send buf for LayerProgressBatch, {} layers pending",
+                 pending_progress_.size());
+    return;
+  }
+  offload::LayerProgressBatch batch{};
+  for (auto &progress : pending_progress_) {
+    *batch.add_progress() = std::move(progress);
+  }
+  pending_progress_.clear();
+  auto send_buf = free_buf->addr;
+  auto send_cap = free_buf->cap;
+  *reinterpret_cast<int *>(send_buf) =
+      static_cast<int>(MsgType::kLayerProgress);
+  auto frame_len = serializeRdmaPbMsg(send_buf + sizeof(MsgType),
+                                      send_cap - sizeof(MsgType), batch);
+  if (frame_len == -1) {
+    SPDLOG_ERROR("Serialize RDMA msg error, drop the progress of {} layers",
+                 batch.progress_size());
+    conn_->releaseSendBuf(free_buf->id);
+    return;
+  }
+  progress_wr_id_ = wr_id_;
+  conn_->send(send_buf, frame_len + sizeof(MsgType), wr_id_++);
+  conn_->releaseSendBuf(free_buf->id);
+  SPDLOG_DEBUG("Send LayerProgressBatch of {} layers. wr_id: {}",
+               batch.progress_size(), *progress_wr_id_);
 }
 
-void OffloadServerEpoll::onRecvSuccess(const RdmaConnectionPtr &conn,
+void OffloadServerEpoll::onRecvSuccess(const MsgConnectionPtr &conn,
                                        uint8_t *recv_buf, uint32_t recv_len,
-                                       const ibv_wc &wc) {
+                                       const Completion &wc) {
   if (recv_len < sizeof(int)) {
     SPDLOG_ERROR("recv_len < 4");
     return;
@@ -87,45 +147,61 @@ void OffloadServerEpoll::onRecvSuccess(const RdmaConnectionPtr &conn,
   }
 }
 
-void OffloadServerEpoll::onRecvFail(const RdmaConnectionPtr &conn,
-                                    const ibv_wc &wc) {
+void OffloadServerEpoll::onRecvFail(const MsgConnectionPtr &conn,
+                                    const Completion &wc) {
   SPDLOG_ERROR("RDMA recv complete fail. wr_id: {}", wc.wr_id);
 }
 
-void OffloadServerEpoll::onSendCompleteSuccess(const RdmaConnectionPtr &conn,
-                                               const ibv_wc &wc) {}
+void OffloadServerEpoll::onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                                               const Completion &wc) {
+  if (progress_wr_id_ == wc.wr_id) {
+    progress_wr_id_.reset();
+  }
+  // a batch waits for the one in flight or for a send buf
+  sendLayerProgress();
+}
 
-void OffloadServerEpoll::onSendCompleteFail(const RdmaConnectionPtr &conn,
-                                            const ibv_wc &wc) {
+void OffloadServerEpoll::onSendCompleteFail(const MsgConnectionPtr &conn,
+                                            const Completion &wc) {
   SPDLOG_ERROR("RDMA send complete fail. wr_id: {}", wc.wr_id);
+  if (progress_wr_id_ == wc.wr_id) {
+    progress_wr_id_.reset();
+  }
 }
 
 bool OffloadServerEpoll::handleOffloadRequest(
-    const RdmaConnectionPtr &conn, const offload::OffloadRequest &req) {
-  /// you can modify this code to support query database and use cache
+    const MsgConnectionPtr &conn, const offload::OffloadRequest &req) {
+  /// the host keeps the layer state table (see host/client/layer_table.h) and
+  /// only asks for the layers that are neither present nor in flight on it, so
+  /// every layer here is fetched once, but for the segments a lazy pull
+  /// reads. A request may carry the layers of several images.
   auto &image = req.image_name_tag();
-  int fetch_count = 1;
+  TransportConfig transportConfig = {
+      hdc::utils::transportTypeFlag(FLAGS_content_client_transport),
+      FLAGS_content_client_ib_dev_name, FLAGS_content_client_ib_dev_port,
+      FLAGS_content_client_rdma_mem, FLAGS_content_client_rdma_mem_num};
+  std::vector<InetAddress> registries;
+  for (auto &ip : hdc::utils::listFlag(FLAGS_content_client_peer_ip)) {
+    registries.emplace_back(
+        ip, static_cast<uint16_t>(FLAGS_content_client_peer_port));
+  }
 
   for (auto &layer : req.layers()) {
-    SPDLOG_DEBUG("image {}, layer {}", image, layer.layer());
-    RdmaConfig rdmaConfig = {
-        FLAGS_content_client_ib_dev_name,
-        FLAGS_content_client_ib_dev_port,
-        FLAGS_content_client_rdma_mem,
-        FLAGS_content_client_rdma_mem_num
-    };
-
+    auto &layer_image =
+        layer.has_image_name_tag() ? layer.image_name_tag() : image;
+    auto priority = layer.has_priority() ? layer.priority() : req.priority();
+    SPDLOG_DEBUG("image {}, layer {}, priority {}", layer_image, layer.layer(),
+                 priority);
     fetcher_->fetch(
-        layer.layer(), image,
-        InetAddress{FLAGS_content_client_peer_ip,
-                    static_cast<uint16_t>(FLAGS_content_client_peer_port)},
-        rdmaConfig);
+        layer.layer(), layer_image, registries, transportConfig, priority,
+        std::vector<int>(layer.segments().begin(), layer.segments().end()));
   }
 
   // send response
   offload::OffloadResponse offload_resp{};
   offload_resp.set_image_name_tag(image);
   offload_resp.set_success(true);
+  offload_resp.set_layers(req.layers_size());
   auto free_buf = conn->acquireFreeSendBuf();
   auto send_buf = free_buf->addr;
   auto send_cap = free_buf->cap;
@@ -146,7 +222,7 @@ bool OffloadServerEpoll::handleOffloadRequest(
 }
 
 bool OffloadServerEpoll::handleDecompressConnectionReqeust(
-    const RdmaConnectionPtr &conn,
+    const MsgConnectionPtr &conn,
     const offload::DecompressConnectionRequest &req) {
   SPDLOG_INFO("Recv DecompressConnectionRequest");
   offload::DecompressConnectionResponse resp{};
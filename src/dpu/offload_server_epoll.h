@@ -1,50 +1,68 @@
 #pragma once
 #include "dpu/decompress_client_epoll.h"
-#include "network/rdma/Callbacks.h"
-#include "network/rdma/RdmaServer.h"
+#include "network/transport/Callbacks.h"
+#include "network/transport/Transport.h"
 #include "offload.pb.h"
 #include <dpu/content_fetcher.h>
 #include <dpu/metadata.h>
+#include <optional>
 #include <spdlog/spdlog.h>
 #include <utils/MsgFrame.h>
+#include <vector>
 
 namespace hdc {
 namespace dpu {
 using hdc::network::EventLoop;
 using hdc::network::InetAddress;
-using hdc::network::rdma::RdmaConfig;
-using hdc::network::rdma::RdmaServer;
+using hdc::network::transport::TransportConfig;
+using hdc::network::transport::createMsgServer;
+using hdc::network::transport::MsgServer;
 class OffloadServerEpoll {
 
 public:
   OffloadServerEpoll(EventLoop *loop, const InetAddress &listen_addr,
-                     RdmaConfig rdma_config, ContentFetcherPtr fetcher,
+                     TransportConfig transport_config,
+                     ContentFetcherPtr fetcher,
                      DecompressClientEpoll *decompress_client) noexcept;
 
   void start();
 
 private:
-  enum class MsgType : int { kDecompressConnection, kOffload };
-  RdmaServer server_;
+  enum class MsgType : int { kDecompressConnection, kOffload, kLayerProgress };
+  EventLoop *loop_;
+  std::unique_ptr<MsgServer> server_;
+  // the connection of the host
+  MsgConnectionPtr conn_{nullptr};
   ContentFetcherPtr fetcher_;
   DecompressClientEpoll *decompress_client_;
   uint64_t wr_id_{0};
+  // the layers fetched and not sent to the host yet
+  std::vector<offload::LayerProgress> pending_progress_;
+  // the wr_id of the LayerProgressBatch in flight. One batch at a time, so
+  // that the progress takes at most the one receive the host keeps for it.
+  std::optional<uint64_t> progress_wr_id_;
 
-  void onConnected(const RdmaConnectionPtr &conn);
+  void onConnected(const MsgConnectionPtr &conn);
 
-  void onRecvSuccess(const RdmaConnectionPtr &conn, uint8_t *recv_buf,
-                     uint32_t recv_len, const ibv_wc &wc);
+  void onRecvSuccess(const MsgConnectionPtr &conn, uint8_t *recv_buf,
+                     uint32_t recv_len, const Completion &wc);
 
-  void onRecvFail(const RdmaConnectionPtr &conn, const ibv_wc &wc);
-  void onSendCompleteSuccess(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onRecvFail(const MsgConnectionPtr &conn, const Completion &wc);
+  void onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                             const Completion &wc);
 
-  void onSendCompleteFail(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onSendCompleteFail(const MsgConnectionPtr &conn, const Completion &wc);
 
-  bool handleOffloadRequest(const RdmaConnectionPtr &conn,
+  bool handleOffloadRequest(const MsgConnectionPtr &conn,
                             const offload::OffloadRequest &req);
 
+  /// @brief: Tell the host the layers fetched since the last batch, in one
+  /// LayerProgressBatch, unless a batch is in flight. The next batch is sent
+  /// once its send is complete. Not thread safe.
+  void sendLayerProgress();
+
   bool handleDecompressConnectionReqeust(
-      const RdmaConnectionPtr &conn,
+      const MsgConnectionPtr &conn,
       const offload::DecompressConnectionRequest &req);
 };
 
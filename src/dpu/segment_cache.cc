@@ -0,0 +1,113 @@
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <dpu/segment_cache.h>
+#include <spdlog/spdlog.h>
+
+namespace hdc {
+namespace dpu {
+
+SegmentCache::SegmentCache(size_t capacity) : capacity_(capacity) {}
+
+std::optional<SegmentCache::Segment>
+SegmentCache::lookup(const std::string &layer, int index) {
+  auto it = entries_.find(Key{layer, index});
+  if (it == entries_.end()) {
+    return std::nullopt;
+  }
+  auto &entry = it->second;
+  lru_.splice(lru_.begin(), lru_, entry.lru_it);
+  return Segment{entry.data.get(), entry.size, entry.total_segments,
+                 entry.codec};
+}
+
+std::optional<SegmentCache::Segment>
+SegmentCache::lookupChunk(const std::string &chunk) {
+  auto it = chunks_.find(chunk);
+  if (it == chunks_.end()) {
+    return std::nullopt;
+  }
+  auto key = it->second;
+  return lookup(key.first, key.second);
+}
+
+const std::vector<std::string> *
+SegmentCache::lookupRecipe(const std::string &layer) const {
+  auto it = recipes_.find(layer);
+  return it == recipes_.end() ? nullptr : &it->second;
+}
+
+void SegmentCache::insertRecipe(const std::string &layer,
+                                std::vector<std::string> chunks) {
+  // only the layers with cached segments keep their recipe
+  auto it = entries_.lower_bound(Key{layer, 0});
+  if (it == entries_.end() || it->first.first != layer) {
+    return;
+  }
+  recipes_[layer] = std::move(chunks);
+}
+
+void SegmentCache::insert(const std::string &layer, int index,
+                          int total_segments, content::Codec codec,
+                          const uint8_t *data, size_t size,
+                          const std::string &chunk) {
+  if (size > capacity_ || capacity_ == 0) {
+    return;
+  }
+  Key key{layer, index};
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    // a segment is immutable, it is addressed by the layer digest
+    lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+    return;
+  }
+  // only a prefix of a layer is of use, and the eviction may cut it
+  auto extends_prefix = [&]() {
+    return index == 0 || entries_.count(Key{layer, index - 1}) != 0;
+  };
+  if (!extends_prefix()) {
+    return;
+  }
+  while (bytes_ + size > capacity_) {
+    evictOne();
+  }
+  if (!extends_prefix()) {
+    return;
+  }
+  // copied over at once, no need to initialize it
+  std::unique_ptr<uint8_t[]> copy{new uint8_t[size]};
+  memcpy(copy.get(), data, size);
+  bytes_ += size;
+  lru_.emplace_front(key);
+  if (!chunk.empty()) {
+    chunks_.emplace(chunk, key);
+  }
+  entries_.emplace(std::move(key), Entry{std::move(copy), size, total_segments,
+                                         codec, chunk, lru_.begin()});
+}
+
+void SegmentCache::evictOne() {
+  assert(!lru_.empty());
+  // the last segment of the least recently used layer
+  const auto layer = lru_.back().first;
+  auto it = entries_.lower_bound(Key{layer, INT_MAX});
+  assert(it != entries_.begin());
+  --it;
+  assert(it->first.first == layer);
+  SPDLOG_DEBUG("Evict segment {} of layer {} from the segment cache",
+               it->first.second, layer);
+  lru_.erase(it->second.lru_it);
+  if (auto chunk = chunks_.find(it->second.chunk);
+      chunk != chunks_.end() && chunk->second == it->first) {
+    chunks_.erase(chunk);
+  }
+  if (it->first.second == 0) {
+    // the last segment of the layer
+    recipes_.erase(layer);
+  }
+  bytes_ -= it->second.size;
+  entries_.erase(it);
+}
+
+} // namespace dpu
+} // namespace hdc
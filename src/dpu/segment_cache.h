@@ -0,0 +1,99 @@
+#pragma once
+#include "content.pb.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace hdc {
+namespace dpu {
+
+/// @brief: A bounded cache of the compressed segments fetched from the
+/// registry, keyed by (layer digest, segment index). The cache holds at most
+/// `capacity` bytes of segments, each in a buffer of its size allocated as it
+/// is inserted and freed as it is evicted, so the memory follows what is
+/// cached.
+///
+/// The eviction is LRU by segment, but the victim is the last cached segment
+/// of the least recently used layer. A layer is fetched in order, so what is
+/// left of a layer is always a prefix, which ContentFetcher can use without
+/// reordering the segments. Not thread safe, it is used in the loop of
+/// ContentFetcher.
+///
+/// A segment of a layer stored in chunks is also found by its chunk, so the
+/// layers that share a chunk share its cached copy.
+class SegmentCache {
+public:
+  struct Segment {
+    const uint8_t *data;
+    size_t size;
+    int total_segments;
+    content::Codec codec;
+  };
+
+  /// @brief: `capacity` 0 caches nothing.
+  explicit SegmentCache(size_t capacity);
+
+  SegmentCache(const SegmentCache &) = delete;
+
+  SegmentCache &operator=(const SegmentCache &) = delete;
+
+  /// @brief: The data is valid until the next insert().
+  std::optional<Segment> lookup(const std::string &layer, int index);
+
+  /// @brief: The cached segment of any layer with the content address
+  /// `chunk`. The data is valid until the next insert().
+  std::optional<Segment> lookupChunk(const std::string &chunk);
+
+  /// @brief: The chunks of the segments of a layer with cached segments, or
+  /// nullptr.
+  const std::vector<std::string> *lookupRecipe(const std::string &layer) const;
+
+  /// @brief: Copy a segment into the cache. A segment larger than the
+  /// capacity or whose previous segment is not cached is not cached.
+  /// `chunk` is empty if the layer is not stored in chunks.
+  void insert(const std::string &layer, int index, int total_segments,
+              content::Codec codec, const uint8_t *data, size_t size,
+              const std::string &chunk = "");
+
+  /// @brief: Keep the chunks of the segments of `layer` while any of them
+  /// is cached.
+  void insertRecipe(const std::string &layer, std::vector<std::string> chunks);
+
+  size_t size() const { return entries_.size(); }
+
+  /// @brief: The bytes of the cached segments.
+  size_t bytes() const { return bytes_; }
+
+private:
+  using Key = std::pair<std::string, int>;
+  struct Entry {
+    // not a Blob, which fills its buffer as it is allocated
+    std::unique_ptr<uint8_t[]> data;
+    size_t size;
+    int total_segments;
+    content::Codec codec;
+    std::string chunk;
+    std::list<Key>::iterator lru_it;
+  };
+
+  void evictOne();
+
+  const size_t capacity_;
+  size_t bytes_{0};
+  // the segments of a layer are adjacent and ordered by index
+  std::map<Key, Entry> entries_;
+  // the most recently used first
+  std::list<Key> lru_;
+  // chunk -> the cached segment that holds it
+  std::map<std::string, Key> chunks_;
+  std::map<std::string, std::vector<std::string>> recipes_;
+};
+
+} // namespace dpu
+} // namespace hdc
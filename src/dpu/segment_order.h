@@ -0,0 +1,64 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace hdc {
+namespace dpu {
+
+/// @brief: Puts the segments of each layer back in the order they were
+/// admitted in, whatever order they finish in. A segment gets a ticket when
+/// it is admitted, and once it finishes it is handed on together with the
+/// finished segments behind it, as soon as all the segments before it are.
+/// Not thread safe.
+template <typename T> class SegmentOrder {
+public:
+  /// @brief: The ticket of the next segment of `layer`.
+  uint64_t admit(const std::string &layer) {
+    auto &order = layers_[layer];
+    auto ticket = order.head + order.slots.size();
+    order.slots.emplace_back();
+    return ticket;
+  }
+
+  /// @brief: The segment of `ticket` of `layer` finished as `item`. `ready`
+  /// is called with it and the finished segments after it, in their order,
+  /// unless a segment before it is not finished yet.
+  template <typename F>
+  void finish(const std::string &layer, uint64_t ticket, T item, F &&ready) {
+    auto it = layers_.find(layer);
+    assert(it != layers_.end());
+    auto &order = it->second;
+    assert(ticket >= order.head && ticket - order.head < order.slots.size());
+    order.slots[ticket - order.head] = std::move(item);
+    while (!order.slots.empty() && order.slots.front().has_value()) {
+      auto front = std::move(*order.slots.front());
+      order.slots.pop_front();
+      ++order.head;
+      ready(std::move(front));
+    }
+    if (order.slots.empty()) {
+      layers_.erase(it);
+    }
+  }
+
+  /// @brief: The layers with a segment not handed on yet.
+  size_t layers() const { return layers_.size(); }
+
+private:
+  struct LayerOrder {
+    // the ticket of the front of slots
+    uint64_t head{0};
+    // the finished segments hold their item
+    std::deque<std::optional<T>> slots;
+  };
+
+  std::map<std::string, LayerOrder> layers_;
+};
+
+} // namespace dpu
+} // namespace hdc
@@ -1,4 +1,6 @@
 #include "container.pb.h"
+#include <algorithm>
+#include <cctype>
 #include "network/EventLoop.h"
 #include "network/InetAddress.h"
 #include "network/tcp/TcpClient.h"
@@ -6,6 +8,7 @@
 #include <host/client/metadata.h>
 #include <spdlog/spdlog.h>
 #include <utils/MsgFrame.h>
+#include <utils/logging.h>
 using container::CreateContainerRequest;
 using container::CreateContainerResponse;
 using hdc::network::EventLoop;
@@ -15,6 +18,12 @@ DEFINE_string(command_peer_ip, "10.16.0.186",
 DEFINE_int32(command_peer_port, 9000, "The port of command server");
 DEFINE_string(image_name, "", "Image name to pull");
 DEFINE_string(image_tag, "latest", "The tag of image");
+DEFINE_string(request_type, "pull",
+              "pull, prefetch (pull at low priority while no pull is "
+              "running), cancel_prefetch or progress");
+DEFINE_int32(priority, 0,
+             "The priority of the pull, the higher the sooner with the "
+             "priority and fair sched policies");
 
 using namespace hdc::network;
 using namespace hdc::network::tcp;
@@ -65,7 +74,19 @@ private:
       return;
     }
     if (!response.success()) {
-      SPDLOG_ERROR("pull {} fail.", request_.image_name_tag());
+      SPDLOG_ERROR("{} {} fail. {}",
+                   container::RequestType_Name(request_.type()),
+                   request_.image_name_tag(), response.message());
+      conn->shutdown();
+      conn->getLoop()->quit();
+      return;
+    }
+    if (request_.type() == container::PROGRESS) {
+      SPDLOG_INFO("{}: {}/{} layers fetched, {} done",
+                  request_.image_name_tag(), response.fetched_layers(),
+                  response.total_layers(), response.done_layers());
+      conn->shutdown();
+      conn->getLoop()->quit();
       return;
     }
     SPDLOG_INFO("Recv CreateContainerResponse. image: {}, path: {}",
@@ -78,15 +99,25 @@ private:
 
 int main(int argc, char **argv) {
   GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
-  spdlog::set_level(spdlog::level::debug);
-  spdlog::set_pattern("%^[%L][%T.%e]%$[%s:%#] %v");
+  hdc::utils::initLogger("client_cli");
 
-  SPDLOG_DEBUG("start pulling {}:{}", FLAGS_image_name, FLAGS_image_tag);
+  SPDLOG_INFO("start pulling {}:{}", FLAGS_image_name, FLAGS_image_tag);
 
   auto image = ImageNameTag{FLAGS_image_name, FLAGS_image_tag};
 
   auto request = CreateContainerRequest();
   request.set_image_name_tag(image.id());
+  container::RequestType type;
+  auto type_name = FLAGS_request_type;
+  std::transform(type_name.begin(), type_name.end(), type_name.begin(),
+                 ::toupper);
+  if (!container::RequestType_Parse(type_name, &type)) {
+    SPDLOG_ERROR("unknown request_type {}", FLAGS_request_type);
+    spdlog::shutdown();
+    return 1;
+  }
+  request.set_type(type);
+  request.set_priority(FLAGS_priority);
   auto loop = EventLoop();
   auto server_addr =
       InetAddress(FLAGS_command_peer_ip, FLAGS_command_peer_port);
@@ -95,4 +126,5 @@ int main(int argc, char **argv) {
   client.setRequest(std::move(request));
   client.connect();
   loop.loop();
+  spdlog::shutdown();
 }
\ No newline at end of file
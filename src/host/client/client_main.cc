@@ -1,29 +1,49 @@
-#include "doca/common.h"
+#include "doca/engine.h"
 #include <spdlog/common.h>
 #include <thread>
-#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
 #include "network/EventLoop.h"
 #include "network/InetAddress.h"
-#include "network/rdma/RdmaConfig.h"
+#include "network/transport/TransportConfig.h"
+#include <algorithm>
+#include <cstdlib>
 #include <gflags/gflags.h>
 #include <host/client/command_server.h>
 #include <host/client/decompress_server_epoll.h>
 #include <host/client/offload_client_epoll.h>
+#include <memory>
+#include <optional>
 #include <spdlog/spdlog.h>
+#include <utils/affinity.h>
+#include <utils/logging.h>
+#include <utils/sched_queue.h>
+#include <utils/transport_flags.h>
 using hdc::host::client::CommandServer;
 using hdc::host::client::DecompressServerEpoll;
+using hdc::host::client::DpuPeer;
+using hdc::host::client::LayerStore;
+using hdc::host::client::LazyFs;
+using hdc::host::client::MetadataService;
 using hdc::host::client::OffloadClientEpoll;
 using hdc::host::client::OffloadTaskQueue;
+using hdc::host::client::UntarEngine;
+using hdc::host::client::UntarResult;
 using hdc::network::EventLoop;
 using hdc::network::InetAddress;
-using hdc::network::rdma::RdmaConfig;
+using hdc::network::transport::TransportConfig;
 // decompress server
+DEFINE_string(decompress_server_transport, "rdma",
+              "The transport of decompress server: rdma, tcp or shm");
+DEFINE_validator(decompress_server_transport,
+                 &hdc::utils::validateTransportFlag);
+// the flags of a device or an address take one item for each DPU,
+// separated by commas, or one for all
 DEFINE_string(decompress_server_ib_dev_name, "mlx5_0",
-              "The IB device name of decompress engine in host");
+              "The IB device name of decompress engine in host, for each DPU");
 DEFINE_int32(decompress_server_ib_dev_port, 1,
              "The IB device port of decompress engine in host");
 DEFINE_string(decompress_server_listen_ip, "172.24.46.186",
-              "The IP address of host listening for decompress engine");
+              "The IP address of host listening for decompress engine, for "
+              "each DPU");
 DEFINE_int32(decompress_server_listen_port, 9001,
              "The IP port of host listening for decompress engine");
 DEFINE_uint32(
@@ -32,7 +52,7 @@ DEFINE_uint32(
 DEFINE_uint64(decompress_server_rdma_mem_num, 4,
               "The number of RDMA buf for decompress engine");
 DEFINE_string(decompress_server_pci_address, "31:00.0",
-              "The PCI address of host decompress engine");
+              "The PCI address of host decompress engine, for each DPU");
 DEFINE_int32(decompress_server_doca_workq_depth, 16,
              "DOCA workq depth of decompress engine");
 DEFINE_int32(decompress_server_doca_mem_num, 4,
@@ -43,13 +63,26 @@ DEFINE_uint64(decompress_server_untar_num_threads, 3,
               "The number of threads for untar");
 DEFINE_string(decompress_server_untar_file_path, "untar/design",
               "File path prefix to store untar layers");
+DEFINE_string(decompress_server_untar_cpus, "",
+              "The CPUs of the untar threads and of the tar processes they "
+              "start, e.g. 0-3,6, empty for any CPU");
+DEFINE_validator(decompress_server_untar_cpus,
+                 &hdc::utils::validateCpuListFlag);
+DEFINE_bool(decompress_server_numa_local, false,
+            "Create the DOCA and RDMA buffers on the NUMA node of "
+            "--decompress_server_pci_address, and run the threads without "
+            "CPUs on that node");
 // offload client
+DEFINE_string(offload_client_transport, "rdma",
+              "The transport of offload client: rdma, tcp or shm");
+DEFINE_validator(offload_client_transport, &hdc::utils::validateTransportFlag);
 DEFINE_string(offload_client_ib_dev_name, "mlx5_0",
-              "The IB device name of offload client");
+              "The IB device name of offload client, for each DPU");
 DEFINE_int32(offload_client_ib_dev_port, 1,
              "The IB device port of offload client");
 DEFINE_string(offload_client_peer_ip, "172.24.46.86",
-              "The IP address of host listening for offload client");
+              "The IP addresses of the DPUs listening for offload client, "
+              "separated by commas. The layers are spread over the DPUs");
 DEFINE_uint32(offload_client_peer_port, 9003,
               "The IP port of host listening for offload client");
 DEFINE_uint32(offload_client_rdma_mem, 4096,
@@ -58,6 +91,22 @@ DEFINE_uint64(offload_client_rdma_mem_num, 4,
               "The number of RDMA buf for offload client");
 DEFINE_string(offload_client_metadata_path, "data/metadata",
               "image metadata path for offload client");
+DEFINE_uint64(offload_client_layer_store_capacity, 0,
+              "The capacity of the extracted layer store under "
+              "decompress_server_untar_file_path in bytes, 0 means no limit");
+DEFINE_string(offload_client_sched_policy, "fifo",
+              "The order in which the layers waiting for a send buffer are "
+              "offloaded: fifo, srpt (the image with the fewest waiting "
+              "layers first), fair or priority");
+DEFINE_validator(offload_client_sched_policy,
+                 &hdc::utils::validateSchedPolicyFlag);
+DEFINE_string(offload_client_cpus, "",
+              "The CPUs of the thread of the offload client, the decompress "
+              "server and the command server listener, empty for any CPU");
+DEFINE_validator(offload_client_cpus, &hdc::utils::validateCpuListFlag);
+DEFINE_bool(offload_client_lazy_pull, false,
+            "Answer a pull before its layers are fetched and serve the layers "
+            "through a FUSE filesystem that fetches the segments a read needs");
 // command server
 DEFINE_string(command_server_ip, "0.0.0.0",
               "The ip address of command server for listening.");
@@ -66,48 +115,164 @@ DEFINE_int32(command_server_port, 9000,
 DEFINE_int64(command_server_thread_num, 0,
              "The number of I/O thread for handling TCP connection (TCP listen "
              "is in another separate thread).");
+DEFINE_string(command_server_cpus, "",
+              "The CPUs of the I/O threads of command server, empty for any "
+              "CPU");
+DEFINE_validator(command_server_cpus, &hdc::utils::validateCpuListFlag);
+
+/// @brief: The item of a per DPU flag for DPU `i`, nullopt if the flag has
+/// neither one item nor one for each of the `dpu_num` DPUs.
+std::optional<std::string> dpuFlag(const char *flagname,
+                                   const std::string &value, size_t i,
+                                   size_t dpu_num) {
+  auto items = hdc::utils::listFlag(value);
+  if (items.size() != 1 && items.size() != dpu_num) {
+    SPDLOG_ERROR("--{} has {} items for {} DPUs", flagname, items.size(),
+                 dpu_num);
+    return std::nullopt;
+  }
+  return items.size() == 1 ? items[0] : items[i];
+}
+
+/// @brief: The CPUs of a `*_cpus` flag, or with
+/// --decompress_server_numa_local those of the node of the decompress engine
+/// at `pci_address` if it is empty.
+std::vector<int> stageCpus(const std::string &cpus_flag,
+                           const std::string &pci_address) {
+  auto cpus = hdc::utils::cpuListFlag(cpus_flag);
+  if (cpus.empty() && FLAGS_decompress_server_numa_local) {
+    auto node = hdc::utils::pciDeviceNumaNode(pci_address);
+    if (node.has_value()) {
+      cpus = hdc::utils::numaNodeCpus(*node);
+    }
+  }
+  return cpus;
+}
+
 int main(int argc, char **argv) {
-  spdlog::set_level(spdlog::level::debug);
-  spdlog::set_pattern("%^[%L][%T.%e]%$[%s:%#] %v");
   GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+  hdc::utils::initLogger("client_main");
 
   auto loop = EventLoop();
 
-  // offload client
+  // layer store
+  auto layer_store = LayerStore::open(FLAGS_decompress_server_untar_file_path,
+                                      FLAGS_offload_client_layer_store_capacity);
+  if (!layer_store.has_value()) {
+    SPDLOG_ERROR("open layer store error");
+    spdlog::shutdown();
+    return EXIT_FAILURE;
+  }
 
-  RdmaConfig offload_client_rdma_config = {
-      FLAGS_offload_client_ib_dev_name, FLAGS_offload_client_ib_dev_port,
-      FLAGS_offload_client_rdma_mem, FLAGS_offload_client_rdma_mem_num};
-  OffloadClientEpoll offload_client{
-      &loop,
-      InetAddress{FLAGS_offload_client_peer_ip,
-                  static_cast<uint16_t>(FLAGS_offload_client_peer_port)},
-      std::move(offload_client_rdma_config),
-      FLAGS_offload_client_metadata_path};
+  // image metadata
+  MetadataService metadata_service{FLAGS_offload_client_metadata_path};
+  metadata_service.start();
 
-  // decompress server
-  RdmaConfig decompress_server_rdma_config = {
-      FLAGS_decompress_server_ib_dev_name, FLAGS_decompress_server_ib_dev_port,
-      FLAGS_decompress_server_rdma_mem, FLAGS_decompress_server_rdma_mem_num};
-  auto compress_engine = CompressEngine::create(
-      FLAGS_decompress_server_pci_address.data(), DOCA_BUF_EXTENSION_NONE,
-      FLAGS_decompress_server_doca_workq_depth, &loop, 8, FLAGS_decompress_server_doca_mem,
-      FLAGS_decompress_server_doca_mem_num);
+  // lazy pull
+  std::unique_ptr<LazyFs> lazy_fs;
+  if (FLAGS_offload_client_lazy_pull) {
+    lazy_fs =
+        std::make_unique<LazyFs>(FLAGS_decompress_server_untar_file_path);
+  }
 
-  if (!compress_engine.has_value()) {
-    SPDLOG_ERROR("create engine error");
-    return 0;
+  // one offload client session and one decompress server for each DPU
+  auto peer_ips = hdc::utils::listFlag(FLAGS_offload_client_peer_ip);
+  auto dpu_num = peer_ips.size();
+  // the stages below are pinned near the first DPU
+  if (dpu_num == 0 ||
+      std::any_of(peer_ips.begin(), peer_ips.end(),
+                  [](const std::string &ip) { return ip.empty(); })) {
+    SPDLOG_ERROR("offload_client_peer_ip {} lists no DPU or an empty one",
+                 FLAGS_offload_client_peer_ip);
+    spdlog::shutdown();
+    return EXIT_FAILURE;
+  }
+  std::vector<std::string> pci_addresses;
+  std::vector<DpuPeer> dpu_peers;
+  std::vector<InetAddress> listen_addrs;
+  std::vector<TransportConfig> decompress_server_transport_configs;
+  for (size_t i = 0; i < dpu_num; ++i) {
+    auto peer_ip = dpuFlag("offload_client_peer_ip",
+                           FLAGS_offload_client_peer_ip, i, dpu_num);
+    auto offload_ib_dev = dpuFlag("offload_client_ib_dev_name",
+                                  FLAGS_offload_client_ib_dev_name, i, dpu_num);
+    auto listen_ip = dpuFlag("decompress_server_listen_ip",
+                             FLAGS_decompress_server_listen_ip, i, dpu_num);
+    auto decompress_ib_dev =
+        dpuFlag("decompress_server_ib_dev_name",
+                FLAGS_decompress_server_ib_dev_name, i, dpu_num);
+    auto pci_address = dpuFlag("decompress_server_pci_address",
+                               FLAGS_decompress_server_pci_address, i, dpu_num);
+    if (!peer_ip.has_value() || !offload_ib_dev.has_value() ||
+        !listen_ip.has_value() || !decompress_ib_dev.has_value() ||
+        !pci_address.has_value()) {
+      spdlog::shutdown();
+      return EXIT_FAILURE;
+    }
+    dpu_peers.push_back(DpuPeer{
+        InetAddress{*peer_ip,
+                    static_cast<uint16_t>(FLAGS_offload_client_peer_port)},
+        TransportConfig{
+            hdc::utils::transportTypeFlag(FLAGS_offload_client_transport),
+            *offload_ib_dev, FLAGS_offload_client_ib_dev_port,
+            FLAGS_offload_client_rdma_mem, FLAGS_offload_client_rdma_mem_num}});
+    listen_addrs.emplace_back(
+        *listen_ip,
+        static_cast<uint16_t>(FLAGS_decompress_server_listen_port));
+    decompress_server_transport_configs.push_back(TransportConfig{
+        hdc::utils::transportTypeFlag(FLAGS_decompress_server_transport),
+        *decompress_ib_dev, FLAGS_decompress_server_ib_dev_port,
+        FLAGS_decompress_server_rdma_mem,
+        FLAGS_decompress_server_rdma_mem_num});
+    pci_addresses.push_back(std::move(*pci_address));
+  }
+
+  // offload client
+  OffloadClientEpoll offload_client{
+      &loop, std::move(dpu_peers), &metadata_service, &*layer_store,
+      hdc::utils::schedPolicyFlag(FLAGS_offload_client_sched_policy),
+      lazy_fs.get()};
+  if (lazy_fs != nullptr && !lazy_fs->mount()) {
+    SPDLOG_ERROR("mount lazy layers error");
+    spdlog::shutdown();
+    return EXIT_FAILURE;
   }
 
-  DecompressServerEpoll decompress_server{
-      std::move(*compress_engine),
-      //   std::move(*dma_engine),
-      &loop,
-      InetAddress{FLAGS_decompress_server_listen_ip,
-                  static_cast<uint16_t>(FLAGS_decompress_server_listen_port)},
-      std::move(decompress_server_rdma_config),
+  // the segments of all the DPUs are extracted by the same threads
+  UntarEngine untar_engine{
       FLAGS_decompress_server_untar_num_threads,
-      FLAGS_decompress_server_untar_file_path, &offload_client};
+      [&offload_client](UntarResult untar_res) {
+        offload_client.completeTask(std::move(untar_res));
+      },
+      FLAGS_decompress_server_untar_file_path,
+      stageCpus(FLAGS_decompress_server_untar_cpus, pci_addresses[0])};
+
+  // decompress server
+  std::vector<std::unique_ptr<DecompressServerEpoll>> decompress_servers;
+  for (size_t i = 0; i < dpu_num; ++i) {
+    std::optional<CompressEngine> compress_engine;
+    {
+      // the engine fills its buffers as it is created
+      hdc::utils::ScopedPin pin{stageCpus("", pci_addresses[i])};
+      auto engine = CompressEngine::create(
+          pci_addresses[i].data(), DOCA_BUF_EXTENSION_NONE,
+          FLAGS_decompress_server_doca_workq_depth, &loop, 8,
+          FLAGS_decompress_server_doca_mem,
+          FLAGS_decompress_server_doca_mem_num);
+      if (engine.has_value()) {
+        compress_engine = std::move(*engine);
+      }
+    }
+    if (!compress_engine.has_value()) {
+      SPDLOG_ERROR("create engine on {} error", pci_addresses[i]);
+      spdlog::shutdown();
+      return EXIT_FAILURE;
+    }
+    decompress_servers.push_back(std::make_unique<DecompressServerEpoll>(
+        std::move(*compress_engine), &loop, listen_addrs[i],
+        std::move(decompress_server_transport_configs[i]), &untar_engine,
+        lazy_fs.get()));
+  }
 
   // command server
 
@@ -116,9 +281,16 @@ int main(int argc, char **argv) {
 
   auto command_server =
       CommandServer(&loop, command_server_listen_addr,
-                    FLAGS_command_server_thread_num, &offload_client);
+                    FLAGS_command_server_thread_num, &offload_client,
+                    stageCpus(FLAGS_command_server_cpus, pci_addresses[0]));
   command_server.start();
-  decompress_server.start();
+  for (auto &decompress_server : decompress_servers) {
+    decompress_server->start();
+  }
+  // after the other threads are started, so that they do not inherit it
+  hdc::utils::pinThread(
+      stageCpus(FLAGS_offload_client_cpus, pci_addresses[0]));
   offload_client.connect();
   loop.loop();
+  spdlog::shutdown();
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <spdlog/common.h>
 #include <spdlog/spdlog.h>
 #include <utils/MsgFrame.h>
+#include <utils/affinity.h>
 
 using hdc::host::client::CommandServer;
 using hdc::host::client::OffloadTaskQueue;
@@ -17,10 +18,16 @@ using hdc::network::InetAddress;
 namespace hdc::host::client {
 CommandServer::CommandServer(EventLoop *event_loop,
                              const InetAddress &listenAddr, int numThreads,
-                             OffloadClientEpoll* offload_client)
+                             OffloadClientEpoll* offload_client,
+                             std::vector<int> cpus)
     : tcp_server_(event_loop, listenAddr, "ClientCommandServer"),
       offload_client_(offload_client) {
   tcp_server_.setThreadNum(numThreads);
+  // it runs in the loop of the listener without I/O threads
+  if (numThreads > 0) {
+    tcp_server_.setThreadInitCallback(
+        [cpus = std::move(cpus)](EventLoop *) { utils::pinThread(cpus); });
+  }
 
   tcp_server_.setConnectionCallback(
       [this](const TcpConnectionPtr &conn) { this->OnConnection(conn); });
@@ -44,14 +51,31 @@ void CommandServer::OnMessage(const TcpConnectionPtr &conn, Buffer *buffer,
   if (receiveTcpPbMsg(buffer, request) == false) {
     return;
   }
-  SPDLOG_INFO("Recv CreateContainerRequest. image: {}",
-              request.image_name_tag());
-  pullImage(request.image_name_tag(), conn);
+  SPDLOG_INFO("Recv CreateContainerRequest. image: {}, type: {}, "
+              "priority: {}",
+              request.image_name_tag(),
+              container::RequestType_Name(request.type()), request.priority());
+  switch (request.type()) {
+  case container::PULL:
+    pullImage(request.image_name_tag(), conn, request.priority());
+    break;
+  case container::PREFETCH:
+    offload_client_->offload(OffloadElement{request.image_name_tag(), conn,
+                                            true, request.priority()});
+    break;
+  case container::CANCEL_PREFETCH:
+    offload_client_->cancelPrefetch(request.image_name_tag(), conn);
+    break;
+  case container::PROGRESS:
+    offload_client_->queryProgress(request.image_name_tag(), conn);
+    break;
+  }
 }
 
 void CommandServer::pullImage(const std::string &imageNameTag,
-                              const TcpConnectionPtr &conn) {
-  offload_client_->offload(OffloadElement{imageNameTag, conn});
+                              const TcpConnectionPtr &conn, int priority) {
+  offload_client_->offload(
+      OffloadElement{imageNameTag, conn, false, priority});
 }
 
 } // namespace hdc::host::client
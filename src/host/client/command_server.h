@@ -6,6 +6,7 @@
 #include <network/tcp/TcpServer.h>
 #include <optional>
 #include <string>
+#include <vector>
 #include "host/client/metadata.h"
 #include "host/client/offload_client_epoll.h"
 
@@ -22,8 +23,10 @@ public:
   CommandServer(const CommandServer &) = delete;
   CommandServer &operator=(const CommandServer &) = delete;
 
+  /// @brief: The I/O threads run on `cpus`, on any CPU if it is empty.
   CommandServer(EventLoop *event_loop, const InetAddress &listenAddr,
-                int numThreads, OffloadClientEpoll* offload_client);
+                int numThreads, OffloadClientEpoll* offload_client,
+                std::vector<int> cpus = {});
 
   void start() { tcp_server_.start(); }
 
@@ -37,7 +40,8 @@ private:
 
   void OnWriteComplete(const TcpConnectionPtr &conn);
 
-  void pullImage(const std::string &imageNameTag, const TcpConnectionPtr &conn);
+  void pullImage(const std::string &imageNameTag, const TcpConnectionPtr &conn,
+                 int priority);
 
 };
 } // namespace client
@@ -1,55 +1,55 @@
 
 #include "compress.pb.h"
-#include "doca/common.h"
-#include "doca_error.h"
-#include "network/rdma/RdmaServer.h"
+#include "doca/engine.h"
+#include "network/transport/Transport.h"
 #include <cassert>
 #include <cstdint>
+#include <fmt/format.h>
 #include <host/client/decompress_server_epoll.h>
-#include <network/rdma/RdmaConnection.h>
+#include <network/transport/MsgConnection.h>
 #include <spdlog/spdlog.h>
 #include <utils/MsgFrame.h>
 namespace hdc::host::client {
 
 DecompressServerEpoll::DecompressServerEpoll(
     CompressEngine compress_engine,
-    EventLoop *loop, const InetAddress &listen_addr, RdmaConfig rdma_config,
-    size_t untar_num_threads, std::string untar_file_path,
-    OffloadClientEpoll *offload_client) noexcept
+    EventLoop *loop, const InetAddress &listen_addr,
+    TransportConfig transport_config, UntarEngine *untar_engine,
+    LazyFs *lazy_fs) noexcept
     : compress_engine_(std::move(compress_engine)),
-      server_(loop, listen_addr, "DecompressServer", std::move(rdma_config)),
-      untar_engine_(untar_num_threads, offload_client,
-                    std::move(untar_file_path)) {
-  server_.setConnectedCallback(
-      [this](const RdmaConnectionPtr &conn) { this->onConnected(conn); });
-  server_.setRecvSuccessCallback([this](const RdmaConnectionPtr &conn,
-                                        uint8_t *recv_buf, uint32_t recv_len,
-                                        const ibv_wc &wc) {
+      server_(createMsgServer(loop, listen_addr, "DecompressServer",
+                              transport_config)),
+      untar_engine_(untar_engine), lazy_fs_(lazy_fs) {
+  server_->setConnectedCallback(
+      [this](const MsgConnectionPtr &conn) { this->onConnected(conn); });
+  server_->setRecvSuccessCallback([this](const MsgConnectionPtr &conn,
+                                         uint8_t *recv_buf, uint32_t recv_len,
+                                         const Completion &wc) {
     this->onRecvSuccess(conn, recv_buf, recv_len, wc);
   });
-  server_.setRecvFailCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  server_->setRecvFailCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onRecvFail(conn, wc);
       });
-  server_.setSendCompleteSuccessCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  server_->setSendCompleteSuccessCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onSendCompleteSuccess(conn, wc);
       });
-  server_.setSendCompleteFailCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+  server_->setSendCompleteFailCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
         this->onSendCompleteFail(conn, wc);
       });
 }
 
-void DecompressServerEpoll::start() { server_.start(); }
+void DecompressServerEpoll::start() { server_->start(); }
 
-void DecompressServerEpoll::onConnected(const RdmaConnectionPtr &conn) {
+void DecompressServerEpoll::onConnected(const MsgConnectionPtr &conn) {
   SPDLOG_INFO("DecompressServer connected");
 }
 
-void DecompressServerEpoll::onRecvSuccess(const RdmaConnectionPtr &conn,
+void DecompressServerEpoll::onRecvSuccess(const MsgConnectionPtr &conn,
                                           uint8_t *recv_buf, uint32_t recv_len,
-                                          const ibv_wc &wc) {
+                                          const Completion &wc) {
   if (recv_len < sizeof(int)) {
     SPDLOG_ERROR("recv_len < 4");
     return;
@@ -86,36 +86,47 @@ void DecompressServerEpoll::onRecvSuccess(const RdmaConnectionPtr &conn,
 }
 
 bool DecompressServerEpoll::handleMmapInfoRequest(
-    const RdmaConnectionPtr &conn, const compress::MmapInfoRequest &req) {
+    const MsgConnectionPtr &conn, const compress::MmapInfoRequest &req) {
   SPDLOG_INFO("recv MmapInfoRequest");
   assert(compress_engine_.get_bufpair(0).dst_mem.size() == MAX_FILE_SIZE);
-  assert(req.mmap_num() == compress_engine_.bufpair_num());
 
-  // compress engine
-  auto res = compress_engine_.dst_mmaps_start(
-      std::make_optional(DOCA_ACCESS_DPU_READ_WRITE));
-  if (res != DOCA_SUCCESS) {
+  auto resp = compress::MmapInfoResponse();
+  if (req.mmap_num() != static_cast<int>(compress_engine_.bufpair_num())) {
+    // the DPU engines own as many bufpairs as this engine has
+    SPDLOG_ERROR("MmapInfoRequest of {} mmaps, {} bufpairs here",
+                 req.mmap_num(), compress_engine_.bufpair_num());
+    resp.set_error(fmt::format("{} mmaps requested, {} exported",
+                               req.mmap_num(),
+                               compress_engine_.bufpair_num()));
+  } else if (auto res = compress_engine_.dst_mmaps_start(
+                 std::make_optional(DOCA_ACCESS_DPU_READ_WRITE));
+             res != DOCA_SUCCESS) {
     SPDLOG_ERROR("dst buf mmap start error: {}", doca_get_error_string(res));
-    return false;
-  }
-  auto export_descs = compress_engine_.dst_mmaps_export_dpu();
-  if (!export_descs.has_value()) {
+    resp.set_error("dst buf mmap start error");
+  } else if (auto export_descs = compress_engine_.dst_mmaps_export_dpu();
+             !export_descs.has_value()) {
     SPDLOG_ERROR("export dst mmap to DPU error: {}",
                  doca_get_error_string(export_descs.error()));
-  }
-  auto resp = compress::MmapInfoResponse();
-  for (int i = 0, n = export_descs->size(); i < n; ++i) {
-    auto mmap_element = resp.add_mmaps();
-    auto &desc = (*export_descs)[i];
-    auto &bufpair = compress_engine_.get_bufpair(i);
-    mmap_element->set_addr(reinterpret_cast<uint64_t>(bufpair.dst_mem.data()));
-    mmap_element->set_len(bufpair.dst_mem.size());
-    mmap_element->set_export_desc(
-        std::string(reinterpret_cast<const char *>(desc.export_desc),
-                    desc.export_desc_len));
+    resp.set_error("export dst mmap to DPU error");
+  } else {
+    for (int i = 0, n = export_descs->size(); i < n; ++i) {
+      auto mmap_element = resp.add_mmaps();
+      auto &desc = (*export_descs)[i];
+      auto &bufpair = compress_engine_.get_bufpair(i);
+      mmap_element->set_addr(
+          reinterpret_cast<uint64_t>(bufpair.dst_mem.data()));
+      mmap_element->set_len(bufpair.dst_mem.size());
+      mmap_element->set_export_desc(
+          std::string(reinterpret_cast<const char *>(desc.export_desc),
+                      desc.export_desc_len));
+    }
   }
 
   auto free_buf = conn->acquireFreeSendBuf();
+  if (!free_buf.has_value()) {
+    SPDLOG_ERROR("No send buf for MmapInfoResponse");
+    return false;
+  }
   auto send_buf = free_buf->addr;
   auto send_cap = free_buf->cap;
   *reinterpret_cast<int *>(send_buf) = static_cast<int>(MsgType::kMmapInfo);
@@ -123,24 +134,28 @@ bool DecompressServerEpoll::handleMmapInfoRequest(
                                       send_cap - sizeof(MsgType), resp);
   if (frame_len == -1) {
     SPDLOG_ERROR("serialize MmapInfoResponse error");
+    conn->releaseSendBuf(free_buf->id);
     return false;
   }
   SPDLOG_INFO("Send MmapInfoResponse");
   conn->send(send_buf, sizeof(MsgType) + frame_len, wr_id_++);
   conn->releaseSendBuf(free_buf->id);
-  return true;
+  return !resp.has_error();
 }
 
 bool DecompressServerEpoll::handleDecompressFinishRequest(
-    const RdmaConnectionPtr &conn, const compress::DecompressFinishRequest &req,
+    const MsgConnectionPtr &conn, const compress::DecompressFinishRequest &req,
     uint8_t *remain_buf, int remain_len) {
 
-  SPDLOG_INFO("recv DecompressFinishRequest: image {}, layer {} seg {}-{}, "
-              "seg_size {}, bufpair_id {}, data_inline {}",
-              req.image_name_tag(), req.layer_name(), req.segment_idx(),
-              req.total_segments(), req.segment_size(), req.bufpair_id(),
-              req.data_inline());
+  SPDLOG_DEBUG("recv DecompressFinishRequest: image {}, layer {} seg {}-{}, "
+               "seg_size {}, bufpair_id {}, data_inline {}",
+               req.image_name_tag(), req.layer_name(), req.segment_idx(),
+               req.total_segments(), req.segment_size(), req.bufpair_id(),
+               req.data_inline());
   std::vector<uint8_t> data = [&req, this, remain_buf, remain_len]() {
+    if (req.failed()) {
+      return std::vector<uint8_t>();
+    }
     if (req.data_inline()) {
       return std::vector<uint8_t>(remain_buf, remain_buf + remain_len);
 
@@ -162,6 +177,12 @@ bool DecompressServerEpoll::handleDecompressFinishRequest(
   resp.set_bufpair_id(req.bufpair_id());
 
   auto free_buf = conn->acquireFreeSendBuf();
+  if (!free_buf.has_value()) {
+    SPDLOG_ERROR("No send buf for DecompressFinishResponse of segment {} of "
+                 "layer {}",
+                 req.segment_idx(), req.layer_name());
+    return false;
+  }
   auto send_buf = free_buf->addr;
   auto send_cap = free_buf->cap;
   *reinterpret_cast<int *>(send_buf) =
@@ -170,31 +191,44 @@ bool DecompressServerEpoll::handleDecompressFinishRequest(
                                       send_cap - sizeof(MsgType), resp);
   if (frame_len == -1) {
     SPDLOG_ERROR("serialize DecompressFinishResponse error");
+    conn->releaseSendBuf(free_buf->id);
     return false;
   }
-  SPDLOG_INFO("Send DecompressFinishResponse: layer {}, idx {}, success {}, "
-              "bufpair_id {}. wr_id {}",
-              resp.layer_name(), resp.segment_idx(), resp.success(),
-              resp.bufpair_id(), wr_id_);
+  SPDLOG_DEBUG("Send DecompressFinishResponse: layer {}, idx {}, success {}, "
+               "bufpair_id {}. wr_id {}",
+               resp.layer_name(), resp.segment_idx(), resp.success(),
+               resp.bufpair_id(), wr_id_);
 
   conn->send(send_buf, sizeof(MsgType) + frame_len, wr_id_++);
   conn->releaseSendBuf(free_buf->id);
-  untar_engine_.untar(UntarData{req.layer_name(), req.image_name_tag(),
-                                std::move(data), req.segment_idx(),
-                                req.total_segments()});
+  if (lazy_fs_ != nullptr && lazy_fs_->contains(req.layer_name())) {
+    if (req.failed()) {
+      lazy_fs_->failSegment(req.layer_name(), req.segment_idx());
+      return true;
+    }
+    lazy_fs_->putSegment(req.layer_name(), req.segment_idx(),
+                         req.total_segments(), std::move(data), req.codec());
+    return true;
+  }
+  UntarData untar_data{req.layer_name(), req.image_name_tag(),
+                       std::move(data), req.segment_idx(),
+                       req.total_segments(), req.codec()};
+  // the untar task of the layer is aborted and the image fails
+  untar_data.failed_ = req.failed();
+  untar_engine_->untar(std::move(untar_data));
   return true;
 }
 
-void DecompressServerEpoll::onRecvFail(const RdmaConnectionPtr &conn,
-                                       const ibv_wc &wc) {
+void DecompressServerEpoll::onRecvFail(const MsgConnectionPtr &conn,
+                                       const Completion &wc) {
   SPDLOG_ERROR("RDMA recv complete fail. wr_id: {}", wc.wr_id);
 }
 
-void DecompressServerEpoll::onSendCompleteSuccess(const RdmaConnectionPtr &conn,
-                                                  const ibv_wc &wc) {}
+void DecompressServerEpoll::onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                                                  const Completion &wc) {}
 
-void DecompressServerEpoll::onSendCompleteFail(const RdmaConnectionPtr &conn,
-                                               const ibv_wc &wc) {
+void DecompressServerEpoll::onSendCompleteFail(const MsgConnectionPtr &conn,
+                                               const Completion &wc) {
   SPDLOG_ERROR("RDMA send complete fail. wr_id: {}", wc.wr_id);
 }
 } // namespace hdc::host::client
\ No newline at end of file
@@ -1,9 +1,11 @@
 #pragma once
 
 #include "compress.pb.h"
-#include "doca/compress.h"
+#include "doca/engine.h"
+#include "host/client/lazy_fs.h"
+#include "host/client/offload_client_epoll.h"
 #include "host/client/untar_engine.h"
-#include "network/rdma/RdmaServer.h"
+#include "network/transport/Transport.h"
 #include <cstdint>
 namespace hdc {
 namespace host {
@@ -11,17 +13,22 @@ namespace client {
 
 using hdc::network::EventLoop;
 using hdc::network::InetAddress;
-using hdc::network::rdma::RdmaConfig;
-using hdc::network::rdma::RdmaConnectionPtr;
-using hdc::network::rdma::RdmaServer;
+using hdc::network::transport::TransportConfig;
+using hdc::network::transport::Completion;
+using hdc::network::transport::MsgConnectionPtr;
+using hdc::network::transport::createMsgServer;
+using hdc::network::transport::MsgServer;
+/// @brief: Receives the segments of one DPU into `untar_engine`, or into
+/// `lazy_fs` for the lazy layers. The servers of the DPUs of a host share
+/// them, a layer is sent by one DPU.
 class DecompressServerEpoll {
 public:
   DecompressServerEpoll(CompressEngine compress_engine,
                         //  DmaEngine dma_engine,
                         EventLoop *loop, const InetAddress &listen_addr,
-                        RdmaConfig rdma_config, size_t untar_num_threads,
-                        std::string untar_file_path,
-                        OffloadClientEpoll *offload_client) noexcept;
+                        TransportConfig transport_config,
+                        UntarEngine *untar_engine,
+                        LazyFs *lazy_fs = nullptr) noexcept;
 
   DecompressServerEpoll(const DecompressServerEpoll &) = delete;
 
@@ -40,26 +47,29 @@ private:
   };
 
   CompressEngine compress_engine_;
-  RdmaServer server_;
-  UntarEngine untar_engine_;
+  std::unique_ptr<MsgServer> server_;
+  UntarEngine *untar_engine_;
+  // the segments of the lazy layers go here instead of the untar engine
+  LazyFs *lazy_fs_;
   uint64_t wr_id_{0};
 
-  void onConnected(const RdmaConnectionPtr &conn);
+  void onConnected(const MsgConnectionPtr &conn);
 
-  void onRecvSuccess(const RdmaConnectionPtr &conn, uint8_t *recv_buf,
-                     uint32_t recv_len, const ibv_wc &wc);
+  void onRecvSuccess(const MsgConnectionPtr &conn, uint8_t *recv_buf,
+                     uint32_t recv_len, const Completion &wc);
 
-  void onRecvFail(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onRecvFail(const MsgConnectionPtr &conn, const Completion &wc);
 
-  void onSendCompleteSuccess(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                             const Completion &wc);
 
-  void onSendCompleteFail(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onSendCompleteFail(const MsgConnectionPtr &conn, const Completion &wc);
 
-  bool handleMmapInfoRequest(const RdmaConnectionPtr &conn,
+  bool handleMmapInfoRequest(const MsgConnectionPtr &conn,
                              const compress::MmapInfoRequest &req);
 
   bool
-  handleDecompressFinishRequest(const RdmaConnectionPtr &conn,
+  handleDecompressFinishRequest(const MsgConnectionPtr &conn,
                                 const compress::DecompressFinishRequest &req,
                                 uint8_t *remain_buf, int remain_len);
 };
@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <fmt/format.h>
+#include <host/client/layer_store.h>
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <spdlog/spdlog.h>
+
+namespace hdc::host::client {
+namespace fs = std::filesystem;
+namespace {
+// the directories of the store and of LazyFs next to the image directories
+const std::set<std::string> kReservedDirs{"layers", "tmp",      "index",
+                                          "lazy",   "segments", "indexes"};
+} // namespace
+
+std::optional<LayerStore> LayerStore::open(std::string root,
+                                           uint64_t capacity) {
+  std::error_code ec;
+  // the extractions left by the last run are incomplete
+  fs::remove_all(root + "/tmp", ec);
+  fs::create_directories(root + "/tmp", ec);
+  if (!ec) {
+    fs::create_directories(root + "/layers", ec);
+  }
+  if (ec) {
+    SPDLOG_ERROR("Create layer store {} error: {}", root, ec.message());
+    return std::nullopt;
+  }
+
+  leveldb::Options options;
+  options.create_if_missing = true;
+  leveldb::DB *db = nullptr;
+  auto status = leveldb::DB::Open(options, root + "/index", &db);
+  if (!status.ok()) {
+    SPDLOG_ERROR("Open layer store index {} error: {}", root + "/index",
+                 status.ToString());
+    return std::nullopt;
+  }
+  LayerStore store{std::move(root), capacity,
+                   std::unique_ptr<leveldb::DB>(db)};
+  if (!store.load()) {
+    return std::nullopt;
+  }
+  store.loadLinks();
+  store.loadSegments();
+  SPDLOG_INFO("Open layer store {}: {} layers, {} bytes, {} bytes of lazy "
+              "segments",
+              store.root_, store.entries_.size(), store.bytes_,
+              store.segment_bytes_);
+  store.evict();
+  return store;
+}
+
+LayerStore::LayerStore(std::string root, uint64_t capacity,
+                       std::unique_ptr<leveldb::DB> db)
+    : root_(std::move(root)), capacity_(capacity), db_(std::move(db)) {}
+
+LayerStore::LayerStore(LayerStore &&) = default;
+
+LayerStore &LayerStore::operator=(LayerStore &&) = default;
+
+LayerStore::~LayerStore() {
+  // moved from
+  if (db_ != nullptr) {
+    flush();
+  }
+}
+
+bool LayerStore::load() {
+  std::unique_ptr<leveldb::Iterator> it(
+      db_->NewIterator(leveldb::ReadOptions()));
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    auto layer = it->key().ToString();
+    auto value = it->value().ToString();
+    Entry entry;
+    if (std::sscanf(value.c_str(), "%" SCNu64 " %" SCNu64, &entry.bytes,
+                    &entry.last_use) != 2 ||
+        !fs::is_directory(layerPath(layer))) {
+      SPDLOG_WARN("Drop layer {} from the layer store index", layer);
+      db_->Delete(leveldb::WriteOptions(), layer);
+      continue;
+    }
+    entries_.emplace(layer, entry);
+    lru_.emplace(entry.last_use, layer);
+    bytes_ += entry.bytes;
+    use_seq_ = std::max(use_seq_, entry.last_use);
+  }
+  if (!it->status().ok()) {
+    SPDLOG_ERROR("Read layer store index error: {}", it->status().ToString());
+    return false;
+  }
+
+  // a crash between the rename and the index update leaves a layer that is
+  // not in the index
+  std::error_code ec;
+  for (auto &dir : fs::directory_iterator(root_ + "/layers", ec)) {
+    auto layer = dir.path().filename().string();
+    if (entries_.count(layer) == 0) {
+      SPDLOG_WARN("Remove layer {} missing in the layer store index", layer);
+      fs::remove_all(dir.path(), ec);
+    }
+  }
+  return true;
+}
+
+void LayerStore::loadLinks() {
+  std::error_code ec;
+  for (auto &image_dir : fs::directory_iterator(root_, ec)) {
+    auto image = image_dir.path().filename().string();
+    if (kReservedDirs.count(image) != 0 || !image_dir.is_directory(ec)) {
+      continue;
+    }
+    for (auto &link : fs::directory_iterator(image_dir.path(), ec)) {
+      if (link.is_symlink(ec)) {
+        links_[link.path().filename().string()].insert(image);
+      }
+    }
+  }
+}
+
+void LayerStore::loadSegments() {
+  std::error_code ec;
+  for (auto &layer_dir : fs::directory_iterator(root_ + "/segments", ec)) {
+    if (!layer_dir.is_directory(ec)) {
+      continue;
+    }
+    uint64_t bytes = 0;
+    for (auto &segment : fs::directory_iterator(layer_dir.path(), ec)) {
+      auto size = segment.file_size(ec);
+      if (!ec) {
+        bytes += size;
+      }
+    }
+    segments_[layer_dir.path().filename().string()] = bytes;
+    segment_bytes_ += bytes;
+  }
+}
+
+void LayerStore::addSegmentBytes(const std::string &layer, int64_t bytes) {
+  auto &layer_bytes = segments_[layer];
+  // a removal races with a write of the layer
+  auto delta = std::max<int64_t>(bytes, -static_cast<int64_t>(layer_bytes));
+  layer_bytes += delta;
+  segment_bytes_ += delta;
+  if (delta > 0) {
+    evict();
+  }
+}
+
+void LayerStore::evictSegments() {
+  for (auto it = segments_.begin();
+       bytes_ + segment_bytes_ > capacity_ && it != segments_.end();) {
+    auto &[layer, bytes] = *it;
+    auto linked = links_.find(layer);
+    if (pins_.count(layer) != 0 ||
+        (linked != links_.end() && !linked->second.empty())) {
+      ++it;
+      continue;
+    }
+    bool removed = true;
+    if (remove_segments_cb_) {
+      removed = remove_segments_cb_(layer);
+    } else {
+      std::error_code ec;
+      fs::remove_all(root_ + "/segments/" + layer, ec);
+    }
+    if (!removed) {
+      ++it;
+      continue;
+    }
+    SPDLOG_INFO("Evict the {} bytes of lazy segments of layer {}", bytes,
+                layer);
+    segment_bytes_ -= bytes;
+    it = segments_.erase(it);
+  }
+}
+
+void LayerStore::addLink(const std::string &image, const std::string &layer) {
+  links_[layer].insert(image);
+}
+
+void LayerStore::removeLinkingImages(const std::string &layer) {
+  auto it = links_.find(layer);
+  if (it == links_.end()) {
+    return;
+  }
+  auto images = std::move(it->second);
+  links_.erase(it);
+  for (auto &image : images) {
+    SPDLOG_INFO("Remove image {} linking to evicted layer {}", image, layer);
+    std::error_code ec;
+    fs::remove_all(fs::path(root_) / image, ec);
+    for (auto &[other, linking] : links_) {
+      linking.erase(image);
+    }
+  }
+}
+
+bool LayerStore::putEntry(const std::string &layer, const Entry &entry) {
+  auto status = db_->Put(leveldb::WriteOptions(), layer,
+                         fmt::format("{} {}", entry.bytes, entry.last_use));
+  if (!status.ok()) {
+    SPDLOG_ERROR("Write layer store index of {} error: {}", layer,
+                 status.ToString());
+    return false;
+  }
+  return true;
+}
+
+void LayerStore::touch(const std::string &layer) {
+  auto it = entries_.find(layer);
+  if (it == entries_.end()) {
+    return;
+  }
+  auto &entry = it->second;
+  lru_.erase({entry.last_use, layer});
+  entry.last_use = ++use_seq_;
+  lru_.emplace(entry.last_use, layer);
+  dirty_.insert(layer);
+}
+
+void LayerStore::flush() {
+  if (dirty_.empty()) {
+    return;
+  }
+  leveldb::WriteBatch batch;
+  for (auto &layer : dirty_) {
+    auto it = entries_.find(layer);
+    if (it != entries_.end()) {
+      batch.Put(layer, fmt::format("{} {}", it->second.bytes,
+                                   it->second.last_use));
+    }
+  }
+  auto status = db_->Write(leveldb::WriteOptions(), &batch);
+  if (!status.ok()) {
+    SPDLOG_ERROR("Write layer store index of {} layers error: {}",
+                 dirty_.size(), status.ToString());
+    return;
+  }
+  dirty_.clear();
+}
+
+void LayerStore::pin(const std::string &layer) { pins_[layer]++; }
+
+void LayerStore::unpin(const std::string &layer) {
+  auto it = pins_.find(layer);
+  if (it != pins_.end() && --it->second == 0) {
+    pins_.erase(it);
+  }
+}
+
+bool LayerStore::publish(const std::string &layer, uint64_t bytes) {
+  std::error_code ec;
+  auto path = layerPath(layer);
+  if (entries_.count(layer) != 0) {
+    SPDLOG_WARN("Layer {} is already in the layer store", layer);
+    discard(layer);
+    touch(layer);
+    return true;
+  }
+  fs::remove_all(path, ec);
+  fs::rename(stagingPath(root_, layer), path, ec);
+  if (ec) {
+    SPDLOG_ERROR("Publish layer {} error: {}", layer, ec.message());
+    discard(layer);
+    return false;
+  }
+  Entry entry{bytes, ++use_seq_};
+  if (!putEntry(layer, entry)) {
+    fs::remove_all(path, ec);
+    return false;
+  }
+  entries_.emplace(layer, entry);
+  lru_.emplace(entry.last_use, layer);
+  bytes_ += bytes;
+  SPDLOG_DEBUG("Publish layer {}, {} bytes. layer store {} bytes", layer,
+               bytes, bytes_);
+  evict();
+  return true;
+}
+
+void LayerStore::discard(const std::string &layer) {
+  std::error_code ec;
+  fs::remove_all(stagingPath(root_, layer), ec);
+}
+
+void LayerStore::evict() {
+  if (capacity_ == 0) {
+    return;
+  }
+  // fetched again on a read, cheaper than a layer pulled again
+  evictSegments();
+  auto it = lru_.begin();
+  while (bytes_ + segment_bytes_ > capacity_ && it != lru_.end()) {
+    auto &layer = it->second;
+    if (pins_.count(layer) != 0) {
+      ++it;
+      continue;
+    }
+    SPDLOG_INFO("Evict layer {} from the layer store", layer);
+    db_->Delete(leveldb::WriteOptions(), layer);
+    dirty_.erase(layer);
+    // an image without one of its layers is incomplete
+    removeLinkingImages(layer);
+    std::error_code ec;
+    fs::remove_all(layerPath(layer), ec);
+    auto entry = entries_.find(layer);
+    bytes_ -= entry->second.bytes;
+    entries_.erase(entry);
+    it = lru_.erase(it);
+  }
+}
+
+} // namespace hdc::host::client
@@ -0,0 +1,155 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+
+namespace leveldb {
+class DB;
+} // namespace leveldb
+
+namespace hdc {
+namespace host {
+namespace client {
+
+/// @brief: The content-addressed store of the extracted layers on the host.
+/// Its layout under `root` is:
+///
+///   layers/<digest>   the extracted layers, shared by all images
+///   tmp/<digest>      the layers being extracted by UntarEngine
+///   index/            a LevelDB of digest -> "<bytes> <last use>"
+///   <image>/<digest>  a symlink to ../layers/<digest> per layer of an image
+///   segments/<digest> the segments of a lazy layer, written by LazyFs
+///
+/// A layer is extracted into tmp/ and published into layers/ by a rename, so
+/// layers/ only holds complete layers, also after a crash. When the layers
+/// exceed the capacity, the least recently used ones that are not pinned are
+/// evicted, with the image directories linking to them, which a later pull
+/// links again. The segments of the lazy layers count to the capacity too,
+/// and those of the lazy layers no image links to and no pull pins are
+/// removed first. The last uses are kept in memory and written to the index
+/// by flush(). Not thread safe, it is used in the loop of OffloadClientEpoll.
+class LayerStore {
+public:
+  /// @brief: Open the store in `root` and create it if missing. `capacity` is
+  /// in bytes of the layer tar streams, 0 means no limit.
+  static std::optional<LayerStore> open(std::string root, uint64_t capacity);
+
+  /// @brief: The directory UntarEngine extracts `layer` into.
+  static std::string stagingPath(const std::string &root,
+                                 const std::string &layer) {
+    return root + "/tmp/" + layer;
+  }
+
+  LayerStore(LayerStore &&);
+
+  LayerStore &operator=(LayerStore &&);
+
+  ~LayerStore();
+
+  const std::string &root() const { return root_; }
+
+  std::string layerPath(const std::string &layer) const {
+    return root_ + "/layers/" + layer;
+  }
+
+  bool contains(const std::string &layer) const {
+    return entries_.count(layer) != 0;
+  }
+
+  /// @brief: Mark the layer as used now, in memory until the next flush().
+  void touch(const std::string &layer);
+
+  /// @brief: Write the last uses marked since the last flush to the index in
+  /// one batch.
+  void flush();
+
+  /// @brief: Record that <image>/<layer> links to the layer.
+  void addLink(const std::string &image, const std::string &layer);
+
+  /// @brief: Removes the segments of a lazy layer, false if they are in use.
+  using RemoveSegmentsCallback = std::function<bool(const std::string &)>;
+
+  /// @brief: Segments are removed by `cb` from now on, by removing
+  /// segments/<digest> before.
+  void setRemoveSegmentsCallback(RemoveSegmentsCallback cb) {
+    remove_segments_cb_ = std::move(cb);
+  }
+
+  /// @brief: segments/<layer> grew by `bytes`.
+  void addSegmentBytes(const std::string &layer, int64_t bytes);
+
+  /// @brief: The bytes of the segments of the lazy layers.
+  uint64_t segmentBytes() const { return segment_bytes_; }
+
+  /// @brief: A pinned layer is never evicted. Pins are counted and need not
+  /// refer to a present layer.
+  void pin(const std::string &layer);
+
+  void unpin(const std::string &layer);
+
+  /// @brief: Move the extracted layer from tmp/ into layers/ and record it.
+  /// `bytes` is the size of its tar stream.
+  bool publish(const std::string &layer, uint64_t bytes);
+
+  /// @brief: Remove what is left in tmp/ by a failed extraction.
+  void discard(const std::string &layer);
+
+  uint64_t bytes() const { return bytes_; }
+
+  size_t size() const { return entries_.size(); }
+
+private:
+  struct Entry {
+    uint64_t bytes{0};
+    uint64_t last_use{0};
+  };
+
+  LayerStore(std::string root, uint64_t capacity,
+             std::unique_ptr<leveldb::DB> db);
+
+  bool load();
+
+  /// @brief: Rebuild links_ from the image directories.
+  void loadLinks();
+
+  /// @brief: Count the segments of the lazy layers under segments/.
+  void loadSegments();
+
+  /// @brief: Remove the segments of the lazy layers that are neither linked
+  /// nor pinned while the store exceeds the capacity.
+  void evictSegments();
+
+  /// @brief: Remove the directories of the images linking to the layer.
+  void removeLinkingImages(const std::string &layer);
+
+  bool putEntry(const std::string &layer, const Entry &entry);
+
+  void evict();
+
+  std::string root_;
+  uint64_t capacity_;
+  std::unique_ptr<leveldb::DB> db_;
+  std::map<std::string, Entry> entries_;
+  // (last_use, layer), the least recently used first
+  std::set<std::pair<uint64_t, std::string>> lru_;
+  std::map<std::string, int> pins_;
+  // layer -> the images linking to it
+  std::map<std::string, std::set<std::string>> links_;
+  // the layers touched since the last flush
+  std::set<std::string> dirty_;
+  // lazy layer -> the bytes of its segments
+  std::map<std::string, uint64_t> segments_;
+  uint64_t segment_bytes_{0};
+  RemoveSegmentsCallback remove_segments_cb_;
+  uint64_t bytes_{0};
+  uint64_t use_seq_{0};
+};
+
+} // namespace client
+} // namespace host
+} // namespace hdc
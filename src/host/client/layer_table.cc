@@ -0,0 +1,37 @@
+#include <cassert>
+#include <host/client/layer_table.h>
+#include <spdlog/spdlog.h>
+
+namespace hdc::host::client {
+
+void LayerTable::startPull(const std::string &layer,
+                           const ImageNameTag &image) {
+  assert(!inflight(layer));
+  layers_[layer].owner = image;
+}
+
+void LayerTable::addWaiter(const std::string &layer,
+                           const ImageNameTag &image) {
+  auto it = layers_.find(layer);
+  assert(it != layers_.end());
+  it->second.waiters.emplace_back(image);
+}
+
+std::vector<ImageNameTag> LayerTable::complete(const std::string &layer) {
+  auto it = layers_.find(layer);
+  if (it == layers_.end()) {
+    SPDLOG_ERROR("Layer {} completes but it is not in flight", layer);
+    return {};
+  }
+  auto &info = it->second;
+  std::vector<ImageNameTag> images;
+  images.reserve(info.waiters.size() + 1);
+  images.emplace_back(info.owner);
+  for (auto &waiter : info.waiters) {
+    images.emplace_back(std::move(waiter));
+  }
+  layers_.erase(it);
+  return images;
+}
+
+} // namespace hdc::host::client
@@ -0,0 +1,47 @@
+#pragma once
+#include <host/client/metadata.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace hdc {
+namespace host {
+namespace client {
+
+/// @brief: The layers being pulled by the host, shared by all images. A layer
+/// is fetched, decompressed and extracted only once: the first image that
+/// needs it owns the pull and the other images wait for it while it is in
+/// flight. Once extracted, a layer is present in the LayerStore and leaves
+/// the table. Not thread safe, it is used in the loop of OffloadClientEpoll.
+class LayerTable {
+public:
+  bool inflight(const std::string &layer) const {
+    return layers_.count(layer) != 0;
+  }
+
+  /// @brief: Mark an absent layer in flight on behalf of `image`.
+  void startPull(const std::string &layer, const ImageNameTag &image);
+
+  /// @brief: Attach `image` to an in-flight layer.
+  void addWaiter(const std::string &layer, const ImageNameTag &image);
+
+  /// @brief: The in-flight layer is extracted or failed and leaves the table,
+  /// so that a later pull of a failed layer retries it. Return the images
+  /// that wait for it, the owner first.
+  std::vector<ImageNameTag> complete(const std::string &layer);
+
+  size_t size() const { return layers_.size(); }
+
+private:
+  struct LayerInfo {
+    ImageNameTag owner;
+    // the images other than the owner waiting for the in-flight layer
+    std::vector<ImageNameTag> waiters;
+  };
+
+  std::map<std::string, LayerInfo> layers_;
+};
+
+} // namespace client
+} // namespace host
+} // namespace hdc
@@ -0,0 +1,687 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <host/client/lazy_fs.h>
+#include <spdlog/spdlog.h>
+#include <sys/mount.h>
+#include <unistd.h>
+#include <utils/codec.h>
+#include <utils/crc32.h>
+#ifdef POBY_LAZY_PULL
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#endif
+
+namespace hdc::host::client {
+namespace fs = std::filesystem;
+
+namespace {
+// a read that waits longer for its segments fails
+constexpr auto kWaitTimeout = std::chrono::minutes(2);
+
+mode_t typeBits(int type) {
+  switch (type) {
+  case '2':
+    return S_IFLNK;
+  case '3':
+    return S_IFCHR;
+  case '4':
+    return S_IFBLK;
+  case '5':
+    return S_IFDIR;
+  case '6':
+    return S_IFIFO;
+  default:
+    return S_IFREG;
+  }
+}
+
+std::string parentOf(const std::string &path) {
+  auto slash = path.rfind('/');
+  return slash == std::string::npos ? "" : path.substr(0, slash);
+}
+
+std::string nameOf(const std::string &path) {
+  auto slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+} // namespace
+
+LazyFs::LazyFs(std::string root) : root_(std::move(root)) {}
+
+LazyFs::~LazyFs() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  // the reads waiting for a segment fail
+  cond_.notify_all();
+#ifdef POBY_LAZY_PULL
+  if (fuse_ != nullptr) {
+    fuse_exit(fuse_);
+    fuse_unmount(fuse_);
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    fuse_destroy(fuse_);
+  }
+#endif
+  writer_.join();
+}
+
+std::string LazyFs::segmentPath(const std::string &layer, int index) const {
+  return root_ + "/segments/" + layer + "/" + std::to_string(index);
+}
+
+std::string LazyFs::indexPath(const std::string &layer) const {
+  return root_ + "/indexes/" + layer;
+}
+
+bool LazyFs::contains(const std::string &layer) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return layers_.count(layer) != 0;
+}
+
+void LazyFs::addEntry(Layer &layer, int i) {
+  // a later entry of the same path replaces the former one
+  auto &entry = layer.index.entries(i);
+  layer.paths[entry.path()] = i;
+  // tar may omit the entries of the parent directories
+  std::string path = entry.path();
+  while (!path.empty()) {
+    auto parent = parentOf(path);
+    if (!layer.children[parent].insert(nameOf(path)).second) {
+      break;
+    }
+    path = std::move(parent);
+  }
+}
+
+bool LazyFs::addLayer(const std::string &layer, const std::string &image) {
+  // the index and the segments are read before the lock is taken
+  std::optional<layer_index::LayerIndex> index;
+  std::vector<bool> present;
+  std::error_code ec;
+  std::ifstream in(indexPath(layer), std::ios::binary);
+  if (in.is_open()) {
+    index.emplace();
+    if (!index->ParseFromIstream(&in)) {
+      SPDLOG_ERROR("Parse the index of layer {} error", layer);
+      index.reset();
+    }
+  }
+  if (index.has_value()) {
+    for (int i = 0; i < index->segment_sizes_size(); ++i) {
+      auto size = fs::file_size(segmentPath(layer, i), ec);
+      present.push_back(!ec && size == index->segment_sizes(i));
+    }
+  }
+  fs::create_directories(root_ + "/segments/" + layer, ec);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto [it, inserted] = layers_.try_emplace(layer);
+  if (!inserted) {
+    return false;
+  }
+  auto &l = it->second;
+  l.digest = layer;
+  l.image = image;
+  if (!index.has_value()) {
+    SPDLOG_INFO("Lazy layer {} has no index, stream it", layer);
+    l.indexer = std::make_unique<TarIndexer>(
+        [&l](const layer_index::FileEntry &entry) {
+          *l.index.add_entries() = entry;
+          addEntry(l, l.index.entries_size() - 1);
+        });
+    return true;
+  }
+  l.index = std::move(*index);
+  for (int i = 0; i < l.index.entries_size(); ++i) {
+    addEntry(l, i);
+  }
+  for (auto size : l.index.segment_sizes()) {
+    l.offsets.push_back(l.offsets.back() + size);
+  }
+  l.present = std::move(present);
+  l.indexed = true;
+  SPDLOG_INFO("Lazy layer {}: {} entries, {} of {} segments present", layer,
+              l.index.entries_size(),
+              std::count(l.present.begin(), l.present.end(), true),
+              l.present.size());
+  return false;
+}
+
+void LazyFs::putSegment(std::string layer, int index, int total_segments,
+                        std::vector<uint8_t> data, content::Codec codec) {
+  writer_.add([this, layer = std::move(layer), index, total_segments, codec,
+               data = std::move(data)]() mutable {
+    if (!utils::softDecompress(codec, data)) {
+      SPDLOG_ERROR("Decompress {} segment {} of lazy layer {} error",
+                   utils::codecName(codec), index, layer);
+      markCorrupt(layer, index);
+      return;
+    }
+    writeSegment(layer, index, total_segments, data);
+  });
+}
+
+void LazyFs::failSegment(std::string layer, int index) {
+  writer_.add([this, layer = std::move(layer), index]() {
+    SPDLOG_ERROR("Segment {} of lazy layer {} failed on the DPU", index,
+                 layer);
+    markCorrupt(layer, index);
+  });
+}
+
+bool LazyFs::removeSegments(const std::string &layer) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = layers_.find(layer);
+  if (it != layers_.end() && !it->second.indexed) {
+    return false;
+  }
+  std::error_code ec;
+  fs::remove_all(root_ + "/segments/" + layer, ec);
+  if (it != layers_.end()) {
+    auto &present = it->second.present;
+    present.assign(present.size(), false);
+    fs::create_directories(root_ + "/segments/" + layer, ec);
+  }
+  return true;
+}
+
+void LazyFs::markCorrupt(const std::string &layer, int index) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = layers_.find(layer);
+  if (it == layers_.end()) {
+    return;
+  }
+  // a streamed layer cannot go on without it
+  auto &l = it->second;
+  l.requested.erase(index);
+  l.corrupt.insert(index);
+  if (!l.indexed) {
+    l.failed = true;
+  }
+  cond_.notify_all();
+}
+
+void LazyFs::writeSegment(const std::string &layer, int index,
+                          int total_segments,
+                          const std::vector<uint8_t> &data) {
+  const auto crc = utils::crc32(data.data(), data.size());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = layers_.find(layer);
+    if (it == layers_.end()) {
+      return;
+    }
+    auto &l = it->second;
+    if (l.indexed && index < l.index.segment_crcs_size() &&
+        l.index.segment_crcs(index) != crc) {
+      // the reads of it fail and the next one fetches it again
+      SPDLOG_ERROR("Segment {} of lazy layer {} has CRC {:08x}, expect {:08x}",
+                   index, layer, crc, l.index.segment_crcs(index));
+      l.requested.erase(index);
+      l.corrupt.insert(index);
+      cond_.notify_all();
+      return;
+    }
+  }
+  auto path = segmentPath(layer, index);
+  // a segment file is complete once it has its name
+  auto tmp_path = path + ".tmp";
+  bool written = false;
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    written = out.good();
+  }
+  std::error_code ec;
+  // a segment fetched again replaces the corrupt one
+  auto old_size = fs::file_size(path, ec);
+  if (ec) {
+    old_size = 0;
+  }
+  if (written) {
+    fs::rename(tmp_path, path, ec);
+    written = !ec;
+  }
+  if (!written) {
+    SPDLOG_ERROR("Write segment {} of lazy layer {} error", index, layer);
+  } else if (store_cb_) {
+    store_cb_(layer, static_cast<int64_t>(data.size()) -
+                         static_cast<int64_t>(old_size));
+  }
+
+  std::optional<layer_index::LayerIndex> finished;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = layers_.find(layer);
+    if (it == layers_.end()) {
+      return;
+    }
+    auto &l = it->second;
+    if (!written) {
+      l.failed = true;
+    } else {
+      if (l.present.size() < static_cast<size_t>(total_segments)) {
+        l.present.resize(total_segments, false);
+      }
+      l.present[index] = true;
+      l.requested.erase(index);
+      l.corrupt.erase(index);
+    }
+    if (written && !l.indexed) {
+      // a streamed layer comes in order
+      if (static_cast<size_t>(index) + 1 != l.offsets.size()) {
+        SPDLOG_ERROR("Lazy layer {} expects segment {}, got {}", layer,
+                     l.offsets.size() - 1, index);
+        l.failed = true;
+      } else {
+        l.indexer->feed(data.data(), data.size());
+        l.offsets.push_back(l.offsets.back() + data.size());
+        l.index.add_segment_sizes(data.size());
+        l.index.add_segment_crcs(crc);
+        if (l.indexer->failed()) {
+          l.failed = true;
+        } else if (index + 1 == total_segments) {
+          l.indexed = true;
+          l.indexer.reset();
+          locateEntries(l.index);
+          finished = l.index;
+        }
+      }
+    }
+  }
+  cond_.notify_all();
+
+  if (finished.has_value()) {
+    SPDLOG_INFO("Lazy layer {} streamed, {} entries", layer,
+                finished->entries_size());
+    fs::create_directories(root_ + "/indexes", ec);
+    auto index_path = indexPath(layer);
+    {
+      std::ofstream out(index_path + ".tmp", std::ios::binary);
+      written = finished->SerializeToOstream(&out);
+    }
+    if (written) {
+      fs::rename(index_path + ".tmp", index_path, ec);
+    }
+    if (!written || ec) {
+      SPDLOG_ERROR("Save the index of lazy layer {} error", layer);
+    }
+  }
+}
+
+bool LazyFs::wait(std::unique_lock<std::mutex> &lock,
+                  const std::function<bool()> &pred) {
+  return cond_.wait_for(lock, kWaitTimeout,
+                        [&]() { return stopping_ || pred(); }) &&
+         !stopping_;
+}
+
+LazyFs::Layer *LazyFs::resolve(const std::string &path, std::string &rest) {
+  // "/<digest>/<rest>"
+  auto begin = path.find_first_not_of('/');
+  if (begin == std::string::npos) {
+    return nullptr;
+  }
+  auto slash = path.find('/', begin);
+  auto layer = path.substr(begin, slash == std::string::npos
+                                      ? std::string::npos
+                                      : slash - begin);
+  rest = slash == std::string::npos ? "" : path.substr(slash + 1);
+  auto it = layers_.find(layer);
+  return it == layers_.end() ? nullptr : &it->second;
+}
+
+int LazyFs::lookup(std::unique_lock<std::mutex> &lock, Layer &layer,
+                   const std::string &rest) {
+  if (rest.empty()) {
+    return -1;
+  }
+  // a name not seen yet may come later in the stream
+  if (!wait(lock, [&]() {
+        return layer.indexed || layer.failed || layer.paths.count(rest) != 0;
+      })) {
+    return -EIO;
+  }
+  auto it = layer.paths.find(rest);
+  if (it == layer.paths.end()) {
+    if (layer.children.count(rest) != 0) {
+      return -1;
+    }
+    return layer.failed ? -EIO : -ENOENT;
+  }
+  auto &entry = layer.index.entries(it->second);
+  if (entry.type() == '1') {
+    // a hard link shares the data of its target, which comes before it
+    auto target = layer.paths.find(entry.link());
+    if (target == layer.paths.end()) {
+      return -ENOENT;
+    }
+    return target->second;
+  }
+  return it->second;
+}
+
+int LazyFs::getattr(const std::string &path, struct stat *st) {
+  memset(st, 0, sizeof(*st));
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::string rest;
+  auto *layer = resolve(path, rest);
+  if (layer == nullptr) {
+    if (path.find_first_not_of('/') != std::string::npos) {
+      return -ENOENT;
+    }
+    st->st_mode = S_IFDIR | 0755;
+    st->st_nlink = 2;
+    return 0;
+  }
+  int i = lookup(lock, *layer, rest);
+  if (i < -1) {
+    return i;
+  }
+  if (i == -1) {
+    st->st_mode = S_IFDIR | 0755;
+    st->st_nlink = 2;
+    return 0;
+  }
+  auto &entry = layer->index.entries(i);
+  st->st_mode = typeBits(entry.type()) | (entry.mode() & 07777);
+  st->st_nlink = entry.type() == '5' ? 2 : 1;
+  st->st_size = entry.type() == '2' ? entry.link().size() : entry.size();
+  st->st_uid = entry.uid();
+  st->st_gid = entry.gid();
+  st->st_mtime = entry.mtime();
+  st->st_rdev = entry.rdev();
+  st->st_blocks = (st->st_size + 511) / 512;
+  return 0;
+}
+
+int LazyFs::readdir(const std::string &path, std::vector<std::string> &names) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::string rest;
+  auto *layer = resolve(path, rest);
+  if (layer == nullptr) {
+    if (path.find_first_not_of('/') != std::string::npos) {
+      return -ENOENT;
+    }
+    for (auto &[digest, l] : layers_) {
+      names.emplace_back(digest);
+    }
+    return 0;
+  }
+  // a listing is complete only once the layer is indexed
+  if (!wait(lock, [&]() { return layer->indexed || layer->failed; })) {
+    return -EIO;
+  }
+  auto it = layer->children.find(rest);
+  if (it == layer->children.end()) {
+    return layer->paths.count(rest) != 0 ? -ENOTDIR : -ENOENT;
+  }
+  names.assign(it->second.begin(), it->second.end());
+  return 0;
+}
+
+int LazyFs::readlink(const std::string &path, std::string &target) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::string rest;
+  auto *layer = resolve(path, rest);
+  if (layer == nullptr) {
+    return -EINVAL;
+  }
+  int i = lookup(lock, *layer, rest);
+  if (i < 0 || layer->index.entries(i).type() != '2') {
+    return i < -1 ? i : -EINVAL;
+  }
+  target = layer->index.entries(i).link();
+  return 0;
+}
+
+int LazyFs::open(const std::string &path) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::string rest;
+  auto *layer = resolve(path, rest);
+  if (layer == nullptr) {
+    return -EISDIR;
+  }
+  int i = lookup(lock, *layer, rest);
+  if (i < -1) {
+    return i;
+  }
+  if (i == -1 || layer->index.entries(i).type() == '5') {
+    return -EISDIR;
+  }
+  return 0;
+}
+
+int LazyFs::read(const std::string &path, char *buf, size_t size,
+                 off_t offset) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::string rest;
+  auto *layer = resolve(path, rest);
+  if (layer == nullptr) {
+    return -EISDIR;
+  }
+  int i = lookup(lock, *layer, rest);
+  if (i < 0) {
+    return i < -1 ? i : -EISDIR;
+  }
+  auto &entry = layer->index.entries(i);
+  if (offset < 0 || static_cast<uint64_t>(offset) >= entry.size() ||
+      size == 0) {
+    return 0;
+  }
+  size = std::min<uint64_t>(size, entry.size() - offset);
+  const uint64_t begin = entry.offset() + offset;
+  const uint64_t end = begin + size;
+  auto &offsets = layer->offsets;
+  auto segmentOf = [&offsets](uint64_t pos) {
+    return static_cast<int>(
+        std::upper_bound(offsets.begin(), offsets.end(), pos) -
+        offsets.begin() - 1);
+  };
+
+  if (!layer->indexed) {
+    // a streamed layer gets its segments in order
+    if (!wait(lock, [&]() {
+          return layer->indexed || layer->failed || offsets.back() >= end;
+        })) {
+      return -EIO;
+    }
+    if (layer->failed) {
+      return -EIO;
+    }
+  }
+  const int first = segmentOf(begin);
+  const int last = segmentOf(end - 1);
+  auto present = [&]() {
+    for (int s = first; s <= last; ++s) {
+      if (!layer->present[s]) {
+        return false;
+      }
+    }
+    return true;
+  };
+  auto corrupt = [&]() {
+    auto it = layer->corrupt.lower_bound(first);
+    return it != layer->corrupt.end() && *it <= last;
+  };
+  if (!present()) {
+    std::vector<int> missing;
+    for (int s = first; s <= last; ++s) {
+      if (!layer->present[s] && layer->requested.insert(s).second) {
+        missing.push_back(s);
+      }
+    }
+    if (!missing.empty() && fetch_cb_) {
+      SPDLOG_DEBUG("Lazy layer {}: read of {} fetches {} segments from {}",
+                   layer->digest, rest, missing.size(), missing.front());
+      lock.unlock();
+      fetch_cb_(layer->image, layer->digest, std::move(missing));
+      lock.lock();
+    }
+    if (!wait(lock,
+              [&]() { return layer->failed || corrupt() || present(); }) ||
+        layer->failed || corrupt()) {
+      // the next read asks again
+      for (int s = first; s <= last; ++s) {
+        layer->requested.erase(s);
+        layer->corrupt.erase(s);
+      }
+      return -EIO;
+    }
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  for (int s = first; s <= last; ++s) {
+    ranges.emplace_back(offsets[s], offsets[s + 1]);
+  }
+  // a present segment file does not change, it is read without the lock
+  lock.unlock();
+  size_t copied = 0;
+  for (int s = first; s <= last; ++s) {
+    auto [start, stop] = ranges[s - first];
+    uint64_t pos = begin + copied;
+    auto len = static_cast<size_t>(std::min(end, stop) - pos);
+    int fd = ::open(segmentPath(layer->digest, s).c_str(),
+                    O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return -EIO;
+    }
+    auto n = ::pread(fd, buf + copied, len, pos - start);
+    ::close(fd);
+    if (n != static_cast<ssize_t>(len)) {
+      return -EIO;
+    }
+    copied += len;
+  }
+  return static_cast<int>(copied);
+}
+
+#ifdef POBY_LAZY_PULL
+struct LazyFsOps {
+  static LazyFs *self() {
+    return static_cast<LazyFs *>(fuse_get_context()->private_data);
+  }
+
+  static void *init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    // the content of a layer never changes
+    cfg->kernel_cache = 1;
+    cfg->entry_timeout = 3600;
+    cfg->attr_timeout = 3600;
+    return fuse_get_context()->private_data;
+  }
+
+  static int getattr(const char *path, struct stat *st,
+                     struct fuse_file_info *) {
+    return self()->getattr(path, st);
+  }
+
+  static int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                     off_t, struct fuse_file_info *,
+                     enum fuse_readdir_flags) {
+    std::vector<std::string> names;
+    int res = self()->readdir(path, names);
+    if (res != 0) {
+      return res;
+    }
+    filler(buf, ".", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+    filler(buf, "..", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+    for (auto &name : names) {
+      if (filler(buf, name.c_str(), nullptr, 0,
+                 static_cast<fuse_fill_dir_flags>(0)) != 0) {
+        break;
+      }
+    }
+    return 0;
+  }
+
+  static int readlink(const char *path, char *buf, size_t size) {
+    std::string target;
+    int res = self()->readlink(path, target);
+    if (res != 0) {
+      return res;
+    }
+    auto n = std::min(size - 1, target.size());
+    memcpy(buf, target.data(), n);
+    buf[n] = '\0';
+    return 0;
+  }
+
+  static int open(const char *path, struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+      return -EROFS;
+    }
+    int res = self()->open(path);
+    if (res == 0) {
+      fi->keep_cache = 1;
+    }
+    return res;
+  }
+
+  static int read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *) {
+    return self()->read(path, buf, size, offset);
+  }
+
+  static fuse_operations operations() {
+    fuse_operations ops{};
+    ops.init = init;
+    ops.getattr = getattr;
+    ops.readdir = readdir;
+    ops.readlink = readlink;
+    ops.open = open;
+    ops.read = read;
+    return ops;
+  }
+};
+#endif
+
+bool LazyFs::mount() {
+#ifdef POBY_LAZY_PULL
+  auto mount_point = root_ + "/lazy";
+  // left mounted by a previous run that did not exit cleanly
+  ::umount2(mount_point.c_str(), MNT_DETACH);
+  std::error_code ec;
+  fs::create_directories(mount_point, ec);
+  if (ec) {
+    SPDLOG_ERROR("Create mount point {} error: {}", mount_point, ec.message());
+    return false;
+  }
+
+  static const fuse_operations ops = LazyFsOps::operations();
+  struct fuse_args args = FUSE_ARGS_INIT(0, nullptr);
+  fuse_opt_add_arg(&args, "poby");
+  fuse_opt_add_arg(&args, "-oro,default_permissions,fsname=poby");
+  // the containers run as other users
+  if (::geteuid() == 0) {
+    fuse_opt_add_arg(&args, "-oallow_other");
+  }
+  fuse_ = fuse_new(&args, &ops, sizeof(ops), this);
+  fuse_opt_free_args(&args);
+  if (fuse_ == nullptr) {
+    SPDLOG_ERROR("Create FUSE filesystem error");
+    return false;
+  }
+  if (fuse_mount(fuse_, mount_point.c_str()) != 0) {
+    SPDLOG_ERROR("Mount FUSE filesystem on {} error", mount_point);
+    fuse_destroy(fuse_);
+    fuse_ = nullptr;
+    return false;
+  }
+  // a read waiting for a segment takes a thread, the others go on
+  thread_ = std::thread([this]() { fuse_loop_mt(fuse_, 0); });
+  SPDLOG_INFO("Mount the lazy layers on {}", mount_point);
+  return true;
+#else
+  SPDLOG_ERROR("Built without fuse3, the lazy pull is not supported");
+  return false;
+#endif
+}
+
+} // namespace hdc::host::client
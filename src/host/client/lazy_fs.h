@@ -0,0 +1,170 @@
+#pragma once
+#include "content.pb.h"
+#include "host/client/tar_index.h"
+#include "layer_index.pb.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+struct fuse;
+
+namespace hdc {
+namespace host {
+namespace client {
+
+/// @brief: A read-only FUSE filesystem over the layers of a lazy pull. A lazy
+/// layer is served from its decompressed segments, which are fetched through
+/// the DPU pipeline when a read needs them, so a container starts after the
+/// bytes it reads are fetched instead of the whole image. Its layout under
+/// `root`, next to the LayerStore:
+///
+///   lazy/             the mount point, lazy/<digest> is the layer root
+///   segments/<digest> the decompressed segments fetched so far, one file each
+///   indexes/<digest>  the LayerIndex of the layer
+///
+/// A layer without a saved index is streamed in full and in order, and the
+/// index is built from the tar stream as it arrives. Until then a lookup of a
+/// name not seen yet and a listing wait for the stream, and a read waits for
+/// the segments of its bytes. Once the index is saved, a later pull of the
+/// layer fetches only the segments that are read, and checks them against
+/// the CRCs of the index. Thread safe.
+class LazyFs {
+public:
+  /// @brief: Called with (image, layer, segments) to fetch the segments a
+  /// read waits for. It is called in a FUSE thread.
+  using FetchCallback = std::function<void(
+      const std::string &, const std::string &, std::vector<int>)>;
+
+  explicit LazyFs(std::string root);
+
+  LazyFs(const LazyFs &) = delete;
+
+  LazyFs &operator=(const LazyFs &) = delete;
+
+  ~LazyFs();
+
+  /// @brief: Called with (layer, bytes) when a segment file of the layer is
+  /// stored, `bytes` by which segments/<digest> grew. It is called in the
+  /// writer thread.
+  using StoreCallback = std::function<void(const std::string &, int64_t)>;
+
+  /// @brief: Not thread safe, set it before mount().
+  void setFetchCallback(FetchCallback cb) { fetch_cb_ = std::move(cb); }
+
+  /// @brief: Not thread safe, set it before mount().
+  void setStoreCallback(StoreCallback cb) { store_cb_ = std::move(cb); }
+
+  /// @brief: Mount the filesystem on lazy/ and serve it in its own threads.
+  /// Return false if it fails or FUSE is not built in.
+  bool mount();
+
+  bool contains(const std::string &layer) const;
+
+  /// @brief: Serve `layer` of `image` lazily from now on. Return true if the
+  /// layer has no saved index, then the caller streams all of its segments
+  /// in order to putSegment().
+  bool addLayer(const std::string &layer, const std::string &image);
+
+  /// @brief: Store a segment of a lazy layer, `data` is decompressed from
+  /// `codec` first. It is written out of the thread of the caller.
+  void putSegment(std::string layer, int index, int total_segments,
+                  std::vector<uint8_t> data,
+                  content::Codec codec = content::UNCOMPRESSED);
+
+  /// @brief: The DPU failed a segment of a lazy layer, which counts as a
+  /// corrupt one. In the order of putSegment().
+  void failSegment(std::string layer, int index);
+
+  /// @brief: Remove the segments of an indexed layer no image uses, its
+  /// reads fetch them again. The index is kept. A layer being streamed is
+  /// kept whole, return false then.
+  bool removeSegments(const std::string &layer);
+
+private:
+  struct Layer {
+    std::string digest;
+    // the image the segments are fetched for
+    std::string image;
+    layer_index::LayerIndex index;
+    // all entries and the segment sizes are known
+    bool indexed{false};
+    bool failed{false};
+    // builds the index while the layer is streamed
+    std::unique_ptr<TarIndexer> indexer;
+    // the offset in the tar stream of each known segment, and its end
+    std::vector<uint64_t> offsets{0};
+    std::vector<bool> present;
+    // the segments asked for and not present yet
+    std::set<int> requested;
+    // the segments fetched with a CRC not the one of the index
+    std::set<int> corrupt;
+    // path -> the index of its entry
+    std::map<std::string, int> paths;
+    // directory -> the names in it, also of the directories without entry
+    std::map<std::string, std::set<std::string>> children;
+  };
+  friend struct LazyFsOps;
+
+  std::string segmentPath(const std::string &layer, int index) const;
+
+  std::string indexPath(const std::string &layer) const;
+
+  /// @brief: Make the entry `i` of the index of `layer` visible.
+  static void addEntry(Layer &layer, int i);
+
+  void writeSegment(const std::string &layer, int index, int total_segments,
+                    const std::vector<uint8_t> &data);
+
+  /// @brief: The segment is not stored, its reads fail and the next one
+  /// fetches it again. A streamed layer fails.
+  void markCorrupt(const std::string &layer, int index);
+
+  /// @brief: The layer and the path in it of a FUSE path, nullptr for the
+  /// root of the filesystem.
+  Layer *resolve(const std::string &path, std::string &rest);
+
+  /// @brief: Wait until the entry of `rest` is known. Return its index, -1
+  /// for a directory without entry, or -errno.
+  int lookup(std::unique_lock<std::mutex> &lock, Layer &layer,
+             const std::string &rest);
+
+  bool wait(std::unique_lock<std::mutex> &lock,
+            const std::function<bool()> &pred);
+
+  // the FUSE operations, 0 or -errno
+  int getattr(const std::string &path, struct stat *st);
+
+  int readdir(const std::string &path, std::vector<std::string> &names);
+
+  int readlink(const std::string &path, std::string &target);
+
+  int open(const std::string &path);
+
+  int read(const std::string &path, char *buf, size_t size, off_t offset);
+
+  const std::string root_;
+  FetchCallback fetch_cb_;
+  StoreCallback store_cb_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::map<std::string, Layer> layers_;
+  bool stopping_{false};
+  // writes the segments in the order they come
+  folly::CPUThreadPoolExecutor writer_{1};
+  struct fuse *fuse_{nullptr};
+  std::thread thread_;
+};
+
+} // namespace client
+} // namespace host
+} // namespace hdc
@@ -55,15 +55,15 @@ namespace host {
 namespace client {
 UntarData::UntarData(std::string layer, std::string image_name_tag,
                      std::vector<uint8_t> segment, int index,
-                     int total_segments)
+                     int total_segments, content::Codec codec)
     : layer_(std::move(layer)), image_name_tag_(std::move(image_name_tag)),
       segment_(std::move(segment)), index_(index),
-      total_segments_(total_segments) {}
+      total_segments_(total_segments), codec_(codec) {}
 
 UntarResult::UntarResult(std::string layer, std::string image_name_tag,
-                         bool success)
+                         bool success, size_t bytes)
     : layer(std::move(layer)), image_name_tag(std::move(image_name_tag)),
-      success(success) {}
+      success(success), bytes(bytes) {}
 } // namespace client
 } // namespace host
 } // namespace hdc
\ No newline at end of file
@@ -1,4 +1,5 @@
 #pragma once
+#include "content.pb.h"
 #include "image/image_ops.h"
 #include "isula_libutils/oci_image_spec.h"
 #include "isula_libutils/registry_manifest_schema2.h"
@@ -158,6 +159,9 @@ using hdc::network::tcp::TcpConnectionPtr;
 struct OffloadElement {
   std::string image_name_tag;
   TcpConnectionPtr conn;
+  // a prefetch runs only while no pull is running
+  bool prefetch{false};
+  int priority{0};
 };
 
 struct UntarData {
@@ -166,9 +170,14 @@ struct UntarData {
   std::vector<uint8_t> segment_;
   int index_;
   int total_segments_;
+  // the segment is decompressed from it before it is extracted
+  content::Codec codec_;
+  // the DPU failed the segment, its layer fails
+  bool failed_{false};
 
   UntarData(std::string layer, std::string image_name_tag,
-            std::vector<uint8_t> segment, int index, int total_segments);
+            std::vector<uint8_t> segment, int index, int total_segments,
+            content::Codec codec = content::UNCOMPRESSED);
 
   UntarData(UntarData &&) = default;
 
@@ -179,8 +188,11 @@ struct UntarResult {
   std::string layer;
   std::string image_name_tag;
   bool success;
+  // the size of the tar stream of the layer
+  size_t bytes;
 
-  UntarResult(std::string layer, std::string image_name_tag, bool success);
+  UntarResult(std::string layer, std::string image_name_tag, bool success,
+              size_t bytes = 0);
 
   UntarResult(const UntarResult &) = default;
 
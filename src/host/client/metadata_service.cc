@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <host/client/metadata_service.h>
+#include <network/CountDownLatch.h>
+#include <numeric>
+#include <set>
+#include <spdlog/spdlog.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace hdc::host::client {
+namespace fs = std::filesystem;
+
+namespace {
+constexpr uint32_t kRootMask = IN_CREATE | IN_MOVED_TO | IN_DELETE |
+                               IN_MOVED_FROM | IN_ONLYDIR;
+constexpr uint32_t kImageMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR;
+} // namespace
+
+MetadataService::MetadataService(std::string metadata_path)
+    : metadata_path_(std::move(metadata_path)),
+      thread_(network::EventLoopThread::ThreadInitCallback(),
+              "MetadataService") {}
+
+MetadataService::~MetadataService() {
+  if (loop_ == nullptr) {
+    return;
+  }
+  CountDownLatch latch(1);
+  loop_->runInLoop([this, &latch]() {
+    if (channel_ != nullptr) {
+      channel_->disableAll();
+      channel_->remove();
+      channel_.reset();
+    }
+    latch.countDown();
+  });
+  latch.wait();
+  if (inotify_fd_ != -1) {
+    ::close(inotify_fd_);
+  }
+}
+
+void MetadataService::start() {
+  loop_ = thread_.startLoop();
+  loop_->runInLoop([this]() {
+    inotify_fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ == -1) {
+      SPDLOG_ERROR("inotify_init1 error: {}", strerror(errno));
+    } else {
+      channel_ = std::make_unique<network::Channel>(loop_, inotify_fd_,
+                                                    "MetadataService");
+      channel_->setReadCallback(
+          [this](network::Timestamp) { handleEvents(); });
+      channel_->enableReading();
+    }
+    loadAll();
+  });
+}
+
+ImageNameTag MetadataService::normalize(const std::string &image_name_tag) {
+  // a registry host may have a port, the tag follows the last '/'
+  auto slash = image_name_tag.rfind('/');
+  auto colon = image_name_tag.rfind(':');
+  if (colon == std::string::npos ||
+      (slash != std::string::npos && colon < slash)) {
+    return ImageNameTag{image_name_tag + ":latest"};
+  }
+  return ImageNameTag{image_name_tag};
+}
+
+ImageInfoPtr MetadataService::find(const ImageNameTag &image) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = images_.find(image);
+  return it == images_.end() ? nullptr : it->second;
+}
+
+void MetadataService::load(const ImageNameTag &image, LoadCallback cb) {
+  loop_->runInLoop([this, image, cb = std::move(cb)]() {
+    auto info = find(image);
+    if (info == nullptr) {
+      info = loadImage(image.id());
+    }
+    cb(std::move(info));
+  });
+}
+
+void MetadataService::loadAll() {
+  loop_->assertInLoopThread();
+  std::error_code ec;
+  fs::create_directories(metadata_path_, ec);
+  watch("");
+  for (auto &dir : fs::directory_iterator(metadata_path_, ec)) {
+    if (!dir.is_directory(ec)) {
+      continue;
+    }
+    auto dir_name = dir.path().filename().string();
+    watch(dir_name);
+    loadImage(dir_name);
+  }
+  if (ec) {
+    SPDLOG_ERROR("Scan metadata path {} error: {}", metadata_path_,
+                 ec.message());
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  SPDLOG_INFO("Load metadata of {} images from {}", images_.size(),
+              metadata_path_);
+}
+
+ImageInfoPtr MetadataService::loadImage(const std::string &dir_name) {
+  loop_->assertInLoopThread();
+  auto dir = fs::path(metadata_path_) / dir_name;
+  std::error_code ec;
+  // an image directory being written is loaded again on IN_CLOSE_WRITE
+  if (!fs::exists(dir / "manifest.json", ec) ||
+      !fs::exists(dir / "config", ec)) {
+    SPDLOG_DEBUG("Image {} has no metadata yet", dir_name);
+    return nullptr;
+  }
+  auto manifest = OciManifest::from_file((dir / "manifest.json").string());
+  if (!manifest.has_value()) {
+    return nullptr;
+  }
+  // the config is not used by a pull, but an image without a valid one is
+  // not loaded
+  if (!OciConfig::from_file((dir / "config").string()).has_value()) {
+    return nullptr;
+  }
+
+  auto info = std::make_shared<ImageInfo>();
+  info->image = ImageNameTag{dir_name};
+  // a manifest may list a layer twice
+  std::set<std::string> seen;
+  std::vector<int64_t> sizes;
+  for (size_t i = 0; i < manifest->layers_len(); ++i) {
+    auto *element = manifest->layers()[i];
+    std::string layer{element->digest};
+    if (seen.insert(layer).second) {
+      info->layers.emplace_back(std::move(layer));
+      sizes.emplace_back(element->size);
+    }
+  }
+  info->pull_order.resize(info->layers.size());
+  std::iota(info->pull_order.begin(), info->pull_order.end(), 0);
+  std::stable_sort(info->pull_order.begin(), info->pull_order.end(),
+                   [&](uint32_t lhs, uint32_t rhs) {
+                     return sizes[lhs] < sizes[rhs];
+                   });
+  SPDLOG_DEBUG("Load metadata of image {}, {} layers", dir_name,
+               info->layers.size());
+  std::lock_guard<std::mutex> lock(mutex_);
+  images_[info->image] = info;
+  return info;
+}
+
+void MetadataService::eraseImage(const std::string &dir_name) {
+  SPDLOG_DEBUG("Erase metadata of image {}", dir_name);
+  std::lock_guard<std::mutex> lock(mutex_);
+  images_.erase(ImageNameTag{dir_name});
+}
+
+void MetadataService::watch(const std::string &dir_name) {
+  if (inotify_fd_ == -1) {
+    return;
+  }
+  auto path = dir_name.empty() ? metadata_path_
+                               : (fs::path(metadata_path_) / dir_name).string();
+  int wd = ::inotify_add_watch(inotify_fd_, path.c_str(),
+                               dir_name.empty() ? kRootMask : kImageMask);
+  if (wd == -1) {
+    SPDLOG_ERROR("Watch {} error: {}", path, strerror(errno));
+    return;
+  }
+  watches_[wd] = dir_name;
+}
+
+void MetadataService::handleEvents() {
+  loop_->assertInLoopThread();
+  alignas(struct inotify_event) char buf[4096];
+  while (true) {
+    auto n = ::read(inotify_fd_, buf, sizeof(buf));
+    if (n <= 0) {
+      if (n == -1 && errno != EAGAIN) {
+        SPDLOG_ERROR("Read inotify events error: {}", strerror(errno));
+      }
+      return;
+    }
+    for (char *p = buf; p < buf + n;) {
+      auto *event = reinterpret_cast<struct inotify_event *>(p);
+      p += sizeof(struct inotify_event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        SPDLOG_WARN("inotify queue overflow, reload all metadata");
+        loadAll();
+        continue;
+      }
+      auto it = watches_.find(event->wd);
+      if (it == watches_.end()) {
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        watches_.erase(it);
+        continue;
+      }
+      std::string name = event->len > 0 ? event->name : "";
+      if (it->second.empty()) {
+        if (!(event->mask & IN_ISDIR)) {
+          continue;
+        }
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          // the files may be written before the watch is added
+          watch(name);
+          loadImage(name);
+        } else {
+          eraseImage(name);
+        }
+      } else if (name == "manifest.json" || name == "config") {
+        loadImage(it->second);
+      }
+    }
+  }
+}
+
+} // namespace hdc::host::client
@@ -0,0 +1,87 @@
+#pragma once
+#include "host/client/metadata.h"
+#include "network/Channel.h"
+#include "network/EventLoop.h"
+#include "network/EventLoopThread.h"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace hdc {
+namespace host {
+namespace client {
+
+/// @brief: The metadata of an image that a pull needs, parsed out of its
+/// manifest.json and config.
+struct ImageInfo {
+  ImageNameTag image;
+  // the layer digests in the manifest order, without duplicates
+  std::vector<std::string> layers;
+  // the indexes into `layers` in the order they are pulled, the smallest
+  // compressed layer first, so that the extraction starts and finishes early
+  std::vector<uint32_t> pull_order;
+};
+using ImageInfoPtr = std::shared_ptr<const ImageInfo>;
+
+/// @brief: Loads the metadata of the images under `metadata_path`, one
+/// directory `<name>:<tag>` with manifest.json and config per image. All
+/// images are loaded when the service starts, and inotify reloads an image
+/// whose files change, so the metadata is parsed once and never in the loop
+/// of the caller. The reads and the parsing happen in the thread of the
+/// service.
+class MetadataService {
+public:
+  using LoadCallback = std::function<void(ImageInfoPtr)>;
+
+  explicit MetadataService(std::string metadata_path);
+
+  MetadataService(const MetadataService &) = delete;
+
+  MetadataService &operator=(const MetadataService &) = delete;
+
+  ~MetadataService();
+
+  /// @brief: Start the thread of the service, which loads all images and
+  /// watches `metadata_path`. Not thread safe.
+  void start();
+
+  /// @brief: The loaded metadata of `image`, or nullptr. It does no I/O.
+  /// Thread safe.
+  ImageInfoPtr find(const ImageNameTag &image) const;
+
+  /// @brief: Load `image` if it is not loaded yet, and call `cb` in the thread
+  /// of the service with its metadata, nullptr if it has none. Thread safe.
+  void load(const ImageNameTag &image, LoadCallback cb);
+
+  /// @brief: "name" means "name:latest".
+  static ImageNameTag normalize(const std::string &image_name_tag);
+
+private:
+  void loadAll();
+
+  ImageInfoPtr loadImage(const std::string &dir_name);
+
+  void eraseImage(const std::string &dir_name);
+
+  void watch(const std::string &dir_name);
+
+  void handleEvents();
+
+  std::string metadata_path_;
+  network::EventLoopThread thread_;
+  network::EventLoop *loop_{nullptr};
+  int inotify_fd_{-1};
+  std::unique_ptr<network::Channel> channel_;
+  // watch descriptor -> image directory, "" for metadata_path itself
+  std::map<int, std::string> watches_;
+  mutable std::mutex mutex_;
+  std::map<ImageNameTag, ImageInfoPtr> images_;
+};
+
+} // namespace client
+} // namespace host
+} // namespace hdc
@@ -1,54 +1,102 @@
 #include "container.pb.h"
-#include "network/rdma/Callbacks.h"
-#include "network/rdma/RdmaClient.h"
-#include "network/rdma/RdmaConnection.h"
+#include "network/transport/Callbacks.h"
+#include "network/transport/Transport.h"
+#include "network/transport/MsgConnection.h"
 #include "offload.pb.h"
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <filesystem>
 #include <host/client/offload_client_epoll.h>
 #include <spdlog/spdlog.h>
 #include <thread>
 #include <utils/MsgFrame.h>
 
 namespace hdc::host::client {
+namespace {
+// the priority of the segments a read of a lazy layer waits for, above the
+// priority of any pull
+constexpr int kLazyReadPriority = 1 << 20;
+// how often the last uses of the layers are written to the LayerStore index
+constexpr double kLayerStoreFlushSec = 5;
+} // namespace
+
 OffloadClientEpoll::OffloadClientEpoll(EventLoop *loop,
-                                       const InetAddress &listen_addr,
-                                       RdmaConfig rdmaConfig,
-                                       std::string metadata_path)
-    : client_(loop, listen_addr, "OffloadClient", std::move(rdmaConfig)),
-      loop_(loop), metadata_path_(std::move(metadata_path)) {
-
-  client_.setConnectedCallback(
-      [this](const RdmaConnectionPtr &conn) { this->onConnected(conn); });
-  client_.setRecvSuccessCallback([this](const RdmaConnectionPtr &conn,
-                                        uint8_t *recv_buf, uint32_t recv_len,
-                                        const ibv_wc &wc) {
-    this->onRecvSuccess(conn, recv_buf, recv_len, wc);
-  });
-  client_.setRecvFailCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
-        this->onRecvFail(conn, wc);
-      });
-  client_.setSendCompleteSuccessCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
-        this->onSendCompleteSuccess(conn, wc);
-      });
-  client_.setSendCompleteFailCallback(
-      [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
-        this->onSendCompleteFail(conn, wc);
+                                       std::vector<DpuPeer> peers,
+                                       MetadataService *metadata_service,
+                                       LayerStore *layer_store,
+                                       SchedPolicy sched_policy,
+                                       LazyFs *lazy_fs)
+    : sessions_(peers.size()), loop_(loop), unsent_layers_(sched_policy),
+      metadata_service_(metadata_service),
+      layer_store_(layer_store), lazy_fs_(lazy_fs) {
+  loop_->runEvery(kLayerStoreFlushSec, [this]() { layer_store_->flush(); });
+  if (lazy_fs_ != nullptr) {
+    lazy_fs_->setFetchCallback([this](const std::string &image,
+                                      const std::string &layer,
+                                      std::vector<int> segments) {
+      fetchSegments(image, layer, std::move(segments));
+    });
+    // the lazy segments count to the capacity of the LayerStore
+    lazy_fs_->setStoreCallback([this](const std::string &layer,
+                                      int64_t bytes) {
+      loop_->runInLoop([this, layer, bytes]() {
+        layer_store_->addSegmentBytes(layer, bytes);
       });
+    });
+    layer_store_->setRemoveSegmentsCallback(
+        [this](const std::string &layer) {
+          return lazy_fs_->removeSegments(layer);
+        });
+  }
+
+  for (size_t i = 0; i < peers.size(); ++i) {
+    auto mem_num = peers[i].transport_config.memNum_;
+    sessions_[i].max_inflight_sends = mem_num > 1 ? mem_num - 1 : 1;
+    auto &client = sessions_[i].client;
+    client = createMsgClient(
+        loop, peers[i].addr,
+        peers.size() == 1 ? "OffloadClient"
+                          : "OffloadClient" + std::to_string(i),
+        peers[i].transport_config);
+    client->setConnectedCallback([this, i](const MsgConnectionPtr &conn) {
+      this->onConnected(i, conn);
+    });
+    client->setRecvSuccessCallback(
+        [this, i](const MsgConnectionPtr &conn, uint8_t *recv_buf,
+                  uint32_t recv_len, const Completion &wc) {
+          this->onRecvSuccess(i, recv_buf, recv_len, wc);
+        });
+    client->setRecvFailCallback(
+        [this](const MsgConnectionPtr &conn, const Completion &wc) {
+          this->onRecvFail(conn, wc);
+        });
+    client->setSendCompleteSuccessCallback(
+        [this](const MsgConnectionPtr &conn, const Completion &wc) {
+          this->onSendCompleteSuccess(conn, wc);
+        });
+    client->setSendCompleteFailCallback(
+        [this](const MsgConnectionPtr &conn, const Completion &wc) {
+          this->onSendCompleteFail(conn, wc);
+        });
+  }
 }
 
-void OffloadClientEpoll::connect() { client_.connect(); }
+void OffloadClientEpoll::connect() {
+  for (auto &session : sessions_) {
+    session.client->connect();
+  }
+}
 
-void OffloadClientEpoll::onConnected(const RdmaConnectionPtr &conn) {
-  SPDLOG_INFO("OffloadClient connected");
-  conn_ = conn;
+void OffloadClientEpoll::onConnected(size_t session,
+                                     const MsgConnectionPtr &conn) {
+  SPDLOG_INFO("OffloadClient connected to DPU {}", session);
+  sessions_[session].conn = conn;
 
   offload::DecompressConnectionRequest req{};
   req.set_connection(true);
   auto free_buf = conn->acquireFreeSendBuf();
-  inflight_sends_.emplace_back(free_buf->id);
+  sessions_[session].inflight_sends.emplace_back(free_buf->id);
   auto send_buf = free_buf->addr;
   auto send_cap = free_buf->cap;
 
@@ -64,18 +112,24 @@ void OffloadClientEpoll::onConnected(const RdmaConnectionPtr &conn) {
   conn->send(send_buf, frame_len + sizeof(MsgType), wr_id_++);
 }
 
-void OffloadClientEpoll::onRecvSuccess(const RdmaConnectionPtr &conn,
-                                       uint8_t *recv_buf, uint32_t recv_len,
-                                       const ibv_wc &wc) {
+void OffloadClientEpoll::onRecvSuccess(size_t session, uint8_t *recv_buf,
+                                       uint32_t recv_len,
+                                       const Completion &wc) {
   if (recv_len < sizeof(int)) {
     SPDLOG_ERROR("recv_len < 4");
     return;
   }
 
-  conn_->releaseSendBuf(inflight_sends_.front());
-  inflight_sends_.pop_front();
-
   int type = *reinterpret_cast<int *>(recv_buf);
+  // a response frees the send buf of its request, a LayerProgress is sent by
+  // the DPU on its own
+  if (type == static_cast<int>(MsgType::kDecompressConnection) ||
+      type == static_cast<int>(MsgType::kOffload)) {
+    auto &inflight_sends = sessions_[session].inflight_sends;
+    sessions_[session].conn->releaseSendBuf(inflight_sends.front());
+    inflight_sends.pop_front();
+  }
+
   if (type == static_cast<int>(MsgType::kDecompressConnection)) {
     offload::DecompressConnectionResponse resp{};
     if (!parseRdmaPbMsg(recv_buf + sizeof(MsgType), recv_len - sizeof(MsgType),
@@ -83,7 +137,7 @@ void OffloadClientEpoll::onRecvSuccess(const RdmaConnectionPtr &conn,
       SPDLOG_ERROR("parse DecompressConnectionResponse error");
       return;
     }
-    if (!handleDecompressConnectionResponse(resp)) {
+    if (!handleDecompressConnectionResponse(session, resp)) {
       SPDLOG_ERROR("handle DecompressConnectionResponse error");
       return;
     }
@@ -94,10 +148,20 @@ void OffloadClientEpoll::onRecvSuccess(const RdmaConnectionPtr &conn,
       SPDLOG_ERROR("parse OffloadResponse error");
       return;
     }
-    if (!handleOffloadResponse(resp)) {
+    if (!handleOffloadResponse(session, resp)) {
       SPDLOG_ERROR("handlre OffloadResponse error");
       return;
     }
+  } else if (type == static_cast<int>(MsgType::kLayerProgress)) {
+    offload::LayerProgressBatch batch{};
+    if (!parseRdmaPbMsg(recv_buf + sizeof(MsgType), recv_len - sizeof(MsgType),
+                        batch)) {
+      SPDLOG_ERROR("parse LayerProgressBatch error");
+      return;
+    }
+    for (auto &progress : batch.progress()) {
+      handleLayerProgress(progress);
+    }
   } else {
     SPDLOG_ERROR("Request type error");
   }
@@ -106,137 +170,544 @@ void OffloadClientEpoll::onRecvSuccess(const RdmaConnectionPtr &conn,
 void OffloadClientEpoll::completeTask(UntarResult untar_res) {
   loop_->runInLoop([this, untar_res = std::move(untar_res)]() {
     loop_->assertInLoopThread();
-    auto it_tasks = tasks_.find(untar_res.image_name_tag);
-    assert(it_tasks != tasks_.end());
-    auto &task_info = it_tasks->second;
-    task_info.untar_layers++;
-    if (task_info.untar_layers == task_info.total_layers) {
-      // success
-      tasks_.erase(it_tasks);
-      container::CreateContainerResponse response{};
-      response.set_path("untar/" + untar_res.image_name_tag);
-      response.set_success(true);
-      response.set_duration(0);
-      sendTcpPbMsg(task_info.conn, response);
-      SPDLOG_INFO("Send CreateContainerResponse. image: {}, path: {}, {}",
-                  untar_res.image_name_tag, response.path(),
-                  response.success() ? "success" : "fail");
+    bool success = untar_res.success;
+    if (success) {
+      success = layer_store_->publish(untar_res.layer, untar_res.bytes);
+    } else {
+      layer_store_->discard(untar_res.layer);
+    }
+    for (auto &image : layers_.complete(untar_res.layer)) {
+      finishLayer(image, success && linkLayer(image, untar_res.layer));
+    }
+    prefetch_inflight_.erase(untar_res.layer);
+    fetched_layers_.erase(untar_res.layer);
+    auto it_session = layer_sessions_.find(untar_res.layer);
+    if (it_session != layer_sessions_.end()) {
+      sessions_[it_session->second].inflight_layers--;
+      layer_sessions_.erase(it_session);
+    }
+    // the pipeline may be idle for the prefetches now
+    if (!tryOffloadTask()) {
+      SPDLOG_ERROR("Do offloadTask error");
     }
   });
 }
 
-void OffloadClientEpoll::onRecvFail(const RdmaConnectionPtr &conn,
-                                    const ibv_wc &wc) {
+void OffloadClientEpoll::finishLayer(const ImageNameTag &image,
+                                     bool success) {
+  auto it_tasks = tasks_.find(image);
+  assert(it_tasks != tasks_.end());
+  auto &task_info = it_tasks->second;
+  task_info.untar_layers++;
+  if (!success) {
+    task_info.failed_layers++;
+  }
+  if (task_info.untar_layers != task_info.total_layers) {
+    return;
+  }
+  finishTask(it_tasks);
+}
+
+void OffloadClientEpoll::finishTask(TaskMap::iterator it_tasks) {
+  auto &image = it_tasks->first;
+  auto &task_info = it_tasks->second;
+  container::CreateContainerResponse response{};
+  response.set_path("untar/" + image.id());
+  response.set_success(task_info.failed_layers == 0);
+  response.set_duration(0);
+  response.set_total_layers(task_info.total_layers);
+  response.set_fetched_layers(task_info.untar_layers);
+  response.set_done_layers(task_info.untar_layers);
+  for (auto &conn : task_info.conns) {
+    sendTcpPbMsg(conn, response);
+  }
+  SPDLOG_INFO("Send CreateContainerResponse. image: {}, path: {}, {}",
+              image.id(), response.path(),
+              response.success() ? "success" : "fail");
+  for (auto &layer : task_info.layers) {
+    layer_store_->unpin(layer);
+  }
+  if (!task_info.prefetch) {
+    pull_tasks_--;
+  }
+  tasks_.erase(it_tasks);
+}
+
+bool OffloadClientEpoll::linkLayer(const ImageNameTag &image,
+                                   const std::string &layer) {
+  namespace fs = std::filesystem;
+  auto image_dir = fs::path(layer_store_->root()) / image.id();
+  auto link = image_dir / layer;
+  // LazyFs is mounted on lazy/ of the store
+  auto target = lazy_fs_ != nullptr && !layer_store_->contains(layer)
+                    ? fs::path("../lazy") / layer
+                    : fs::path("../layers") / layer;
+  std::error_code ec;
+  fs::create_directories(image_dir, ec);
+  if (!ec && !fs::exists(fs::symlink_status(link))) {
+    // relative, so that the store can be moved
+    fs::create_directory_symlink(target, link, ec);
+  }
+  if (ec) {
+    SPDLOG_ERROR("Link layer {} of image {} error: {}", layer, image.id(),
+                 ec.message());
+    return false;
+  }
+  layer_store_->addLink(image.id(), layer);
+  return true;
+}
+
+void OffloadClientEpoll::onRecvFail(const MsgConnectionPtr &conn,
+                                    const Completion &wc) {
   SPDLOG_ERROR("RDMA recv complete fail. wr_id: {}", wc.wr_id);
 }
 
-void OffloadClientEpoll::onSendCompleteSuccess(const RdmaConnectionPtr &conn,
-                                               const ibv_wc &wc) {
+void OffloadClientEpoll::onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                                               const Completion &wc) {
   // SPDLOG_DEBUG("RDMA send complete wr_id {}", wc.wr_id);
 }
 
-void OffloadClientEpoll::onSendCompleteFail(const RdmaConnectionPtr &conn,
-                                            const ibv_wc &wc) {
+void OffloadClientEpoll::onSendCompleteFail(const MsgConnectionPtr &conn,
+                                            const Completion &wc) {
   SPDLOG_ERROR("RDMA send complete fail. wr_id: {}", wc.wr_id);
 }
 
 bool OffloadClientEpoll::handleOffloadResponse(
-    const offload::OffloadResponse &resp) {
-  SPDLOG_INFO("Recv OffloadResponse: image: {} {}", resp.image_name_tag(),
+    size_t session, const offload::OffloadResponse &resp) {
+  SPDLOG_INFO("Recv OffloadResponse from DPU {}: image: {}, {} layers {}",
+              session, resp.image_name_tag(), resp.layers(),
               resp.success() ? "success" : "fail");
-  return tryOffloadTask(conn_);
+  return tryOffloadTask();
 }
-bool OffloadClientEpoll::handleDecompressConnectionResponse(
-    const offload::DecompressConnectionResponse &resp) {
-  SPDLOG_INFO("Recv DecompressConnectionResponse");
-  connected_ = true;
 
-  if (!tryOffloadTask(conn_)) {
-    return false;
+void OffloadClientEpoll::handleLayerProgress(
+    const offload::LayerProgress &progress) {
+  SPDLOG_INFO("Recv LayerProgress: image: {}, layer: {} fetched, {} segments, "
+              "{} from the DPU segment cache",
+              progress.image_name_tag(), progress.layer(),
+              progress.total_segments(), progress.cached_segments());
+  // a lazy layer is fetched segment by segment and stays lazy
+  if (layers_.inflight(progress.layer())) {
+    fetched_layers_.insert(progress.layer());
   }
-  return true;
 }
-bool OffloadClientEpoll::loadMetadata(const ImageNameTag &image) {
-  if (metadatas_.find(image) != metadatas_.end()) {
-    return true;
-  }
 
-  std::string name = image.id().substr(0, image.id().find(":"));
-  std::string manifest_path = metadata_path_ + "/" + name + ":latest/manifest.json";
-  auto manifest = OciManifest::from_file(manifest_path);
-  if (!manifest.has_value()) {
-    return false;
-  }
+bool OffloadClientEpoll::handleDecompressConnectionResponse(
+    size_t session, const offload::DecompressConnectionResponse &resp) {
+  SPDLOG_INFO("Recv DecompressConnectionResponse from DPU {}", session);
+  sessions_[session].connected = true;
 
-  std::string config_path = metadata_path_ + "/" + name + ":latest/config";
-  auto config = OciConfig::from_file(config_path);
-  if (!config.has_value()) {
+  if (!tryOffloadTask()) {
     return false;
   }
-  metadatas_.emplace(
-      image, ImageMetadata{image, std::move(*config), std::move(*manifest)});
   return true;
 }
 
+void OffloadClientEpoll::loadMetadata(OffloadElement task) {
+  auto image = MetadataService::normalize(task.image_name_tag);
+  metadata_service_->load(image, [this, task = std::move(task)](
+                                     ImageInfoPtr info) mutable {
+    loop_->runInLoop([this, task = std::move(task), info]() {
+      loop_->assertInLoopThread();
+      if (info == nullptr) {
+        SPDLOG_ERROR("Image {} has no metadata", task.image_name_tag);
+        container::CreateContainerResponse response{};
+        response.set_success(false);
+        response.set_duration(0);
+        sendTcpPbMsg(task.conn, response);
+        return;
+      }
+      // the image is found by prepareTask() now
+      if (task.prefetch) {
+        preparePrefetch(task);
+        return;
+      }
+      prepareTask(task);
+      if (!tryOffloadTask()) {
+        SPDLOG_ERROR("Do offloadTask error");
+      }
+    });
+  });
+}
+
 void OffloadClientEpoll::offload(OffloadElement task) {
   loop_->runInLoop([this, task = std::move(task)]() {
     loop_->assertInLoopThread();
-    pending_tasks_.emplace_back(std::move(task));
-    if (!connected_) {
+    if (task.prefetch) {
+      preparePrefetch(task);
       return;
     }
-    if (!this->tryOffloadTask(conn_)) {
+    // the task is admitted at once, only the send of its layers may wait
+    prepareTask(task);
+    if (!this->tryOffloadTask()) {
       SPDLOG_ERROR("Do offloadTask error");
     }
   });
 }
 
-bool OffloadClientEpoll::tryOffloadTask(const RdmaConnectionPtr &conn) {
-  if (pending_tasks_.empty()) {
-    return true;
+void OffloadClientEpoll::cancelPrefetch(std::string image_name_tag,
+                                        TcpConnectionPtr conn) {
+  loop_->runInLoop([this, image_name_tag = std::move(image_name_tag),
+                    conn = std::move(conn)]() {
+    loop_->assertInLoopThread();
+    auto image = MetadataService::normalize(image_name_tag);
+    container::CreateContainerResponse response{};
+    response.set_path("untar/" + image.id());
+    response.set_duration(0);
+    auto it_tasks = tasks_.find(image);
+    if (it_tasks == tasks_.end() || !it_tasks->second.prefetch) {
+      SPDLOG_INFO("Cancel prefetch of image {}: not prefetched", image.id());
+      response.set_success(false);
+      response.set_message("not prefetched");
+      sendTcpPbMsg(conn, response);
+      return;
+    }
+    if (it_tasks->second.cancelled) {
+      SPDLOG_INFO("Cancel prefetch of image {}: cancelled already",
+                  image.id());
+      response.set_success(false);
+      response.set_message("cancelled already, in progress");
+      sendTcpPbMsg(conn, response);
+      return;
+    }
+
+    auto &task_info = it_tasks->second;
+    for (auto it = prefetch_layers_.begin(); it != prefetch_layers_.end();) {
+      if (it->first.id() == image.id()) {
+        task_info.dropped_layers.emplace_back(std::move(it->second));
+        it = prefetch_layers_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    int dropped = static_cast<int>(task_info.dropped_layers.size());
+    if (dropped == 0) {
+      SPDLOG_INFO("Cancel prefetch of image {}: all layers offloaded",
+                  image.id());
+      response.set_success(false);
+      response.set_message("in progress, not cancellable");
+      sendTcpPbMsg(conn, response);
+      return;
+    }
+    task_info.cancelled = true;
+    response.set_success(true);
+    sendTcpPbMsg(conn, response);
+    SPDLOG_INFO("Cancel prefetch of image {}: drop {} layers", image.id(),
+                dropped);
+    // the layers in flight finish the task, or the last dropped one does
+    for (int i = 0; i < dropped; ++i) {
+      finishLayer(image, false);
+    }
+  });
+}
+
+void OffloadClientEpoll::queryProgress(std::string image_name_tag,
+                                       TcpConnectionPtr conn) {
+  loop_->runInLoop([this, image_name_tag = std::move(image_name_tag),
+                    conn = std::move(conn)]() {
+    loop_->assertInLoopThread();
+    auto image = MetadataService::normalize(image_name_tag);
+    container::CreateContainerResponse response{};
+    response.set_path("untar/" + image.id());
+    response.set_duration(0);
+    auto it_tasks = tasks_.find(image);
+    if (it_tasks == tasks_.end()) {
+      response.set_success(false);
+      response.set_message("not in flight");
+      sendTcpPbMsg(conn, response);
+      return;
+    }
+    auto &task_info = it_tasks->second;
+    // the layers done are no longer in fetched_layers_
+    int fetched = task_info.untar_layers;
+    for (auto &layer : task_info.layers) {
+      fetched += static_cast<int>(fetched_layers_.count(layer));
+    }
+    response.set_success(true);
+    response.set_total_layers(task_info.total_layers);
+    response.set_fetched_layers(fetched);
+    response.set_done_layers(task_info.untar_layers);
+    sendTcpPbMsg(conn, response);
+    SPDLOG_INFO("Progress of image {}: {}/{} layers fetched, {} done",
+                image.id(), fetched, task_info.total_layers,
+                task_info.untar_layers);
+  });
+}
+
+std::optional<size_t> OffloadClientEpoll::pickSession() const {
+  std::optional<size_t> best;
+  for (size_t n = 0; n < sessions_.size(); ++n) {
+    auto i = (next_session_ + n) % sessions_.size();
+    auto &session = sessions_[i];
+    if (!session.connected || session.conn->isFreeSendBufEmpty() ||
+        session.inflight_sends.size() >= session.max_inflight_sends) {
+      continue;
+    }
+    if (!best.has_value() ||
+        session.inflight_layers < sessions_[*best].inflight_layers) {
+      best = i;
+    }
   }
-  auto free_buf = conn->acquireFreeSendBuf();
-  if (!free_buf.has_value()) {
+  return best;
+}
+
+bool OffloadClientEpoll::tryOffloadTask() {
+  // offloaded once a DPU is connected
+  if (std::none_of(sessions_.begin(), sessions_.end(),
+                   [](const DpuSession &s) { return s.connected; })) {
     return true;
   }
-  auto &task = pending_tasks_.front();
-  if (!offloadTaskToDpu(conn_, task, *free_buf)) {
-    SPDLOG_ERROR("Do offloadTask error");
-    pending_tasks_.pop_front();
-    return false;
+  admitPrefetchLayer();
+  // as many layers per OffloadRequest as fit in a send buf
+  while (!unsent_layers_.empty()) {
+    auto session = pickSession();
+    if (!session.has_value()) {
+      // sent once an OffloadResponse frees a send buf
+      return true;
+    }
+    auto free_buf = sessions_[*session].conn->acquireFreeSendBuf();
+    size_t room = free_buf->cap - sizeof(MsgType) - kFrameHeaderLen;
+    offload::OffloadRequest offload_req{};
+    offload_req.set_image_name_tag(unsent_layers_.front().image_name_tag());
+    while (!unsent_layers_.empty()) {
+      auto &layer = unsent_layers_.front();
+      // a repeated element also takes a tag and a length
+      size_t layer_size = layer.ByteSizeLong() + 8;
+      if (offload_req.layers_size() != 0 &&
+          offload_req.ByteSizeLong() + layer_size > room) {
+        break;
+      }
+      // the rest goes to another DPU once this one is loaded more
+      auto other = pickSession();
+      if (offload_req.layers_size() != 0 && other.has_value() &&
+          sessions_[*other].inflight_layers <
+              sessions_[*session].inflight_layers) {
+        break;
+      }
+      // the segments of a layer are extracted in order, so a whole layer
+      // goes to one DPU and is counted until it is extracted
+      if (layers_.inflight(layer.layer()) &&
+          layer_sessions_.emplace(layer.layer(), *session).second) {
+        sessions_[*session].inflight_layers++;
+      }
+      *offload_req.add_layers() = std::move(layer);
+      unsent_layers_.pop();
+    }
+    next_session_ = (*session + 1) % sessions_.size();
+    if (!offloadTaskToDpu(*session, offload_req, *free_buf)) {
+      SPDLOG_ERROR("Do offloadTask error");
+      return false;
+    }
   }
-  pending_tasks_.pop_front();
   return true;
 }
-bool OffloadClientEpoll::offloadTaskToDpu(
-    const RdmaConnectionPtr &conn, const OffloadElement &task,
-    const RdmaConnection::SendBuf &free_buf) {
-  // load metadata
-  ImageNameTag image{task.image_name_tag};
-  if (!loadMetadata(image)) {
-    SPDLOG_ERROR("loadMetadata error");
+
+void OffloadClientEpoll::admitPrefetchLayer() {
+  // a prefetch is offloaded one layer at a time and only while no pull runs,
+  // so that a pull waits for at most one layer of it
+  while (pull_tasks_ == 0 && prefetch_inflight_.empty() &&
+         unsent_layers_.empty() && !prefetch_layers_.empty()) {
+    auto image = prefetch_layers_.front().first;
+    auto layer = std::move(prefetch_layers_.front().second);
+    prefetch_layers_.pop_front();
+    auto it_tasks = tasks_.find(image);
+    if (it_tasks == tasks_.end()) {
+      SPDLOG_ERROR("Prefetch layer {} of unknown image {}", layer, image.id());
+      continue;
+    }
+    std::vector<std::string> present_layers;
+    if (startLayer(image, layer, it_tasks->second.priority, present_layers)) {
+      prefetch_inflight_.insert(layer);
+    }
+    for (auto &layer_name : present_layers) {
+      finishLayer(image, linkLayer(image, layer_name));
+    }
+  }
+}
+
+bool OffloadClientEpoll::startLayer(const ImageNameTag &image,
+                                    const std::string &layer, int priority,
+                                    std::vector<std::string> &present_layers) {
+  if (layer_store_->contains(layer)) {
+    SPDLOG_DEBUG("image {}, layer {} is present", image.id(), layer);
+    layer_store_->touch(layer);
+    present_layers.emplace_back(layer);
+    return false;
+  }
+  if (layers_.inflight(layer)) {
+    SPDLOG_DEBUG("image {}, layer {} is in flight", image.id(), layer);
+    layers_.addWaiter(layer, image);
     return false;
   }
-  auto &metadata = metadatas_[image];
-  auto &manifest = metadata.manifest();
-  size_t layers_len = manifest.layers_len();
+  offload::LayerElement layer_element;
+  if (lazy_fs_ != nullptr) {
+    // the pull does not wait for the layer, only the reads of its files do
+    if (lazy_fs_->addLayer(layer, image.id())) {
+      layer_element.set_layer(layer);
+      layer_element.set_image_name_tag(image.id());
+      layer_element.set_priority(priority);
+      unsent_layers_.push(image.id(), std::move(layer_element), 1, priority);
+    }
+    present_layers.emplace_back(layer);
+    return false;
+  }
+  layers_.startPull(layer, image);
+  layer_element.set_layer(layer);
+  layer_element.set_image_name_tag(image.id());
+  layer_element.set_priority(priority);
+  unsent_layers_.push(image.id(), std::move(layer_element), 1, priority);
+  return true;
+}
 
-  // // update tasks and layers.
-  // // construct OffloadRequest.
-  offload::OffloadRequest offload_req{};
-  offload_req.set_image_name_tag(image.id());
+void OffloadClientEpoll::prepareTask(const OffloadElement &task) {
+  auto image = MetadataService::normalize(task.image_name_tag);
+  // the image is being pulled, answer this pull together with it
+  auto it_tasks = tasks_.find(image);
+  if (it_tasks != tasks_.end()) {
+    SPDLOG_INFO("Image {} is being pulled, wait for it", image.id());
+    it_tasks->second.conns.emplace_back(task.conn);
+    if (it_tasks->second.prefetch) {
+      it_tasks->second.priority = task.priority;
+      promotePrefetch(image, it_tasks->second);
+    }
+    return;
+  }
 
-  for (size_t i = 0; i < layers_len; ++i) {
-    auto m_layer = manifest.layers()[i];
-    std::string layer_name = std::string{m_layer->digest};
-    offload::LayerElement layer;
-    layer.set_layer(m_layer->digest);
-    *offload_req.add_layers() = layer;
+  // the metadata is loaded by MetadataService out of this loop
+  auto info = metadata_service_->find(image);
+  if (info == nullptr) {
+    loadMetadata(task);
+    return;
   }
-  tasks_.emplace(image, TaskInfo{static_cast<int>(layers_len), 0, task.conn});
+  auto layers = info->layers;
+  // update tasks and layers.
+  std::vector<std::string> present_layers;
+  for (auto i : info->pull_order) {
+    auto &layer_name = layers[i];
+    layer_store_->pin(layer_name);
+    startLayer(image, layer_name, task.priority, present_layers);
+  }
+  auto &task_info =
+      tasks_.emplace(image, TaskInfo{task.conn, std::move(layers)})
+          .first->second;
+  task_info.priority = task.priority;
+  pull_tasks_++;
+  if (task_info.total_layers == 0) {
+    SPDLOG_INFO("Image {} has no layers", image.id());
+    // the path of the response exists, empty
+    std::error_code ec;
+    std::filesystem::create_directories(
+        std::filesystem::path(layer_store_->root()) / image.id(), ec);
+    finishTask(tasks_.find(image));
+    return;
+  }
+  // last, the task may finish here
+  for (auto &layer_name : present_layers) {
+    finishLayer(image, linkLayer(image, layer_name));
+  }
+}
 
+void OffloadClientEpoll::preparePrefetch(const OffloadElement &task) {
+  auto image = MetadataService::normalize(task.image_name_tag);
+  auto it_tasks = tasks_.find(image);
+  if (it_tasks != tasks_.end()) {
+    SPDLOG_INFO("Image {} is being pulled, prefetch waits for it", image.id());
+    it_tasks->second.conns.emplace_back(task.conn);
+    return;
+  }
+  auto info = metadata_service_->find(image);
+  if (info == nullptr) {
+    loadMetadata(task);
+    return;
+  }
+  auto layers = info->layers;
+  for (auto i : info->pull_order) {
+    layer_store_->pin(layers[i]);
+    prefetch_layers_.emplace_back(image, layers[i]);
+  }
+  SPDLOG_INFO("Prefetch image {}, {} layers", image.id(), layers.size());
+  auto &task_info =
+      tasks_.emplace(image, TaskInfo{task.conn, std::move(layers)})
+          .first->second;
+  task_info.prefetch = true;
+  task_info.priority = task.priority;
+  if (task_info.total_layers == 0) {
+    finishTask(tasks_.find(image));
+    return;
+  }
+  if (!tryOffloadTask()) {
+    SPDLOG_ERROR("Do offloadTask error");
+  }
+}
+
+void OffloadClientEpoll::promotePrefetch(const ImageNameTag &image,
+                                         TaskInfo &task_info) {
+  SPDLOG_INFO("Prefetch of image {} becomes a pull", image.id());
+  task_info.prefetch = false;
+  pull_tasks_++;
+  std::vector<std::string> present_layers;
+  if (task_info.cancelled) {
+    // the pull needs the layers the cancel dropped, they no longer count as
+    // failed
+    int dropped = static_cast<int>(task_info.dropped_layers.size());
+    SPDLOG_INFO("Pull of image {} restarts {} layers of the cancelled "
+                "prefetch",
+                image.id(), dropped);
+    task_info.cancelled = false;
+    task_info.untar_layers -= dropped;
+    task_info.failed_layers -= dropped;
+    for (auto &layer : task_info.dropped_layers) {
+      startLayer(image, layer, task_info.priority, present_layers);
+    }
+    task_info.dropped_layers.clear();
+  }
+  for (auto it = prefetch_layers_.begin(); it != prefetch_layers_.end();) {
+    if (it->first.id() == image.id()) {
+      startLayer(image, it->second, task_info.priority, present_layers);
+      it = prefetch_layers_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (auto &layer_name : present_layers) {
+    finishLayer(image, linkLayer(image, layer_name));
+  }
+}
+
+void OffloadClientEpoll::fetchSegments(std::string image_name_tag,
+                                       std::string layer,
+                                       std::vector<int> segments) {
+  if (segments.empty()) {
+    return;
+  }
+  loop_->runInLoop([this, image_name_tag = std::move(image_name_tag),
+                    layer = std::move(layer),
+                    segments = std::move(segments)]() {
+    loop_->assertInLoopThread();
+    SPDLOG_DEBUG("Fetch {} segments of lazy layer {} from {}",
+                 segments.size(), layer, segments.front());
+    offload::LayerElement layer_element;
+    layer_element.set_layer(layer);
+    layer_element.set_image_name_tag(image_name_tag);
+    layer_element.set_priority(kLazyReadPriority);
+    for (int segment : segments) {
+      layer_element.add_segments(segment);
+    }
+    // a read waits for them, they go before the other layers of the image
+    unsent_layers_.pushFront(image_name_tag, std::move(layer_element), 1,
+                             kLazyReadPriority);
+    if (!tryOffloadTask()) {
+      SPDLOG_ERROR("Do offloadTask error");
+    }
+  });
+}
+
+bool OffloadClientEpoll::offloadTaskToDpu(
+    size_t session, const offload::OffloadRequest &offload_req,
+    const MsgConnection::SendBuf &free_buf) {
   // send OffloadRequest
-  inflight_sends_.emplace_back(free_buf.id);
+  auto &conn = sessions_[session].conn;
+  sessions_[session].inflight_sends.emplace_back(free_buf.id);
   auto send_buf = free_buf.addr;
   auto send_cap = free_buf.cap;
 
@@ -248,8 +719,10 @@ bool OffloadClientEpoll::offloadTaskToDpu(
     return false;
   }
   conn->send(send_buf, frame_len + sizeof(MsgType), wr_id_++);
-  SPDLOG_INFO("Send OffloadRequest. image {}. wr_id {}",
-              offload_req.image_name_tag(), wr_id_ - 1);
+  SPDLOG_INFO("Send OffloadRequest to DPU {}. first image {}, {} layers. "
+              "wr_id {}",
+              session, offload_req.image_name_tag(), offload_req.layers_size(),
+              wr_id_ - 1);
   return true;
 }
 } // namespace hdc::host::client
\ No newline at end of file
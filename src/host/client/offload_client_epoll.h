@@ -1,36 +1,81 @@
 #pragma once
+#include "host/client/layer_store.h"
+#include "host/client/lazy_fs.h"
+#include "host/client/layer_table.h"
 #include "host/client/metadata.h"
+#include "host/client/metadata_service.h"
 #include "network/EventLoop.h"
 #include "network/InetAddress.h"
-#include "network/rdma/Callbacks.h"
-#include "network/rdma/RdmaClient.h"
-#include "network/rdma/RdmaConfig.h"
-#include "network/rdma/RdmaConnection.h"
+#include "network/transport/Callbacks.h"
+#include "network/transport/Transport.h"
+#include "network/transport/TransportConfig.h"
+#include "network/transport/MsgConnection.h"
 #include "network/tcp/Callbacks.h"
 #include "offload.pb.h"
+#include "utils/sched_queue.h"
 #include <deque>
 #include <host/client/metadata.h>
 #include <map>
+#include <optional>
 #include <network/tcp/TcpConnection.h>
 #include <set>
+#include <vector>
 namespace hdc {
 namespace host {
 namespace client {
 using hdc::network::EventLoop;
 using hdc::network::InetAddress;
-using hdc::network::rdma::RdmaClient;
-using hdc::network::rdma::RdmaConfig;
-using hdc::network::rdma::RdmaConnectionPtr;
+using hdc::network::transport::createMsgClient;
+using hdc::network::transport::MsgClient;
+using hdc::network::transport::TransportConfig;
+using hdc::network::transport::Completion;
+using hdc::network::transport::MsgConnectionPtr;
 using hdc::network::tcp::TcpConnectionPtr;
-using hdc::network::rdma::RdmaConnection;
+using hdc::network::transport::MsgConnection;
+using hdc::utils::SchedPolicy;
+using hdc::utils::SchedQueue;
+
+/// @brief: A DPU the layers are offloaded to, through its offload server.
+struct DpuPeer {
+  InetAddress addr;
+  TransportConfig transport_config;
+};
+
+/// @brief: Offloads the layers of the pulls to the DPUs of `peers`, each
+/// layer to one of them. A request goes to the connected DPU with the fewest
+/// layers in flight, round robin among the equally loaded ones, so that the
+/// DPUs of a host share the pulls.
 class OffloadClientEpoll {
 public:
-  OffloadClientEpoll(EventLoop *loop, const InetAddress &listenAddr,
-                     RdmaConfig rdmaConfig, std::string metadata_path);
-
-  /// @brief: Try to offload a task to DPU. thread safe.
+  OffloadClientEpoll(EventLoop *loop, std::vector<DpuPeer> peers,
+                     MetadataService *metadata_service,
+                     LayerStore *layer_store,
+                     SchedPolicy sched_policy = SchedPolicy::kFifo,
+                     LazyFs *lazy_fs = nullptr);
+
+  /// @brief: Try to offload a task to DPU. A prefetch task is queued layer by
+  /// layer and offloaded only while no pull is running. thread safe.
   void offload(OffloadElement task);
 
+  /// @brief: Drop the layers of the prefetch of the image that are not
+  /// offloaded yet, and answer `conn` whether any was dropped. A prefetch
+  /// whose layers are all offloaded, or cancelled already, cannot be
+  /// cancelled and runs to its end. The prefetch is answered with a failure
+  /// once its offloaded layers are done, unless a pull joins it before, which
+  /// pulls the dropped layers again. Thread safe.
+  void cancelPrefetch(std::string image_name_tag, TcpConnectionPtr conn);
+
+  /// @brief: Answer `conn` how many layers of the pull or prefetch of the
+  /// image in flight are fetched by the DPUs, and how many are done. Thread
+  /// safe.
+  void queryProgress(std::string image_name_tag, TcpConnectionPtr conn);
+
+  /// @brief: Fetch the segments of a lazy layer that a read waits for,
+  /// before the layers waiting to be offloaded. No segments is a no-op.
+  /// Thread safe.
+  void fetchSegments(std::string image_name_tag, std::string layer,
+                     std::vector<int> segments);
+
   /// @brief: It will be called when a fetch->decompress->untar task is
   /// completed. It will send a response to CommandClient. Thread safe.
   void completeTask(UntarResult untar_res);
@@ -41,10 +86,21 @@ private:
   struct TaskInfo {
     int total_layers{0};
     int untar_layers{0};
-    TcpConnectionPtr conn{nullptr};
-    TaskInfo(int total_layers, int untar_layers, TcpConnectionPtr conn)
-        : total_layers(total_layers), untar_layers(untar_layers),
-          conn(std::move(conn)) {}
+    int failed_layers{0};
+    // no pull but prefetches wait for the image
+    bool prefetch{false};
+    // the prefetch is cancelled, its layers in flight drain
+    bool cancelled{false};
+    // the layers the cancel dropped, counted as failed until a pull joins
+    std::vector<std::string> dropped_layers;
+    int priority{0};
+    // the pulls of the image waiting for it
+    std::vector<TcpConnectionPtr> conns;
+    // the layers of the image, pinned in the LayerStore until it finishes
+    std::vector<std::string> layers;
+    TaskInfo(TcpConnectionPtr conn, std::vector<std::string> layers)
+        : total_layers(static_cast<int>(layers.size())),
+          conns{std::move(conn)}, layers(std::move(layers)) {}
     TaskInfo() {}
 
     TaskInfo(const TaskInfo &) = default;
@@ -55,50 +111,125 @@ private:
 
     TaskInfo &operator=(TaskInfo &&) = default;
   };
-  enum class MsgType : int { kDecompressConnection, kOffload };
+  enum class MsgType : int { kDecompressConnection, kOffload, kLayerProgress };
   using TaskMap = std::map<ImageNameTag, TaskInfo>;
-  // a layer may be used by multiple images.
-  using LayerMap = std::map<std::string, std::set<ImageNameTag>>;
-  using MetadataMap = std::map<ImageNameTag, ImageMetadata>;
 
-  RdmaClient client_;
+  struct DpuSession {
+    std::unique_ptr<MsgClient> client;
+    MsgConnectionPtr conn{nullptr};
+    bool connected{false};
+    // the bufpair_id of the sends waiting for their response
+    std::deque<size_t> inflight_sends;
+    // the layers offloaded to the DPU and not extracted yet
+    size_t inflight_layers{0};
+    // one receive of the DPU's messages is kept for the LayerProgressBatch,
+    // the DPU has one in flight at most
+    size_t max_inflight_sends{1};
+  };
+
+  std::vector<DpuSession> sessions_;
+  // the session of each layer in flight
+  std::map<std::string, size_t> layer_sessions_;
+  // the first session tried among the equally loaded ones
+  size_t next_session_{0};
   EventLoop *loop_;
-  std::deque<OffloadElement> pending_tasks_;
-  // record the bufpair_id of inflight_sends_;
-  std::deque<size_t> inflight_sends_;
-  std::string metadata_path_;
-  bool connected_{false};
-  RdmaConnectionPtr conn_{nullptr};
+  // the layers admitted but not sent to DPU yet, the sched policy picks the
+  // image
+  SchedQueue<offload::LayerElement> unsent_layers_;
+  // the layers of the prefetches not offloaded yet, (image, layer)
+  std::deque<std::pair<ImageNameTag, std::string>> prefetch_layers_;
+  // the number of the tasks in tasks_ that are not prefetches
+  size_t pull_tasks_{0};
+  // the layers offloaded for prefetches and not extracted yet
+  std::set<std::string> prefetch_inflight_;
+  // the layers in flight that the DPUs have fetched, being decompressed or
+  // extracted
+  std::set<std::string> fetched_layers_;
+  MetadataService *metadata_service_;
+  LayerStore *layer_store_;
+  // serves the layers not in layer_store_ for a lazy pull, may be null
+  LazyFs *lazy_fs_;
   TaskMap tasks_;
-  // LayerMap layers_;
-  MetadataMap metadatas_;
+  // a layer may be used by multiple images.
+  LayerTable layers_;
   uint64_t wr_id_{0};
 
-  void onConnected(const RdmaConnectionPtr &conn);
+  void onConnected(size_t session, const MsgConnectionPtr &conn);
 
-  void onRecvSuccess(const RdmaConnectionPtr &conn, uint8_t *recv_buf,
-                     uint32_t recv_len, const ibv_wc &wc);
+  void onRecvSuccess(size_t session, uint8_t *recv_buf, uint32_t recv_len,
+                     const Completion &wc);
 
-  void onRecvFail(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onRecvFail(const MsgConnectionPtr &conn, const Completion &wc);
 
-  void onSendCompleteSuccess(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                             const Completion &wc);
 
-  void onSendCompleteFail(const RdmaConnectionPtr &conn, const ibv_wc &wc);
+  void onSendCompleteFail(const MsgConnectionPtr &conn, const Completion &wc);
 
-  bool handleOffloadResponse(const offload::OffloadResponse &resp);
+  bool handleOffloadResponse(size_t session,
+                             const offload::OffloadResponse &resp);
 
-  bool handleDecompressConnectionResponse(
-      const offload::DecompressConnectionResponse &resp);
+  /// @brief: Record that a layer in flight is fetched by the DPU.
+  void handleLayerProgress(const offload::LayerProgress &progress);
 
-  /// @brief: Loads metadata to metadatas_. Return true if metadata is already
-  /// in the map or is loaded successfully. Otherwise returns false.
-  bool loadMetadata(const ImageNameTag &image);
-
-  /// @brief: Offload the task to DPU. It will query metadata and send request
-  /// to DPU. Not thread safe.
-  bool offloadTaskToDpu(const RdmaConnectionPtr &conn,
-                        const OffloadElement &task, const RdmaConnection::SendBuf &free_buf);
-  bool tryOffloadTask(const RdmaConnectionPtr &conn);
+  bool handleDecompressConnectionResponse(
+      size_t session, const offload::DecompressConnectionResponse &resp);
+
+  /// @brief: Ask MetadataService for the metadata of an image it has not
+  /// loaded, and offload the task again once it is loaded.
+  void loadMetadata(OffloadElement task);
+
+  /// @brief: Register the task in tasks_ and layers_. The layers that are
+  /// neither in the LayerStore nor in flight are queued in unsent_layers_,
+  /// the others are reused. A task whose metadata is not loaded yet is
+  /// deferred to loadMetadata(). Not thread safe.
+  void prepareTask(const OffloadElement &task);
+
+  /// @brief: Register a prefetch task in tasks_ and queue its layers in
+  /// prefetch_layers_. Not thread safe.
+  void preparePrefetch(const OffloadElement &task);
+
+  /// @brief: Turn the prefetch of `image` into a pull. Its queued layers, and
+  /// those a cancel dropped, are started at once. Not thread safe.
+  void promotePrefetch(const ImageNameTag &image, TaskInfo &task_info);
+
+  /// @brief: Start the next prefetch layer if no pull and no other prefetch
+  /// layer is running. Not thread safe.
+  void admitPrefetchLayer();
+
+  /// @brief: Reuse the layer if it is present or in flight, otherwise pull it
+  /// and queue it in unsent_layers_. With lazy_fs_, a layer that is neither
+  /// present nor in flight is served lazily and counts as present. The
+  /// present layers are added to `present_layers` and must be finished by the
+  /// caller. Return true if the layer is pulled. Not thread safe.
+  bool startLayer(const ImageNameTag &image, const std::string &layer,
+                  int priority, std::vector<std::string> &present_layers);
+
+  /// @brief: Send the OffloadRequest to the DPU of `session`. Not thread
+  /// safe.
+  bool offloadTaskToDpu(size_t session, const offload::OffloadRequest &req,
+                        const MsgConnection::SendBuf &free_buf);
+
+  /// @brief: The connected session with a free send buf and the fewest
+  /// layers in flight, nullopt if there is none. Not thread safe.
+  std::optional<size_t> pickSession() const;
+
+  /// @brief: Send the layers in unsent_layers_ to the DPUs, as many per
+  /// OffloadRequest as fit in a send buf while its DPU is still the least
+  /// loaded, until the send bufs run out. Not thread safe.
+  bool tryOffloadTask();
+
+  /// @brief: Make the layer in the LayerStore, or in LazyFs if it is not in
+  /// the store, visible in the directory of `image`.
+  bool linkLayer(const ImageNameTag &image, const std::string &layer);
+
+  /// @brief: Count a layer of `image` and answer its pulls once all layers
+  /// are done.
+  void finishLayer(const ImageNameTag &image, bool success);
+
+  /// @brief: Answer the pulls of a task whose layers are all done, or which
+  /// has none, and drop it.
+  void finishTask(TaskMap::iterator it_tasks);
 };
 } // namespace client
 } // namespace host
@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <cstring>
+#include <host/client/tar_index.h>
+#include <spdlog/spdlog.h>
+
+namespace hdc::host::client {
+
+namespace {
+// the offsets and sizes of the ustar header fields
+constexpr size_t kNameOff = 0, kNameLen = 100;
+constexpr size_t kModeOff = 100, kModeLen = 8;
+constexpr size_t kUidOff = 108, kUidLen = 8;
+constexpr size_t kGidOff = 116, kGidLen = 8;
+constexpr size_t kSizeOff = 124, kSizeLen = 12;
+constexpr size_t kMtimeOff = 136, kMtimeLen = 12;
+constexpr size_t kTypeOff = 156;
+constexpr size_t kLinkOff = 157, kLinkLen = 100;
+constexpr size_t kMagicOff = 257;
+constexpr size_t kDevMajorOff = 329, kDevMinorOff = 337, kDevLen = 8;
+constexpr size_t kPrefixOff = 345, kPrefixLen = 155;
+
+std::string field(const char *block, size_t off, size_t len) {
+  const char *begin = block + off;
+  return std::string(begin, strnlen(begin, len));
+}
+
+/// octal, or base-256 with the high bit set for the GNU large numbers
+uint64_t number(const char *block, size_t off, size_t len) {
+  auto *p = reinterpret_cast<const uint8_t *>(block + off);
+  uint64_t value = 0;
+  if (p[0] & 0x80) {
+    value = p[0] & 0x7f;
+    for (size_t i = 1; i < len; ++i) {
+      value = (value << 8) | p[i];
+    }
+    return value;
+  }
+  size_t i = 0;
+  while (i < len && (p[i] == ' ' || p[i] == '\0')) {
+    ++i;
+  }
+  for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i) {
+    value = (value << 3) | (p[i] - '0');
+  }
+  return value;
+}
+
+uint64_t padding(uint64_t size) { return (512 - size % 512) % 512; }
+
+/// "./a/b/" -> "a/b"
+std::string normalizePath(std::string path) {
+  while (path.compare(0, 2, "./") == 0) {
+    path.erase(0, 2);
+  }
+  while (!path.empty() && path.front() == '/') {
+    path.erase(0, 1);
+  }
+  while (!path.empty() && path.back() == '/') {
+    path.pop_back();
+  }
+  return path == "." ? "" : path;
+}
+} // namespace
+
+void TarIndexer::feed(const uint8_t *data, size_t len) {
+  while (len > 0 && !done()) {
+    if (skip_ > 0) {
+      auto n = static_cast<size_t>(std::min<uint64_t>(skip_, len));
+      skip_ -= n;
+      pos_ += n;
+      data += n;
+      len -= n;
+      continue;
+    }
+    if (extension_left_ > 0) {
+      auto n = static_cast<size_t>(std::min<uint64_t>(extension_left_, len));
+      if (extension_ != Extension::kSkip) {
+        extension_data_.append(reinterpret_cast<const char *>(data), n);
+      }
+      extension_left_ -= n;
+      pos_ += n;
+      data += n;
+      len -= n;
+      if (extension_left_ == 0) {
+        finishExtension();
+        skip_ = extension_padding_;
+      }
+      continue;
+    }
+    auto n = std::min(kBlockSize - block_.size(), len);
+    block_.append(reinterpret_cast<const char *>(data), n);
+    pos_ += n;
+    data += n;
+    len -= n;
+    if (block_.size() == kBlockSize) {
+      parseHeader();
+      block_.clear();
+    }
+  }
+}
+
+void TarIndexer::parseHeader() {
+  const char *block = block_.data();
+  if (std::all_of(block_.begin(), block_.end(),
+                  [](char c) { return c == '\0'; })) {
+    // two zero blocks end the archive
+    done_ = ++zero_blocks_ == 2;
+    return;
+  }
+  zero_blocks_ = 0;
+  if (memcmp(block + kMagicOff, "ustar", 5) != 0) {
+    SPDLOG_ERROR("Tar header at offset {} has no ustar magic",
+                 pos_ - kBlockSize);
+    failed_ = true;
+    return;
+  }
+  char type = block[kTypeOff];
+  uint64_t size = number(block, kSizeOff, kSizeLen);
+  if (!in_entry_) {
+    header_offset_ = pos_ - kBlockSize;
+    in_entry_ = true;
+  }
+
+  // the extensions describe the next entry
+  Extension extension = Extension::kNone;
+  switch (type) {
+  case 'L':
+    extension = Extension::kLongName;
+    break;
+  case 'K':
+    extension = Extension::kLongLink;
+    break;
+  case 'x':
+    extension = Extension::kPax;
+    break;
+  case 'g':
+    extension = Extension::kSkip;
+    break;
+  default:
+    break;
+  }
+  if (extension != Extension::kNone) {
+    extension_ = extension;
+    extension_data_.clear();
+    extension_left_ = size;
+    extension_padding_ = padding(size);
+    if (size == 0) {
+      finishExtension();
+    }
+    return;
+  }
+
+  if (pax_size_ >= 0) {
+    size = static_cast<uint64_t>(pax_size_);
+  }
+  std::string path;
+  if (!pax_path_.empty()) {
+    path = pax_path_;
+  } else if (!long_name_.empty()) {
+    path = long_name_;
+  } else {
+    path = field(block, kNameOff, kNameLen);
+    auto prefix = field(block, kPrefixOff, kPrefixLen);
+    if (!prefix.empty()) {
+      path = prefix + "/" + path;
+    }
+  }
+  std::string link = !pax_link_.empty()    ? pax_link_
+                     : !long_link_.empty() ? long_link_
+                                           : field(block, kLinkOff, kLinkLen);
+  long_name_.clear();
+  long_link_.clear();
+  pax_path_.clear();
+  pax_link_.clear();
+  pax_size_ = -1;
+  in_entry_ = false;
+
+  // the data of a link, a directory or a device takes no room
+  bool has_data = type == '0' || type == '\0' || type == '7';
+  skip_ = has_data ? size + padding(size) : 0;
+
+  path = normalizePath(std::move(path));
+  if (path.empty()) {
+    return;
+  }
+  auto *entry = index_.add_entries();
+  entry->set_path(std::move(path));
+  entry->set_type(type == '\0' ? '0' : type);
+  entry->set_mode(static_cast<uint32_t>(number(block, kModeOff, kModeLen)));
+  entry->set_size(has_data ? size : 0);
+  entry->set_offset(pos_);
+  entry->set_header_offset(header_offset_);
+  if (type == '1') {
+    // a hard link names another entry of the layer
+    entry->set_link(normalizePath(std::move(link)));
+  } else if (type == '2') {
+    entry->set_link(std::move(link));
+  }
+  entry->set_mtime(static_cast<int64_t>(number(block, kMtimeOff, kMtimeLen)));
+  entry->set_uid(static_cast<uint32_t>(number(block, kUidOff, kUidLen)));
+  entry->set_gid(static_cast<uint32_t>(number(block, kGidOff, kGidLen)));
+  if (type == '3' || type == '4') {
+    auto major = number(block, kDevMajorOff, kDevLen);
+    auto minor = number(block, kDevMinorOff, kDevLen);
+    entry->set_rdev((major << 8) | minor);
+  }
+  if (entry_cb_) {
+    entry_cb_(*entry);
+  }
+}
+
+void TarIndexer::finishExtension() {
+  auto &data = extension_data_;
+  switch (extension_) {
+  case Extension::kLongName:
+    long_name_.assign(data.c_str());
+    break;
+  case Extension::kLongLink:
+    long_link_.assign(data.c_str());
+    break;
+  case Extension::kPax: {
+    // records of "<length> <key>=<value>\n"
+    size_t off = 0;
+    while (off < data.size()) {
+      auto space = data.find(' ', off);
+      if (space == std::string::npos) {
+        break;
+      }
+      auto record_len = std::strtoull(data.c_str() + off, nullptr, 10);
+      if (record_len == 0 || off + record_len > data.size()) {
+        break;
+      }
+      auto record = data.substr(space + 1, off + record_len - space - 2);
+      off += record_len;
+      auto eq = record.find('=');
+      if (eq == std::string::npos) {
+        continue;
+      }
+      auto key = record.substr(0, eq);
+      auto value = record.substr(eq + 1);
+      if (key == "path") {
+        pax_path_ = std::move(value);
+      } else if (key == "linkpath") {
+        pax_link_ = std::move(value);
+      } else if (key == "size") {
+        pax_size_ = static_cast<int64_t>(std::strtoull(value.c_str(), nullptr,
+                                                       10));
+      }
+    }
+    break;
+  }
+  case Extension::kNone:
+  case Extension::kSkip:
+    break;
+  }
+  extension_ = Extension::kNone;
+  data.clear();
+}
+
+void locateEntries(layer_index::LayerIndex &index) {
+  // the offset in the tar stream where each segment starts
+  std::vector<uint64_t> starts{0};
+  for (auto size : index.segment_sizes()) {
+    starts.push_back(starts.back() + size);
+  }
+  for (auto &entry : *index.mutable_entries()) {
+    auto it = std::upper_bound(starts.begin(), starts.end(), entry.offset());
+    auto segment = static_cast<int>(it - starts.begin()) - 1;
+    // an empty file at the end of the stream is past the last segment
+    segment = std::min(segment, std::max(index.segment_sizes_size() - 1, 0));
+    entry.set_segment(segment);
+    entry.set_segment_offset(entry.offset() - starts[segment]);
+  }
+}
+
+} // namespace hdc::host::client
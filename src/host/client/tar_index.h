@@ -0,0 +1,92 @@
+#pragma once
+#include "layer_index.pb.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace hdc {
+namespace host {
+namespace client {
+
+/// @brief: Builds the LayerIndex of a layer from its uncompressed tar stream,
+/// fed in order and in pieces of any size, so that the files are known while
+/// the layer is still being fetched. It understands ustar, the GNU long names
+/// and the pax path, linkpath and size records. The segment sizes are not
+/// known by the indexer, the caller adds them. Not thread safe.
+class TarIndexer {
+public:
+  /// @brief: Called with each entry once its header is parsed, before its
+  /// data is fed.
+  using EntryCallback = std::function<void(const layer_index::FileEntry &)>;
+
+  explicit TarIndexer(EntryCallback entry_cb = nullptr)
+      : entry_cb_(std::move(entry_cb)) {}
+
+  void feed(const uint8_t *data, size_t len);
+
+  /// @brief: The end of the archive is reached or the stream is not a tar.
+  bool done() const { return done_ || failed_; }
+
+  bool failed() const { return failed_; }
+
+  /// @brief: The bytes of the stream fed so far.
+  uint64_t position() const { return pos_; }
+
+  /// @brief: The bytes of entry data and padding the next feed() skips. A
+  /// caller that only wants the index seeks over them and calls skip().
+  uint64_t pendingSkip() const { return skip_; }
+
+  /// @brief: Skip `len` bytes of pendingSkip() without feeding them.
+  void skip(uint64_t len) {
+    len = std::min(len, skip_);
+    skip_ -= len;
+    pos_ += len;
+  }
+
+  layer_index::LayerIndex &index() { return index_; }
+
+private:
+  static constexpr size_t kBlockSize = 512;
+
+  enum class Extension { kNone, kLongName, kLongLink, kPax, kSkip };
+
+  void parseHeader();
+
+  void finishExtension();
+
+  EntryCallback entry_cb_;
+  layer_index::LayerIndex index_;
+  uint64_t pos_{0};
+  // a header block not fed in full yet
+  std::string block_;
+  // the bytes of the data of the current entry and its padding to skip
+  uint64_t skip_{0};
+  // the data of a GNU long name or a pax header, read before its entry
+  Extension extension_{Extension::kNone};
+  std::string extension_data_;
+  uint64_t extension_left_{0};
+  uint64_t extension_padding_{0};
+  // what the extensions set for the next entry
+  std::string long_name_;
+  std::string long_link_;
+  std::string pax_path_;
+  std::string pax_link_;
+  int64_t pax_size_{-1};
+  // the offset of the first header of the entry being parsed
+  uint64_t header_offset_{0};
+  bool in_entry_{false};
+  int zero_blocks_{0};
+  bool done_{false};
+  bool failed_{false};
+};
+
+/// @brief: Set the segment and the segment offset of the entries of `index`
+/// from their offsets and the segment sizes.
+void locateEntries(layer_index::LayerIndex &index);
+
+} // namespace client
+} // namespace host
+} // namespace hdc
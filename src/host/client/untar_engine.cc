@@ -1,35 +1,59 @@
 
 #include "folly/concurrency/ConcurrentHashMap.h"
 #include <chrono>
+#include <folly/executors/thread_factory/InitThreadFactory.h>
+#include <folly/executors/thread_factory/NamedThreadFactory.h>
 #include <host/client/untar_engine.h>
 #include <spdlog/spdlog.h>
 #include <string>
+#include <utils/affinity.h>
+#include <utils/codec.h>
 namespace hdc::host::client {
 
 const std::string UntarEngine::untar_command_prefix = "tar xf - -C ";
 
 void UntarEngine::untar_task(
-    UntarDataQueuePtr task_queue, OffloadClientEpoll *offload_client,
+    UntarDataQueuePtr task_queue, const UntarCompleteCallback &complete_cb,
     std::string cmd, std::string layer, std::string image_name_tag,
     folly::ConcurrentHashMap<std::string, UntarDataQueuePtr> &untar_map) {
   auto start_time = std::chrono::high_resolution_clock::now();
   FILE *fd = popen(cmd.c_str(), "w");
+  // the later segments of a failed layer find no task and are dropped
+  auto fail = [&]() {
+    if (fd != nullptr) {
+      pclose(fd);
+    }
+    untar_map.erase(layer);
+    complete_cb(
+        UntarResult{std::move(layer), std::move(image_name_tag), false});
+  };
   if (!fd) {
     SPDLOG_ERROR("Error executing tar command, layer {}.", layer);
-    offload_client->completeTask(
-        UntarResult{std::move(layer), std::move(image_name_tag), false});
+    fail();
     return;
   }
   SPDLOG_INFO("Untar task start. cmd: {}", cmd);
+  size_t bytes = 0;
   while (true) {
     auto data = task_queue->dequeue();
+    if (data.failed_) {
+      SPDLOG_ERROR("Segment {} of layer {} failed on the DPU", data.index_,
+                   data.layer_);
+      fail();
+      return;
+    }
+    if (!utils::softDecompress(data.codec_, data.segment_)) {
+      SPDLOG_ERROR("Decompress {} segment {} of layer {} error",
+                   utils::codecName(data.codec_), data.index_, data.layer_);
+      fail();
+      return;
+    }
     auto res = fwrite(data.segment_.data(), 1, data.segment_.size(), fd);
-    if (res == 0) {
-      SPDLOG_ERROR("Untar error: image {}, index {}, total {}", data.layer_,
+    bytes += data.segment_.size();
+    if (res != data.segment_.size()) {
+      SPDLOG_ERROR("Untar error: layer {}, index {}, total {}", data.layer_,
                    data.index_, data.total_segments_);
-      pclose(fd);
-      offload_client->completeTask(
-          UntarResult{std::move(layer), std::move(image_name_tag), false});
+      fail();
       return;
     }
     if (data.index_ == (data.total_segments_ - 1)) {
@@ -45,33 +69,51 @@ void UntarEngine::untar_task(
 
   if (status != 0) {
     SPDLOG_ERROR("Untar task close error. layer {}. status {}", layer, status);
-    offload_client->completeTask(
+    complete_cb(
         UntarResult{std::move(layer), std::move(image_name_tag), false});
   } else {
     SPDLOG_INFO("Untar task finish: layer {}", layer);
-    offload_client->completeTask(
-        UntarResult{std::move(layer), std::move(image_name_tag), true});
+    complete_cb(
+        UntarResult{std::move(layer), std::move(image_name_tag), true, bytes});
   }
   return;
 }
 
-UntarEngine::UntarEngine(size_t numThreads, OffloadClientEpoll *offload_client,
-                         std::string untar_file_path)
-    : untar_map_(), executor_(numThreads), offload_client_(offload_client),
+UntarEngine::UntarEngine(size_t numThreads, UntarCompleteCallback complete_cb,
+                         std::string untar_file_path, std::vector<int> cpus)
+    : untar_map_(),
+      executor_(numThreads,
+                std::make_shared<folly::InitThreadFactory>(
+                    std::make_shared<folly::NamedThreadFactory>("Untar"),
+                    // the threads are started as untar() is called, from a
+                    // thread which may run elsewhere
+                    [cpus = cpus.empty() ? utils::threadCpus()
+                                         : std::move(cpus)] {
+                      utils::pinThread(cpus);
+                    })),
+      complete_cb_(std::move(complete_cb)),
       untar_file_path_(std::move(untar_file_path)) {}
 
 void UntarEngine::untar(UntarData data) {
   const auto layer = data.layer_;
-  const auto &image = data.image_name_tag_;
   auto it = untar_map_.find(layer);
+  if (it == untar_map_.end() && data.index_ != 0) {
+    // its task failed on an earlier segment and the layer is reported
+    SPDLOG_DEBUG("Drop segment {} of failed layer {}", data.index_, layer);
+    return;
+  }
+  if (it == untar_map_.end() && data.failed_) {
+    SPDLOG_ERROR("Segment 0 of layer {} failed on the DPU", layer);
+    complete_cb_(UntarResult{layer, std::move(data.image_name_tag_), false});
+    return;
+  }
   if (it == untar_map_.end()) {
-    // create file for image
-    auto file_path = untar_file_path_ + "/" + image + "/" + layer;
-    if (!std::filesystem::exists(file_path)) {
-      std::filesystem::create_directories(file_path);
-      // SPDLOG_INFO("Crete directory {}", file_path);
-    } else {
-      SPDLOG_ERROR("Create directory {} error", file_path);
+    // extract into the staging directory, LayerStore publishes it
+    auto file_path = LayerStore::stagingPath(untar_file_path_, layer);
+    std::error_code ec;
+    std::filesystem::remove_all(file_path, ec);
+    if (!std::filesystem::create_directories(file_path, ec)) {
+      SPDLOG_ERROR("Create directory {} error: {}", file_path, ec.message());
     }
     // create task
     auto cmd = untar_command_prefix + file_path;
@@ -79,7 +121,7 @@ void UntarEngine::untar(UntarData data) {
 
     executor_.add([task_queue, cmd = std::move(cmd), layer = layer,
                    image = data.image_name_tag_, this]() {
-      untar_task(std::move(task_queue), this->offload_client_, std::move(cmd),
+      untar_task(std::move(task_queue), this->complete_cb_, std::move(cmd),
                  std::move(layer), std::move(image), untar_map_);
     });
     task_queue->enqueue(std::move(data));
@@ -15,8 +15,9 @@
 #include <spdlog/spdlog.h>
 #include <string>
 #include <sys/types.h>
+#include <vector>
+#include <host/client/layer_store.h>
 #include <host/client/metadata.h>
-#include <host/client/offload_client_epoll.h>
 
 namespace hdc {
 namespace host {
@@ -27,6 +28,8 @@ using UntarResultQueue = folly::UMPSCQueue<UntarResult, false>;
 using UntarResultQueuePtr = std::shared_ptr<UntarResultQueue>;
 using UntarDataQueue = folly::USPSCQueue<UntarData, false>;
 using UntarDataQueuePtr = std::shared_ptr<UntarDataQueue>;
+/// @brief: Called in an untar thread once a layer is extracted or failed.
+using UntarCompleteCallback = std::function<void(UntarResult)>;
 
 class UntarEngine {
 
@@ -36,19 +39,24 @@ private:
   folly::ConcurrentHashMap<std::string, UntarDataQueuePtr> untar_map_;
   folly::CPUThreadPoolExecutor executor_;
   // UntarResultQueuePtr result_producer_;
-  OffloadClientEpoll* offload_client_;
+  UntarCompleteCallback complete_cb_;
   const std::string untar_file_path_;
 
 
   static void untar_task(
-      UntarDataQueuePtr task_queue, OffloadClientEpoll* offload_client,
+      UntarDataQueuePtr task_queue, const UntarCompleteCallback &complete_cb,
       std::string cmd, std::string layer, std::string image_name_tag,
       folly::ConcurrentHashMap<std::string, UntarDataQueuePtr> &untar_map);
 
 public:
-  UntarEngine(size_t numThreads, OffloadClientEpoll* offload_client,
-              std::string untar_file_path);
+  /// @brief: The untar threads run on `cpus`, on those of the constructing
+  /// thread if it is empty.
+  UntarEngine(size_t numThreads, UntarCompleteCallback complete_cb,
+              std::string untar_file_path, std::vector<int> cpus = {});
 
+  /// @brief: Extract a segment of a layer, the segments of a layer come in
+  /// order. A failed segment fails its layer and the segments after it are
+  /// dropped.
   void untar(UntarData data);
 };
 } // namespace client
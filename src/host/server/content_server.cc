@@ -1,25 +1,25 @@
+#include "host/server/content_server.h"
 #include "content.pb.h"
-#include "network/EventLoop.h"
-#include "network/InetAddress.h"
-#include "network/rdma/Callbacks.h"
-#include "network/rdma/RdmaConfig.h"
+#include "network/transport/Callbacks.h"
+#include "utils/codec.h"
 #include "utils_file.h"
 #include "utils_verify.h"
 #include <cstddef>
+#include <cstring>
 #include <fstream>
-#include <gflags/gflags.h>
-#include <network/rdma/RdmaConnection.h>
-#include <network/rdma/RdmaServer.h>
 #include <spdlog/common.h>
 #include <spdlog/spdlog.h>
 #include <utility>
 #include <utils/MsgFrame.h>
+#include <vector>
 
-using hdc::network::EventLoop;
-using hdc::network::InetAddress;
-using hdc::network::rdma::RdmaConfig;
-using hdc::network::rdma::RdmaConnectionPtr;
-using hdc::network::rdma::RdmaServer;
+namespace hdc {
+namespace host {
+namespace server {
+
+namespace {
+// the index of a GetLayerRequest for the LayerIndex of the layer
+constexpr int kLayerIndexRequest = -1;
 
 int get_int_from_file(std::string path) {
   std::ifstream file(path);
@@ -36,154 +36,226 @@ int get_int_from_file(std::string path) {
   return value;
 }
 
-DEFINE_string(content_server_ib_dev_name, "mlx5_0",
-              "The IB device name of host ContentServer");
-DEFINE_int32(content_server_ib_dev_port, 1,
-             "The IB device port of host ContentServer");
-DEFINE_string(content_server_listen_ip, "172.24.46.186",
-              "The IP address of host ContentServer to listen");
-DEFINE_uint32(content_server_listen_port, 9002,
-              "The IP port of host ContentServer to listen");
-DEFINE_uint64(
-    content_server_rdma_mem, 129 * 1024 * 1024,
-    "The memory of RDMA sendbuf/recvbuf for host ContentServer in bytes");
-DEFINE_uint64(content_server_rdma_mem_num, 4,
-              "The number of RDMA sendbuf/recvbuf");
-DEFINE_string(content_server_registry_path, "data/registry/content_layers/",
-              "Root path of image layers for registry");
-DEFINE_bool(content_server_layer_is_compressed, true,
-            "The layer is compressed or not");
-class ContentServer {
-
-public:
-  ContentServer(EventLoop *loop, const InetAddress &listenAddr,
-                const std::string &name, RdmaConfig rdmaConfig,
-                const std::string &registry_path)
-      : server_(loop, listenAddr, name, std::move(rdmaConfig)),
-        registry_path_(registry_path) {
-    server_.setConnectedCallback(
-        [this](const RdmaConnectionPtr &conn) { this->onConnected(conn); });
-    server_.setRecvSuccessCallback([this](const RdmaConnectionPtr &conn,
-                                          uint8_t *recv_buf, uint32_t recv_len,
-                                          const ibv_wc &wc) {
-      this->onRecvSuccess(conn, recv_buf, recv_len, wc);
-    });
-    server_.setRecvFailCallback(
-        [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
-          this->onRecvFail(conn, wc);
-        });
-    server_.setSendCompleteSuccessCallback(
-        [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
-          this->onSendCompleteSuccess(conn, wc);
-        });
-    server_.setSendCompleteFailCallback(
-        [this](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
-          this->onSendCompleteFail(conn, wc);
-        });
+/// @brief: The non-empty lines of a file, none if it does not exist.
+std::vector<std::string> get_lines_from_file(const std::string &path) {
+  std::vector<std::string> lines;
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty()) {
+      lines.emplace_back(std::move(line));
+    }
   }
-  void start() {
-    SPDLOG_INFO("Content Server start");
-    server_.start();
+  return lines;
+}
+} // namespace
+
+ContentServer::ContentServer(EventLoop *loop, const InetAddress &listenAddr,
+                             const std::string &name,
+                             TransportConfig transportConfig,
+                             const std::string &registry_path,
+                             bool layer_is_compressed)
+    : server_(createMsgServer(loop, listenAddr, name, transportConfig)),
+      registry_path_(registry_path), layer_is_compressed_(layer_is_compressed) {
+  server_->setConnectedCallback(
+      [this](const MsgConnectionPtr &conn) { this->onConnected(conn); });
+  server_->setRecvSuccessCallback([this](const MsgConnectionPtr &conn,
+                                         uint8_t *recv_buf, uint32_t recv_len,
+                                         const Completion &wc) {
+    this->onRecvSuccess(conn, recv_buf, recv_len, wc);
+  });
+  server_->setRecvFailCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
+        this->onRecvFail(conn, wc);
+      });
+  server_->setSendCompleteSuccessCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
+        this->onSendCompleteSuccess(conn, wc);
+      });
+  server_->setSendCompleteFailCallback(
+      [this](const MsgConnectionPtr &conn, const Completion &wc) {
+        this->onSendCompleteFail(conn, wc);
+      });
+}
+
+void ContentServer::start() {
+  SPDLOG_INFO("Content Server start");
+  server_->start();
+}
+
+void ContentServer::onConnected(const MsgConnectionPtr &conn) {
+  SPDLOG_INFO("new RDMA connection");
+}
+
+const ContentServer::LayerMeta *
+ContentServer::layerMeta(const std::string &layer_digest) {
+  auto it = layer_metas_.find(layer_digest);
+  if (it != layer_metas_.end()) {
+    return &it->second;
+  }
+  auto layer_path = registry_path_ + "/" + layer_digest + "/";
+  int total_segments = get_int_from_file(layer_path + "total_segment.txt");
+  if (total_segments < 0) {
+    return nullptr;
   }
+  LayerMeta meta{total_segments,
+                 get_lines_from_file(layer_path + "recipe.txt")};
+  return &layer_metas_.emplace(layer_digest, std::move(meta)).first->second;
+}
 
-  void onConnected(const RdmaConnectionPtr &conn) {
-    SPDLOG_INFO("new RDMA connection");
+void ContentServer::sendError(const MsgConnectionPtr &conn,
+                              const MsgConnection::SendBuf &free_buf,
+                              content::GetLayerResponse &resp,
+                              const std::string &error) {
+  resp.set_error(error);
+  resp.set_segment_size(0);
+  resp.clear_chunk();
+  resp.clear_chunks();
+  auto frame_len = serializeRdmaPbMsg(free_buf.addr, free_buf.cap, resp);
+  if (frame_len < 0) {
+    SPDLOG_ERROR("Serialize error GetLayerResponse of layer {} failed",
+                 resp.layer());
+    conn->releaseSendBuf(free_buf.id);
+    return;
   }
+  SPDLOG_DEBUG("Send error GetLayerResponse. layer: {}, idx: {}, error: {}",
+               resp.layer(), resp.index(), error);
+  conn->send(free_buf.addr, frame_len, 0);
+  conn->releaseSendBuf(free_buf.id);
+}
 
-  void onRecvSuccess(const RdmaConnectionPtr &conn, uint8_t *recv_buf,
-                     uint32_t recv_len, const ibv_wc &wc) {
-    auto get_layer_req = content::GetLayerRequest();
-    if (!parseRdmaPbMsg(recv_buf, recv_len, get_layer_req)) {
-      SPDLOG_ERROR("Parse GetLayerRequest error");
-      return;
-    }
-    SPDLOG_INFO(
-        "Recv GetLayerRequest. image_name_tag: {}, layer: {}, index: {}",
-        get_layer_req.image_name_tag(), get_layer_req.layer(),
-        get_layer_req.index());
-    auto &layer_digest = get_layer_req.layer();
-    if (!util_valid_digest(layer_digest.c_str())) {
-      SPDLOG_ERROR("GetLayerRequest layer id {} error, len {}, strlen {}",
-                   layer_digest, layer_digest.length(),
-                   strlen(layer_digest.c_str()));
-    }
-    auto index = get_layer_req.index();
+void ContentServer::onRecvSuccess(const MsgConnectionPtr &conn,
+                                  uint8_t *recv_buf, uint32_t recv_len,
+                                  const Completion &wc) {
+  auto get_layer_req = content::GetLayerRequest();
+  if (!parseRdmaPbMsg(recv_buf, recv_len, get_layer_req)) {
+    SPDLOG_ERROR("Parse GetLayerRequest error");
+    return;
+  }
+  SPDLOG_DEBUG("Recv GetLayerRequest. image_name_tag: {}, layer: {}, index: {}",
+               get_layer_req.image_name_tag(), get_layer_req.layer(),
+               get_layer_req.index());
+  // a client sends at most as many requests as there are send buffers
+  auto free_buf = conn->acquireFreeSendBuf();
+  if (!free_buf.has_value()) {
+    SPDLOG_ERROR("No send buf for GetLayerResponse of layer {}",
+                 get_layer_req.layer());
+    return;
+  }
+  auto &layer_digest = get_layer_req.layer();
+  auto index = get_layer_req.index();
+  auto get_layer_resp = content::GetLayerResponse();
+  get_layer_resp.set_layer(layer_digest);
+  get_layer_resp.set_index(index);
+  get_layer_resp.set_image_name_tag(get_layer_req.image_name_tag());
+  get_layer_resp.set_iscompressed(false);
+  get_layer_resp.set_segment_size(0);
+  get_layer_resp.set_total_segments(get_layer_req.total_segments());
+  if (!util_valid_digest(layer_digest.c_str())) {
+    SPDLOG_ERROR("GetLayerRequest layer id {} error, len {}, strlen {}",
+                 layer_digest, layer_digest.length(),
+                 strlen(layer_digest.c_str()));
+    sendError(conn, *free_buf, get_layer_resp, "invalid layer digest");
+    return;
+  }
+  const bool is_layer_index = index == kLayerIndexRequest;
 
-    auto index_path = registry_path_ + "/" + layer_digest + "/" +
-                      std::to_string(index) + ".tar.gz";
-    if (!util_file_exists(index_path.c_str())) {
-      SPDLOG_ERROR("Layer dir {} not exsit", index_path);
+  auto layer_path = registry_path_ + "/" + layer_digest + "/";
+  auto *meta = layerMeta(layer_digest);
+  if (meta == nullptr) {
+    sendError(conn, *free_buf, get_layer_resp, "layer not found");
+    return;
+  }
+  get_layer_resp.set_total_segments(meta->total_segments);
+  auto index_path = layer_path + "index.pb";
+  // a .tar.gz of a registry of uncompressed layers is a plain tar
+  auto codec = is_layer_index         ? content::UNCOMPRESSED
+               : layer_is_compressed_ ? content::DEFLATE
+                                      : content::UNCOMPRESSED;
+  if (!is_layer_index) {
+    index_path = layer_path + std::to_string(index) + ".tar.gz";
+    for (auto accept : get_layer_req.accept_codecs()) {
+      auto accepted = static_cast<content::Codec>(accept);
+      if (accepted == content::DEFLATE) {
+        break;
+      }
+      auto path = layer_path + std::to_string(index) +
+                  utils::codecExtension(accepted);
+      if (util_file_exists(path.c_str())) {
+        index_path = std::move(path);
+        codec = accepted;
+        break;
+      }
     }
+  }
+  auto segment_size = util_file_size(index_path.c_str());
+  if (segment_size <= 0) {
+    SPDLOG_ERROR("Segment file {} is missing or empty, size {}", index_path,
+                 segment_size);
+    sendError(conn, *free_buf, get_layer_resp, "segment not found");
+    return;
+  }
 
-    auto get_layer_resp = content::GetLayerResponse();
-    get_layer_resp.set_layer(layer_digest);
-    get_layer_resp.set_index(index);
-    get_layer_resp.set_iscompressed(FLAGS_content_server_layer_is_compressed);
-    auto total_segments_path =
-        registry_path_ + "/" + layer_digest + "/total_segment.txt";
-    get_layer_resp.set_total_segments(get_int_from_file(total_segments_path));
-    auto segment_size = util_file_size(index_path.c_str());
-    if (segment_size <= 0) {
-      SPDLOG_ERROR("GetLayerRequest segment size is %d", segment_size);
-      return;
+  get_layer_resp.set_iscompressed(codec != content::UNCOMPRESSED);
+  get_layer_resp.set_codec(codec);
+  get_layer_resp.set_segment_size(segment_size);
+  if (!is_layer_index) {
+    auto &chunks = meta->chunks;
+    if (index >= 0 && index < static_cast<int>(chunks.size())) {
+      get_layer_resp.set_chunk(chunks[index]);
     }
-    get_layer_resp.set_segment_size(segment_size);
-    get_layer_resp.set_image_name_tag(get_layer_req.image_name_tag());
-
-    auto free_buf = conn->acquireFreeSendBuf();
-    auto send_buf = free_buf->addr;
-    auto send_cap = free_buf->cap;
-    auto frame_len = serializeRdmaPbMsg(send_buf, send_cap, get_layer_resp);
-    if (util_file2str(index_path.c_str(),
-                      reinterpret_cast<char *>(send_buf) + frame_len,
-                      segment_size + 1) < 0) {
-      SPDLOG_ERROR("Read layer file {} failed, size : {}", index_path,
-                   segment_size);
-      return;
+    if (index == 0) {
+      for (auto &chunk : chunks) {
+        get_layer_resp.add_chunks(chunk);
+      }
     }
-     SPDLOG_DEBUG("read file end. size {}MB",1.0*segment_size / 1024/1024 );
-    SPDLOG_INFO("Send GetLayerResponse. image: {}, layer: {}, idx: {}, "
-                "total_segments: {}, size: {}",
-                get_layer_resp.image_name_tag(), get_layer_resp.layer(),
-                get_layer_resp.index(), get_layer_resp.total_segments(),
-                get_layer_resp.segment_size());
-    conn->send(send_buf, frame_len + segment_size, 0);
-    conn->releaseSendBuf(free_buf->id);
   }
 
-  void onRecvFail(const RdmaConnectionPtr &conn, const ibv_wc &wc) {
-    SPDLOG_ERROR("RDMA recv fail");
+  auto send_buf = free_buf->addr;
+  auto send_cap = free_buf->cap;
+  auto frame_len = serializeRdmaPbMsg(send_buf, send_cap, get_layer_resp);
+  if (frame_len < 0 || frame_len + segment_size >= send_cap) {
+    SPDLOG_ERROR("File {} of {} bytes exceeds the send buffer", index_path,
+                 segment_size);
+    sendError(conn, *free_buf, get_layer_resp,
+              "segment exceeds the send buffer");
+    return;
   }
-
-  void onSendCompleteSuccess(const RdmaConnectionPtr &conn, const ibv_wc &wc) {
-    // SPDLOG_INFO("RDMA send complete success");
+  // util_file2str reads up to its size - 1 bytes and ends them with a NUL,
+  // which the check above leaves room for
+  if (util_file2str(index_path.c_str(),
+                    reinterpret_cast<char *>(send_buf) + frame_len,
+                    segment_size + 1) < 0) {
+    SPDLOG_ERROR("Read layer file {} failed, size : {}", index_path,
+                 segment_size);
+    sendError(conn, *free_buf, get_layer_resp, "segment read failed");
+    return;
   }
+  SPDLOG_DEBUG("read file end. size {}MB", 1.0 * segment_size / 1024 / 1024);
+  SPDLOG_DEBUG("Send GetLayerResponse. image: {}, layer: {}, idx: {}, "
+               "total_segments: {}, size: {}",
+               get_layer_resp.image_name_tag(), get_layer_resp.layer(),
+               get_layer_resp.index(), get_layer_resp.total_segments(),
+               get_layer_resp.segment_size());
+  conn->send(send_buf, frame_len + segment_size, 0);
+  conn->releaseSendBuf(free_buf->id);
+}
 
-  void onSendCompleteFail(const RdmaConnectionPtr &conn, const ibv_wc &wc) {
-    SPDLOG_INFO("RDMA send complete fail");
-  }
+void ContentServer::onRecvFail(const MsgConnectionPtr &conn,
+                               const Completion &wc) {
+  SPDLOG_ERROR("RDMA recv fail");
+}
 
-private:
-  RdmaServer server_;
-  const std::string registry_path_;
-};
-
-int main(int argc, char *argv[]) {
-  GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
-  spdlog::set_level(spdlog::level::debug);
-  spdlog::set_pattern("%^[%L][%T.%e]%$[%s:%#] %v");
-  RdmaConfig rdmaConfig = {
-      FLAGS_content_server_ib_dev_name, FLAGS_content_server_ib_dev_port,
-      FLAGS_content_server_rdma_mem, FLAGS_content_server_rdma_mem_num};
-
-  EventLoop loop;
-
-  auto server = ContentServer{
-      &loop,
-      InetAddress{FLAGS_content_server_listen_ip,
-                  static_cast<uint16_t>(FLAGS_content_server_listen_port)},
-      "RdmaContentServer", rdmaConfig, FLAGS_content_server_registry_path};
-
-  server.start();
-  loop.loop();
+void ContentServer::onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                                          const Completion &wc) {
+  // SPDLOG_INFO("RDMA send complete success");
 }
+
+void ContentServer::onSendCompleteFail(const MsgConnectionPtr &conn,
+                                       const Completion &wc) {
+  SPDLOG_INFO("RDMA send complete fail");
+}
+
+} // namespace server
+} // namespace host
+} // namespace hdc
@@ -0,0 +1,88 @@
+#pragma once
+#include "network/EventLoop.h"
+#include "network/InetAddress.h"
+#include "network/transport/TransportConfig.h"
+#include "content.pb.h"
+#include <cstdint>
+#include <map>
+#include <network/transport/MsgConnection.h>
+#include <network/transport/Transport.h>
+#include <string>
+#include <vector>
+
+namespace hdc {
+namespace host {
+namespace server {
+using hdc::network::EventLoop;
+using hdc::network::InetAddress;
+using hdc::network::transport::TransportConfig;
+using hdc::network::transport::Completion;
+using hdc::network::transport::MsgConnection;
+using hdc::network::transport::MsgConnectionPtr;
+using hdc::network::transport::createMsgServer;
+using hdc::network::transport::MsgServer;
+
+/// @brief: Serve the segments of image layers in `registry_path`. The segment
+/// `i` of a layer is `<registry_path>/<digest>/<i>.tar.gz` and the number of
+/// segments is in `<registry_path>/<digest>/total_segment.txt`. The request
+/// of segment -1 gets `<registry_path>/<digest>/index.pb`, the LayerIndex of
+/// the layer written by image_compress, uncompressed. A layer stored in
+/// chunks has `<registry_path>/<digest>/recipe.txt`, and each response
+/// carries the chunk of its segment, the one of segment 0 all of them.
+///
+/// A segment may also be stored in other codecs, as `<i>.tar.zst`,
+/// `<i>.tar.lz4` or `<i>.tar` uncompressed. It is sent in the first codec of
+/// the `accept_codecs` of the request that it is stored in, and as
+/// `<i>.tar.gz` if there is none.
+///
+/// A segment that cannot be served gets a response with an error and no
+/// segment. total_segment.txt and recipe.txt are read once per layer.
+class ContentServer {
+
+public:
+  ContentServer(EventLoop *loop, const InetAddress &listenAddr,
+                const std::string &name, TransportConfig transportConfig,
+                const std::string &registry_path, bool layer_is_compressed);
+
+  void start();
+
+private:
+  void onConnected(const MsgConnectionPtr &conn);
+
+  void onRecvSuccess(const MsgConnectionPtr &conn, uint8_t *recv_buf,
+                     uint32_t recv_len, const Completion &wc);
+
+  void onRecvFail(const MsgConnectionPtr &conn, const Completion &wc);
+
+  void onSendCompleteSuccess(const MsgConnectionPtr &conn,
+                             const Completion &wc);
+
+  void onSendCompleteFail(const MsgConnectionPtr &conn, const Completion &wc);
+
+  struct LayerMeta {
+    int total_segments{0};
+    // the chunk of each segment, none for a layer not stored in chunks
+    std::vector<std::string> chunks;
+  };
+
+  /// @brief: The total_segment.txt and recipe.txt of a layer, read on the
+  /// first request of the layer. nullptr if the layer has no
+  /// total_segment.txt, which is read again on the next request.
+  const LayerMeta *layerMeta(const std::string &layer_digest);
+
+  /// @brief: Answer the request of `resp` with `error` and no segment, in
+  /// `free_buf`, which is released.
+  void sendError(const MsgConnectionPtr &conn,
+                 const MsgConnection::SendBuf &free_buf,
+                 content::GetLayerResponse &resp, const std::string &error);
+
+  std::unique_ptr<MsgServer> server_;
+  const std::string registry_path_;
+  const bool layer_is_compressed_;
+  // the metadata of the layers requested, by digest
+  std::map<std::string, LayerMeta> layer_metas_;
+};
+
+} // namespace server
+} // namespace host
+} // namespace hdc
@@ -0,0 +1,74 @@
+#include "host/server/content_server.h"
+#include "network/EventLoop.h"
+#include "network/InetAddress.h"
+#include "network/transport/TransportConfig.h"
+#include <gflags/gflags.h>
+#include <spdlog/spdlog.h>
+#include <utils/affinity.h>
+#include <utils/logging.h>
+#include <utils/transport_flags.h>
+
+using hdc::host::server::ContentServer;
+using hdc::network::EventLoop;
+using hdc::network::InetAddress;
+using hdc::network::transport::TransportConfig;
+
+DEFINE_string(content_server_transport, "rdma",
+              "The transport of host ContentServer: rdma, tcp or shm");
+DEFINE_validator(content_server_transport, &hdc::utils::validateTransportFlag);
+DEFINE_string(content_server_ib_dev_name, "mlx5_0",
+              "The IB device name of host ContentServer");
+DEFINE_int32(content_server_ib_dev_port, 1,
+             "The IB device port of host ContentServer");
+DEFINE_string(content_server_listen_ip, "172.24.46.186",
+              "The IP address of host ContentServer to listen");
+DEFINE_uint32(content_server_listen_port, 9002,
+              "The IP port of host ContentServer to listen");
+DEFINE_uint64(
+    content_server_rdma_mem, 129 * 1024 * 1024,
+    "The memory of RDMA sendbuf/recvbuf for host ContentServer in bytes");
+DEFINE_uint64(content_server_rdma_mem_num, 4,
+              "The number of RDMA sendbuf/recvbuf");
+DEFINE_string(content_server_registry_path, "data/registry/content_layers/",
+              "Root path of image layers for registry");
+DEFINE_bool(content_server_layer_is_compressed, true,
+            "The layer is compressed or not");
+DEFINE_string(content_server_cpus, "",
+              "The CPUs of host ContentServer, e.g. 0-3,6, empty for any CPU");
+DEFINE_validator(content_server_cpus, &hdc::utils::validateCpuListFlag);
+DEFINE_bool(content_server_numa_local, false,
+            "Create the RDMA buffers on the NUMA node of "
+            "--content_server_ib_dev_name, and run there without "
+            "--content_server_cpus");
+
+int main(int argc, char *argv[]) {
+  GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+  hdc::utils::initLogger("content_server");
+  TransportConfig transportConfig = {
+      hdc::utils::transportTypeFlag(FLAGS_content_server_transport),
+      FLAGS_content_server_ib_dev_name, FLAGS_content_server_ib_dev_port,
+      FLAGS_content_server_rdma_mem, FLAGS_content_server_rdma_mem_num};
+
+  auto cpus = hdc::utils::cpuListFlag(FLAGS_content_server_cpus);
+  if (cpus.empty() && FLAGS_content_server_numa_local) {
+    auto node = hdc::utils::ibDeviceNumaNode(FLAGS_content_server_ib_dev_name);
+    if (node.has_value()) {
+      cpus = hdc::utils::numaNodeCpus(*node);
+    }
+  }
+  hdc::utils::pinThread(cpus);
+  EventLoop loop;
+
+  auto server = ContentServer{
+      &loop,
+      InetAddress{FLAGS_content_server_listen_ip,
+                  static_cast<uint16_t>(FLAGS_content_server_listen_port)},
+      "ContentServer",
+      transportConfig,
+      FLAGS_content_server_registry_path,
+      FLAGS_content_server_layer_is_compressed};
+
+  server.start();
+  loop.loop();
+  spdlog::shutdown();
+}
@@ -3,7 +3,6 @@
 #include <network/Channel.h>
 #include <network/EventLoop.h>
 #include <poll.h>
-#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
 #include <spdlog/spdlog.h>
 #include <sstream>
 using namespace hdc;
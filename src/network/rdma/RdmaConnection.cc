@@ -359,7 +359,7 @@ RDMAError RdmaConnection::connectQp(const RdmaExchangeInfo &remoteInfo) & {
   remote_rkey_ = remoteInfo.recv_rkey_;
   return result;
 }
-void RdmaConnection::send(const void *addr, uint32_t length, uint64_t wr_id) & {
+void RdmaConnection::send(const void *addr, uint32_t length, uint64_t wr_id) {
   if (loop_->isInLoopThread()) {
     if (sendInLoop(addr, length, wr_id) != RDMAError::kSuccess) {
       SPDLOG_ERROR("RdmaConnection {} send error", name_);
@@ -431,7 +431,7 @@ void RdmaConnection::handleRead(Timestamp recvTime) {
     ne = ibv_poll_cq(cq_, wc_capacity_, wcs_.data());
     if (ne < 0) {
       SPDLOG_ERROR("Fail to poll CQ {}", ne);
-      std::terminate();
+      handleFailure();
       return;
     }
 
@@ -447,8 +447,10 @@ void RdmaConnection::handleRead(Timestamp recvTime) {
         } else {
           SPDLOG_ERROR("other opcode fail: {}", int(wc.opcode));
         }
-        std::terminate();
-        continue;
+        // the QP is in the error state, the work requests after it are
+        // flushed
+        handleFailure();
+        return;
       }
       // success
       if (wc.opcode == IBV_WC_SEND) {
@@ -470,6 +472,20 @@ void RdmaConnection::handleRead(Timestamp recvTime) {
   } while (ne > 0);
 }
 
+void RdmaConnection::handleFailure() {
+  if (!disconnectedCallback_) {
+    // the user would wait on the lost connection forever, fail fast
+    SPDLOG_CRITICAL("RdmaConnection {} failed", name_);
+    std::terminate();
+  }
+  SPDLOG_ERROR("RdmaConnection {} failed, tear it down", name_);
+  if (state_ == State::kConnected) {
+    setState(State::kDisconnected);
+    channel_->disableAll();
+    disconnectedCallback_(shared_from_this());
+  }
+}
+
 void RdmaConnection::handleWrite() {
   SPDLOG_ERROR("RdmaConnection should not have write event");
 }
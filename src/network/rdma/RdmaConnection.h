@@ -5,6 +5,7 @@
 #include "network/rdma/RdmaConnector.h"
 #include "network/rdma/RdmaExchangeInfo.h"
 #include "network/rdma/error.h"
+#include "network/transport/MsgConnection.h"
 #include <atomic>
 #include <cstddef>
 #include <cstdint>
@@ -29,7 +30,8 @@ namespace hdc {
 namespace network {
 namespace rdma {
 
-class RdmaConnection : public std::enable_shared_from_this<RdmaConnection> {
+class RdmaConnection : public transport::MsgConnection,
+                       public std::enable_shared_from_this<RdmaConnection> {
   template <class T> struct memalign_allocator {
     using value_type = T;
     T *allocate(std::size_t n) {
@@ -68,17 +70,6 @@ public:
     unsigned int tx_depth_;
   };
 
-  struct SendBuf {
-    size_t id{0};
-    uint8_t *addr{nullptr};
-    uint32_t cap{0};
-
-    SendBuf() {}
-
-    SendBuf(size_t id, uint8_t *addr, uint32_t cap)
-        : id(id), addr(addr), cap(cap) {}
-  };
-
   RdmaConnection(const RdmaConnection &) = delete;
 
   RdmaConnection &operator=(const RdmaConnection &) = delete;
@@ -99,9 +90,11 @@ public:
 
   ~RdmaConnection();
 
-  inline const std::string &name() const { return name_; }
+  inline const std::string &name() const override { return name_; }
 
-  inline bool connected() const & { return state_ == State::kConnected; }
+  inline bool connected() const override {
+    return state_ == State::kConnected;
+  }
 
   inline bool disconnected() const & { return state_ == State::kDisconnected; }
 
@@ -110,7 +103,7 @@ public:
   //                          static_cast<uint32_t>(send_capacity_));
   // }
 
-  std::optional<SendBuf> acquireFreeSendBuf() {
+  std::optional<SendBuf> acquireFreeSendBuf() override {
     if (!free_bufpairs_.empty()) {
       size_t id = free_bufpairs_.front();
       free_bufpairs_.pop_front();
@@ -121,18 +114,18 @@ public:
     }
   }
 
-  void releaseSendBuf(size_t bufpair_id) {
+  void releaseSendBuf(size_t bufpair_id) override {
     free_bufpairs_.emplace_back(bufpair_id);
   }
 
-  bool isFreeSendBufEmpty() { return free_bufpairs_.empty(); }
+  bool isFreeSendBufEmpty() override { return free_bufpairs_.empty(); }
 
   static tl::expected<RdmaConnectionPtr, RDMAError>
   create(std::string_view ib_dev_name, int ib_dev_port, size_t mem_size,
          size_t mem_num, EventLoop *loop, const std::string &name);
 
   /// @brief: Thread Safe.
-  void send(const void *addr, uint32_t length, uint64_t wr_id) &;
+  void send(const void *addr, uint32_t length, uint64_t wr_id) override;
 
   inline void setRecvSuccessCallback(const RecvSuccessCallback &cb) {
     recvSuccessCallback_ = cb;
@@ -263,6 +256,11 @@ private:
   /// @brief: Register to Channel for handling read Event.
   void handleRead(Timestamp recvTime);
 
+  /// @brief: Tear the connection down after a failed work completion, the
+  /// user learns it from the DisconnectedCallback. Without one the process
+  /// terminates.
+  void handleFailure();
+
   void handleWrite();
 
   void handleClose();
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace hdc {
+namespace network {
+namespace transport {
+class MsgConnection;
+using MsgConnectionPtr = std::shared_ptr<MsgConnection>;
+
+/// @brief: The completion of a send or a recv. It is the part of ibv_wc the
+/// transports have in common.
+struct Completion {
+  uint64_t wr_id{0};
+  uint32_t byte_len{0};
+  bool success{true};
+};
+
+using RecvSuccessCallback =
+    std::function<void(const MsgConnectionPtr &conn, uint8_t *recv_buf,
+                       uint32_t recv_len, const Completion &wc)>;
+using RecvFailCallback =
+    std::function<void(const MsgConnectionPtr &conn, const Completion &wc)>;
+
+using SendCompleteSuccessCallback =
+    std::function<void(const MsgConnectionPtr &conn, const Completion &wc)>;
+
+using SendCompleteFailCallback =
+    std::function<void(const MsgConnectionPtr &conn, const Completion &wc)>;
+
+using ConnectedCallback = std::function<void(const MsgConnectionPtr &conn)>;
+
+using DisconnectedCallback = std::function<void(const MsgConnectionPtr &conn)>;
+
+/// @brief: The user callbacks of a client or a server. They are copied into
+/// every connection. Unset callbacks are not called.
+struct MsgCallbacks {
+  ConnectedCallback connected;
+  DisconnectedCallback disconnected;
+  RecvSuccessCallback recvSuccess;
+  RecvFailCallback recvFail;
+  SendCompleteSuccessCallback sendCompleteSuccess;
+  SendCompleteFailCallback sendCompleteFail;
+};
+} // namespace transport
+} // namespace network
+} // namespace hdc
@@ -0,0 +1,51 @@
+#pragma once
+#include "network/transport/Callbacks.h"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+namespace hdc {
+namespace network {
+namespace transport {
+
+/// @brief: A message connection. Messages are sent from send buffers owned by
+/// the connection and are delivered whole to the RecvSuccessCallback of the
+/// peer, in order.
+class MsgConnection {
+public:
+  struct SendBuf {
+    size_t id{0};
+    uint8_t *addr{nullptr};
+    uint32_t cap{0};
+
+    SendBuf() {}
+
+    SendBuf(size_t id, uint8_t *addr, uint32_t cap)
+        : id(id), addr(addr), cap(cap) {}
+  };
+
+  virtual ~MsgConnection() = default;
+
+  virtual const std::string &name() const = 0;
+
+  virtual bool connected() const = 0;
+
+  /// @brief: Not thread safe. Call it in the EventLoop thread of the
+  /// connection.
+  virtual std::optional<SendBuf> acquireFreeSendBuf() = 0;
+
+  /// @brief: Not thread safe. Call it in the EventLoop thread of the
+  /// connection.
+  virtual void releaseSendBuf(size_t bufpair_id) = 0;
+
+  virtual bool isFreeSendBufEmpty() = 0;
+
+  /// @brief: Send `length` bytes at `addr`, which is inside a send buffer of
+  /// this connection, as one message. Thread Safe.
+  virtual void send(const void *addr, uint32_t length, uint64_t wr_id) = 0;
+};
+
+} // namespace transport
+} // namespace network
+} // namespace hdc
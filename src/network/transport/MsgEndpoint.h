@@ -0,0 +1,66 @@
+#pragma once
+#include "network/transport/Callbacks.h"
+
+namespace hdc {
+namespace network {
+namespace transport {
+
+/// @brief: The callbacks registration shared by MsgClient and MsgServer.
+class MsgEndpoint {
+public:
+  virtual ~MsgEndpoint() = default;
+
+  /// @brief: Users register it.
+  inline void setRecvSuccessCallback(const RecvSuccessCallback &cb) {
+    callbacks_.recvSuccess = cb;
+  }
+
+  /// @brief: Users register it.
+  inline void setRecvFailCallback(const RecvFailCallback &cb) {
+    callbacks_.recvFail = cb;
+  }
+
+  /// @brief: Users register it.
+  inline void
+  setSendCompleteSuccessCallback(const SendCompleteSuccessCallback &cb) {
+    callbacks_.sendCompleteSuccess = cb;
+  }
+
+  /// @brief: Users register it.
+  inline void setSendCompleteFailCallback(const SendCompleteFailCallback &cb) {
+    callbacks_.sendCompleteFail = cb;
+  }
+
+  /// @brief: Users register it.
+  inline void setConnectedCallback(const ConnectedCallback &cb) {
+    callbacks_.connected = cb;
+  }
+
+  /// @brief: Users register it. Without it, a lost RDMA connection
+  /// terminates the process rather than leave the user waiting on it.
+  inline void setDisconnectedCallback(const DisconnectedCallback &cb) {
+    callbacks_.disconnected = cb;
+  }
+
+protected:
+  MsgCallbacks callbacks_;
+};
+
+/// @brief: The client side of a transport.
+class MsgClient : public MsgEndpoint {
+public:
+  /// @brief: Connect to the server. The ConnectedCallback is called in the
+  /// EventLoop thread once the peer is ready to receive.
+  virtual void connect() = 0;
+};
+
+/// @brief: The server side of a transport.
+class MsgServer : public MsgEndpoint {
+public:
+  /// @brief: Start listening.
+  virtual void start() = 0;
+};
+
+} // namespace transport
+} // namespace network
+} // namespace hdc
@@ -0,0 +1,73 @@
+#include "network/transport/RdmaTransport.h"
+#include <exception>
+#include <network/rdma/RdmaConnection.h>
+#include <spdlog/spdlog.h>
+
+namespace hdc::network::transport {
+using rdma::RdmaConnectionPtr;
+
+namespace {
+Completion toCompletion(const ibv_wc &wc) {
+  return Completion{wc.wr_id, wc.byte_len, wc.status == IBV_WC_SUCCESS};
+}
+
+/// @brief: Forward the callbacks of RdmaClient/RdmaServer to `callbacks`,
+/// which is read at call time so that users may register after construction.
+template <typename Endpoint>
+void bindRdmaCallbacks(Endpoint &endpoint, const MsgCallbacks *callbacks) {
+  endpoint.setConnectedCallback([callbacks](const RdmaConnectionPtr &conn) {
+    if (callbacks->connected) {
+      callbacks->connected(conn);
+    }
+  });
+  endpoint.setDisconnectedCallback([callbacks](const RdmaConnectionPtr &conn) {
+    if (!callbacks->disconnected) {
+      // the user would wait on the lost connection forever, fail fast
+      SPDLOG_CRITICAL("{} lost and no DisconnectedCallback", conn->name());
+      std::terminate();
+    }
+    callbacks->disconnected(conn);
+  });
+  endpoint.setRecvSuccessCallback(
+      [callbacks](const RdmaConnectionPtr &conn, uint8_t *recv_buf,
+                  uint32_t recv_len, const ibv_wc &wc) {
+        if (callbacks->recvSuccess) {
+          callbacks->recvSuccess(conn, recv_buf, recv_len, toCompletion(wc));
+        }
+      });
+  endpoint.setRecvFailCallback(
+      [callbacks](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+        if (callbacks->recvFail) {
+          callbacks->recvFail(conn, toCompletion(wc));
+        }
+      });
+  endpoint.setSendCompleteSuccessCallback(
+      [callbacks](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+        if (callbacks->sendCompleteSuccess) {
+          callbacks->sendCompleteSuccess(conn, toCompletion(wc));
+        }
+      });
+  endpoint.setSendCompleteFailCallback(
+      [callbacks](const RdmaConnectionPtr &conn, const ibv_wc &wc) {
+        if (callbacks->sendCompleteFail) {
+          callbacks->sendCompleteFail(conn, toCompletion(wc));
+        }
+      });
+}
+} // namespace
+
+RdmaMsgClient::RdmaMsgClient(EventLoop *loop, const InetAddress &serverAddr,
+                             const std::string &name,
+                             rdma::RdmaConfig rdmaConfig)
+    : client_(loop, serverAddr, name, std::move(rdmaConfig)) {
+  bindRdmaCallbacks(client_, &callbacks_);
+}
+
+RdmaMsgServer::RdmaMsgServer(EventLoop *loop, const InetAddress &listenAddr,
+                             const std::string &name,
+                             rdma::RdmaConfig rdmaConfig)
+    : server_(loop, listenAddr, name, std::move(rdmaConfig)) {
+  bindRdmaCallbacks(server_, &callbacks_);
+}
+
+} // namespace hdc::network::transport
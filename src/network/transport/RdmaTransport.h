@@ -0,0 +1,38 @@
+#pragma once
+#include "network/rdma/RdmaClient.h"
+#include "network/rdma/RdmaConfig.h"
+#include "network/rdma/RdmaServer.h"
+#include "network/transport/MsgEndpoint.h"
+
+namespace hdc {
+namespace network {
+namespace transport {
+
+/// @brief: MsgClient over RdmaClient. RdmaConnection is a MsgConnection, the
+/// callbacks only translate ibv_wc into Completion.
+class RdmaMsgClient : public MsgClient {
+public:
+  RdmaMsgClient(EventLoop *loop, const InetAddress &serverAddr,
+                const std::string &name, rdma::RdmaConfig rdmaConfig);
+
+  void connect() override { client_.connect(); }
+
+private:
+  rdma::RdmaClient client_;
+};
+
+/// @brief: MsgServer over RdmaServer.
+class RdmaMsgServer : public MsgServer {
+public:
+  RdmaMsgServer(EventLoop *loop, const InetAddress &listenAddr,
+                const std::string &name, rdma::RdmaConfig rdmaConfig);
+
+  void start() override { server_.start(); }
+
+private:
+  rdma::RdmaServer server_;
+};
+
+} // namespace transport
+} // namespace network
+} // namespace hdc
@@ -0,0 +1,142 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <optional>
+
+namespace hdc {
+namespace network {
+namespace transport {
+
+constexpr size_t kShmCacheLine = 64;
+
+/// @brief: A message descriptor. The payload stays in send buffer `slot` of
+/// the shared arena, only the descriptor goes through the ring.
+struct ShmMsgDesc {
+  uint32_t slot;
+  // the offset of the payload in the send buffer
+  uint32_t offset;
+  uint32_t len;
+  uint64_t wr_id;
+};
+
+/// @brief: A lock-free single producer single consumer ring in shared memory.
+/// The ring is a view, the indexes and the entries live in the memory passed
+/// to the constructor, so both processes can construct it on their own
+/// mapping. `head` and `tail` only increase and are on separate cache lines.
+template <typename T> class ShmSpscRing {
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "the indexes must be lock free to be shared by processes");
+
+  struct Indexes {
+    alignas(kShmCacheLine) std::atomic<uint64_t> head;
+    alignas(kShmCacheLine) std::atomic<uint64_t> tail;
+  };
+
+public:
+  /// @brief: The bytes of a ring of `capacity` entries. `capacity` must be a
+  /// power of 2.
+  static constexpr size_t bytes(size_t capacity) {
+    return sizeof(Indexes) + capacity * sizeof(T);
+  }
+
+  ShmSpscRing() noexcept = default;
+
+  ShmSpscRing(void *mem, size_t capacity) noexcept
+      : indexes_(static_cast<Indexes *>(mem)),
+        entries_(reinterpret_cast<T *>(static_cast<uint8_t *>(mem) +
+                                       sizeof(Indexes))),
+        mask_(capacity - 1) {}
+
+  /// @brief: Initialize the indexes. Called once by the process that creates
+  /// the shared memory.
+  void init() {
+    new (&indexes_->head) std::atomic<uint64_t>(0);
+    new (&indexes_->tail) std::atomic<uint64_t>(0);
+  }
+
+  /// @brief: Called by the producer only. Return false if the ring is full.
+  bool push(const T &entry) {
+    auto tail = indexes_->tail.load(std::memory_order_relaxed);
+    auto head = indexes_->head.load(std::memory_order_acquire);
+    if (tail - head > mask_) {
+      return false;
+    }
+    entries_[tail & mask_] = entry;
+    indexes_->tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// @brief: Called by the consumer only.
+  std::optional<T> pop() {
+    auto head = indexes_->head.load(std::memory_order_relaxed);
+    auto tail = indexes_->tail.load(std::memory_order_acquire);
+    if (head == tail) {
+      return std::nullopt;
+    }
+    T entry = entries_[head & mask_];
+    indexes_->head.store(head + 1, std::memory_order_release);
+    return entry;
+  }
+
+private:
+  Indexes *indexes_{nullptr};
+  T *entries_{nullptr};
+  uint64_t mask_{0};
+};
+
+/// @brief: The layout of the shared arena of a connection:
+///
+///   [header][4 rings][send buffers of the client][send buffers of the server]
+///
+/// The data of direction `d` (0: client to server, 1: server to client) is
+/// written by the sender into its own send buffers and announced through
+/// msg ring `d`. The receiver hands the buffer back through ret ring `d` once
+/// its RecvSuccessCallback returns.
+struct ShmArenaLayout {
+  static constexpr uint64_t kMagic = 0x706f62792d73686dULL; // "poby-shm"
+
+  struct Header {
+    uint64_t magic;
+    uint64_t slot_size;
+    uint64_t slot_num;
+  };
+
+  size_t slot_size;
+  size_t slot_num;
+  size_t ring_capacity;
+
+  ShmArenaLayout(size_t slot_size, size_t slot_num) noexcept
+      : slot_size(slot_size), slot_num(slot_num), ring_capacity(1) {
+    while (ring_capacity < slot_num) {
+      ring_capacity <<= 1;
+    }
+  }
+
+  static constexpr size_t align(size_t n) {
+    return (n + kShmCacheLine - 1) / kShmCacheLine * kShmCacheLine;
+  }
+
+  size_t ringBytes() const {
+    return align(ShmSpscRing<ShmMsgDesc>::bytes(ring_capacity));
+  }
+
+  /// @brief: The offset of msg ring (`ret` false) or ret ring of `dir`.
+  size_t ringOffset(int dir, bool ret) const {
+    return align(sizeof(Header)) + (dir * 2 + (ret ? 1 : 0)) * ringBytes();
+  }
+
+  size_t slotsOffset(int dir) const {
+    // page aligned, like the RDMA buffers
+    constexpr size_t kPage = 4096;
+    auto rings_end = ringOffset(1, true) + ringBytes();
+    return (rings_end + kPage - 1) / kPage * kPage + dir * slot_size * slot_num;
+  }
+
+  size_t totalBytes() const { return slotsOffset(1) + slot_size * slot_num; }
+};
+
+} // namespace transport
+} // namespace network
+} // namespace hdc
@@ -0,0 +1,515 @@
+#include "network/transport/ShmTransport.h"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace hdc::network::transport {
+namespace {
+
+/// the first and only message on the unix socket, sent by the server with the
+/// memfd of the arena, the eventfd of the client and the eventfd of the server
+struct ShmHandshake {
+  uint64_t magic;
+  uint64_t slot_size;
+  uint64_t slot_num;
+};
+
+constexpr int kHandshakeFdNum = 3;
+
+socklen_t shmSockAddr(const InetAddress &addr, sockaddr_un *sun) {
+  auto name = shmSocketName(addr);
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  // abstract namespace: sun_path starts with '\0'
+  auto len = std::min(name.size(), sizeof(sun->sun_path) - 1);
+  memcpy(sun->sun_path + 1, name.data(), len);
+  return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + len);
+}
+
+void closeFds(std::initializer_list<int> fds) {
+  for (auto fd : fds) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+}
+
+} // namespace
+
+const int ShmMsgClient::kMaxRetryDelayMs;
+
+std::string shmSocketName(const InetAddress &addr) {
+  return "poby-shm-" + addr.toIpPort();
+}
+
+ShmMsgConnection::ShmMsgConnection(EventLoop *loop, const std::string &name,
+                                   uint8_t *arena, size_t arena_len,
+                                   const ShmArenaLayout &layout, int dir,
+                                   int sock_fd, int notify_fd,
+                                   int peer_notify_fd, MsgCallbacks callbacks)
+    : loop_(loop), name_(name), arena_(arena), arena_len_(arena_len),
+      layout_(layout), send_slots_(arena + layout.slotsOffset(dir)),
+      recv_slots_(arena + layout.slotsOffset(1 - dir)),
+      send_ring_(arena + layout.ringOffset(dir, false),
+                 layout.ring_capacity),
+      send_ret_ring_(arena + layout.ringOffset(dir, true),
+                     layout.ring_capacity),
+      recv_ring_(arena + layout.ringOffset(1 - dir, false),
+                 layout.ring_capacity),
+      recv_ret_ring_(arena + layout.ringOffset(1 - dir, true),
+                     layout.ring_capacity),
+      sock_fd_(sock_fd), notify_fd_(notify_fd),
+      peer_notify_fd_(peer_notify_fd), inflight_(layout.slot_num, 0),
+      released_(layout.slot_num, false), callbacks_(std::move(callbacks)) {
+  for (size_t i = 0; i < layout.slot_num; ++i) {
+    free_bufs_.emplace_back(i);
+  }
+}
+
+ShmMsgConnection::~ShmMsgConnection() {
+  for (auto channel : {notify_channel_.get(), sock_channel_.get()}) {
+    if (channel != nullptr) {
+      channel->disableAll();
+      channel->remove();
+    }
+  }
+  ::munmap(arena_, arena_len_);
+  closeFds({sock_fd_, notify_fd_, peer_notify_fd_});
+}
+
+std::optional<MsgConnection::SendBuf> ShmMsgConnection::acquireFreeSendBuf() {
+  if (free_bufs_.empty()) {
+    return std::nullopt;
+  }
+  auto id = free_bufs_.front();
+  free_bufs_.pop_front();
+  return SendBuf{id, send_slots_ + id * layout_.slot_size,
+                 static_cast<uint32_t>(layout_.slot_size)};
+}
+
+void ShmMsgConnection::releaseSendBuf(size_t bufpair_id) {
+  assert(bufpair_id < layout_.slot_num);
+  if (inflight_[bufpair_id] != 0) {
+    // reuse it once the peer hands it back
+    released_[bufpair_id] = true;
+  } else {
+    free_bufs_.emplace_back(bufpair_id);
+  }
+}
+
+void ShmMsgConnection::send(const void *addr, uint32_t length,
+                            uint64_t wr_id) {
+  if (loop_->isInLoopThread()) {
+    sendInLoop(addr, length, wr_id);
+  } else {
+    loop_->runInLoop([self = shared_from_this(), addr, length, wr_id]() {
+      self->sendInLoop(addr, length, wr_id);
+    });
+  }
+}
+
+void ShmMsgConnection::sendInLoop(const void *addr, uint32_t length,
+                                  uint64_t wr_id) {
+  loop_->assertInLoopThread();
+  auto self = shared_from_this();
+  auto fail = [this, self, wr_id, length]() {
+    loop_->queueInLoop([self, wr_id, length]() {
+      if (self->callbacks_.sendCompleteFail) {
+        self->callbacks_.sendCompleteFail(self,
+                                          Completion{wr_id, length, false});
+      }
+    });
+  };
+  if (!connected_) {
+    SPDLOG_WARN("{} disconnected, give up send.", name_);
+    fail();
+    return;
+  }
+  auto ptr = static_cast<const uint8_t *>(addr);
+  auto total = layout_.slot_size * layout_.slot_num;
+  if (ptr < send_slots_ || ptr >= send_slots_ + total) {
+    SPDLOG_ERROR("{} send: the data is not in a send buffer", name_);
+    fail();
+    return;
+  }
+  auto pos = static_cast<size_t>(ptr - send_slots_);
+  ShmMsgDesc desc{static_cast<uint32_t>(pos / layout_.slot_size),
+                  static_cast<uint32_t>(pos % layout_.slot_size), length,
+                  wr_id};
+  if (desc.offset + length > layout_.slot_size) {
+    SPDLOG_ERROR("{} send: {} bytes overflow the send buffer", name_, length);
+    fail();
+    return;
+  }
+  // the peer hands back each message through a ring of the same capacity,
+  // there is room for it as long as the sends not handed back fit
+  if (unreturned_ >= layout_.ring_capacity || !send_ring_.push(desc)) {
+    SPDLOG_ERROR("{} send: the ring is full", name_);
+    fail();
+    return;
+  }
+  ++inflight_[desc.slot];
+  ++unreturned_;
+  notifyPeer();
+}
+
+void ShmMsgConnection::start() {
+  loop_->assertInLoopThread();
+  auto self = shared_from_this();
+  notify_channel_ =
+      std::make_unique<Channel>(loop_, notify_fd_, name_ + "_notify");
+  notify_channel_->tie(self);
+  notify_channel_->setReadCallback([this](Timestamp) { handleNotify(); });
+  notify_channel_->enableReading();
+
+  // the socket carries no data after the handshake, it only tells us when
+  // the peer goes away
+  sock_channel_ = std::make_unique<Channel>(loop_, sock_fd_, name_ + "_sock");
+  sock_channel_->tie(self);
+  sock_channel_->setReadCallback([this](Timestamp) {
+    char buf[64];
+    auto n = ::read(sock_fd_, buf, sizeof(buf));
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      handleClose();
+    }
+  });
+  sock_channel_->setCloseCallback([this]() { handleClose(); });
+  sock_channel_->setErrorCallback([this]() { handleClose(); });
+  sock_channel_->enableReading();
+
+  // deliver what the peer sent before we watch the eventfd
+  handleNotify();
+}
+
+void ShmMsgConnection::handleNotify() {
+  uint64_t count = 0;
+  if (::read(notify_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    SPDLOG_ERROR("{} read eventfd error: {}", name_, strerror(errno));
+  }
+  if (!connected_) {
+    return;
+  }
+  auto self = shared_from_this();
+
+  // the send buffers handed back by the peer
+  while (auto desc = send_ret_ring_.pop()) {
+    auto slot = desc->slot;
+    assert(slot < layout_.slot_num && inflight_[slot] != 0);
+    --unreturned_;
+    if (--inflight_[slot] == 0 && released_[slot]) {
+      released_[slot] = false;
+      free_bufs_.emplace_back(slot);
+    }
+    if (callbacks_.sendCompleteSuccess) {
+      callbacks_.sendCompleteSuccess(self,
+                                     Completion{desc->wr_id, desc->len, true});
+    }
+  }
+
+  // the messages of the peer, read in place
+  bool handed_back = false;
+  while (auto desc = recv_ring_.pop()) {
+    if (desc->slot >= layout_.slot_num ||
+        desc->offset + desc->len > layout_.slot_size) {
+      SPDLOG_ERROR("{} invalid message descriptor: slot {}, offset {}, len {}",
+                   name_, desc->slot, desc->offset, desc->len);
+      if (callbacks_.recvFail) {
+        callbacks_.recvFail(self, Completion{desc->slot, desc->len, false});
+      }
+    } else if (callbacks_.recvSuccess) {
+      auto data =
+          recv_slots_ + desc->slot * layout_.slot_size + desc->offset;
+      callbacks_.recvSuccess(self, data, desc->len,
+                             Completion{desc->slot, desc->len, true});
+    }
+    // the peer sends no more than the capacity of the ring before we hand
+    // them back, so it is never full
+    bool pushed = recv_ret_ring_.push(*desc);
+    assert(pushed);
+    if (!pushed) {
+      SPDLOG_ERROR("{} the ring to hand back the buffers is full", name_);
+      handleClose();
+      break;
+    }
+    handed_back = true;
+    if (!connected_) {
+      break;
+    }
+  }
+  if (handed_back) {
+    notifyPeer();
+  }
+}
+
+void ShmMsgConnection::notifyPeer() {
+  uint64_t one = 1;
+  if (::write(peer_notify_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    SPDLOG_ERROR("{} write eventfd error: {}", name_, strerror(errno));
+  }
+}
+
+void ShmMsgConnection::handleClose() {
+  if (!connected_) {
+    return;
+  }
+  connected_ = false;
+  notify_channel_->disableAll();
+  sock_channel_->disableAll();
+  SPDLOG_INFO("{} disconnected", name_);
+  // call back outside the channel handlers, the owner may destroy us
+  loop_->queueInLoop([self = shared_from_this()]() {
+    if (self->callbacks_.disconnected) {
+      self->callbacks_.disconnected(self);
+    }
+    if (self->closeCallback_) {
+      self->closeCallback_(self);
+    }
+  });
+}
+
+ShmMsgClient::ShmMsgClient(EventLoop *loop, const InetAddress &serverAddr,
+                           const std::string &name)
+    : loop_(loop), serverAddr_(serverAddr), name_(name),
+      retryDelayMs_(kInitRetryDelayMs) {}
+
+ShmMsgClient::~ShmMsgClient() {
+  if (channel_) {
+    channel_->disableAll();
+    channel_->remove();
+  }
+  closeFds({sock_fd_});
+}
+
+void ShmMsgClient::connect() {
+  loop_->runInLoop([this, alive = std::weak_ptr<bool>(alive_)]() {
+    if (alive.lock()) {
+      connectInLoop();
+    }
+  });
+}
+
+void ShmMsgClient::connectInLoop() {
+  loop_->assertInLoopThread();
+  sock_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock_fd_ < 0) {
+    SPDLOG_ERROR("{} create socket error: {}", name_, strerror(errno));
+    return;
+  }
+  sockaddr_un sun;
+  auto len = shmSockAddr(serverAddr_, &sun);
+  if (::connect(sock_fd_, reinterpret_cast<sockaddr *>(&sun), len) < 0) {
+    SPDLOG_DEBUG("{} connect {} error: {}", name_, shmSocketName(serverAddr_),
+                 strerror(errno));
+    retry();
+    return;
+  }
+  channel_ = std::make_unique<Channel>(loop_, sock_fd_, name_ + "_handshake");
+  channel_->setReadCallback([this](Timestamp) { handleHandshake(); });
+  channel_->enableReading();
+}
+
+void ShmMsgClient::retry() {
+  closeFds({sock_fd_});
+  sock_fd_ = -1;
+  SPDLOG_INFO("{} retry connecting to {} in {} ms", name_,
+              shmSocketName(serverAddr_), retryDelayMs_);
+  loop_->runAfter(retryDelayMs_ / 1000.0,
+                  [this, alive = std::weak_ptr<bool>(alive_)]() {
+                    if (alive.lock()) {
+                      connectInLoop();
+                    }
+                  });
+  retryDelayMs_ = std::min(retryDelayMs_ * 2, kMaxRetryDelayMs);
+}
+
+void ShmMsgClient::handleHandshake() {
+  ShmHandshake handshake{};
+  iovec iov{&handshake, sizeof(handshake)};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * kHandshakeFdNum)];
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  auto n = ::recvmsg(sock_fd_, &msg, MSG_CMSG_CLOEXEC);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  channel_->disableAll();
+  channel_->remove();
+  // we are in the handler of the channel, destroy it later
+  std::shared_ptr<Channel> handshake_channel(std::move(channel_));
+  loop_->queueInLoop([handshake_channel]() {});
+
+  int fds[kHandshakeFdNum] = {-1, -1, -1};
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  }
+  auto [mem_fd, notify_fd, peer_notify_fd] = fds;
+  if (n != sizeof(handshake) || handshake.magic != ShmArenaLayout::kMagic ||
+      mem_fd < 0) {
+    SPDLOG_ERROR("{} invalid handshake from {}", name_,
+                 shmSocketName(serverAddr_));
+    closeFds({mem_fd, notify_fd, peer_notify_fd});
+    retry();
+    return;
+  }
+
+  ShmArenaLayout layout(handshake.slot_size, handshake.slot_num);
+  auto arena_len = layout.totalBytes();
+  auto arena = ::mmap(nullptr, arena_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      mem_fd, 0);
+  ::close(mem_fd);
+  if (arena == MAP_FAILED) {
+    SPDLOG_ERROR("{} mmap arena error: {}", name_, strerror(errno));
+    closeFds({notify_fd, peer_notify_fd});
+    retry();
+    return;
+  }
+  retryDelayMs_ = kInitRetryDelayMs;
+  conn_ = std::make_shared<ShmMsgConnection>(
+      loop_, "Shm_" + name_ + ":" + serverAddr_.toIpPort(),
+      static_cast<uint8_t *>(arena), arena_len, layout, 0, sock_fd_,
+      notify_fd, peer_notify_fd, callbacks_);
+  sock_fd_ = -1;
+  conn_->setCloseCallback([this](const ShmMsgConnectionPtr &conn) {
+    if (conn_ == conn) {
+      conn_.reset();
+    }
+  });
+  SPDLOG_INFO("{} connected", conn_->name());
+  conn_->start();
+  if (callbacks_.connected) {
+    callbacks_.connected(conn_);
+  }
+}
+
+ShmMsgServer::ShmMsgServer(EventLoop *loop, const InetAddress &listenAddr,
+                           const std::string &name, size_t mem_size,
+                           size_t mem_num)
+    : loop_(loop), listenAddr_(listenAddr), name_(name), mem_size_(mem_size),
+      mem_num_(mem_num) {}
+
+ShmMsgServer::~ShmMsgServer() {
+  if (channel_) {
+    channel_->disableAll();
+    channel_->remove();
+  }
+  closeFds({listen_fd_});
+}
+
+void ShmMsgServer::start() {
+  loop_->runInLoop([this]() {
+    listen_fd_ =
+        ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    sockaddr_un sun;
+    auto len = shmSockAddr(listenAddr_, &sun);
+    if (listen_fd_ < 0 ||
+        ::bind(listen_fd_, reinterpret_cast<sockaddr *>(&sun), len) < 0 ||
+        ::listen(listen_fd_, SOMAXCONN) < 0) {
+      SPDLOG_ERROR("{} listen on {} error: {}", name_,
+                   shmSocketName(listenAddr_), strerror(errno));
+      return;
+    }
+    channel_ = std::make_unique<Channel>(loop_, listen_fd_, name_ + "_accept");
+    channel_->setReadCallback([this](Timestamp) { handleAccept(); });
+    channel_->enableReading();
+    SPDLOG_INFO("{} listening on {}", name_, shmSocketName(listenAddr_));
+  });
+}
+
+void ShmMsgServer::handleAccept() {
+  while (true) {
+    int fd = ::accept4(listen_fd_, nullptr, nullptr,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        SPDLOG_ERROR("{} accept error: {}", name_, strerror(errno));
+      }
+      return;
+    }
+    newConnection(fd);
+  }
+}
+
+void ShmMsgServer::newConnection(int sock_fd) {
+  auto conn_name = fmt::format("Shm_{}-{}#{}", name_, listenAddr_.toIpPort(),
+                               next_conn_id_++);
+  ShmArenaLayout layout(mem_size_, mem_num_);
+  auto arena_len = layout.totalBytes();
+  int mem_fd = ::memfd_create(conn_name.c_str(), MFD_CLOEXEC);
+  int client_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int server_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  void *arena = MAP_FAILED;
+  if (mem_fd >= 0 && client_fd >= 0 && server_fd >= 0 &&
+      ::ftruncate(mem_fd, static_cast<off_t>(arena_len)) == 0) {
+    arena = ::mmap(nullptr, arena_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   mem_fd, 0);
+  }
+  if (arena == MAP_FAILED) {
+    SPDLOG_ERROR("{} create arena error: {}", conn_name, strerror(errno));
+    closeFds({sock_fd, mem_fd, client_fd, server_fd});
+    return;
+  }
+
+  auto base = static_cast<uint8_t *>(arena);
+  auto header = reinterpret_cast<ShmArenaLayout::Header *>(base);
+  header->magic = ShmArenaLayout::kMagic;
+  header->slot_size = mem_size_;
+  header->slot_num = mem_num_;
+  for (int dir = 0; dir < 2; ++dir) {
+    for (bool ret : {false, true}) {
+      ShmSpscRing<ShmMsgDesc>(base + layout.ringOffset(dir, ret),
+                              layout.ring_capacity)
+          .init();
+    }
+  }
+
+  ShmHandshake handshake{ShmArenaLayout::kMagic, mem_size_, mem_num_};
+  iovec iov{&handshake, sizeof(handshake)};
+  int fds[kHandshakeFdNum] = {mem_fd, client_fd, server_fd};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  auto n = ::sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+  ::close(mem_fd);
+  if (n != sizeof(handshake)) {
+    SPDLOG_ERROR("{} send handshake error: {}", conn_name, strerror(errno));
+    ::munmap(arena, arena_len);
+    closeFds({sock_fd, client_fd, server_fd});
+    return;
+  }
+
+  auto conn = std::make_shared<ShmMsgConnection>(
+      loop_, conn_name, base, arena_len, layout, 1, sock_fd, server_fd,
+      client_fd, callbacks_);
+  conn->setCloseCallback(
+      [this](const ShmMsgConnectionPtr &conn) { connections_.erase(conn); });
+  connections_.insert(conn);
+  SPDLOG_INFO("{} connected", conn->name());
+  conn->start();
+  if (callbacks_.connected) {
+    callbacks_.connected(conn);
+  }
+}
+
+} // namespace hdc::network::transport
@@ -0,0 +1,172 @@
+#pragma once
+#include "network/Channel.h"
+#include "network/EventLoop.h"
+#include "network/InetAddress.h"
+#include "network/transport/MsgConnection.h"
+#include "network/transport/MsgEndpoint.h"
+#include "network/transport/ShmRing.h"
+#include <deque>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace hdc {
+namespace network {
+namespace transport {
+class ShmMsgConnection;
+using ShmMsgConnectionPtr = std::shared_ptr<ShmMsgConnection>;
+
+/// @brief: A MsgConnection between two processes on the same host. Both sides
+/// map one shared arena (see ShmArenaLayout). The send buffers are in the
+/// arena, so a message is never copied: send() only pushes a descriptor into
+/// an SPSC ring and the peer's RecvSuccessCallback reads the payload in
+/// place. Each side waits on its own eventfd, which the peer writes after
+/// pushing into a ring. A connection is driven by a single EventLoop, so each
+/// ring has exactly one producer and one consumer.
+///
+/// A send is complete when the peer hands the send buffer back, that is after
+/// its RecvSuccessCallback returns. A send buffer released before that is
+/// reused only after it is handed back.
+class ShmMsgConnection : public MsgConnection,
+                         public std::enable_shared_from_this<ShmMsgConnection> {
+public:
+  /// @brief: `dir` is the direction of the messages sent by this side, 0 for
+  /// the client and 1 for the server. It takes the ownership of `sock_fd`,
+  /// `notify_fd` and `peer_notify_fd`.
+  ShmMsgConnection(EventLoop *loop, const std::string &name, uint8_t *arena,
+                   size_t arena_len, const ShmArenaLayout &layout, int dir,
+                   int sock_fd, int notify_fd, int peer_notify_fd,
+                   MsgCallbacks callbacks);
+
+  ~ShmMsgConnection();
+
+  ShmMsgConnection(const ShmMsgConnection &) = delete;
+
+  ShmMsgConnection &operator=(const ShmMsgConnection &) = delete;
+
+  const std::string &name() const override { return name_; }
+
+  bool connected() const override { return connected_; }
+
+  std::optional<SendBuf> acquireFreeSendBuf() override;
+
+  void releaseSendBuf(size_t bufpair_id) override;
+
+  bool isFreeSendBufEmpty() override { return free_bufs_.empty(); }
+
+  void send(const void *addr, uint32_t length, uint64_t wr_id) override;
+
+  /// @brief: Start watching the eventfd and the socket, and deliver the
+  /// messages the peer sent before. Must be called in the EventLoop thread.
+  void start();
+
+  void setCloseCallback(std::function<void(const ShmMsgConnectionPtr &)> cb) {
+    closeCallback_ = std::move(cb);
+  }
+
+private:
+  void sendInLoop(const void *addr, uint32_t length, uint64_t wr_id);
+
+  void handleNotify();
+
+  void handleClose();
+
+  void notifyPeer();
+
+  EventLoop *loop_;
+  std::string name_;
+  uint8_t *arena_;
+  size_t arena_len_;
+  ShmArenaLayout layout_;
+  uint8_t *send_slots_;
+  uint8_t *recv_slots_;
+  // messages and handed back buffers of the direction we send
+  ShmSpscRing<ShmMsgDesc> send_ring_;
+  ShmSpscRing<ShmMsgDesc> send_ret_ring_;
+  // messages and handed back buffers of the direction we receive
+  ShmSpscRing<ShmMsgDesc> recv_ring_;
+  ShmSpscRing<ShmMsgDesc> recv_ret_ring_;
+  int sock_fd_;
+  int notify_fd_;
+  int peer_notify_fd_;
+  std::unique_ptr<Channel> notify_channel_;
+  std::unique_ptr<Channel> sock_channel_;
+  std::deque<size_t> free_bufs_;
+  // the number of sends of the buffer not handed back by the peer
+  std::vector<uint32_t> inflight_;
+  // the send buffer is released by the user while it is inflight
+  std::vector<bool> released_;
+  // the sends not handed back by the peer, at most the ring capacity
+  size_t unreturned_{0};
+  bool connected_{true};
+  MsgCallbacks callbacks_;
+  std::function<void(const ShmMsgConnectionPtr &)> closeCallback_;
+};
+
+/// @brief: MsgClient over shared memory. The rendezvous is a unix socket in
+/// the abstract namespace named after the server address, through which the
+/// server passes the arena memfd and the eventfds.
+class ShmMsgClient : public MsgClient {
+public:
+  ShmMsgClient(EventLoop *loop, const InetAddress &serverAddr,
+               const std::string &name);
+
+  ~ShmMsgClient();
+
+  void connect() override;
+
+private:
+  void connectInLoop();
+
+  void retry();
+
+  void handleHandshake();
+
+  EventLoop *loop_;
+  InetAddress serverAddr_;
+  std::string name_;
+  int sock_fd_{-1};
+  std::unique_ptr<Channel> channel_;
+  int retryDelayMs_;
+  ShmMsgConnectionPtr conn_;
+  // the callbacks queued in the loop hold it weakly, and do nothing once the
+  // client is destroyed
+  std::shared_ptr<bool> alive_{std::make_shared<bool>(true)};
+  static const int kMaxRetryDelayMs = 30 * 1000;
+  static const int kInitRetryDelayMs = 500;
+};
+
+/// @brief: MsgServer over shared memory. All connections are handled in the
+/// loop of the server.
+class ShmMsgServer : public MsgServer {
+public:
+  ShmMsgServer(EventLoop *loop, const InetAddress &listenAddr,
+               const std::string &name, size_t mem_size, size_t mem_num);
+
+  ~ShmMsgServer();
+
+  void start() override;
+
+private:
+  void handleAccept();
+
+  void newConnection(int sock_fd);
+
+  EventLoop *loop_;
+  InetAddress listenAddr_;
+  std::string name_;
+  size_t mem_size_;
+  size_t mem_num_;
+  int listen_fd_{-1};
+  std::unique_ptr<Channel> channel_;
+  int next_conn_id_{1};
+  std::set<ShmMsgConnectionPtr> connections_;
+};
+
+/// @brief: The abstract unix socket name of a shm server.
+std::string shmSocketName(const InetAddress &addr);
+
+} // namespace transport
+} // namespace network
+} // namespace hdc
@@ -0,0 +1,128 @@
+#include "network/transport/TcpTransport.h"
+#include "network/EventLoop.h"
+#include <any>
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+namespace hdc::network::transport {
+using TcpMsgConnectionPtr = std::shared_ptr<TcpMsgConnection>;
+
+TcpMsgConnection::TcpMsgConnection(const TcpConnectionPtr &conn,
+                                   size_t mem_size, size_t mem_num,
+                                   MsgCallbacks callbacks)
+    : name_("Tcp_" + conn->name()), conn_(conn), mem_(mem_size * mem_num),
+      mem_size_(mem_size), callbacks_(std::move(callbacks)) {
+  for (size_t i = 0; i < mem_num; ++i) {
+    free_bufs_.emplace_back(i);
+  }
+}
+
+std::optional<MsgConnection::SendBuf> TcpMsgConnection::acquireFreeSendBuf() {
+  if (free_bufs_.empty()) {
+    return std::nullopt;
+  }
+  auto id = free_bufs_.front();
+  free_bufs_.pop_front();
+  return SendBuf{id, mem_.data() + id * mem_size_,
+                 static_cast<uint32_t>(mem_size_)};
+}
+
+void TcpMsgConnection::send(const void *addr, uint32_t length,
+                            uint64_t wr_id) {
+  auto self = shared_from_this();
+  auto loop = conn_->getLoop();
+  if (!conn_->connected()) {
+    SPDLOG_WARN("{} disconnected, give up send.", name_);
+    loop->queueInLoop([self, wr_id, length]() {
+      if (self->callbacks_.sendCompleteFail) {
+        self->callbacks_.sendCompleteFail(self,
+                                          Completion{wr_id, length, false});
+      }
+    });
+    return;
+  }
+  Buffer frame;
+  frame.appendInt32(static_cast<int32_t>(length));
+  frame.append(addr, length);
+  conn_->send(&frame);
+  loop->queueInLoop([self, wr_id, length]() {
+    if (self->callbacks_.sendCompleteSuccess) {
+      self->callbacks_.sendCompleteSuccess(self,
+                                           Completion{wr_id, length, true});
+    }
+  });
+}
+
+void TcpMsgConnection::handleMessage(Buffer *buffer) {
+  auto self = shared_from_this();
+  while (buffer->readableBytes() >= sizeof(int32_t)) {
+    auto len = static_cast<uint32_t>(buffer->peekInt32());
+    if (buffer->readableBytes() < sizeof(int32_t) + len) {
+      return;
+    }
+    buffer->retrieveInt32();
+    auto data = reinterpret_cast<uint8_t *>(const_cast<char *>(buffer->peek()));
+    if (callbacks_.recvSuccess) {
+      callbacks_.recvSuccess(self, data, len, Completion{0, len, true});
+    }
+    buffer->retrieve(len);
+  }
+}
+
+void TcpMsgConnection::handleDisconnected() {
+  if (callbacks_.disconnected) {
+    callbacks_.disconnected(shared_from_this());
+  }
+}
+
+void TcpMsgConnection::onTcpConnection(const TcpConnectionPtr &conn,
+                                       size_t mem_size, size_t mem_num,
+                                       const MsgCallbacks &callbacks) {
+  if (conn->connected()) {
+    conn->setTcpNoDelay(true);
+    auto msg_conn =
+        std::make_shared<TcpMsgConnection>(conn, mem_size, mem_num, callbacks);
+    conn->setContext(msg_conn);
+    SPDLOG_INFO("{} connected", msg_conn->name());
+    if (callbacks.connected) {
+      callbacks.connected(msg_conn);
+    }
+  } else {
+    if (!conn->getContext().has_value()) {
+      return;
+    }
+    auto msg_conn = std::any_cast<TcpMsgConnectionPtr>(conn->getContext());
+    // break the cycle between the TcpConnection and its context
+    conn->setContext(std::any());
+    msg_conn->handleDisconnected();
+  }
+}
+
+void TcpMsgConnection::onTcpMessage(const TcpConnectionPtr &conn,
+                                    Buffer *buffer, Timestamp timestamp) {
+  auto msg_conn = std::any_cast<TcpMsgConnectionPtr>(conn->getContext());
+  msg_conn->handleMessage(buffer);
+}
+
+TcpMsgClient::TcpMsgClient(EventLoop *loop, const InetAddress &serverAddr,
+                           const std::string &name, size_t mem_size,
+                           size_t mem_num)
+    : client_(loop, serverAddr, name), mem_size_(mem_size), mem_num_(mem_num) {
+  client_.setConnectionCallback([this](const TcpConnectionPtr &conn) {
+    TcpMsgConnection::onTcpConnection(conn, mem_size_, mem_num_, callbacks_);
+  });
+  client_.setMessageCallback(&TcpMsgConnection::onTcpMessage);
+}
+
+TcpMsgServer::TcpMsgServer(EventLoop *loop, const InetAddress &listenAddr,
+                           const std::string &name, size_t mem_size,
+                           size_t mem_num)
+    : server_(loop, listenAddr, name), mem_size_(mem_size),
+      mem_num_(mem_num) {
+  server_.setConnectionCallback([this](const TcpConnectionPtr &conn) {
+    TcpMsgConnection::onTcpConnection(conn, mem_size_, mem_num_, callbacks_);
+  });
+  server_.setMessageCallback(&TcpMsgConnection::onTcpMessage);
+}
+
+} // namespace hdc::network::transport
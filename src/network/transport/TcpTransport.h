@@ -0,0 +1,100 @@
+#pragma once
+#include "network/tcp/Buffer.h"
+#include "network/tcp/Callbacks.h"
+#include "network/tcp/TcpClient.h"
+#include "network/tcp/TcpServer.h"
+#include "network/transport/MsgConnection.h"
+#include "network/transport/MsgEndpoint.h"
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace hdc {
+namespace network {
+namespace transport {
+using tcp::Buffer;
+using tcp::TcpConnectionPtr;
+
+/// @brief: A MsgConnection over a TcpConnection. Every message is framed by
+/// its length as a network order int32. A send is complete once the message
+/// is copied into the output buffer of the TcpConnection, so the send buffer
+/// can be reused immediately.
+class TcpMsgConnection : public MsgConnection,
+                         public std::enable_shared_from_this<TcpMsgConnection> {
+public:
+  TcpMsgConnection(const TcpConnectionPtr &conn, size_t mem_size,
+                   size_t mem_num, MsgCallbacks callbacks);
+
+  TcpMsgConnection(const TcpMsgConnection &) = delete;
+
+  TcpMsgConnection &operator=(const TcpMsgConnection &) = delete;
+
+  const std::string &name() const override { return name_; }
+
+  bool connected() const override { return conn_ && conn_->connected(); }
+
+  std::optional<SendBuf> acquireFreeSendBuf() override;
+
+  void releaseSendBuf(size_t bufpair_id) override {
+    free_bufs_.emplace_back(bufpair_id);
+  }
+
+  bool isFreeSendBufEmpty() override { return free_bufs_.empty(); }
+
+  void send(const void *addr, uint32_t length, uint64_t wr_id) override;
+
+  /// @brief: The ConnectionCallback of TcpClient/TcpServer. It attaches a
+  /// TcpMsgConnection to the context of `conn`.
+  static void onTcpConnection(const TcpConnectionPtr &conn, size_t mem_size,
+                              size_t mem_num, const MsgCallbacks &callbacks);
+
+  /// @brief: The MessageCallback of TcpClient/TcpServer.
+  static void onTcpMessage(const TcpConnectionPtr &conn, Buffer *buffer,
+                           Timestamp timestamp);
+
+private:
+  /// @brief: Deliver the complete messages in `buffer`.
+  void handleMessage(Buffer *buffer);
+
+  void handleDisconnected();
+
+  std::string name_;
+  TcpConnectionPtr conn_;
+  std::vector<uint8_t> mem_;
+  size_t mem_size_;
+  std::deque<size_t> free_bufs_;
+  MsgCallbacks callbacks_;
+};
+
+/// @brief: MsgClient over TcpClient.
+class TcpMsgClient : public MsgClient {
+public:
+  TcpMsgClient(EventLoop *loop, const InetAddress &serverAddr,
+               const std::string &name, size_t mem_size, size_t mem_num);
+
+  void connect() override { client_.connect(); }
+
+private:
+  tcp::TcpClient client_;
+  size_t mem_size_;
+  size_t mem_num_;
+};
+
+/// @brief: MsgServer over TcpServer. All connections are handled in the loop
+/// of the server.
+class TcpMsgServer : public MsgServer {
+public:
+  TcpMsgServer(EventLoop *loop, const InetAddress &listenAddr,
+               const std::string &name, size_t mem_size, size_t mem_num);
+
+  void start() override { server_.start(); }
+
+private:
+  tcp::TcpServer server_;
+  size_t mem_size_;
+  size_t mem_num_;
+};
+
+} // namespace transport
+} // namespace network
+} // namespace hdc
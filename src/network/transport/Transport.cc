@@ -0,0 +1,68 @@
+#include "network/transport/Transport.h"
+#include "network/transport/RdmaTransport.h"
+#include "network/transport/ShmTransport.h"
+#include "network/transport/TcpTransport.h"
+
+namespace hdc::network::transport {
+
+std::optional<TransportType> parseTransportType(std::string_view name) {
+  if (name == "rdma") {
+    return TransportType::kRdma;
+  }
+  if (name == "tcp") {
+    return TransportType::kTcp;
+  }
+  if (name == "shm") {
+    return TransportType::kShm;
+  }
+  return std::nullopt;
+}
+
+const char *transportTypeName(TransportType type) {
+  switch (type) {
+  case TransportType::kRdma:
+    return "rdma";
+  case TransportType::kTcp:
+    return "tcp";
+  case TransportType::kShm:
+    return "shm";
+  }
+  return "unknown";
+}
+
+std::unique_ptr<MsgClient> createMsgClient(EventLoop *loop,
+                                           const InetAddress &serverAddr,
+                                           const std::string &name,
+                                           const TransportConfig &config) {
+  switch (config.type_) {
+  case TransportType::kRdma:
+    return std::make_unique<RdmaMsgClient>(loop, serverAddr, name,
+                                           config.rdmaConfig());
+  case TransportType::kTcp:
+    return std::make_unique<TcpMsgClient>(loop, serverAddr, name,
+                                          config.memSize_, config.memNum_);
+  case TransportType::kShm:
+    return std::make_unique<ShmMsgClient>(loop, serverAddr, name);
+  }
+  return nullptr;
+}
+
+std::unique_ptr<MsgServer> createMsgServer(EventLoop *loop,
+                                           const InetAddress &listenAddr,
+                                           const std::string &name,
+                                           const TransportConfig &config) {
+  switch (config.type_) {
+  case TransportType::kRdma:
+    return std::make_unique<RdmaMsgServer>(loop, listenAddr, name,
+                                           config.rdmaConfig());
+  case TransportType::kTcp:
+    return std::make_unique<TcpMsgServer>(loop, listenAddr, name,
+                                          config.memSize_, config.memNum_);
+  case TransportType::kShm:
+    return std::make_unique<ShmMsgServer>(loop, listenAddr, name,
+                                          config.memSize_, config.memNum_);
+  }
+  return nullptr;
+}
+
+} // namespace hdc::network::transport
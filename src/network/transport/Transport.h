@@ -0,0 +1,28 @@
+#pragma once
+#include "network/EventLoop.h"
+#include "network/InetAddress.h"
+#include "network/transport/MsgConnection.h"
+#include "network/transport/MsgEndpoint.h"
+#include "network/transport/TransportConfig.h"
+#include <memory>
+#include <string>
+
+namespace hdc {
+namespace network {
+namespace transport {
+
+/// @brief: Create the client of `config.type_`.
+std::unique_ptr<MsgClient> createMsgClient(EventLoop *loop,
+                                           const InetAddress &serverAddr,
+                                           const std::string &name,
+                                           const TransportConfig &config);
+
+/// @brief: Create the server of `config.type_`.
+std::unique_ptr<MsgServer> createMsgServer(EventLoop *loop,
+                                           const InetAddress &listenAddr,
+                                           const std::string &name,
+                                           const TransportConfig &config);
+
+} // namespace transport
+} // namespace network
+} // namespace hdc
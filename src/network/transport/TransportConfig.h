@@ -0,0 +1,46 @@
+#pragma once
+#include "network/rdma/RdmaConfig.h"
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace hdc {
+namespace network {
+namespace transport {
+
+enum class TransportType {
+  kRdma,
+  kTcp,
+  // shared memory, for the components on the same host
+  kShm,
+};
+
+/// @brief: Parse "rdma", "tcp" or "shm".
+std::optional<TransportType> parseTransportType(std::string_view name);
+
+const char *transportTypeName(TransportType type);
+
+struct TransportConfig {
+  TransportType type_;
+  // RDMA only
+  std::string ibDevName_;
+  int ibDevPort_;
+  // the size and the number of send/recv buffers of a connection. With shm,
+  // the buffers of both sides are those of the server.
+  size_t memSize_;
+  size_t memNum_;
+
+  TransportConfig(TransportType type, std::string ibDevName, int ibDevPort,
+                  size_t memSize, size_t memNum)
+      : type_(type), ibDevName_(std::move(ibDevName)), ibDevPort_(ibDevPort),
+        memSize_(memSize), memNum_(memNum) {}
+
+  rdma::RdmaConfig rdmaConfig() const {
+    return rdma::RdmaConfig{ibDevName_, ibDevPort_, memSize_, memNum_};
+  }
+};
+
+} // namespace transport
+} // namespace network
+} // namespace hdc
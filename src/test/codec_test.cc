@@ -0,0 +1,74 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "utils/codec.h"
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using hdc::utils::codecName;
+using hdc::utils::parseCodec;
+using hdc::utils::parseCodecList;
+using hdc::utils::softCodecAvailable;
+using hdc::utils::softCompress;
+using hdc::utils::softDecompress;
+
+namespace {
+std::vector<uint8_t> sample(size_t len) {
+  std::vector<uint8_t> data(len);
+  for (size_t i = 0; i < len; ++i) {
+    // compressible, but not a single run
+    data[i] = static_cast<uint8_t>((i * 7) % 251 / 3);
+  }
+  return data;
+}
+
+void testParse() {
+  assert(parseCodec("none") == content::UNCOMPRESSED);
+  assert(parseCodec("deflate") == content::DEFLATE);
+  assert(parseCodec("zstd") == content::ZSTD);
+  assert(parseCodec("lz4") == content::LZ4);
+  assert(!parseCodec("gzip").has_value());
+  assert(std::string(codecName(content::ZSTD)) == "zstd");
+
+  auto list = parseCodecList("zstd,deflate");
+  assert(list.has_value());
+  assert((*list ==
+          std::vector<content::Codec>{content::ZSTD, content::DEFLATE}));
+  assert(!parseCodecList("zstd,gzip").has_value());
+}
+
+void testRoundTrip(content::Codec codec) {
+  if (!softCodecAvailable(codec)) {
+    return;
+  }
+  auto data = sample(256 * 1024);
+  std::vector<uint8_t> frame;
+  assert(softCompress(codec, data.data(), data.size(), frame));
+  assert(frame.size() < data.size());
+
+  std::vector<uint8_t> out(data.size());
+  auto size =
+      softDecompress(codec, frame.data(), frame.size(), out.data(), out.size());
+  assert(size == data.size());
+  assert(memcmp(out.data(), data.data(), data.size()) == 0);
+
+  // a smaller buffer is refused
+  std::vector<uint8_t> small(data.size() / 2);
+  assert(!softDecompress(codec, frame.data(), frame.size(), small.data(),
+                         small.size())
+              .has_value());
+
+  std::vector<uint8_t> in_place = frame;
+  assert(softDecompress(codec, in_place));
+  assert(in_place == data);
+}
+} // namespace
+
+int main() {
+  testParse();
+  testRoundTrip(content::DEFLATE);
+  testRoundTrip(content::ZSTD);
+  testRoundTrip(content::LZ4);
+  return 0;
+}
@@ -0,0 +1,216 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "content.pb.h"
+#include "dpu/content_fetcher.h"
+#include "dpu/segment_cache.h"
+#include "network/EventLoop.h"
+#include "network/InetAddress.h"
+#include "network/transport/Transport.h"
+#include "network/transport/TransportConfig.h"
+#include "utils/MsgFrame.h"
+#include "utils/blob_pool.h"
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using hdc::dpu::ContentClient;
+using hdc::dpu::ContentElement;
+using hdc::dpu::SegmentCache;
+using hdc::network::EventLoop;
+using hdc::network::InetAddress;
+using hdc::network::transport::Completion;
+using hdc::network::transport::createMsgServer;
+using hdc::network::transport::MsgConnectionPtr;
+using hdc::network::transport::MsgServer;
+using hdc::network::transport::TransportConfig;
+using hdc::network::transport::TransportType;
+using hdc::utils::SchedPolicy;
+
+namespace {
+constexpr uint16_t kPort = 18561;
+
+TransportConfig tcpConfig() {
+  return TransportConfig(TransportType::kTcp, "", 0, 4096, 4);
+}
+
+/// @brief: A registry which records the requests and answers them only when
+/// asked to.
+struct FakeRegistry {
+  std::unique_ptr<MsgServer> server;
+  MsgConnectionPtr conn;
+  std::vector<content::GetLayerRequest> requests;
+
+  explicit FakeRegistry(EventLoop *loop) {
+    server = createMsgServer(loop, InetAddress("127.0.0.1", kPort),
+                             "registry", tcpConfig());
+    server->setConnectedCallback(
+        [this](const MsgConnectionPtr &conn) { this->conn = conn; });
+    server->setRecvSuccessCallback(
+        [this](const MsgConnectionPtr &conn, uint8_t *recv_buf,
+               uint32_t recv_len, const Completion &wc) {
+          content::GetLayerRequest req;
+          assert(parseRdmaPbMsg(recv_buf, recv_len, req) != -1);
+          requests.push_back(req);
+        });
+    server->start();
+  }
+
+  void answer(const content::GetLayerRequest &req, const std::string &data) {
+    content::GetLayerResponse resp;
+    resp.set_layer(req.layer());
+    resp.set_index(req.index());
+    resp.set_total_segments(req.total_segments());
+    resp.set_image_name_tag(req.image_name_tag());
+    resp.set_iscompressed(false);
+    resp.set_codec(content::UNCOMPRESSED);
+    resp.set_segment_size(data.size());
+    auto free_buf = conn->acquireFreeSendBuf();
+    assert(free_buf.has_value());
+    auto frame_len = serializeRdmaPbMsg(free_buf->addr, free_buf->cap, resp);
+    assert(frame_len != -1);
+    memcpy(free_buf->addr + frame_len, data.data(), data.size());
+    conn->send(free_buf->addr, frame_len + data.size(), 0);
+    conn->releaseSendBuf(free_buf->id);
+  }
+};
+
+/// @brief: Run the loop until `done` or a few seconds passed.
+void runUntil(EventLoop &loop, const std::function<bool()> &done) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  std::function<void()> poll = [&]() {
+    if (done() || std::chrono::steady_clock::now() > deadline) {
+      loop.quit();
+      return;
+    }
+    loop.runAfter(0.01, poll);
+  };
+  loop.runAfter(0.01, poll);
+  loop.loop();
+  assert(done());
+}
+
+ContentClient::LayerRequest request(int index, const std::string &chunk) {
+  ContentClient::LayerRequest request;
+  request.req.set_layer("layer");
+  request.req.set_index(index);
+  request.req.set_total_segments(2);
+  request.req.set_image_name_tag("image:tag");
+  request.priority = 0;
+  request.partial = false;
+  request.chunk = chunk;
+  return request;
+}
+
+/// @brief: The client of one registry with segment 1 of "layer" in the
+/// segment cache, by its chunk.
+struct Fixture {
+  std::shared_ptr<SegmentCache> cache = std::make_shared<SegmentCache>(4096);
+  std::vector<ContentElement> fetched;
+  std::vector<ContentClient::LayerRequest> taken;
+  std::unique_ptr<ContentClient> client;
+
+  explicit Fixture(EventLoop *loop) {
+    std::string cached = "cached-segment";
+    cache->insert("other", 0, 1, content::UNCOMPRESSED,
+                  reinterpret_cast<const uint8_t *>(cached.data()),
+                  cached.size(), "c1");
+    client = std::make_unique<ContentClient>(
+        loop, InetAddress("127.0.0.1", kPort), "content", tcpConfig(),
+        std::vector<content::Codec>{content::UNCOMPRESSED},
+        std::make_shared<BlobPool>(0, 0), cache, nullptr, SchedPolicy::kFifo,
+        [this](ContentElement element, bool, std::vector<std::string>) {
+          fetched.push_back(std::move(element));
+        },
+        // as the fetcher fails the registry over
+        [this]() {
+          for (auto &request : client->takeRequests()) {
+            taken.push_back(std::move(request));
+          }
+        });
+  }
+
+  /// @brief: Request segment 0, which the registry holds back, and segment 1
+  /// served from the cache behind it.
+  void requestBoth(EventLoop &loop, FakeRegistry &registry) {
+    client->connect();
+    client->enqueueRequest(request(0, ""));
+    client->enqueueRequest(request(1, "c1"));
+    runUntil(loop, [&]() { return registry.requests.size() == 1; });
+    client->trySendRequests();
+    assert(registry.requests[0].index() == 0);
+    // in the order of the layer
+    assert(fetched.empty());
+    assert(client->outstanding() == 1);
+  }
+};
+
+bool takenIndexes(const std::vector<ContentClient::LayerRequest> &taken,
+                  const std::vector<int> &indexes) {
+  if (taken.size() != indexes.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < taken.size(); ++i) {
+    if (taken[i].req.index() != indexes[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void testStallTakesCached(EventLoop &loop) {
+  auto registry = std::make_unique<FakeRegistry>(&loop);
+  Fixture fixture(&loop);
+  fixture.requestBoth(loop, *registry);
+  auto now = std::chrono::steady_clock::now();
+  assert(!fixture.client->stalled(now, 1000));
+  // the cached segment waits behind the request with no response
+  assert(fixture.client->stalled(now + std::chrono::seconds(2), 1000));
+  auto taken = fixture.client->takeRequests();
+  assert(takenIndexes(taken, {0, 1}));
+  assert(fixture.client->outstanding() == 0);
+  assert(!fixture.client->stalled(now + std::chrono::seconds(2), 1000));
+  // a late response is still delivered, nothing is delivered behind it
+  registry->answer(registry->requests[0], "segment-0");
+  runUntil(loop, [&]() { return fixture.fetched.size() == 1; });
+  assert(fixture.fetched[0].segment_idx == 0);
+  // the taken request is not requested again once the connection is lost
+  registry.reset();
+  runUntil(loop, [&]() { return fixture.client->lost(); });
+  assert(fixture.taken.empty());
+}
+
+void testFailoverAndReconnect(EventLoop &loop) {
+  auto registry = std::make_unique<FakeRegistry>(&loop);
+  Fixture fixture(&loop);
+  fixture.requestBoth(loop, *registry);
+  assert(!fixture.client->lost());
+  // the registry goes away with the request unanswered
+  registry.reset();
+  runUntil(loop, [&]() { return fixture.client->lost(); });
+  assert(takenIndexes(fixture.taken, {0, 1}));
+  assert(fixture.fetched.empty());
+  assert(fixture.client->outstanding() == 0);
+
+  registry = std::make_unique<FakeRegistry>(&loop);
+  fixture.client->reconnect();
+  fixture.client->enqueueRequest(request(0, ""));
+  runUntil(loop, [&]() { return registry->requests.size() == 1; });
+  assert(!fixture.client->lost());
+  registry->answer(registry->requests[0], "segment-0");
+  runUntil(loop, [&]() { return fixture.fetched.size() == 1; });
+  assert(fixture.fetched[0].segment_idx == 0);
+  assert(fixture.fetched[0].segment.get_size() == 9);
+  assert(fixture.taken.size() == 2);
+}
+} // namespace
+
+int main() {
+  EventLoop loop;
+  testStallTakesCached(loop);
+  testFailoverAndReconnect(loop);
+  return 0;
+}
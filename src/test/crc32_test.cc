@@ -0,0 +1,26 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "utils/crc32.h"
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include <zlib.h>
+
+using hdc::utils::crc32;
+
+int main() {
+  const char *check = "123456789";
+  auto *bytes = reinterpret_cast<const uint8_t *>(check);
+  assert(crc32(bytes, 9) == 0xcbf43926U);
+  assert(crc32(bytes, 0) == 0);
+  // continued over the pieces
+  assert(crc32(bytes + 4, 5, crc32(bytes, 4)) == 0xcbf43926U);
+
+  std::vector<uint8_t> data(1 << 16);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<uint8_t>(i * 31 + i / 7);
+  }
+  assert(crc32(data.data(), data.size()) ==
+         ::crc32(0L, data.data(), static_cast<uInt>(data.size())));
+  return 0;
+}
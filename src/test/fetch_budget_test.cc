@@ -0,0 +1,47 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "dpu/fetch_budget.h"
+#include <cassert>
+
+using hdc::dpu::FetchBudget;
+
+namespace {
+void testExhausted() {
+  FetchBudget budget(100);
+  int available = 0;
+  budget.setAvailableCallback([&available] { available++; });
+  budget.acquire(60);
+  assert(!budget.exhausted());
+  // a response may exceed the budget
+  budget.acquire(60);
+  assert(budget.exhausted());
+  assert(budget.used() == 120);
+  budget.release(10);
+  assert(budget.exhausted());
+  assert(available == 0);
+  budget.release(20);
+  assert(!budget.exhausted());
+  assert(available == 1);
+  // called once per crossing only
+  budget.release(50);
+  assert(available == 1);
+  assert(budget.used() == 40);
+}
+
+void testUnlimited() {
+  FetchBudget budget(0);
+  int available = 0;
+  budget.setAvailableCallback([&available] { available++; });
+  budget.acquire(1ULL << 40);
+  assert(!budget.exhausted());
+  budget.release(1ULL << 40);
+  assert(available == 0);
+  assert(budget.used() == 0);
+}
+} // namespace
+
+int main() {
+  testExhausted();
+  testUnlimited();
+  return 0;
+}
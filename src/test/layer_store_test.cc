@@ -0,0 +1,205 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "host/client/layer_store.h"
+#include <cassert>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+using hdc::host::client::LayerStore;
+namespace fs = std::filesystem;
+
+namespace {
+std::string makeRoot() {
+  char root[] = "/tmp/layer_store_test.XXXXXX";
+  auto *dir = mkdtemp(root);
+  assert(dir != nullptr);
+  return dir;
+}
+
+/// @brief: Extract a layer as UntarEngine does and publish it.
+void publish(LayerStore &store, const std::string &layer, uint64_t bytes) {
+  auto staging = LayerStore::stagingPath(store.root(), layer);
+  fs::create_directories(staging);
+  std::ofstream(staging + "/file") << layer;
+  assert(store.publish(layer, bytes));
+}
+
+/// @brief: Link the layer into the image directory as OffloadClientEpoll
+/// does.
+void link(LayerStore &store, const std::string &image,
+          const std::string &layer) {
+  fs::create_directories(store.root() + "/" + image);
+  fs::create_directory_symlink("../layers/" + layer,
+                               store.root() + "/" + image + "/" + layer);
+  store.addLink(image, layer);
+}
+
+/// @brief: Write a segment of a lazy layer as LazyFs does.
+void writeSegment(LayerStore &store, const std::string &layer,
+                  uint64_t bytes) {
+  auto dir = store.root() + "/segments/" + layer;
+  fs::create_directories(dir);
+  std::ofstream(dir + "/0.tar") << std::string(bytes, 's');
+  store.addSegmentBytes(layer, static_cast<int64_t>(bytes));
+}
+
+void testPublish() {
+  auto root = makeRoot();
+  auto store = LayerStore::open(root, 0);
+  assert(store.has_value());
+  publish(*store, "a", 100);
+  assert(store->contains("a"));
+  assert(fs::exists(store->layerPath("a") + "/file"));
+  assert(!fs::exists(LayerStore::stagingPath(root, "a")));
+  assert(store->bytes() == 100);
+  // published again, not counted twice
+  publish(*store, "a", 100);
+  assert(store->bytes() == 100);
+  assert(store->size() == 1);
+  fs::remove_all(root);
+}
+
+void testEvictLru() {
+  auto root = makeRoot();
+  auto store = LayerStore::open(root, 300);
+  assert(store.has_value());
+  publish(*store, "a", 100);
+  publish(*store, "b", 100);
+  publish(*store, "c", 100);
+  store->touch("a");
+  publish(*store, "d", 100);
+  // b is the least recently used
+  assert(!store->contains("b"));
+  assert(!fs::exists(store->layerPath("b")));
+  assert(store->contains("a") && store->contains("c") && store->contains("d"));
+  assert(store->bytes() == 300);
+  fs::remove_all(root);
+}
+
+void testPin() {
+  auto root = makeRoot();
+  auto store = LayerStore::open(root, 200);
+  assert(store.has_value());
+  publish(*store, "a", 100);
+  store->pin("a");
+  store->pin("a");
+  publish(*store, "b", 100);
+  publish(*store, "c", 100);
+  assert(store->contains("a"));
+  assert(!store->contains("b"));
+  store->unpin("a");
+  publish(*store, "d", 100);
+  assert(store->contains("a"));
+  store->unpin("a");
+  publish(*store, "e", 100);
+  assert(!store->contains("a"));
+  fs::remove_all(root);
+}
+
+void testEvictLinkingImages() {
+  auto root = makeRoot();
+  auto store = LayerStore::open(root, 200);
+  assert(store.has_value());
+  publish(*store, "a", 100);
+  publish(*store, "b", 100);
+  link(*store, "img1", "a");
+  link(*store, "img1", "b");
+  link(*store, "img2", "b");
+  publish(*store, "c", 100);
+  // an image without one of its layers is incomplete
+  assert(!store->contains("a"));
+  assert(!fs::exists(root + "/img1"));
+  assert(fs::exists(root + "/img2/b"));
+  fs::remove_all(root);
+}
+
+void testSegments() {
+  auto root = makeRoot();
+  auto store = LayerStore::open(root, 300);
+  assert(store.has_value());
+  publish(*store, "a", 100);
+  writeSegment(*store, "linked", 50);
+  link(*store, "img", "linked");
+  writeSegment(*store, "pinned", 50);
+  store->pin("pinned");
+  writeSegment(*store, "unused", 50);
+  assert(store->segmentBytes() == 150);
+
+  // the segments no image uses go before the layers
+  publish(*store, "b", 100);
+  assert(!fs::exists(root + "/segments/unused"));
+  assert(store->segmentBytes() == 100);
+  assert(store->contains("a") && store->contains("b"));
+
+  // a removal refused by LazyFs is kept
+  store->unpin("pinned");
+  bool refuse = true;
+  store->setRemoveSegmentsCallback(
+      [&refuse, &root](const std::string &layer) {
+        if (refuse) {
+          return false;
+        }
+        fs::remove_all(root + "/segments/" + layer);
+        return true;
+      });
+  publish(*store, "c", 50);
+  assert(fs::exists(root + "/segments/pinned"));
+  assert(!store->contains("a"));
+  refuse = false;
+  publish(*store, "d", 100);
+  assert(!fs::exists(root + "/segments/pinned"));
+  assert(fs::exists(root + "/segments/linked"));
+  assert(store->segmentBytes() == 50);
+
+  // a removal that races with a write does not go below 0
+  store->addSegmentBytes("linked", -200);
+  assert(store->segmentBytes() == 0);
+  fs::remove_all(root);
+}
+
+void testReopen() {
+  auto root = makeRoot();
+  {
+    auto store = LayerStore::open(root, 0);
+    assert(store.has_value());
+    publish(*store, "a", 100);
+    publish(*store, "b", 100);
+    store->touch("a");
+    writeSegment(*store, "lazy", 30);
+    link(*store, "img", "b");
+    store->flush();
+    // an extraction left by a crash
+    fs::create_directories(LayerStore::stagingPath(root, "c"));
+  }
+  {
+    auto store = LayerStore::open(root, 0);
+    assert(store.has_value());
+    assert(store->size() == 2);
+    assert(store->bytes() == 200);
+    assert(store->segmentBytes() == 30);
+    assert(!fs::exists(LayerStore::stagingPath(root, "c")));
+  }
+  {
+    // the last uses survive: b goes, and img with it
+    auto store = LayerStore::open(root, 150);
+    assert(store.has_value());
+    assert(store->contains("a"));
+    assert(!store->contains("b"));
+    assert(!fs::exists(root + "/img"));
+    assert(!fs::exists(root + "/segments/lazy"));
+  }
+  fs::remove_all(root);
+}
+} // namespace
+
+int main() {
+  testPublish();
+  testEvictLru();
+  testPin();
+  testEvictLinkingImages();
+  testSegments();
+  testReopen();
+  return 0;
+}
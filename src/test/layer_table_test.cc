@@ -0,0 +1,53 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "host/client/layer_table.h"
+#include <cassert>
+#include <string>
+#include <vector>
+
+using hdc::host::client::LayerTable;
+
+namespace {
+std::vector<std::string> ids(const std::vector<ImageNameTag> &images) {
+  std::vector<std::string> ids;
+  for (auto &image : images) {
+    ids.push_back(image.id());
+  }
+  return ids;
+}
+
+void testWaiters() {
+  LayerTable table;
+  assert(!table.inflight("layer"));
+  table.startPull("layer", ImageNameTag{"app:1"});
+  assert(table.inflight("layer"));
+  // the other pulls of the layer wait for the one in flight
+  table.addWaiter("layer", ImageNameTag{"app:2"});
+  table.addWaiter("layer", ImageNameTag{"app:3"});
+  assert(table.size() == 1);
+  assert((ids(table.complete("layer")) ==
+          std::vector<std::string>{"app:1", "app:2", "app:3"}));
+  assert(!table.inflight("layer"));
+  assert(table.size() == 0);
+}
+
+void testRetry() {
+  LayerTable table;
+  table.startPull("a", ImageNameTag{"app:1"});
+  table.startPull("b", ImageNameTag{"app:1"});
+  assert(table.size() == 2);
+  // a failed layer leaves the table too, the next pull retries it
+  assert((ids(table.complete("a")) == std::vector<std::string>{"app:1"}));
+  table.startPull("a", ImageNameTag{"app:2"});
+  assert((ids(table.complete("a")) == std::vector<std::string>{"app:2"}));
+  assert(table.inflight("b"));
+  // a layer not in flight completes no image
+  assert(table.complete("a").empty());
+}
+} // namespace
+
+int main() {
+  testWaiters();
+  testRetry();
+  return 0;
+}
@@ -0,0 +1,313 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "container.pb.h"
+#include "host/client/layer_store.h"
+#include "host/client/metadata.h"
+#include "host/client/metadata_service.h"
+#include "host/client/offload_client_epoll.h"
+#include "network/EventLoop.h"
+#include "network/InetAddress.h"
+#include "network/tcp/TcpClient.h"
+#include "network/tcp/TcpServer.h"
+#include "network/transport/Transport.h"
+#include "network/transport/TransportConfig.h"
+#include "offload.pb.h"
+#include "utils/MsgFrame.h"
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+using hdc::host::client::DpuPeer;
+using hdc::host::client::LayerStore;
+using hdc::host::client::MetadataService;
+using hdc::host::client::OffloadClientEpoll;
+using hdc::host::client::OffloadElement;
+using hdc::host::client::UntarResult;
+using hdc::network::EventLoop;
+using hdc::network::InetAddress;
+using hdc::network::tcp::TcpClient;
+using hdc::network::tcp::TcpServer;
+using hdc::network::transport::Completion;
+using hdc::network::transport::createMsgServer;
+using hdc::network::transport::MsgConnectionPtr;
+using hdc::network::transport::MsgServer;
+using hdc::network::transport::TransportConfig;
+using hdc::network::transport::TransportType;
+namespace fs = std::filesystem;
+
+namespace {
+constexpr uint16_t kDpuPort = 18571;
+constexpr uint16_t kCommandPort = 18572;
+// the message types of OffloadClientEpoll
+constexpr int kDecompressConnection = 0;
+constexpr int kOffload = 1;
+
+TransportConfig tcpConfig() {
+  return TransportConfig(TransportType::kTcp, "", 0, 4096, 4);
+}
+
+std::string digest(char c) { return "sha256:" + std::string(64, c); }
+
+/// @brief: Write the metadata of `image` with `layers` of (digest, size),
+/// pulled from the smallest.
+void writeImage(const fs::path &metadata_path, const std::string &image,
+                const std::vector<std::pair<std::string, size_t>> &layers) {
+  std::string config = R"({"architecture":"amd64","os":"linux","config":{},)"
+                       R"("rootfs":{"type":"layers","diff_ids":[]}})";
+  std::string layers_json;
+  for (auto &[layer, size] : layers) {
+    layers_json += fmt::format(
+        R"({}{{"mediaType":"application/vnd.docker.image.rootfs.diff.tar.gzip",)"
+        R"("size":{},"digest":"{}"}})",
+        layers_json.empty() ? "" : ",", size, layer);
+  }
+  auto manifest = fmt::format(
+      R"({{"schemaVersion":2,)"
+      R"("mediaType":"application/vnd.docker.distribution.manifest.v2+json",)"
+      R"("config":{{"mediaType":"application/vnd.docker.container.image.v1+json",)"
+      R"("size":{},"digest":"{}"}},"layers":[{}]}})",
+      config.size(), digest('c'), layers_json);
+  auto dir = metadata_path / image;
+  fs::create_directories(dir);
+  std::ofstream(dir / "manifest.json") << manifest;
+  std::ofstream(dir / "config") << config;
+}
+
+/// @brief: A DPU which accepts every OffloadRequest and records its layers.
+struct FakeDpu {
+  std::unique_ptr<MsgServer> server;
+  std::vector<std::string> layers;
+
+  explicit FakeDpu(EventLoop *loop) {
+    server = createMsgServer(loop, InetAddress("127.0.0.1", kDpuPort), "dpu",
+                             tcpConfig());
+    server->setRecvSuccessCallback(
+        [this](const MsgConnectionPtr &conn, uint8_t *recv_buf,
+               uint32_t recv_len, const Completion &wc) {
+          this->onRequest(conn, recv_buf, recv_len);
+        });
+    server->start();
+  }
+
+  template <typename T>
+  void reply(const MsgConnectionPtr &conn, int type, const T &resp) {
+    auto free_buf = conn->acquireFreeSendBuf();
+    assert(free_buf.has_value());
+    *reinterpret_cast<int *>(free_buf->addr) = type;
+    auto frame_len = serializeRdmaPbMsg(free_buf->addr + sizeof(int),
+                                        free_buf->cap - sizeof(int), resp);
+    assert(frame_len != -1);
+    conn->send(free_buf->addr, frame_len + sizeof(int), 0);
+    conn->releaseSendBuf(free_buf->id);
+  }
+
+  void onRequest(const MsgConnectionPtr &conn, uint8_t *recv_buf,
+                 uint32_t recv_len) {
+    int type = *reinterpret_cast<int *>(recv_buf);
+    if (type == kDecompressConnection) {
+      offload::DecompressConnectionResponse resp;
+      resp.set_connection(true);
+      reply(conn, kDecompressConnection, resp);
+      return;
+    }
+    assert(type == kOffload);
+    offload::OffloadRequest req;
+    assert(parseRdmaPbMsg(recv_buf + sizeof(int), recv_len - sizeof(int),
+                          req) != -1);
+    for (auto &layer : req.layers()) {
+      layers.push_back(layer.layer());
+    }
+    offload::OffloadResponse resp;
+    resp.set_image_name_tag(req.image_name_tag());
+    resp.set_success(true);
+    resp.set_layers(req.layers_size());
+    reply(conn, kOffload, resp);
+  }
+};
+
+/// @brief: The command connection of the pulls, the responses to them are
+/// collected on the client side.
+struct Commands {
+  TcpServer server;
+  TcpClient client;
+  hdc::network::tcp::TcpConnectionPtr conn;
+  std::vector<container::CreateContainerResponse> responses;
+
+  explicit Commands(EventLoop *loop)
+      : server(loop, InetAddress("127.0.0.1", kCommandPort), "command"),
+        client(loop, InetAddress("127.0.0.1", kCommandPort), "pull") {
+    server.setConnectionCallback(
+        [this](const hdc::network::tcp::TcpConnectionPtr &conn) {
+          if (conn->connected()) {
+            this->conn = conn;
+          }
+        });
+    client.setMessageCallback(
+        [this](const hdc::network::tcp::TcpConnectionPtr &, Buffer *buffer,
+               hdc::network::Timestamp) {
+          container::CreateContainerResponse resp;
+          while (receiveTcpPbMsg(buffer, resp)) {
+            responses.push_back(resp);
+          }
+        });
+    server.start();
+    client.connect();
+  }
+};
+
+/// @brief: Run the loop until `done` or a few seconds passed.
+void runUntil(EventLoop &loop, const std::function<bool()> &done) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  std::function<void()> poll = [&]() {
+    if (done() || std::chrono::steady_clock::now() > deadline) {
+      loop.quit();
+      return;
+    }
+    loop.runAfter(0.01, poll);
+  };
+  loop.runAfter(0.01, poll);
+  loop.loop();
+  assert(done());
+}
+
+/// @brief: An offload client connected to a fake DPU, with images "app:1"
+/// and "app:2" of two layers each, the smaller pulled first.
+struct Fixture {
+  fs::path root;
+  MetadataService metadata_service;
+  std::optional<LayerStore> layer_store;
+  FakeDpu dpu;
+  Commands commands;
+  std::unique_ptr<OffloadClientEpoll> offload_client;
+
+  explicit Fixture(EventLoop &loop)
+      : root(makeRoot()), metadata_service((root / "metadata").string()),
+        layer_store(LayerStore::open((root / "store").string(), 0)),
+        dpu(&loop), commands(&loop) {
+    assert(layer_store.has_value());
+    metadata_service.start();
+    offload_client = std::make_unique<OffloadClientEpoll>(
+        &loop,
+        std::vector<DpuPeer>{
+            DpuPeer{InetAddress("127.0.0.1", kDpuPort), tcpConfig()}},
+        &metadata_service, &*layer_store);
+    offload_client->connect();
+    runUntil(loop, [&]() {
+      return commands.conn != nullptr &&
+             metadata_service.find(ImageNameTag{"app:2"}) != nullptr;
+    });
+  }
+
+  /// @brief: Close the connections, the servers first, so that the clients
+  /// are not destroyed with their connections open.
+  void close(EventLoop &loop) {
+    dpu.server.reset();
+    // the server closes its side once the last reference is gone
+    commands.conn.reset();
+    commands.client.disconnect();
+    auto until =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    runUntil(loop, [&]() { return std::chrono::steady_clock::now() > until; });
+  }
+
+  ~Fixture() {
+    std::error_code ec;
+    fs::remove_all(root, ec);
+  }
+
+  static fs::path makeRoot() {
+    std::string dir =
+        (fs::temp_directory_path() / "offload_client_test.XXXXXX").string();
+    assert(mkdtemp(dir.data()) != nullptr);
+    writeImage(fs::path(dir) / "metadata", "app:1",
+               {{digest('a'), 1}, {digest('b'), 2}});
+    writeImage(fs::path(dir) / "metadata", "app:2",
+               {{digest('d'), 1}, {digest('e'), 2}});
+    return dir;
+  }
+
+  void offload(const std::string &image, bool prefetch) {
+    offload_client->offload(OffloadElement{image, commands.conn, prefetch, 0});
+  }
+
+  /// @brief: The layer is extracted into the staging path of the store.
+  void extract(const std::string &layer, const std::string &image) {
+    fs::create_directories(
+        LayerStore::stagingPath(layer_store->root(), layer));
+    offload_client->completeTask(UntarResult(layer, image, true, 10));
+  }
+};
+
+void testPullJoinsCancelledPrefetch(EventLoop &loop, Fixture &fixture) {
+  auto &responses = fixture.commands.responses;
+  auto &layers = fixture.dpu.layers;
+  size_t base = responses.size();
+  size_t dpu_base = layers.size();
+  fixture.offload("app:1", true);
+  // one prefetch layer at a time
+  runUntil(loop, [&]() { return layers.size() == dpu_base + 1; });
+  assert(layers[dpu_base] == digest('a'));
+  fixture.offload_client->cancelPrefetch("app:1", fixture.commands.conn);
+  runUntil(loop, [&]() { return responses.size() == base + 1; });
+  assert(responses[base].success());
+
+  // the pull needs the layer the cancel dropped
+  fixture.offload("app:1", false);
+  runUntil(loop, [&]() { return layers.size() == dpu_base + 2; });
+  assert(layers[dpu_base + 1] == digest('b'));
+  fixture.extract(digest('a'), "app:1");
+  fixture.extract(digest('b'), "app:1");
+  // the prefetch and the pull
+  runUntil(loop, [&]() { return responses.size() == base + 3; });
+  for (size_t i = base + 1; i < base + 3; ++i) {
+    assert(responses[i].success());
+    assert(responses[i].total_layers() == 2);
+    assert(responses[i].done_layers() == 2);
+  }
+  assert(fixture.layer_store->contains(digest('a')));
+  assert(fixture.layer_store->contains(digest('b')));
+}
+
+void testCancelledPrefetchFails(EventLoop &loop, Fixture &fixture) {
+  auto &responses = fixture.commands.responses;
+  auto &layers = fixture.dpu.layers;
+  size_t base = responses.size();
+  size_t dpu_base = layers.size();
+  fixture.offload("app:2", true);
+  runUntil(loop, [&]() { return layers.size() == dpu_base + 1; });
+  fixture.offload_client->cancelPrefetch("app:2", fixture.commands.conn);
+  runUntil(loop, [&]() { return responses.size() == base + 1; });
+  assert(responses[base].success());
+  // cancelled already
+  fixture.offload_client->cancelPrefetch("app:2", fixture.commands.conn);
+  runUntil(loop, [&]() { return responses.size() == base + 2; });
+  assert(!responses[base + 1].success());
+
+  // the layer in flight drains, the dropped one is never pulled
+  fixture.extract(digest('d'), "app:2");
+  runUntil(loop, [&]() { return responses.size() == base + 3; });
+  assert(!responses[base + 2].success());
+  assert(layers.size() == dpu_base + 1);
+  assert(fixture.layer_store->contains(digest('d')));
+  assert(!fixture.layer_store->contains(digest('e')));
+}
+} // namespace
+
+int main() {
+  EventLoop loop;
+  // one fixture, the connections of the endpoints are not torn down between
+  // the tests
+  Fixture fixture(loop);
+  testPullJoinsCancelledPrefetch(loop, fixture);
+  testCancelledPrefetchFails(loop, fixture);
+  fixture.close(loop);
+  return 0;
+}
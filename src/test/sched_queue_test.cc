@@ -0,0 +1,110 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "utils/sched_queue.h"
+#include <cassert>
+#include <string>
+#include <vector>
+
+using hdc::utils::parseSchedPolicy;
+using hdc::utils::SchedPolicy;
+using hdc::utils::SchedQueue;
+
+namespace {
+std::vector<std::string> drain(SchedQueue<std::string> &queue) {
+  std::vector<std::string> items;
+  while (!queue.empty()) {
+    items.push_back(queue.front());
+    queue.pop();
+  }
+  return items;
+}
+
+void testParse() {
+  assert(parseSchedPolicy("fifo") == SchedPolicy::kFifo);
+  assert(parseSchedPolicy("srpt") == SchedPolicy::kShortestRemaining);
+  assert(parseSchedPolicy("fair") == SchedPolicy::kFairShare);
+  assert(parseSchedPolicy("priority") == SchedPolicy::kPriority);
+  assert(!parseSchedPolicy("lifo").has_value());
+}
+
+void testFifo() {
+  SchedQueue<std::string> queue;
+  queue.push("a", "a0");
+  queue.push("b", "b0");
+  queue.push("a", "a1");
+  assert(queue.size() == 3);
+  assert((drain(queue) == std::vector<std::string>{"a0", "b0", "a1"}));
+  assert(queue.size() == 0);
+}
+
+void testShortestRemaining() {
+  SchedQueue<std::string> queue(SchedPolicy::kShortestRemaining);
+  queue.push("big", "big0", 100);
+  queue.push("big", "big1", 100);
+  queue.push("small", "small0", 10);
+  queue.push("small", "small1", 10);
+  // the items of a flow stay in order
+  assert((drain(queue) ==
+          std::vector<std::string>{"small0", "small1", "big0", "big1"}));
+}
+
+void testFairShare() {
+  SchedQueue<std::string> queue(SchedPolicy::kFairShare);
+  for (int i = 0; i < 3; ++i) {
+    queue.push("a", "a" + std::to_string(i));
+  }
+  for (int i = 0; i < 3; ++i) {
+    queue.push("b", "b" + std::to_string(i));
+  }
+  assert((drain(queue) ==
+          std::vector<std::string>{"a0", "b0", "a1", "b1", "a2", "b2"}));
+
+  // a flow of priority 1 gets twice the service
+  for (int i = 0; i < 4; ++i) {
+    queue.push("low", "l" + std::to_string(i));
+  }
+  for (int i = 0; i < 4; ++i) {
+    queue.push("high", "h" + std::to_string(i), 1, 1);
+  }
+  auto items = drain(queue);
+  int high = 0;
+  for (int i = 0; i < 3; ++i) {
+    high += items[i][0] == 'h';
+  }
+  assert(high == 2);
+}
+
+void testPriority() {
+  SchedQueue<std::string> queue(SchedPolicy::kPriority);
+  queue.push("a", "a0");
+  queue.push("b", "b0", 1, 2);
+  queue.push("c", "c0", 1, 1);
+  queue.push("a", "a1");
+  assert((drain(queue) == std::vector<std::string>{"b0", "c0", "a0", "a1"}));
+}
+
+void testPushFront() {
+  SchedQueue<std::string> queue;
+  queue.push("a", "a0");
+  queue.push("b", "b0");
+  queue.pushFront("b", "b-1");
+  assert(queue.front() == "b-1");
+  assert((drain(queue) == std::vector<std::string>{"b-1", "a0", "b0"}));
+
+  SchedQueue<std::string> srpt(SchedPolicy::kShortestRemaining);
+  srpt.push("a", "a0", 5);
+  srpt.push("a", "a1", 5);
+  srpt.pushFront("a", "a-1", 5);
+  assert((drain(srpt) == std::vector<std::string>{"a-1", "a0", "a1"}));
+}
+} // namespace
+
+int main() {
+  testParse();
+  testFifo();
+  testShortestRemaining();
+  testFairShare();
+  testPriority();
+  testPushFront();
+  return 0;
+}
@@ -0,0 +1,126 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "dpu/segment_cache.h"
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using hdc::dpu::SegmentCache;
+
+namespace {
+void insert(SegmentCache &cache, const std::string &layer, int index,
+            const std::string &data, const std::string &chunk = "") {
+  cache.insert(layer, index, 4, content::DEFLATE,
+               reinterpret_cast<const uint8_t *>(data.data()), data.size(),
+               chunk);
+}
+
+bool cached(SegmentCache &cache, const std::string &layer, int index) {
+  return cache.lookup(layer, index).has_value();
+}
+
+void testLookup() {
+  SegmentCache cache(64);
+  insert(cache, "a", 0, "a0-data");
+  auto segment = cache.lookup("a", 0);
+  assert(segment.has_value());
+  assert(segment->size == 7);
+  assert(memcmp(segment->data, "a0-data", 7) == 0);
+  assert(segment->total_segments == 4);
+  assert(segment->codec == content::DEFLATE);
+  assert(!cached(cache, "a", 1));
+  assert(!cached(cache, "b", 0));
+}
+
+void testPrefixOnly() {
+  SegmentCache cache(16);
+  // not the first segment of the layer
+  insert(cache, "a", 1, "a1");
+  assert(cache.size() == 0);
+  // larger than the cache
+  insert(cache, "a", 0, std::string(17, 'x'));
+  assert(cache.size() == 0);
+  insert(cache, "a", 0, "a0");
+  insert(cache, "a", 1, "a1");
+  assert(cache.size() == 2);
+  // inserted again, not duplicated
+  insert(cache, "a", 1, "a1");
+  assert(cache.size() == 2);
+}
+
+void testEviction() {
+  // three segments of two bytes
+  SegmentCache cache(6);
+  insert(cache, "a", 0, "a0");
+  insert(cache, "a", 1, "a1");
+  insert(cache, "b", 0, "b0");
+  // a is the least recently used layer, its last segment goes
+  insert(cache, "c", 0, "c0");
+  assert(cache.size() == 3);
+  assert(!cached(cache, "a", 1));
+  // the lookup uses a again, b is the least recently used now
+  assert(cached(cache, "a", 0));
+  insert(cache, "c", 1, "c1");
+  assert(!cached(cache, "b", 0));
+  assert(cached(cache, "a", 0));
+  assert(cached(cache, "c", 1));
+  // the segment after an evicted one is not cached, the prefix is kept
+  insert(cache, "a", 2, "a2");
+  assert(!cached(cache, "a", 2));
+}
+
+void testChunks() {
+  SegmentCache cache(8);
+  insert(cache, "a", 0, "shared", "sha256:0");
+  cache.insertRecipe("a", {"sha256:0", "sha256:1"});
+  // no segment of b is cached
+  cache.insertRecipe("b", {"sha256:0"});
+  assert(cache.lookupRecipe("b") == nullptr);
+  auto *recipe = cache.lookupRecipe("a");
+  assert(recipe != nullptr && recipe->size() == 2);
+  auto segment = cache.lookupChunk("sha256:0");
+  assert(segment.has_value());
+  assert(memcmp(segment->data, "shared", 6) == 0);
+  assert(!cache.lookupChunk("sha256:1").has_value());
+
+  // the chunk and the recipe go with the last segment of a
+  insert(cache, "b", 0, "b0");
+  insert(cache, "c", 0, "c0");
+  assert(!cached(cache, "a", 0));
+  assert(!cache.lookupChunk("sha256:0").has_value());
+  assert(cache.lookupRecipe("a") == nullptr);
+}
+
+void testBytes() {
+  SegmentCache cache(6);
+  insert(cache, "a", 0, "a0");
+  insert(cache, "b", 0, "b0");
+  insert(cache, "c", 0, "c0");
+  assert(cache.bytes() == 6);
+  // a larger segment takes the room of the two least recently used
+  insert(cache, "d", 0, "dddd");
+  assert(cache.size() == 2);
+  assert(cache.bytes() == 6);
+  assert(!cached(cache, "a", 0));
+  assert(!cached(cache, "b", 0));
+  assert(cached(cache, "c", 0));
+  assert(cached(cache, "d", 0));
+}
+
+void testDisabled() {
+  SegmentCache cache(0);
+  insert(cache, "a", 0, "a0");
+  assert(cache.size() == 0);
+}
+} // namespace
+
+int main() {
+  testLookup();
+  testPrefixOnly();
+  testEviction();
+  testChunks();
+  testBytes();
+  testDisabled();
+  return 0;
+}
@@ -0,0 +1,87 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "dpu/segment_order.h"
+#include <cassert>
+#include <string>
+#include <vector>
+
+using hdc::dpu::SegmentOrder;
+
+namespace {
+/// @brief: The segments of a layer, as the engine and software inflate of the
+/// adaptive split finish them.
+struct Sent {
+  std::vector<int> segments;
+
+  void finish(SegmentOrder<int> &order, const std::string &layer,
+              uint64_t ticket, int segment) {
+    order.finish(layer, ticket, segment,
+                 [this](int ready) { segments.push_back(ready); });
+  }
+};
+
+void testInOrder() {
+  SegmentOrder<int> order;
+  Sent sent;
+  for (int i = 0; i < 3; ++i) {
+    assert(order.admit("layer") == static_cast<uint64_t>(i));
+  }
+  for (int i = 0; i < 3; ++i) {
+    sent.finish(order, "layer", i, i);
+    assert(sent.segments.size() == static_cast<size_t>(i + 1));
+  }
+  assert((sent.segments == std::vector<int>{0, 1, 2}));
+  assert(order.layers() == 0);
+}
+
+void testOutOfOrder() {
+  SegmentOrder<int> order;
+  Sent sent;
+  for (int i = 0; i < 5; ++i) {
+    order.admit("layer");
+  }
+  // software inflate finishes the later segments first
+  sent.finish(order, "layer", 2, 2);
+  sent.finish(order, "layer", 1, 1);
+  sent.finish(order, "layer", 4, 4);
+  assert(sent.segments.empty());
+  // the engine finishes the first, it and those behind it are sent
+  sent.finish(order, "layer", 0, 0);
+  assert((sent.segments == std::vector<int>{0, 1, 2}));
+  assert(order.layers() == 1);
+  sent.finish(order, "layer", 3, 3);
+  assert((sent.segments == std::vector<int>{0, 1, 2, 3, 4}));
+  assert(order.layers() == 0);
+}
+
+void testLayers() {
+  SegmentOrder<int> order;
+  Sent a;
+  Sent b;
+  order.admit("a");
+  order.admit("a");
+  order.admit("b");
+  // the layers do not wait for each other
+  a.finish(order, "a", 1, 1);
+  b.finish(order, "b", 0, 0);
+  assert(a.segments.empty());
+  assert((b.segments == std::vector<int>{0}));
+  assert(order.layers() == 1);
+  // the tickets go on after the segments sent, while the layer waits
+  assert(order.admit("a") == 2);
+  a.finish(order, "a", 0, 0);
+  assert((a.segments == std::vector<int>{0, 1}));
+  a.finish(order, "a", 2, 2);
+  assert((a.segments == std::vector<int>{0, 1, 2}));
+  // a layer whose segments were all sent starts over
+  assert(order.layers() == 0);
+  assert(order.admit("a") == 0);
+}
+} // namespace
+
+int main() {
+  testInOrder();
+  testOutOfOrder();
+  testLayers();
+  return 0;
+}
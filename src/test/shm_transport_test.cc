@@ -0,0 +1,201 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "network/EventLoop.h"
+#include "network/InetAddress.h"
+#include "network/transport/ShmRing.h"
+#include "network/transport/Transport.h"
+#include "network/transport/TransportConfig.h"
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using hdc::network::EventLoop;
+using hdc::network::InetAddress;
+using hdc::network::transport::Completion;
+using hdc::network::transport::createMsgClient;
+using hdc::network::transport::createMsgServer;
+using hdc::network::transport::MsgConnectionPtr;
+using hdc::network::transport::MsgServer;
+using hdc::network::transport::ShmArenaLayout;
+using hdc::network::transport::ShmMsgDesc;
+using hdc::network::transport::ShmSpscRing;
+using hdc::network::transport::TransportConfig;
+using hdc::network::transport::TransportType;
+
+namespace {
+constexpr uint16_t kPort = 18581;
+constexpr size_t kSlotSize = 256;
+constexpr size_t kSlotNum = 3;
+
+TransportConfig shmConfig() {
+  return TransportConfig(TransportType::kShm, "", 0, kSlotSize, kSlotNum);
+}
+
+/// @brief: Run the loop until `done` or a few seconds passed.
+void runUntil(EventLoop &loop, const std::function<bool()> &done) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  std::function<void()> poll = [&]() {
+    if (done() || std::chrono::steady_clock::now() > deadline) {
+      loop.quit();
+      return;
+    }
+    loop.runAfter(0.01, poll);
+  };
+  loop.runAfter(0.01, poll);
+  loop.loop();
+  assert(done());
+}
+
+void testRing() {
+  constexpr size_t kCapacity = 4;
+  std::vector<uint64_t> mem(
+      ShmSpscRing<ShmMsgDesc>::bytes(kCapacity) / sizeof(uint64_t) + 1);
+  ShmSpscRing<ShmMsgDesc> ring(mem.data(), kCapacity);
+  ring.init();
+  assert(!ring.pop().has_value());
+  // around the end of the entries a few times
+  uint64_t pushed = 0;
+  uint64_t popped = 0;
+  for (int round = 0; round < 5; ++round) {
+    while (ring.push(ShmMsgDesc{0, 0, 0, pushed})) {
+      ++pushed;
+    }
+    assert(pushed - popped == kCapacity);
+    for (int i = 0; i < 3; ++i) {
+      auto desc = ring.pop();
+      assert(desc.has_value() && desc->wr_id == popped);
+      ++popped;
+    }
+  }
+  while (auto desc = ring.pop()) {
+    assert(desc->wr_id == popped);
+    ++popped;
+  }
+  assert(popped == pushed);
+}
+
+void testLayout() {
+  ShmArenaLayout layout(kSlotSize, kSlotNum);
+  assert(layout.ring_capacity == 4);
+  assert(layout.ringOffset(0, false) >= sizeof(ShmArenaLayout::Header));
+  for (int ring = 1; ring < 4; ++ring) {
+    auto offset = layout.ringOffset(ring / 2, ring % 2 == 1);
+    assert(offset % hdc::network::transport::kShmCacheLine == 0);
+    assert(offset >= layout.ringOffset((ring - 1) / 2, (ring - 1) % 2 == 1) +
+                         ShmSpscRing<ShmMsgDesc>::bytes(4));
+  }
+  assert(layout.slotsOffset(0) % 4096 == 0);
+  assert(layout.slotsOffset(0) >=
+         layout.ringOffset(1, true) + layout.ringBytes());
+  assert(layout.slotsOffset(1) == layout.slotsOffset(0) + kSlotSize * kSlotNum);
+  assert(layout.totalBytes() == layout.slotsOffset(1) + kSlotSize * kSlotNum);
+}
+
+/// @brief: A server which sends every message back.
+struct EchoServer {
+  std::unique_ptr<MsgServer> server;
+  MsgConnectionPtr conn;
+
+  explicit EchoServer(EventLoop *loop) {
+    server = createMsgServer(loop, InetAddress("127.0.0.1", kPort), "echo",
+                             shmConfig());
+    server->setConnectedCallback(
+        [this](const MsgConnectionPtr &conn) { this->conn = conn; });
+    server->setRecvSuccessCallback([](const MsgConnectionPtr &conn,
+                                      uint8_t *recv_buf, uint32_t recv_len,
+                                      const Completion &wc) {
+      auto free_buf = conn->acquireFreeSendBuf();
+      assert(free_buf.has_value());
+      memcpy(free_buf->addr, recv_buf, recv_len);
+      conn->send(free_buf->addr, recv_len, wc.wr_id);
+      conn->releaseSendBuf(free_buf->id);
+    });
+    server->start();
+  }
+};
+
+void testEcho(EventLoop &loop) {
+  EchoServer echo(&loop);
+  auto client = createMsgClient(&loop, InetAddress("127.0.0.1", kPort),
+                                "client", shmConfig());
+  MsgConnectionPtr conn;
+  std::vector<std::string> echoed;
+  size_t completed = 0;
+  client->setConnectedCallback(
+      [&conn](const MsgConnectionPtr &c) { conn = c; });
+  client->setRecvSuccessCallback(
+      [&echoed](const MsgConnectionPtr &, uint8_t *recv_buf,
+                uint32_t recv_len, const Completion &) {
+        echoed.emplace_back(reinterpret_cast<char *>(recv_buf), recv_len);
+      });
+  client->setSendCompleteSuccessCallback(
+      [&completed](const MsgConnectionPtr &, const Completion &wc) {
+        assert(wc.wr_id == completed);
+        ++completed;
+      });
+  bool failed = false;
+  client->setSendCompleteFailCallback(
+      [&failed](const MsgConnectionPtr &, const Completion &wc) {
+        assert(wc.wr_id == 100);
+        failed = true;
+      });
+  client->connect();
+  runUntil(loop, [&]() { return conn != nullptr && echo.conn != nullptr; });
+
+  std::vector<std::string> messages;
+  for (int i = 0; i < 20; ++i) {
+    messages.push_back("message-" + std::to_string(i) +
+                       std::string(i * 10, 'x'));
+  }
+  size_t sent = 0;
+  std::function<void()> sendMore = [&]() {
+    // a released buffer is reused only once the server handed it back
+    while (sent < messages.size()) {
+      auto free_buf = conn->acquireFreeSendBuf();
+      if (!free_buf.has_value()) {
+        assert(sent - completed == kSlotNum);
+        break;
+      }
+      auto &message = messages[sent];
+      memcpy(free_buf->addr, message.data(), message.size());
+      conn->send(free_buf->addr, message.size(), sent++);
+      conn->releaseSendBuf(free_buf->id);
+    }
+    if (sent < messages.size()) {
+      loop.runAfter(0.001, sendMore);
+    }
+  };
+  sendMore();
+  runUntil(loop, [&]() { return echoed.size() == messages.size(); });
+  assert(echoed == messages);
+  assert(completed == messages.size());
+
+  // a message past the end of its buffer fails, the connection stays usable
+  auto free_buf = conn->acquireFreeSendBuf();
+  assert(free_buf.has_value() && free_buf->cap == kSlotSize);
+  conn->send(free_buf->addr + 1, kSlotSize, 100);
+  conn->releaseSendBuf(free_buf->id);
+  runUntil(loop, [&]() { return failed; });
+  assert(conn->connected());
+  assert(completed == messages.size());
+
+  // the client sees the server go away
+  echo.conn.reset();
+  echo.server.reset();
+  runUntil(loop, [&]() { return !conn->connected(); });
+  conn.reset();
+  client.reset();
+}
+} // namespace
+
+int main() {
+  EventLoop loop;
+  testRing();
+  testLayout();
+  testEcho(loop);
+  return 0;
+}
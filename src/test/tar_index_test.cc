@@ -0,0 +1,179 @@
+// the checks must run in the release builds too
+#undef NDEBUG
+#include "host/client/tar_index.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using hdc::host::client::locateEntries;
+using hdc::host::client::TarIndexer;
+
+namespace {
+constexpr size_t kBlock = 512;
+
+void appendHeader(std::vector<uint8_t> &tar, const std::string &name,
+                  char type, size_t size, const std::string &link = "") {
+  uint8_t header[kBlock] = {0};
+  memcpy(header, name.data(), std::min<size_t>(name.size(), 100));
+  snprintf(reinterpret_cast<char *>(header + 100), 8, "%07o", 0644);
+  snprintf(reinterpret_cast<char *>(header + 108), 8, "%07o", 1000);
+  snprintf(reinterpret_cast<char *>(header + 116), 8, "%07o", 1000);
+  snprintf(reinterpret_cast<char *>(header + 124), 12, "%011zo", size);
+  snprintf(reinterpret_cast<char *>(header + 136), 12, "%011o", 1234);
+  header[156] = static_cast<uint8_t>(type);
+  memcpy(header + 157, link.data(), std::min<size_t>(link.size(), 100));
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+  tar.insert(tar.end(), header, header + kBlock);
+}
+
+void appendData(std::vector<uint8_t> &tar, const std::string &data) {
+  tar.insert(tar.end(), data.begin(), data.end());
+  tar.resize(tar.size() + (kBlock - data.size() % kBlock) % kBlock, 0);
+}
+
+std::string paxRecord(const std::string &key, const std::string &value) {
+  // the length counts its own digits
+  auto body = " " + key + "=" + value + "\n";
+  auto len = body.size() + 1;
+  while (std::to_string(len).size() + body.size() != len) {
+    ++len;
+  }
+  return std::to_string(len) + body;
+}
+
+/// @brief: A layer with the kinds of entries the indexer understands.
+std::vector<uint8_t> makeLayer() {
+  std::vector<uint8_t> tar;
+  appendHeader(tar, "./etc/", '5', 0);
+  appendHeader(tar, "./etc/hosts", '0', 5);
+  appendData(tar, "hosts");
+  appendHeader(tar, "bin/sh", '2', 0, "/bin/busybox");
+  std::string long_name(150, 'n');
+  appendHeader(tar, "././@LongLink", 'L', long_name.size() + 1);
+  appendData(tar, long_name + '\0');
+  appendHeader(tar, "truncated", '0', 3);
+  appendData(tar, "abc");
+  auto pax = paxRecord("path", "pax/file") + paxRecord("size", "600");
+  appendHeader(tar, "PaxHeaders/file", 'x', pax.size());
+  appendData(tar, pax);
+  appendHeader(tar, "ustar-name", '0', 0);
+  appendData(tar, std::string(600, 'p'));
+  appendHeader(tar, "etc/hosts.link", '1', 0, "./etc/hosts");
+  tar.resize(tar.size() + 2 * kBlock, 0);
+  return tar;
+}
+
+void checkLayer(TarIndexer &indexer, size_t tar_size) {
+  assert(indexer.done());
+  assert(!indexer.failed());
+  assert(indexer.position() <= tar_size);
+  auto &entries = indexer.index().entries();
+  assert(entries.size() == 6);
+
+  assert(entries[0].path() == "etc");
+  assert(entries[0].type() == '5');
+
+  assert(entries[1].path() == "etc/hosts");
+  assert(entries[1].type() == '0');
+  assert(entries[1].size() == 5);
+  assert(entries[1].offset() == 2 * kBlock);
+  assert(entries[1].header_offset() == kBlock);
+  assert(entries[1].mode() == 0644);
+  assert(entries[1].uid() == 1000);
+  assert(entries[1].mtime() == 1234);
+
+  assert(entries[2].path() == "bin/sh");
+  assert(entries[2].link() == "/bin/busybox");
+  assert(entries[2].size() == 0);
+
+  // the long name entry starts at its extension header
+  assert(entries[3].path() == std::string(150, 'n'));
+  assert(entries[3].size() == 3);
+  assert(entries[3].header_offset() == 4 * kBlock);
+  assert(entries[3].offset() == 7 * kBlock);
+
+  assert(entries[4].path() == "pax/file");
+  assert(entries[4].size() == 600);
+
+  assert(entries[5].path() == "etc/hosts.link");
+  assert(entries[5].type() == '1');
+  assert(entries[5].link() == "etc/hosts");
+}
+
+void testWhole() {
+  auto tar = makeLayer();
+  TarIndexer indexer;
+  indexer.feed(tar.data(), tar.size());
+  checkLayer(indexer, tar.size());
+}
+
+void testPieces() {
+  auto tar = makeLayer();
+  std::vector<std::string> paths;
+  TarIndexer indexer([&paths](const layer_index::FileEntry &entry) {
+    paths.push_back(entry.path());
+  });
+  for (size_t off = 0; off < tar.size(); off += 7) {
+    indexer.feed(tar.data() + off, std::min<size_t>(7, tar.size() - off));
+  }
+  checkLayer(indexer, tar.size());
+  assert(paths.size() == 6);
+  assert(paths[1] == "etc/hosts");
+}
+
+void testSkip() {
+  auto tar = makeLayer();
+  TarIndexer indexer;
+  size_t off = 0;
+  while (!indexer.done() && off < tar.size()) {
+    if (auto skip = indexer.pendingSkip(); skip > 0) {
+      indexer.skip(skip);
+      off += skip;
+      continue;
+    }
+    indexer.feed(tar.data() + off, kBlock);
+    off += kBlock;
+  }
+  assert(indexer.position() == off);
+  checkLayer(indexer, tar.size());
+}
+
+void testNotTar() {
+  std::vector<uint8_t> data(2 * kBlock, 'x');
+  TarIndexer indexer;
+  indexer.feed(data.data(), data.size());
+  assert(indexer.done());
+  assert(indexer.failed());
+}
+
+void testLocate() {
+  auto tar = makeLayer();
+  TarIndexer indexer;
+  indexer.feed(tar.data(), tar.size());
+  auto &index = indexer.index();
+  // 2 blocks, then the rest
+  index.add_segment_sizes(2 * kBlock);
+  index.add_segment_sizes(tar.size() - 2 * kBlock);
+  locateEntries(index);
+  auto &entries = index.entries();
+  assert(entries[0].segment() == 0);
+  assert(entries[0].segment_offset() == kBlock);
+  // the data of etc/hosts starts the second segment
+  assert(entries[1].segment() == 1);
+  assert(entries[1].segment_offset() == 0);
+  assert(entries[3].segment() == 1);
+  assert(entries[3].segment_offset() == 5 * kBlock);
+}
+} // namespace
+
+int main() {
+  testWhole();
+  testPieces();
+  testSkip();
+  testNotTar();
+  testLocate();
+  return 0;
+}
@@ -0,0 +1,148 @@
+#include "utils/affinity.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <spdlog/spdlog.h>
+
+namespace hdc {
+namespace utils {
+
+std::optional<std::vector<int>> parseCpuList(const std::string &value) {
+  std::vector<int> cpus;
+  if (value.empty()) {
+    return cpus;
+  }
+  size_t start = 0;
+  while (start <= value.size()) {
+    auto end = value.find(',', start);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    auto item = value.substr(start, end - start);
+    int first = 0;
+    int last = 0;
+    int len = 0;
+    // a range first-last, or a single CPU
+    if (std::sscanf(item.c_str(), "%d-%d%n", &first, &last, &len) != 2 ||
+        len != static_cast<int>(item.size())) {
+      len = 0;
+      if (std::sscanf(item.c_str(), "%d%n", &first, &len) != 1 ||
+          len != static_cast<int>(item.size())) {
+        return std::nullopt;
+      }
+      last = first;
+    }
+    if (first < 0 || first > last || last >= CPU_SETSIZE) {
+      return std::nullopt;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+    start = end + 1;
+  }
+  return cpus;
+}
+
+bool validateCpuListFlag(const char *flagname, const std::string &value) {
+  if (parseCpuList(value).has_value()) {
+    return true;
+  }
+  SPDLOG_ERROR("Invalid value for --{}: {}, expect a list of CPUs such as "
+               "0-3,6, or empty",
+               flagname, value);
+  return false;
+}
+
+std::vector<int> cpuListFlag(const std::string &value) {
+  return parseCpuList(value).value_or(std::vector<int>{});
+}
+
+bool pinThread(const std::vector<int> &cpus) {
+  if (cpus.empty()) {
+    return true;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err != 0) {
+    std::string list;
+    for (int cpu : cpus) {
+      list += (list.empty() ? "" : ",") + std::to_string(cpu);
+    }
+    SPDLOG_ERROR("pin thread to CPUs {} error: {}", list, strerror(err));
+    return false;
+  }
+  return true;
+}
+
+std::vector<int> threadCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    return cpus;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+namespace {
+/// @brief: The node in a sysfs numa_node file, which is -1 if unknown.
+std::optional<int> readNumaNode(const std::string &path) {
+  std::ifstream in(path);
+  int node = -1;
+  if (!(in >> node) || node < 0) {
+    return std::nullopt;
+  }
+  return node;
+}
+} // namespace
+
+std::optional<int> ibDeviceNumaNode(const std::string &ib_dev_name) {
+  return readNumaNode("/sys/class/infiniband/" + ib_dev_name +
+                      "/device/numa_node");
+}
+
+std::optional<int> pciDeviceNumaNode(const std::string &pci_address) {
+  // the domain is left out in the DOCA flags
+  auto address = std::count(pci_address.begin(), pci_address.end(), ':') < 2
+                     ? "0000:" + pci_address
+                     : pci_address;
+  return readNumaNode("/sys/bus/pci/devices/" + address + "/numa_node");
+}
+
+std::vector<int> numaNodeCpus(int node) {
+  std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) +
+                   "/cpulist");
+  std::string list;
+  if (!std::getline(in, list)) {
+    return {};
+  }
+  return cpuListFlag(list);
+}
+
+ScopedPin::ScopedPin(const std::vector<int> &cpus) {
+  if (cpus.empty() || pthread_getaffinity_np(pthread_self(), sizeof(saved_),
+                                             &saved_) != 0) {
+    return;
+  }
+  pinned_ = pinThread(cpus);
+}
+
+ScopedPin::~ScopedPin() {
+  if (pinned_) {
+    pthread_setaffinity_np(pthread_self(), sizeof(saved_), &saved_);
+  }
+}
+
+} // namespace utils
+} // namespace hdc
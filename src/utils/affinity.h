@@ -0,0 +1,54 @@
+#pragma once
+#include <sched.h>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace hdc {
+namespace utils {
+
+/// @brief: The CPUs of a list such as "0-3,6", none for "".
+std::optional<std::vector<int>> parseCpuList(const std::string &value);
+
+/// @brief: gflags validator of the `*_cpus` flags, e.g.
+/// DEFINE_validator(offload_server_cpus, &validateCpuListFlag).
+bool validateCpuListFlag(const char *flagname, const std::string &value);
+
+/// @brief: The CPUs of a validated `*_cpus` flag.
+std::vector<int> cpuListFlag(const std::string &value);
+
+/// @brief: Run the calling thread on `cpus` only, on any CPU if it is
+/// empty. Return false if the CPUs are not available.
+bool pinThread(const std::vector<int> &cpus);
+
+/// @brief: The CPUs the calling thread runs on.
+std::vector<int> threadCpus();
+
+/// @brief: The NUMA node of an IB device such as mlx5_0, nullopt if the
+/// kernel does not know it, e.g. on a single node.
+std::optional<int> ibDeviceNumaNode(const std::string &ib_dev_name);
+
+/// @brief: The NUMA node of a PCI device such as 31:00.0 or 0000:31:00.0.
+std::optional<int> pciDeviceNumaNode(const std::string &pci_address);
+
+/// @brief: The CPUs of a NUMA node, none if it is unknown.
+std::vector<int> numaNodeCpus(int node);
+
+/// @brief: Pins the calling thread to `cpus` while it lives and restores its
+/// CPUs after. The memory the thread touches first in the meantime, e.g. the
+/// buffers of an engine it creates, is allocated on their NUMA node.
+class ScopedPin {
+public:
+  explicit ScopedPin(const std::vector<int> &cpus);
+  ~ScopedPin();
+
+  ScopedPin(const ScopedPin &) = delete;
+  ScopedPin &operator=(const ScopedPin &) = delete;
+
+private:
+  bool pinned_{false};
+  cpu_set_t saved_;
+};
+
+} // namespace utils
+} // namespace hdc
@@ -0,0 +1,371 @@
+#include "utils/codec.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <zlib.h>
+#ifdef POBY_ZSTD
+#include <zstd.h>
+#endif
+#ifdef POBY_LZ4
+#include <lz4frame.h>
+#endif
+
+namespace hdc {
+namespace utils {
+
+namespace {
+// the raw deflate streams of the DOCA engine, without header
+constexpr int kRawDeflateWindowBits = -15;
+constexpr int kZlibWindowBits = 15;
+constexpr int kGzipWindowBits = 15 + 16;
+
+/// @brief: The windowBits of inflateInit2() for a stream, a segment may be
+/// the whole layer with its gzip header, as the DOCA engine accepts it.
+int detectWindowBits(const uint8_t *src, size_t len) {
+  if (len >= 2 && src[0] == 0x1f && src[1] == 0x8b) {
+    return kGzipWindowBits;
+  }
+  if (len >= 2 && (src[0] & 0x0f) == Z_DEFLATED &&
+      ((src[0] << 8) | src[1]) % 31 == 0) {
+    return kZlibWindowBits;
+  }
+  return kRawDeflateWindowBits;
+}
+
+/// @brief: Inflate a raw deflate stream into `dst`, which grows as needed
+/// since the decompressed size is not in the stream.
+bool inflateRaw(const uint8_t *src, size_t len, std::vector<uint8_t> &dst) {
+  z_stream stream{};
+  if (inflateInit2(&stream, detectWindowBits(src, len)) != Z_OK) {
+    return false;
+  }
+  dst.resize(len * 4);
+  stream.next_in = const_cast<Bytef *>(src);
+  stream.avail_in = len;
+  int ret = Z_OK;
+  while (ret == Z_OK) {
+    if (stream.total_out == dst.size()) {
+      dst.resize(std::max<size_t>(dst.size() * 2, 4096));
+    }
+    stream.next_out = dst.data() + stream.total_out;
+    stream.avail_out = dst.size() - stream.total_out;
+    ret = inflate(&stream, Z_NO_FLUSH);
+  }
+  dst.resize(stream.total_out);
+  inflateEnd(&stream);
+  if (ret != Z_STREAM_END) {
+    SPDLOG_ERROR("inflate error: {}", ret);
+    return false;
+  }
+  return true;
+}
+} // namespace
+
+const char *codecExtension(content::Codec codec) {
+  switch (codec) {
+  case content::UNCOMPRESSED:
+    return ".tar";
+  case content::DEFLATE:
+    return ".tar.gz";
+  case content::ZSTD:
+    return ".tar.zst";
+  case content::LZ4:
+    return ".tar.lz4";
+  }
+  return ".tar.gz";
+}
+
+const char *codecName(content::Codec codec) {
+  switch (codec) {
+  case content::UNCOMPRESSED:
+    return "none";
+  case content::DEFLATE:
+    return "deflate";
+  case content::ZSTD:
+    return "zstd";
+  case content::LZ4:
+    return "lz4";
+  }
+  return "unknown";
+}
+
+std::optional<content::Codec> parseCodec(const std::string &name) {
+  if (name == "none") {
+    return content::UNCOMPRESSED;
+  }
+  if (name == "deflate") {
+    return content::DEFLATE;
+  }
+  if (name == "zstd") {
+    return content::ZSTD;
+  }
+  if (name == "lz4") {
+    return content::LZ4;
+  }
+  return std::nullopt;
+}
+
+std::optional<std::vector<content::Codec>>
+parseCodecList(const std::string &value) {
+  std::vector<content::Codec> codecs;
+  size_t start = 0;
+  while (start <= value.size()) {
+    auto end = value.find(',', start);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    auto codec = parseCodec(value.substr(start, end - start));
+    if (!codec.has_value()) {
+      return std::nullopt;
+    }
+    if (std::find(codecs.begin(), codecs.end(), *codec) == codecs.end()) {
+      codecs.push_back(*codec);
+    }
+    start = end + 1;
+  }
+  return codecs;
+}
+
+bool validateCodecsFlag(const char *flagname, const std::string &value) {
+  auto codecs = parseCodecList(value);
+  if (!codecs.has_value()) {
+    SPDLOG_ERROR("Invalid value for --{}: {}, expect a list of none, "
+                 "deflate, zstd and lz4",
+                 flagname, value);
+    return false;
+  }
+  for (auto codec : *codecs) {
+    if (!softCodecAvailable(codec)) {
+      SPDLOG_ERROR("Invalid value for --{}: {} is not built in", flagname,
+                   codecName(codec));
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<content::Codec> codecsFlag(const std::string &value) {
+  return parseCodecList(value).value_or(
+      std::vector<content::Codec>{content::DEFLATE});
+}
+
+bool softCodecAvailable(content::Codec codec) {
+  switch (codec) {
+  case content::UNCOMPRESSED:
+  case content::DEFLATE:
+    return true;
+#ifdef POBY_ZSTD
+  case content::ZSTD:
+    return true;
+#endif
+#ifdef POBY_LZ4
+  case content::LZ4:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+bool softCompress(content::Codec codec, const uint8_t *src, size_t len,
+                  std::vector<uint8_t> &dst, int level) {
+  switch (codec) {
+  case content::UNCOMPRESSED:
+    dst.assign(src, src + len);
+    return true;
+  case content::DEFLATE: {
+    z_stream stream{};
+    if (deflateInit2(&stream, level == 0 ? Z_DEFAULT_COMPRESSION : level,
+                     Z_DEFLATED, kRawDeflateWindowBits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      return false;
+    }
+    dst.resize(deflateBound(&stream, len));
+    stream.next_in = const_cast<Bytef *>(src);
+    stream.avail_in = len;
+    stream.next_out = dst.data();
+    stream.avail_out = dst.size();
+    auto ret = deflate(&stream, Z_FINISH);
+    dst.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+      SPDLOG_ERROR("deflate error: {}", ret);
+      return false;
+    }
+    return true;
+  }
+#ifdef POBY_ZSTD
+  case content::ZSTD: {
+    dst.resize(ZSTD_compressBound(len));
+    auto res = ZSTD_compress(dst.data(), dst.size(), src, len,
+                             level == 0 ? ZSTD_CLEVEL_DEFAULT : level);
+    if (ZSTD_isError(res)) {
+      SPDLOG_ERROR("zstd compress error: {}", ZSTD_getErrorName(res));
+      return false;
+    }
+    dst.resize(res);
+    return true;
+  }
+#endif
+#ifdef POBY_LZ4
+  case content::LZ4: {
+    LZ4F_preferences_t prefs{};
+    prefs.frameInfo.contentSize = len;
+    prefs.compressionLevel = level;
+    dst.resize(LZ4F_compressFrameBound(len, &prefs));
+    auto res = LZ4F_compressFrame(dst.data(), dst.size(), src, len, &prefs);
+    if (LZ4F_isError(res)) {
+      SPDLOG_ERROR("lz4 compress error: {}", LZ4F_getErrorName(res));
+      return false;
+    }
+    dst.resize(res);
+    return true;
+  }
+#endif
+  default:
+    SPDLOG_ERROR("codec {} is not built in", codecName(codec));
+    return false;
+  }
+}
+
+std::optional<size_t> softDecompressedSize(content::Codec codec,
+                                           const uint8_t *src, size_t len) {
+  switch (codec) {
+  case content::UNCOMPRESSED:
+    return len;
+#ifdef POBY_ZSTD
+  case content::ZSTD: {
+    auto size = ZSTD_getFrameContentSize(src, len);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) {
+      return std::nullopt;
+    }
+    return size;
+  }
+#endif
+#ifdef POBY_LZ4
+  case content::LZ4: {
+    LZ4F_dctx *dctx = nullptr;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+      return std::nullopt;
+    }
+    LZ4F_frameInfo_t info{};
+    size_t consumed = len;
+    auto res = LZ4F_getFrameInfo(dctx, &info, src, &consumed);
+    LZ4F_freeDecompressionContext(dctx);
+    if (LZ4F_isError(res)) {
+      return std::nullopt;
+    }
+    // softCompress() writes the size, 0 is an empty segment
+    return info.contentSize;
+  }
+#endif
+  default:
+    return std::nullopt;
+  }
+}
+
+std::optional<size_t> softDecompress(content::Codec codec, const uint8_t *src,
+                                     size_t len, uint8_t *dst,
+                                     size_t dst_cap) {
+  switch (codec) {
+  case content::UNCOMPRESSED:
+    if (len > dst_cap) {
+      return std::nullopt;
+    }
+    memcpy(dst, src, len);
+    return len;
+  case content::DEFLATE: {
+    z_stream stream{};
+    if (inflateInit2(&stream, detectWindowBits(src, len)) != Z_OK) {
+      return std::nullopt;
+    }
+    stream.next_in = const_cast<Bytef *>(src);
+    stream.avail_in = len;
+    stream.next_out = dst;
+    stream.avail_out = dst_cap;
+    auto ret = inflate(&stream, Z_FINISH);
+    size_t out = stream.total_out;
+    inflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+      SPDLOG_ERROR("inflate error: {}, dst buffer {}", ret, dst_cap);
+      return std::nullopt;
+    }
+    return out;
+  }
+#ifdef POBY_ZSTD
+  case content::ZSTD: {
+    auto res = ZSTD_decompress(dst, dst_cap, src, len);
+    if (ZSTD_isError(res)) {
+      SPDLOG_ERROR("zstd decompress error: {}", ZSTD_getErrorName(res));
+      return std::nullopt;
+    }
+    return res;
+  }
+#endif
+#ifdef POBY_LZ4
+  case content::LZ4: {
+    LZ4F_dctx *dctx = nullptr;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+      return std::nullopt;
+    }
+    size_t in = 0;
+    size_t out = 0;
+    size_t res = 1;
+    // 0 once the frame is complete
+    while (res != 0 && in < len) {
+      size_t src_size = len - in;
+      size_t dst_size = dst_cap - out;
+      res = LZ4F_decompress(dctx, dst + out, &dst_size, src + in, &src_size,
+                            nullptr);
+      if (LZ4F_isError(res) || (src_size == 0 && dst_size == 0)) {
+        break;
+      }
+      in += src_size;
+      out += dst_size;
+    }
+    LZ4F_freeDecompressionContext(dctx);
+    if (res != 0) {
+      SPDLOG_ERROR("lz4 decompress error: {}",
+                   LZ4F_isError(res) ? LZ4F_getErrorName(res)
+                                     : "incomplete or too large");
+      return std::nullopt;
+    }
+    return out;
+  }
+#endif
+  default:
+    SPDLOG_ERROR("codec {} is not built in", codecName(codec));
+    return std::nullopt;
+  }
+}
+
+bool softDecompress(content::Codec codec, std::vector<uint8_t> &data) {
+  if (codec == content::UNCOMPRESSED) {
+    return true;
+  }
+  if (codec == content::DEFLATE) {
+    std::vector<uint8_t> out;
+    if (!inflateRaw(data.data(), data.size(), out)) {
+      return false;
+    }
+    data = std::move(out);
+    return true;
+  }
+  auto size = softDecompressedSize(codec, data.data(), data.size());
+  if (!size.has_value()) {
+    SPDLOG_ERROR("{} segment without its size", codecName(codec));
+    return false;
+  }
+  std::vector<uint8_t> out(*size);
+  auto res = softDecompress(codec, data.data(), data.size(), out.data(),
+                            out.size());
+  if (!res.has_value() || *res != *size) {
+    return false;
+  }
+  data = std::move(out);
+  return true;
+}
+
+} // namespace utils
+} // namespace hdc
@@ -0,0 +1,57 @@
+#pragma once
+#include "content.pb.h"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace hdc {
+namespace utils {
+
+/// @brief: The suffix of the file of a segment stored with `codec`, e.g.
+/// `<i>.tar.zst`. A DEFLATE segment is `<i>.tar.gz` as before the codecs.
+const char *codecExtension(content::Codec codec);
+
+/// @brief: The name of a codec as in the `*codecs` flags.
+const char *codecName(content::Codec codec);
+
+/// @brief: The codec of a name: none, deflate, zstd or lz4.
+std::optional<content::Codec> parseCodec(const std::string &name);
+
+/// @brief: The codecs of a comma separated list of names, in its order.
+std::optional<std::vector<content::Codec>>
+parseCodecList(const std::string &value);
+
+/// @brief: gflags validator of the `*codecs` flags, e.g.
+/// DEFINE_validator(content_fetcher_codecs, &validateCodecsFlag).
+bool validateCodecsFlag(const char *flagname, const std::string &value);
+
+/// @brief: The codecs of a validated `*codecs` flag.
+std::vector<content::Codec> codecsFlag(const std::string &value);
+
+/// @brief: Whether softCompress() and softDecompress() support the codec in
+/// this build. DEFLATE is raw deflate as of the DOCA engine, with zlib.
+bool softCodecAvailable(content::Codec codec);
+
+/// @brief: Compress `len` bytes into `dst` as one frame of `codec`, with the
+/// decompressed size in its header. `level` 0 is the default of the codec.
+bool softCompress(content::Codec codec, const uint8_t *src, size_t len,
+                  std::vector<uint8_t> &dst, int level = 0);
+
+/// @brief: The decompressed size of a frame of `codec`, from its header,
+/// nullopt for DEFLATE.
+std::optional<size_t> softDecompressedSize(content::Codec codec,
+                                           const uint8_t *src, size_t len);
+
+/// @brief: Decompress a frame of `codec` into `dst` of `dst_cap` bytes.
+/// Return the decompressed size, or nullopt if it is corrupt or larger.
+std::optional<size_t> softDecompress(content::Codec codec, const uint8_t *src,
+                                     size_t len, uint8_t *dst,
+                                     size_t dst_cap);
+
+/// @brief: Decompress a frame of `codec` in place of `data`.
+bool softDecompress(content::Codec codec, std::vector<uint8_t> &data);
+
+} // namespace utils
+} // namespace hdc
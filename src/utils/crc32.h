@@ -0,0 +1,36 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace hdc {
+namespace utils {
+
+namespace detail {
+constexpr std::array<uint32_t, 256> makeCrc32Table() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; ++k) {
+      c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+    }
+    table[i] = c;
+  }
+  return table;
+}
+
+inline constexpr auto kCrc32Table = makeCrc32Table();
+} // namespace detail
+
+/// @brief: The CRC-32 of `data`, the same as zlib crc32(). Pass the result of
+/// a former call as `crc` to continue it over the next bytes.
+inline uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc = 0) {
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i) {
+    crc = detail::kCrc32Table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+} // namespace utils
+} // namespace hdc
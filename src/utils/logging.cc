@@ -0,0 +1,86 @@
+#include <gflags/gflags.h>
+#include <memory>
+#include <mutex>
+#include <spdlog/async.h>
+#include <spdlog/details/null_mutex.h>
+#include <spdlog/sinks/base_sink.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+#include <utils/logging.h>
+
+DEFINE_string(log_level, "debug",
+              "Runtime log level: trace, debug, info, warn, err, critical or "
+              "off. Levels below the compile-time POBY_LOG_ACTIVE_LEVEL are "
+              "already removed from the binary");
+DEFINE_bool(log_async, true,
+            "Format and write logs in a background thread instead of the "
+            "calling (event loop) thread");
+DEFINE_uint64(log_async_queue_size, 8192,
+              "The number of messages buffered by the async logger. The "
+              "caller waits for a free slot when it is full");
+DEFINE_uint64(log_rate_limit, 2000,
+              "The maximum number of messages below warn level written per "
+              "second. 0 means unlimited");
+
+namespace hdc {
+namespace utils {
+
+namespace {
+/// @brief: A sink forwarding to another logger, to put a sink in front of the
+/// queue of an async logger.
+class LoggerSink
+    : public spdlog::sinks::base_sink<spdlog::details::null_mutex> {
+public:
+  explicit LoggerSink(std::shared_ptr<spdlog::logger> logger)
+      : logger_(std::move(logger)) {}
+
+protected:
+  void sink_it_(const spdlog::details::log_msg &msg) override {
+    logger_->log(msg.time, msg.source, msg.level, msg.payload);
+  }
+
+  void flush_() override { logger_->flush(); }
+
+  void set_pattern_(const std::string &pattern) override {
+    logger_->set_pattern(pattern);
+  }
+
+  void set_formatter_(std::unique_ptr<spdlog::formatter> formatter) override {
+    logger_->set_formatter(std::move(formatter));
+  }
+
+private:
+  std::shared_ptr<spdlog::logger> logger_;
+};
+} // namespace
+
+void initLogger(const std::string &name) {
+  spdlog::sink_ptr sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+  if (FLAGS_log_async) {
+    spdlog::init_thread_pool(FLAGS_log_async_queue_size, 1);
+    auto async_logger = std::make_shared<spdlog::async_logger>(
+        name, std::move(sink), spdlog::thread_pool(),
+        spdlog::async_overflow_policy::block);
+    async_logger->set_level(spdlog::level::trace);
+    // the messages are rate limited before they are queued, so that only
+    // those at warn level and above may fill the queue and block the caller
+    sink = std::make_shared<LoggerSink>(std::move(async_logger));
+  }
+  if (FLAGS_log_rate_limit != 0) {
+    // called from several event loop threads
+    sink = std::make_shared<RateLimitedSink<std::mutex>>(std::move(sink),
+                                                         FLAGS_log_rate_limit);
+  }
+
+  auto logger = std::make_shared<spdlog::logger>(name, std::move(sink));
+  logger->set_level(spdlog::level::from_str(FLAGS_log_level));
+  logger->set_pattern("%^[%L][%T.%e]%$[%s:%#] %v");
+  logger->flush_on(spdlog::level::err);
+  spdlog::set_default_logger(std::move(logger));
+  // flush the async queue periodically so that logs are not held back when
+  // the daemon is idle.
+  spdlog::flush_every(std::chrono::seconds(1));
+}
+
+} // namespace utils
+} // namespace hdc
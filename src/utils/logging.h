@@ -0,0 +1,82 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <spdlog/sinks/base_sink.h>
+#include <spdlog/spdlog.h>
+#include <string>
+
+namespace hdc {
+namespace utils {
+
+/// @brief: A sink wrapper that forwards at most `rate` messages per second to
+/// the wrapped sink. Messages at warn level and above are never dropped. The
+/// number of dropped messages is reported once the budget refills.
+template <typename Mutex>
+class RateLimitedSink : public spdlog::sinks::base_sink<Mutex> {
+public:
+  RateLimitedSink(spdlog::sink_ptr sink, uint64_t rate)
+      : sink_(std::move(sink)), rate_(rate), tokens_(rate),
+        last_refill_(std::chrono::steady_clock::now()) {}
+
+protected:
+  void sink_it_(const spdlog::details::log_msg &msg) override {
+    if (rate_ != 0 && msg.level < spdlog::level::warn) {
+      refill();
+      if (tokens_ == 0) {
+        ++dropped_;
+        return;
+      }
+      --tokens_;
+    }
+    sink_->log(msg);
+  }
+
+  void flush_() override { sink_->flush(); }
+
+  void set_pattern_(const std::string &pattern) override {
+    sink_->set_pattern(pattern);
+  }
+
+  void set_formatter_(std::unique_ptr<spdlog::formatter> formatter) override {
+    sink_->set_formatter(std::move(formatter));
+  }
+
+private:
+  void refill() {
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_refill_ < std::chrono::seconds(1)) {
+      return;
+    }
+    last_refill_ = now;
+    tokens_ = rate_;
+    if (dropped_ != 0) {
+      auto text = fmt::format("log rate limit: dropped {} messages", dropped_);
+      spdlog::details::log_msg notice(spdlog::source_loc{}, msg_logger_name_,
+                                      spdlog::level::warn, text);
+      sink_->log(notice);
+      dropped_ = 0;
+    }
+  }
+
+  spdlog::sink_ptr sink_;
+  const uint64_t rate_;
+  uint64_t tokens_;
+  uint64_t dropped_{0};
+  std::chrono::steady_clock::time_point last_refill_;
+  spdlog::string_view_t msg_logger_name_{"poby"};
+};
+
+/// @brief: Install the process-wide default logger according to the
+/// `log_level`, `log_async`, `log_async_queue_size` and `log_rate_limit`
+/// flags. In async mode, the pattern formatting and the write to stdout happen
+/// in a dedicated logging thread, and the caller waits when the queue is full,
+/// so that no message is lost. The messages below warn are rate limited by
+/// `log_rate_limit` before they are queued, so they cannot fill it. Call it
+/// after the command line flags are parsed, and spdlog::shutdown() before
+/// returning from main to write the queued ones.
+void initLogger(const std::string &name);
+
+} // namespace utils
+} // namespace hdc
@@ -0,0 +1,189 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace hdc {
+namespace utils {
+
+enum class SchedPolicy {
+  // in the order of arrival
+  kFifo,
+  // the flow with the least queued cost first
+  kShortestRemaining,
+  // start-time fair queuing of the flows, weighted by 1 + priority
+  kFairShare,
+  // the flow with the highest priority first, FIFO among equals
+  kPriority,
+};
+
+inline std::optional<SchedPolicy> parseSchedPolicy(std::string_view name) {
+  if (name == "fifo") {
+    return SchedPolicy::kFifo;
+  }
+  if (name == "srpt") {
+    return SchedPolicy::kShortestRemaining;
+  }
+  if (name == "fair") {
+    return SchedPolicy::kFairShare;
+  }
+  if (name == "priority") {
+    return SchedPolicy::kPriority;
+  }
+  return std::nullopt;
+}
+
+/// @brief: gflags validator of the `*_sched_policy` flags.
+inline bool validateSchedPolicyFlag(const char *flagname,
+                                    const std::string &value) {
+  if (parseSchedPolicy(value).has_value()) {
+    return true;
+  }
+  SPDLOG_ERROR("Invalid value for --{}: {}, expect fifo, srpt, fair or "
+               "priority",
+               flagname, value);
+  return false;
+}
+
+/// @brief: The SchedPolicy of a validated `*_sched_policy` flag.
+inline SchedPolicy schedPolicyFlag(const std::string &value) {
+  return parseSchedPolicy(value).value_or(SchedPolicy::kFifo);
+}
+
+/// @brief: A queue of items grouped into flows, one per image. The items of a
+/// flow leave in the order they are queued, so the segments of a layer stay
+/// in order, and the policy chooses the flow whose first item leaves next.
+/// The cost of an item is its size in bytes or 1 when unknown. Not thread
+/// safe.
+template <typename T> class SchedQueue {
+public:
+  explicit SchedQueue(SchedPolicy policy = SchedPolicy::kFifo)
+      : policy_(policy) {}
+
+  void push(const std::string &flow, T item, size_t cost = 1,
+            int priority = 0) {
+    auto &f = getFlow(flow, priority);
+    f.items.push_back(Item{std::move(item), cost, seq_++});
+    f.cost += cost;
+    size_++;
+  }
+
+  /// @brief: Queue the item before the other items of its flow. With FIFO,
+  /// the item leaves before all queued items.
+  void pushFront(const std::string &flow, T item, size_t cost = 1,
+                 int priority = 0) {
+    auto &f = getFlow(flow, priority);
+    f.items.push_front(Item{std::move(item), cost, front_seq_--});
+    f.cost += cost;
+    size_++;
+  }
+
+  bool empty() const { return size_ == 0; }
+
+  size_t size() const { return size_; }
+
+  /// @brief: The item that pop() removes.
+  T &front() {
+    assert(!empty());
+    return select()->second.items.front().value;
+  }
+
+  void pop() {
+    assert(!empty());
+    auto it = select();
+    auto &f = it->second;
+    auto &item = f.items.front();
+    // the virtual time is the start tag of the flow in service
+    vtime_ = f.vtime;
+    f.vtime += static_cast<double>(item.cost) / weight(f.priority);
+    f.cost -= item.cost;
+    f.items.pop_front();
+    size_--;
+    if (f.items.empty()) {
+      flows_.erase(it);
+    }
+  }
+
+private:
+  struct Item {
+    T value;
+    size_t cost;
+    int64_t seq;
+  };
+  struct Flow {
+    std::deque<Item> items;
+    size_t cost{0};
+    int priority{0};
+    double vtime{0};
+  };
+  using FlowMap = std::map<std::string, Flow>;
+
+  static double weight(int priority) { return 1.0 + std::max(priority, 0); }
+
+  Flow &getFlow(const std::string &flow, int priority) {
+    auto [it, inserted] = flows_.try_emplace(flow);
+    auto &f = it->second;
+    if (inserted) {
+      // a new flow does not get the service it missed while idle
+      f.vtime = vtime_;
+      f.priority = priority;
+    } else {
+      f.priority = std::max(f.priority, priority);
+    }
+    return f;
+  }
+
+  // the flows are the images being pulled, there are few of them
+  typename FlowMap::iterator select() {
+    auto best = flows_.begin();
+    for (auto it = std::next(best); it != flows_.end(); ++it) {
+      if (before(it->second, best->second)) {
+        best = it;
+      }
+    }
+    return best;
+  }
+
+  bool before(const Flow &lhs, const Flow &rhs) const {
+    auto lseq = lhs.items.front().seq;
+    auto rseq = rhs.items.front().seq;
+    switch (policy_) {
+    case SchedPolicy::kFifo:
+      break;
+    case SchedPolicy::kShortestRemaining:
+      if (lhs.cost != rhs.cost) {
+        return lhs.cost < rhs.cost;
+      }
+      break;
+    case SchedPolicy::kFairShare:
+      if (lhs.vtime != rhs.vtime) {
+        return lhs.vtime < rhs.vtime;
+      }
+      break;
+    case SchedPolicy::kPriority:
+      if (lhs.priority != rhs.priority) {
+        return lhs.priority > rhs.priority;
+      }
+      break;
+    }
+    return lseq < rseq;
+  }
+
+  SchedPolicy policy_;
+  FlowMap flows_;
+  size_t size_{0};
+  int64_t seq_{0};
+  int64_t front_seq_{-1};
+  double vtime_{0};
+};
+
+} // namespace utils
+} // namespace hdc
@@ -0,0 +1,45 @@
+#pragma once
+#include "network/transport/TransportConfig.h"
+#include <spdlog/spdlog.h>
+#include <string>
+#include <vector>
+
+namespace hdc {
+namespace utils {
+
+/// @brief: gflags validator of the `*_transport` flags, e.g.
+/// DEFINE_validator(content_server_transport, &validateTransportFlag).
+inline bool validateTransportFlag(const char *flagname,
+                                  const std::string &value) {
+  if (network::transport::parseTransportType(value).has_value()) {
+    return true;
+  }
+  SPDLOG_ERROR("Invalid value for --{}: {}, expect rdma, tcp or shm",
+               flagname, value);
+  return false;
+}
+
+/// @brief: The TransportType of a validated `*_transport` flag.
+inline network::transport::TransportType
+transportTypeFlag(const std::string &value) {
+  return network::transport::parseTransportType(value).value_or(
+      network::transport::TransportType::kRdma);
+}
+
+/// @brief: The items of a comma separated flag, e.g. one per DPU or
+/// registry.
+inline std::vector<std::string> listFlag(const std::string &value) {
+  std::vector<std::string> items;
+  for (size_t start = 0; start <= value.size();) {
+    auto end = value.find(',', start);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    items.push_back(value.substr(start, end - start));
+    start = end + 1;
+  }
+  return items;
+}
+
+} // namespace utils
+} // namespace hdc
@@ -1,29 +1,32 @@
-#include "doca/common.h"
-#include "doca/compress.h"
-#include "doca/params.h"
-#include "doca_compress.h"
-#include "doca_ctx.h"
-#include "doca_error.h"
+#include "doca/engine.h"
+#include "host/client/tar_index.h"
+#include "layer_index.pb.h"
 #include "spdlog/spdlog.h"
 #include <algorithm>
-#include <atomic>
+#include <array>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
-#include <exception>
+#include <deque>
 #include <filesystem>
+#include <folly/executors/CPUThreadPoolExecutor.h>
 #include <fstream>
 #include <gflags/gflags.h>
 #include <ios>
+#include <map>
 #include <memory>
 #include <network/EventLoop.h>
+#include <openssl/evp.h>
 #include <optional>
-#include <stdexcept>
-#include <sys/epoll.h>
-#include <sys/syscall.h>
 #include <thread>
+#include <unordered_map>
+#include <utils/codec.h>
+#include <utils/crc32.h>
+#include <utils/logging.h>
+#include <vector>
 
+using hdc::host::client::TarIndexer;
 using hdc::network::EventLoop;
 namespace fs = std::filesystem;
 
@@ -35,191 +38,814 @@ DEFINE_string(output_folder, "data/registry/content_layers_64m",
 DEFINE_string(doca_pci_address, "31:00.0", "The PCI address of DPU engine");
 DEFINE_uint64(segment_size, (1ULL << 26),
               "size to split the compressed layer into");
+DEFINE_uint32(compress_engines, 0,
+              "The number of compress engines run at once, 0 for one DOCA "
+              "engine or one software engine per core");
+DEFINE_uint32(bufpairs_per_engine, 2,
+              "The segments of an engine being read, compressed and written "
+              "at once");
+DEFINE_uint32(parallel_layers, 4, "The number of layers compressed at once");
+DEFINE_uint32(io_threads, 4, "The threads that read and write the segments");
+DEFINE_string(segment_boundary, "fixed",
+              "Where the segments are cut. fixed: every segment_size bytes. "
+              "entry: at the tar entries, so that each segment can be "
+              "extracted by itself, only an entry larger than segment_size "
+              "is cut inside. cdc: by content, and each segment is stored "
+              "once in <output_folder>/chunks for all layers");
+DEFINE_uint64(chunk_avg_size, (1ULL << 22),
+              "The average size of a segment cut by content");
+DEFINE_string(codecs, "deflate",
+              "The codecs each segment is stored in, of deflate, zstd, lz4 "
+              "and none. deflate runs on the compress engines, the others in "
+              "the io threads, and deflate too if no engine can be created");
+DEFINE_validator(codecs, &hdc::utils::validateCodecsFlag);
+DEFINE_int32(soft_codec_level, 0,
+             "The compression level of zstd and lz4, 0 for their default");
 
+static bool ValidateSegmentSize(const char *flagname, uint64_t value) {
+  if (value > 0 && value <= MAX_FILE_SIZE) {
+    return true;
+  }
+  SPDLOG_ERROR("Invalid value for --{}: {}, expect (0, {}]", flagname, value,
+               MAX_FILE_SIZE);
+  return false;
+}
+DEFINE_validator(segment_size, &ValidateSegmentSize);
+
+static bool ValidatePositive(const char *flagname, uint32_t value) {
+  if (value > 0) {
+    return true;
+  }
+  SPDLOG_ERROR("Invalid value for --{}: {}, expect > 0", flagname, value);
+  return false;
+}
+DEFINE_validator(bufpairs_per_engine, &ValidatePositive);
+DEFINE_validator(parallel_layers, &ValidatePositive);
+DEFINE_validator(io_threads, &ValidatePositive);
+
+static bool ValidateSegmentBoundary(const char *flagname,
+                                    const std::string &value) {
+  if (value == "fixed" || value == "entry" || value == "cdc") {
+    return true;
+  }
+  SPDLOG_ERROR("Invalid value for --{}: {}, expect fixed, entry or cdc",
+               flagname, value);
+  return false;
+}
+DEFINE_validator(segment_boundary, &ValidateSegmentBoundary);
+
+static bool ValidateChunkAvgSize(const char *flagname, uint64_t value) {
+  if (value >= 4096) {
+    return true;
+  }
+  SPDLOG_ERROR("Invalid value for --{}: {}, expect >= 4096", flagname, value);
+  return false;
+}
+DEFINE_validator(chunk_avg_size, &ValidateChunkAvgSize);
+
+namespace {
+enum class SegmentBoundary { kFixed, kEntry, kChunk };
+
+/// @brief: The gear table of the content-defined chunking, fixed so that
+/// the same content is cut the same way by every run.
+constexpr std::array<uint64_t, 256> makeGearTable() {
+  std::array<uint64_t, 256> table{};
+  uint64_t x = 0x9e3779b97f4a7c15ULL;
+  for (auto &v : table) {
+    // splitmix64
+    x += 0x9e3779b97f4a7c15ULL;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    v = z ^ (z >> 31);
+  }
+  return table;
+}
+constexpr auto kGearTable = makeGearTable();
+
+/// @brief: The content address of a chunk, the hex of its SHA-256.
+std::string chunkDigest(const uint8_t *data, size_t len) {
+  uint8_t md[EVP_MAX_MD_SIZE];
+  unsigned int md_len = 0;
+  EVP_Digest(data, len, md, &md_len, EVP_sha256(), nullptr);
+  static const char kHex[] = "0123456789abcdef";
+  std::string res;
+  for (unsigned int i = 0; i < md_len; ++i) {
+    res += kHex[md[i] >> 4];
+    res += kHex[md[i] & 0xf];
+  }
+  return res;
+}
+} // namespace
+
+/// @brief: Splits the layers in a folder into segments and compresses them
+/// with several engines. Each engine compresses one segment at a time, and
+/// its other bufpairs are being read or written meanwhile in the io threads,
+/// so the engines never wait for the disk. Without an engine, the segments
+/// are read into buffers of the tool and deflated in the io threads like the
+/// other codecs. Several layers are read at once,
+/// each of them in order, so that the index of a layer is built as its
+/// segments are read. All the state is owned by the EventLoop thread.
 class ImageCompress {
 
 private:
-  CompressEngine engine_;
-  fs::directory_iterator input_it_;
+  struct Layer {
+    fs::path input;
+    std::string out_path;
+    std::ifstream input_file;
+    size_t input_size{0};
+    size_t head{0};
+    int next_segment{0};
+    // the end offset of each segment when they are not cut every
+    // segment_size bytes
+    std::vector<uint64_t> segment_ends;
+    // the chunk of each segment when they are cut by content
+    std::vector<std::string> chunks;
+    // an io of the layer is in the io threads, they are in order
+    bool reading{false};
+    // the segments read and not written yet
+    int pending{0};
+    bool failed{false};
+    // builds the index.pb of the layer from the segments read, or from the
+    // headers before when the segments are cut at the entries
+    TarIndexer indexer;
+    bool scanned{false};
+
+    bool allRead() const { return next_segment > 0 && head >= input_size; }
+  };
+
+  struct Segment {
+    Layer *layer;
+    int index;
+    size_t engine;
+    size_t bufpair;
+    // the codecs not written yet
+    size_t outputs{0};
+  };
+
+  /// @brief: <output_folder>/chunks/<digest>, shared by the layers, with the
+  /// suffix of the codec but for deflate.
+  std::string chunkPath(const std::string &chunk,
+                        content::Codec codec = content::DEFLATE) const {
+    return output_folder_ + "/chunks/" + chunk +
+           (codec == content::DEFLATE ? ""
+                                      : hdc::utils::codecExtension(codec));
+  }
+
+  std::vector<CompressEngine> engines_;
+  // the src buffers of the segments when there is no engine, see srcMem()
+  std::vector<std::vector<uint8_t>> soft_bufs_;
+  std::vector<size_t> free_soft_bufs_;
+  // the segments read and waiting for their engine
+  std::vector<std::deque<uint64_t>> ready_;
+  // the job running on each engine
+  std::vector<std::optional<uint64_t>> running_;
+  std::unordered_map<uint64_t, Segment> jobs_;
+  std::deque<fs::path> inputs_;
   std::string output_folder_;
-  std::ifstream input_file_;
-  size_t input_size_;
+  std::map<std::string, std::unique_ptr<Layer>> layers_;
   uint64_t job_id_{0};
-  size_t idx_{0};
-  size_t head_{0};
   EventLoop *loop_;
   const size_t segment_size_;
+  const size_t parallel_layers_;
+  const SegmentBoundary boundary_;
+  const size_t chunk_avg_size_;
+  const std::vector<content::Codec> codecs_;
+  const int soft_codec_level_;
+  folly::CPUThreadPoolExecutor io_;
+  size_t layers_done_{0};
+  size_t layers_failed_{0};
 
 public:
-  ImageCompress(CompressEngine engine, fs::directory_iterator input_it,
-                std::string output_folder, EventLoop *loop, size_t segment_size)
-      : engine_(std::move(engine)), input_it_(std::move(input_it)),
+  ImageCompress(std::vector<CompressEngine> engines,
+                std::vector<fs::path> inputs, std::string output_folder,
+                EventLoop *loop, size_t segment_size, size_t parallel_layers,
+                SegmentBoundary boundary, size_t chunk_avg_size,
+                std::vector<content::Codec> codecs, int soft_codec_level,
+                size_t io_threads, size_t soft_bufs = 0)
+      : engines_(std::move(engines)), ready_(engines_.size()),
+        running_(engines_.size()), inputs_(inputs.begin(), inputs.end()),
         output_folder_(std::move(output_folder)), loop_(loop),
-        segment_size_(segment_size) {
-    engine_.setCompressSuccessCallback(
-        [this](CompressEngine &engine, uint64_t job_id, uint8_t *src_addr,
-               size_t src_len, uint8_t *dst_addr, size_t dst_len) {
-          this->onTaskSuccess(engine, job_id, src_addr, src_len, dst_addr,
-                              dst_len);
-        });
-    engine_.setCompressErrorCallback(
-        [this](CompressEngine &engine, doca_error_t err) {
-          this->onTaskError(engine, err);
-        });
-    fs::directory_iterator end_iter;
+        segment_size_(segment_size), parallel_layers_(parallel_layers),
+        boundary_(boundary), chunk_avg_size_(chunk_avg_size),
+        codecs_(std::move(codecs)), soft_codec_level_(soft_codec_level),
+        io_(io_threads) {
+    if (engines_.empty()) {
+      for (size_t i = 0; i < std::max<size_t>(soft_bufs, 1); ++i) {
+        free_soft_bufs_.push_back(i);
+      }
+      soft_bufs_.resize(free_soft_bufs_.size());
+    }
+    for (size_t i = 0; i < engines_.size(); ++i) {
+      engines_[i].setCompressSuccessCallback(
+          [this, i](CompressEngine &engine, uint64_t job_id, uint8_t *src_addr,
+                    size_t src_len, uint8_t *dst_addr, size_t dst_len) {
+            this->onTaskSuccess(i, job_id, dst_addr, dst_len);
+          });
+      engines_[i].setCompressErrorCallback(
+          [this, i](CompressEngine &engine, doca_error_t err) {
+            this->onTaskError(i, err);
+          });
+    }
+  }
 
-    while (input_it_ != end_iter && !input_it_->is_regular_file()) {
-      input_it_++;
+  ~ImageCompress() { io_.join(); }
+
+  void loop() {
+    // pump() quits the loop once all layers are compressed
+    if (!layers_.empty() || !inputs_.empty()) {
+      loop_->loop();
+    }
+  }
+
+  void start() {
+    for (auto &engine : engines_) {
+      engine.start();
+    }
+    if (engines_.empty()) {
+      SPDLOG_INFO("compress {} layers in software with {} buffers",
+                  inputs_.size(), soft_bufs_.size());
+    } else {
+      SPDLOG_INFO("compress {} layers with {} engines", inputs_.size(),
+                  engines_.size());
     }
-    if (input_it_ == end_iter) {
+    pump();
+  }
+
+  bool failed() const { return layers_failed_ > 0; }
+
+private:
+  /// @brief: Read the next segments into the free bufpairs, and open the
+  /// next layers while fewer than `parallel_layers_` are compressed.
+  void pump() {
+    while (layers_.size() < parallel_layers_ && !inputs_.empty()) {
+      openLayer(inputs_.front());
+      inputs_.pop_front();
+    }
+    for (auto &[name, layer] : layers_) {
+      auto *l = layer.get();
+      if (l->reading || l->allRead() || l->failed) {
+        continue;
+      }
+      auto engine = acquireBufpair();
+      if (!engine.has_value()) {
+        break;
+      }
+      readSegment(l, engine->first, engine->second);
+    }
+    if (layers_.empty() && inputs_.empty()) {
+      SPDLOG_INFO("{} layers compressed, {} failed", layers_done_,
+                  layers_failed_);
+      loop_->quit();
+    }
+  }
+
+  /// @brief: A free bufpair of the engine with the fewest segments queued,
+  /// or a free soft buffer as of engine 0 without an engine.
+  std::optional<std::pair<size_t, size_t>> acquireBufpair() {
+    std::optional<std::pair<size_t, size_t>> res;
+    if (engines_.empty()) {
+      if (!free_soft_bufs_.empty()) {
+        res.emplace(0, free_soft_bufs_.back());
+        free_soft_bufs_.pop_back();
+      }
+      return res;
+    }
+    size_t best = SIZE_MAX;
+    for (size_t i = 0; i < engines_.size(); ++i) {
+      auto queued = ready_[i].size() + (running_[i].has_value() ? 1 : 0);
+      if (queued < best) {
+        auto id = engines_[i].acquireFreeBufpair();
+        if (!id.has_value()) {
+          continue;
+        }
+        if (res.has_value()) {
+          engines_[res->first].releaseFreeBufpair(res->second);
+        }
+        res.emplace(i, *id);
+        best = queued;
+      }
+    }
+    return res;
+  }
+
+  void openLayer(const fs::path &input) {
+    auto layer = std::make_unique<Layer>();
+    layer->input = input;
+    layer->out_path = output_folder_ + "/" + input.filename().string() + "/";
+    std::error_code ec;
+    fs::create_directories(layer->out_path, ec);
+    layer->input_file = std::ifstream{input, std::ios::binary};
+    if (ec || !layer->input_file.is_open()) {
+      SPDLOG_ERROR("Fail to open input file: {} or output folder: {}",
+                   input.string(), layer->out_path);
+      ++layers_failed_;
       return;
     }
-    input_file_ = std::ifstream{input_it_->path(), std::ios::binary};
-    if (!input_file_.is_open()) {
-      SPDLOG_ERROR("Fail to open input file: {}", input_it_->path().string());
+    layer->input_file.seekg(0, std::ios::end);
+    layer->input_size = static_cast<size_t>(layer->input_file.tellg());
+    layer->input_file.seekg(0, std::ios::beg);
+    SPDLOG_INFO("new file {}", input.string());
+    auto *l = layer.get();
+    layers_.emplace(input.string(), std::move(layer));
+    if (boundary_ != SegmentBoundary::kFixed) {
+      l->reading = true;
+      io_.add([this, l]() {
+        if (boundary_ == SegmentBoundary::kEntry) {
+          cutAtEntries(*l);
+        } else {
+          cutByContent(*l);
+        }
+        loop_->runInLoop([this, l]() {
+          l->reading = false;
+          pump();
+        });
+      });
+    }
+  }
+
+  /// @brief: Index the layer from its headers, seeking over the data, and
+  /// cut it into segments of at most `segment_size_` at the entries. A layer
+  /// that is not a tar is cut every `segment_size_` bytes.
+  void cutAtEntries(Layer &layer) {
+    auto &in = layer.input_file;
+    TarIndexer indexer;
+    uint8_t block[512];
+    bool ok = true;
+    while (ok && !indexer.done() && indexer.position() < layer.input_size) {
+      if (auto len = indexer.pendingSkip(); len > 0) {
+        ok = static_cast<bool>(in.seekg(len, std::ios::cur));
+        indexer.skip(len);
+        continue;
+      }
+      // a header, or the data of a long name or a pax header
+      ok = static_cast<bool>(in.read(reinterpret_cast<char *>(block),
+                                     sizeof block));
+      indexer.feed(block, sizeof block);
+    }
+    in.clear();
+    in.seekg(0, std::ios::beg);
+    if (!ok || !indexer.done() || indexer.failed()) {
+      SPDLOG_WARN("Layer {} is not a complete tar, cut it every {} bytes",
+                  layer.input.string(), segment_size_);
       return;
     }
-    input_file_.seekg(0, std::ios::end);
-    input_size_ = static_cast<size_t>(input_file_.tellg());
-    input_file_.seekg(0, std::ios::beg);
-    auto read_size = std::min(input_size_ - head_, segment_size_);
 
-    input_file_.read(
-        reinterpret_cast<char *>(engine_.get_bufpair(0).src_mem.data()),
-        read_size);
+    // the offsets where a segment may end, in order
+    std::vector<uint64_t> cuts;
+    for (auto &entry : indexer.index().entries()) {
+      cuts.push_back(entry.header_offset());
+    }
+    cuts.push_back(layer.input_size);
+    uint64_t start = 0;
+    size_t i = 0;
+    while (start < layer.input_size) {
+      const uint64_t limit = start + segment_size_;
+      uint64_t end = start;
+      for (; i < cuts.size() && cuts[i] <= limit; ++i) {
+        end = std::max(end, cuts[i]);
+      }
+      if (end == start) {
+        // the entry is larger than a segment
+        end = std::min<uint64_t>(limit, layer.input_size);
+      }
+      layer.segment_ends.push_back(end);
+      start = end;
+    }
+    if (layer.segment_ends.empty()) {
+      layer.segment_ends.push_back(0);
+    }
+    indexer.index().clear_segment_sizes();
+    layer.indexer = std::move(indexer);
+    layer.scanned = true;
+  }
 
-    if (engine_.get_bufpair(0).src_doca_buf.set_data_by_offset(0, read_size) !=
-        DOCA_SUCCESS) {
-      SPDLOG_ERROR("set doca buf error");
+  /// @brief: Cut the layer where a gear hash of the last bytes matches, so
+  /// that a run of bytes shared by two layers is cut into the same segments
+  /// in both, whatever comes before it. A segment is of `chunk_avg_size_`
+  /// on average, of at least a quarter of it and at most four times of it
+  /// and `segment_size_`.
+  void cutByContent(Layer &layer) {
+    const uint64_t min_size = chunk_avg_size_ / 4;
+    const uint64_t max_size =
+        std::min<uint64_t>(chunk_avg_size_ * 4, segment_size_);
+    uint64_t mask = 1;
+    while (mask < chunk_avg_size_ - min_size) {
+      mask <<= 1;
+    }
+    mask -= 1;
+    auto &in = layer.input_file;
+    std::vector<uint8_t> buf(1 << 20);
+    uint64_t pos = 0;
+    uint64_t start = 0;
+    uint64_t hash = 0;
+    while (pos < layer.input_size) {
+      auto len = std::min<uint64_t>(buf.size(), layer.input_size - pos);
+      if (!in.read(reinterpret_cast<char *>(buf.data()), len)) {
+        break;
+      }
+      for (uint64_t i = 0; i < len; ++i, ++pos) {
+        hash = (hash << 1) + kGearTable[buf[i]];
+        auto size = pos + 1 - start;
+        if ((size >= min_size && (hash & mask) == 0) || size >= max_size) {
+          layer.segment_ends.push_back(pos + 1);
+          start = pos + 1;
+          hash = 0;
+        }
+      }
+    }
+    in.clear();
+    in.seekg(0, std::ios::beg);
+    if (pos != layer.input_size) {
+      // the layer is read every segment_size bytes, and its read fails it
+      SPDLOG_ERROR("read {} error", layer.input.string());
+      layer.segment_ends.clear();
       return;
     }
-    engine_.start_job(job_id_++, DOCA_COMPRESS_DEFLATE_JOB, 0);
-    SPDLOG_INFO("enque job {}", job_id_ - 1);
-    head_ += read_size;
-    idx_ += 1;
+    if (layer.segment_ends.empty() || layer.segment_ends.back() != pos) {
+      layer.segment_ends.push_back(pos);
+    }
+    layer.chunks.resize(layer.segment_ends.size());
   }
 
-  void loop() { loop_->loop(); }
+  /// @brief: The memory a segment is read into. A soft buffer is allocated
+  /// on its first use.
+  uint8_t *srcMem(size_t engine, size_t bufpair) {
+    if (engines_.empty()) {
+      auto &buf = soft_bufs_[bufpair];
+      buf.resize(segment_size_);
+      return buf.data();
+    }
+    return engines_[engine].get_bufpair(bufpair).src_mem.data();
+  }
 
-  void start() { engine_.start(); }
+  void readSegment(Layer *layer, size_t engine, size_t bufpair) {
+    auto job_id = job_id_++;
+    jobs_.emplace(job_id,
+                  Segment{layer, layer->next_segment++, engine, bufpair});
+    auto read_size =
+        layer->segment_ends.empty()
+            ? std::min(layer->input_size - layer->head, segment_size_)
+            : layer->segment_ends[layer->next_segment - 1] - layer->head;
+    layer->head += read_size;
+    layer->reading = true;
+    ++layer->pending;
+    auto *data = srcMem(engine, bufpair);
+    const bool by_content = !layer->chunks.empty();
+    io_.add([this, layer, job_id, data, read_size, by_content]() {
+      layer->input_file.read(reinterpret_cast<char *>(data), read_size);
+      bool ok = layer->input_file.good() || read_size == 0;
+      std::string chunk;
+      if (ok) {
+        indexSegment(*layer, data, read_size);
+        if (by_content) {
+          chunk = chunkDigest(data, read_size);
+        }
+      }
+      loop_->runInLoop([this, job_id, read_size, ok, chunk]() {
+        onSegmentRead(job_id, read_size, ok, chunk);
+      });
+    });
+  }
 
-  void onTaskSuccess(CompressEngine &engine, uint64_t job_id, uint8_t *src_addr,
-                     size_t src_len, uint8_t *dst_addr, size_t dst_len) {
-    SPDLOG_INFO("job {} complete", job_id);
-    // create out file and write data.
+  /// @brief: Add the segment just read to the index of the layer.
+  static void indexSegment(Layer &layer, const uint8_t *data,
+                           size_t read_size) {
+    if (!layer.scanned) {
+      layer.indexer.feed(data, read_size);
+    }
+    auto &index = layer.indexer.index();
+    index.add_segment_sizes(read_size);
+    index.add_segment_crcs(hdc::utils::crc32(data, read_size));
+  }
 
-    auto out_layer_path =
-        output_folder_ + "/" + input_it_->path().filename().string() + "/";
-    if (!fs::exists(out_layer_path)) {
-      if (!fs::create_directory(out_layer_path)) {
-        SPDLOG_ERROR("create directory: {} error", out_layer_path);
-        return;
+  void onSegmentRead(uint64_t job_id, size_t read_size, bool ok,
+                     const std::string &chunk) {
+    auto &seg = jobs_.at(job_id);
+    seg.layer->reading = false;
+    if (ok && !chunk.empty()) {
+      seg.layer->chunks[seg.index] = chunk;
+    }
+    auto *data = srcMem(seg.engine, seg.bufpair);
+    if (ok && !engines_.empty()) {
+      auto &bufpair = engines_[seg.engine].get_bufpair(seg.bufpair);
+      ok = bufpair.src_doca_buf.set_data_by_offset(0, read_size) ==
+           DOCA_SUCCESS;
+    }
+    if (!ok) {
+      SPDLOG_ERROR("read segment {} of {} error", seg.index,
+                   seg.layer->input.string());
+      seg.layer->failed = true;
+      finishSegment(job_id);
+      return;
+    }
+    seg.outputs = codecs_.size();
+    for (auto codec : codecs_) {
+      if (std::error_code ec;
+          !chunk.empty() && fs::exists(chunkPath(chunk, codec), ec)) {
+        // stored for another layer or segment, it is not compressed again
+        SPDLOG_DEBUG("segment {} of {} is chunk {}", seg.index,
+                     seg.layer->input.string(), chunk);
+        storeSegment(job_id, codec, nullptr, 0);
+      } else if (codec == content::DEFLATE && !engines_.empty()) {
+        ready_[seg.engine].push_back(job_id);
+        startJob(seg.engine);
+      } else {
+        softCompress(job_id, codec, data, read_size);
       }
     }
-    auto out_file_path = out_layer_path + std::to_string(idx_ - 1) + ".tar.gz";
-    std::ofstream out_file(out_file_path, std::ios::binary);
-    if (out_file.is_open()) {
-      out_file.write(reinterpret_cast<const char *>(dst_addr), dst_len);
+    pump();
+  }
+
+  void startJob(size_t engine) {
+    if (running_[engine].has_value() || ready_[engine].empty()) {
+      return;
+    }
+    auto job_id = ready_[engine].front();
+    ready_[engine].pop_front();
+    running_[engine] = job_id;
+    engines_[engine].start_job(job_id, DOCA_COMPRESS_DEFLATE_JOB,
+                               jobs_.at(job_id).bufpair);
+    SPDLOG_DEBUG("enque job {} on engine {}", job_id, engine);
+  }
+
+  void onTaskSuccess(size_t engine, uint64_t job_id, uint8_t *dst_addr,
+                     size_t dst_len) {
+    SPDLOG_DEBUG("job {} complete", job_id);
+    running_[engine].reset();
+    startJob(engine);
+    storeSegment(job_id, content::DEFLATE, dst_addr, dst_len);
+  }
+
+  /// @brief: Compress a segment in an io thread with a software codec and
+  /// write it.
+  void softCompress(uint64_t job_id, content::Codec codec,
+                    const uint8_t *data, size_t len) {
+    auto [out_file_path, chunk_path] = outputPaths(jobs_.at(job_id), codec);
+    io_.add([this, job_id, codec, data, len, out_file_path = out_file_path,
+             chunk_path = chunk_path]() {
+      std::vector<uint8_t> out;
+      bool ok = hdc::utils::softCompress(codec, data, len, out,
+                                         soft_codec_level_) &&
+                writeOutput(job_id, out_file_path, chunk_path, out.data(),
+                            out.size());
+      loop_->runInLoop([this, job_id, ok]() { finishOutput(job_id, ok); });
+    });
+  }
+
+  /// @brief: Write a compressed segment in an io thread. `dst_addr` is null
+  /// if its chunk is stored.
+  void storeSegment(uint64_t job_id, content::Codec codec, uint8_t *dst_addr,
+                    size_t dst_len) {
+    auto [out_file_path, chunk_path] = outputPaths(jobs_.at(job_id), codec);
+    io_.add([this, job_id, out_file_path = out_file_path,
+             chunk_path = chunk_path, dst_addr, dst_len]() {
+      bool ok =
+          writeOutput(job_id, out_file_path, chunk_path, dst_addr, dst_len);
+      loop_->runInLoop([this, job_id, ok]() { finishOutput(job_id, ok); });
+    });
+  }
+
+  /// @brief: The file of a segment in `codec`, and its chunk when the layer
+  /// is cut by content or empty.
+  std::pair<std::string, std::string> outputPaths(const Segment &seg,
+                                                  content::Codec codec) const {
+    auto out_file_path = seg.layer->out_path + std::to_string(seg.index) +
+                         hdc::utils::codecExtension(codec);
+    std::string chunk_path;
+    if (!seg.layer->chunks.empty()) {
+      chunk_path = chunkPath(seg.layer->chunks[seg.index], codec);
+    }
+    return {std::move(out_file_path), std::move(chunk_path)};
+  }
+
+  /// @brief: Write a compressed segment, or link it to its chunk when the
+  /// layer is cut by content. `data` is null if the chunk is stored.
+  static bool writeOutput(uint64_t job_id, const std::string &out_file_path,
+                          const std::string &chunk_path, const uint8_t *data,
+                          size_t len) {
+    bool ok = true;
+    if (data != nullptr) {
+      // a chunk is complete once it has its name
+      auto path = chunk_path.empty()
+                      ? out_file_path
+                      : chunk_path + ".tmp" + std::to_string(job_id);
+      std::ofstream out_file(path, std::ios::binary);
+      out_file.write(reinterpret_cast<const char *>(data), len);
+      ok = out_file.good();
       out_file.close();
-    } else {
-      SPDLOG_ERROR("Fail to open file {}", out_file_path);
+      std::error_code ec;
+      if (ok && !chunk_path.empty()) {
+        fs::rename(path, chunk_path, ec);
+        ok = !ec;
+      }
+    }
+    if (ok && !chunk_path.empty()) {
+      std::error_code ec;
+      fs::remove(out_file_path, ec);
+      fs::create_hard_link(chunk_path, out_file_path, ec);
+      if (ec) {
+        // another file system, the layer gets its own copy
+        ec.clear();
+        fs::copy_file(chunk_path, out_file_path, ec);
+      }
+      ok = !ec;
+    }
+    if (!ok) {
+      SPDLOG_ERROR("Fail to write file {}", out_file_path);
+    }
+    return ok;
+  }
+
+  /// @brief: A codec of a segment is written, or failed.
+  void finishOutput(uint64_t job_id, bool ok) {
+    auto &seg = jobs_.at(job_id);
+    if (!ok) {
+      seg.layer->failed = true;
+    }
+    if (--seg.outputs == 0) {
+      finishSegment(job_id);
+    }
+  }
+
+  void onTaskError(size_t engine, doca_error_t err) {
+    SPDLOG_ERROR("Task error: {}", doca_get_error_string(err));
+    if (!running_[engine].has_value()) {
       return;
     }
+    auto job_id = *running_[engine];
+    running_[engine].reset();
+    startJob(engine);
+    finishOutput(job_id, false);
+  }
 
-    // if need to read a new file
-    if (head_ >= input_size_) {
-      input_file_.close();
-      std::ofstream total_segments_file(out_layer_path + "total_segment.txt");
-      if (!total_segments_file.is_open()) {
-        SPDLOG_ERROR("open file {} error",
-                     out_layer_path + "total_segment.txt");
-        return;
-      }
-      total_segments_file << idx_ << std::endl;
-      total_segments_file.close();
-      fs::directory_iterator end_iter;
-      input_it_++;
-      while (input_it_ != end_iter && !input_it_->is_regular_file()) {
-        input_it_++;
-      }
-      if (input_it_ == end_iter) {
-        return;
-      }
-      SPDLOG_INFO("new file {}", input_it_->path().string());
-
-      input_file_ = std::ifstream{input_it_->path(), std::ios::binary};
-      if (!input_file_.is_open()) {
-        SPDLOG_ERROR("Fail to open input file: {}", input_it_->path().string());
-        return;
-      }
-      input_file_.seekg(0, std::ios::end);
-      input_size_ = static_cast<size_t>(input_file_.tellg());
-      input_file_.seekg(0, std::ios::beg);
-      head_ = 0;
-      idx_ = 0;
-    }
-
-    auto read_size = std::min(input_size_ - head_, segment_size_);
-    input_file_.read(
-        reinterpret_cast<char *>(engine_.get_bufpair(0).src_mem.data()),
-        read_size);
-    if (engine_.get_bufpair(0).src_doca_buf.set_data_by_offset(0, read_size) !=
-        DOCA_SUCCESS) {
-      SPDLOG_ERROR("set doca buf error");
+  /// @brief: Free the bufpair of a segment, and finish its layer once all
+  /// of its segments are written.
+  void finishSegment(uint64_t job_id) {
+    auto seg = jobs_.at(job_id);
+    jobs_.erase(job_id);
+    if (engines_.empty()) {
+      free_soft_bufs_.push_back(seg.bufpair);
+    } else {
+      engines_[seg.engine].releaseFreeBufpair(seg.bufpair);
+    }
+    auto *layer = seg.layer;
+    --layer->pending;
+    if (layer->pending == 0 && !layer->reading &&
+        (layer->allRead() || layer->failed)) {
+      finishLayer(layer);
+    }
+    pump();
+  }
+
+  void finishLayer(Layer *layer) {
+    auto name = layer->input.string();
+    if (layer->failed) {
+      SPDLOG_ERROR("compress layer {} failed", name);
+      ++layers_failed_;
+      layers_.erase(name);
+      return;
+    }
+    auto total_segments_path = layer->out_path + "total_segment.txt";
+    std::ofstream total_segments_file(total_segments_path);
+    if (!total_segments_file.is_open()) {
+      SPDLOG_ERROR("open file {} error", total_segments_path);
+      ++layers_failed_;
+      layers_.erase(name);
       return;
     }
-    engine.start_job(job_id_++, DOCA_COMPRESS_DEFLATE_JOB, 0);
-    SPDLOG_INFO("enque job {}", job_id_ - 1);
-    head_ += read_size;
-    idx_ += 1;
+    total_segments_file << layer->next_segment << std::endl;
+    total_segments_file.close();
+    if (!layer->chunks.empty()) {
+      // the recipe of the layer: the chunk of each segment
+      std::ofstream recipe_file(layer->out_path + "recipe.txt");
+      for (auto &chunk : layer->chunks) {
+        recipe_file << chunk << "\n";
+      }
+      if (!recipe_file.good()) {
+        SPDLOG_ERROR("write {} error", layer->out_path + "recipe.txt");
+      }
+    }
+    writeIndex(*layer, layer->out_path + "index.pb");
+    ++layers_done_;
+    layers_.erase(name);
   }
 
-  void onTaskError(CompressEngine &engine, doca_error_t err) {
-    SPDLOG_ERROR("Task error: {}", doca_get_error_string(err));
+  void writeIndex(Layer &layer, const std::string &path) {
+    if (layer.indexer.failed() || !layer.indexer.done()) {
+      // the segment sizes and checksums are still of use
+      SPDLOG_WARN("Layer {} is not a complete tar, its index has no files",
+                  layer.input.string());
+      layer.indexer.index().clear_entries();
+    }
+    auto &index = layer.indexer.index();
+    hdc::host::client::locateEntries(index);
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open() || !index.SerializeToOstream(&out)) {
+      SPDLOG_ERROR("write index {} error", path);
+      return;
+    }
+    SPDLOG_INFO("index {}: {} entries, {} segments", path,
+                index.entries_size(), index.segment_sizes_size());
   }
 };
 
 int main(int argc, char **argv) {
-  spdlog::set_level(spdlog::level::trace);
-  spdlog::set_pattern("%^[%L][%T.%e]%$[%s:%#] %v");
   GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+  hdc::utils::initLogger("image_compress");
 
   EventLoop loop;
 
-  auto engine = CompressEngine::create(FLAGS_doca_pci_address.data(),
-                                       DOCA_BUF_EXTENSION_NONE, 16, &loop,
-                                       MAX_FILE_SIZE, MAX_FILE_SIZE, 1);
-  if (!engine.has_value()) {
-    SPDLOG_ERROR("create engine error");
-    return EXIT_FAILURE;
-  }
-
-  if (engine->src_mmaps_start(std::nullopt) != DOCA_SUCCESS) {
-    SPDLOG_ERROR("src buf mmap error");
-    return -1;
-  }
-  if (engine->dst_mmaps_start(std::nullopt) != DOCA_SUCCESS) {
-    SPDLOG_ERROR("dst buf mmap error");
-    return -1;
-  }
   if (!fs::exists(FLAGS_input_folder)) {
     SPDLOG_ERROR("input_folder:{} not exist", FLAGS_input_folder);
-    return -1;
+    return EXIT_FAILURE;
   }
 
   if (!fs::exists(FLAGS_output_folder)) {
     if (!fs::create_directory(FLAGS_output_folder)) {
       SPDLOG_ERROR("create directory: {} error", FLAGS_output_folder);
-      return -1;
+      return EXIT_FAILURE;
     }
   }
 
+  auto boundary = FLAGS_segment_boundary == "entry" ? SegmentBoundary::kEntry
+                  : FLAGS_segment_boundary == "cdc"  ? SegmentBoundary::kChunk
+                                                     : SegmentBoundary::kFixed;
+  if (boundary == SegmentBoundary::kChunk) {
+    std::error_code ec;
+    fs::create_directories(FLAGS_output_folder + "/chunks", ec);
+    if (ec) {
+      SPDLOG_ERROR("create directory: {}/chunks error", FLAGS_output_folder);
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<fs::path> inputs;
+  for (auto &entry : fs::directory_iterator(FLAGS_input_folder)) {
+    if (entry.is_regular_file()) {
+      inputs.push_back(entry.path());
+    }
+  }
+
+  auto engine_num = FLAGS_compress_engines;
+  if (engine_num == 0) {
+#ifdef POBY_SOFT_COMPRESS
+    engine_num = std::max(1U, std::thread::hardware_concurrency());
+#else
+    engine_num = 1;
+#endif
+  }
+  // a deflate stream is at most a little larger than its input
+  const size_t dst_size =
+      FLAGS_segment_size + (FLAGS_segment_size >> 3) + 4096;
+  std::vector<CompressEngine> engines;
+  for (uint32_t i = 0; i < engine_num; ++i) {
+    auto engine = CompressEngine::create(
+        FLAGS_doca_pci_address.data(), DOCA_BUF_EXTENSION_NONE, 16, &loop,
+        FLAGS_segment_size, dst_size, FLAGS_bufpairs_per_engine);
+    if (!engine.has_value()) {
+      SPDLOG_WARN("create engine {} error", i);
+      break;
+    }
+    if (engine->src_mmaps_start(std::nullopt) != DOCA_SUCCESS ||
+        engine->dst_mmaps_start(std::nullopt) != DOCA_SUCCESS) {
+      SPDLOG_WARN("buf mmap of engine {} error", i);
+      break;
+    }
+    engines.push_back(std::move(*engine));
+  }
+  size_t soft_bufs = 0;
+  if (engines.empty()) {
+    // e.g. no DPU on this machine, the io threads deflate as the engine does
+    if (!hdc::utils::softCodecAvailable(content::DEFLATE)) {
+      SPDLOG_ERROR("no compress engine and no software deflate");
+      return EXIT_FAILURE;
+    }
+    soft_bufs = std::max<size_t>(FLAGS_io_threads, 1) *
+                FLAGS_bufpairs_per_engine;
+    SPDLOG_WARN("no compress engine, deflate in the {} io threads",
+                FLAGS_io_threads);
+  } else if (engines.size() < engine_num) {
+    SPDLOG_WARN("{} of {} compress engines created", engines.size(),
+                engine_num);
+  }
 
-  ImageCompress image_compress{std::move(*engine),
-                               fs::directory_iterator(FLAGS_input_folder),
-                               FLAGS_output_folder, &loop, FLAGS_segment_size};
+  ImageCompress image_compress{std::move(engines),
+                               std::move(inputs),
+                               FLAGS_output_folder,
+                               &loop,
+                               FLAGS_segment_size,
+                               FLAGS_parallel_layers,
+                               boundary,
+                               FLAGS_chunk_avg_size,
+                               hdc::utils::codecsFlag(FLAGS_codecs),
+                               FLAGS_soft_codec_level,
+                               FLAGS_io_threads,
+                               soft_bufs};
 
   image_compress.start();
   image_compress.loop();
-  return 0;
+  auto failed = image_compress.failed();
+  spdlog::shutdown();
+  return failed ? EXIT_FAILURE : 0;
 }